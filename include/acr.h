@@ -211,6 +211,10 @@ public:
   virtual ACR* get_acr(SAS::TrailId trail,
                        ACR::Initiator initiator,
                        ACR::NodeRole role);
+
+  /// Returns whether the ACRs from this factory are sent anywhere (the null
+  /// ACRs from this base factory aren't).
+  virtual bool sends_acrs() const;
 };
 
 
@@ -514,6 +518,9 @@ public:
                        ACR::Initiator initiator,
                        ACR::NodeRole role);
 
+  /// Ralf ACRs are always sent.
+  virtual bool sends_acrs() const;
+
 private:
   RalfProcessor* _ralf;
   ACR::Node _node_functionality;
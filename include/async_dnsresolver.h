@@ -0,0 +1,106 @@
+/**
+ * @file async_dnsresolver.h  Asynchronous NAPTR resolver sharing one c-ares
+ * event loop.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ASYNC_DNSRESOLVER_H__
+#define ASYNC_DNSRESOLVER_H__
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <ares.h>
+#include "sas.h"
+#include "baseresolver.h"
+
+/// @class AsyncDNSResolver
+///
+/// Issues NAPTR queries without blocking the calling thread.  All queries
+/// share a single ares channel, which is driven by a dedicated event loop
+/// thread, so any number of queries can be outstanding at once.  Unlike
+/// DNSResolver, this is thread-safe.
+class AsyncDNSResolver
+{
+public:
+  /// Called on the event loop thread when a query completes.  naptr_reply is
+  /// only valid for the duration of the callback, and ttl is the lowest TTL
+  /// of the NAPTR records in the response (or 0).  Callbacks must not block,
+  /// as they hold up all other queries.
+  typedef std::function<void(int status,
+                             const struct ares_naptr_reply* naptr_reply,
+                             int ttl)> NaptrCallback;
+
+  /// Constructor.  Starts the event loop thread.
+  ///
+  /// @param servers - The DNS servers to query (at most 3 are used).
+  /// @param port    - The port the DNS servers listen on.
+  AsyncDNSResolver(const std::vector<struct IP46Address>& servers,
+                   int port = 53);
+
+  /// Destructor.  Stops the event loop thread.  Any queries still
+  /// outstanding complete with ARES_EDESTRUCTION.
+  virtual ~AsyncDNSResolver();
+
+  /// Queues a NAPTR query for the specified domain, logging to the trail.
+  /// This returns immediately - the callback is called on the event loop
+  /// thread when the query completes or times out.
+  virtual void perform_naptr_query(const std::string& domain,
+                                   NaptrCallback callback,
+                                   SAS::TrailId trail);
+
+private:
+  /// A query that has been requested, but not yet completed.
+  struct Query
+  {
+    AsyncDNSResolver* resolver;
+    std::string domain;
+    SAS::TrailId trail;
+    NaptrCallback callback;
+  };
+
+  // Event loop thread entry point and main loop.
+  static void* loop_thread_fn(void* arg);
+  void run_loop();
+
+  // Sends all the queries that have been queued since the loop last ran.
+  // Called on the event loop thread.
+  void send_queued_queries();
+
+  // ares callback function - static, wrapping the member function below.
+  static void ares_callback(void* arg,
+                            int status,
+                            int timeouts,
+                            unsigned char* abuf,
+                            int alen);
+  void ares_callback(Query* query,
+                     int status,
+                     unsigned char* abuf,
+                     int alen);
+
+  // The ares channel.  This is only used on the event loop thread, as ares
+  // channels aren't thread-safe.
+  ares_channel _channel;
+  struct ares_addr_port_node _ares_addrs[3];
+
+  pthread_t _thread;
+
+  // Protects the queue of queries to send and the terminate flag.
+  pthread_mutex_t _lock;
+  std::deque<Query*> _queue;
+  bool _terminate;
+
+  // A pipe used to wake the event loop when queries are queued or the
+  // resolver is being destroyed.
+  int _wakeup_pipe[2];
+};
+
+#endif
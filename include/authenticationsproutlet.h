@@ -31,6 +31,8 @@ extern "C" {
 #include "snmp_success_fail_count_table.h"
 #include "cfgoptions.h"
 #include "forwardingsproutlet.h"
+#include "stateless_nonce.h"
+#include "digest_av_cache.h"
 
 typedef std::function<int(pjsip_contact_hdr*, pjsip_expires_hdr*)> get_expiry_for_binding_fn;
 
@@ -102,7 +104,9 @@ public:
                           AnalyticsLogger* analytics_logger,
                           SNMP::AuthenticationStatsTables* auth_stats_tbls,
                           bool nonce_count_supported_arg,
-                          get_expiry_for_binding_fn get_expiry_for_binding_arg);
+                          get_expiry_for_binding_fn get_expiry_for_binding_arg,
+                          const std::string& stateless_nonce_key,
+                          DigestAvCache* digest_av_cache);
   ~AuthenticationSproutlet();
 
   bool init();
@@ -166,6 +170,21 @@ private:
                                          ImpiStore::Impi* impi_obj,
                                          SAS::TrailId trail);
 
+  /// Record that a stateless challenge has been responded to, by adding it
+  /// to the IMPI stores if (and only if) it isn't already there. This handles
+  /// GR replication.
+  ///
+  /// @param impi           - The IMPI the challenge relates to.
+  /// @param auth_challenge - The challenge decoded from the nonce.
+  /// @param trail          - SAS trail ID.
+  ///
+  /// @return               - Whether the challenge was recorded in the local
+  ///                         store. This is false if the nonce has already
+  ///                         been used, or on a store failure.
+  bool record_stateless_challenge(const std::string& impi,
+                                  ImpiStore::AuthChallenge* auth_challenge,
+                                  SAS::TrailId trail);
+
   friend class AuthenticationSproutletTsx;
 
   // Realm to use on AKA challenges.
@@ -193,6 +212,13 @@ private:
   // Whether nonce counts are supported.
   bool _nonce_count_supported = false;
 
+  // Encoder for stateless digest nonces, or NULL if digest challenges are
+  // always stored in the IMPI store.
+  StatelessNonce* _stateless_nonce;
+
+  // Cache of digest AVs from the HSS, or NULL if AVs aren't cached.
+  DigestAvCache* _digest_av_cache;
+
   // A function that the authentication module can use to work out the expiry
   // time for a given binding. This is needed so that it knows how long to
   // authentication challenges for.
@@ -244,6 +270,9 @@ protected:
   AuthenticationVector* get_av_from_store(const std::string& impi,
                                           const std::string& nonce,
                                           ImpiStore::Impi** out_impi_obj);
+  ImpiStore::AuthChallenge* get_stateless_challenge(const std::string& impi,
+                                                    const std::string& nonce,
+                                                    bool& is_stateless);
 
   AuthenticationSproutlet* _authentication;
 
@@ -24,10 +24,13 @@ extern "C" {
 #include <vector>
 #include <list>
 #include <set>
+#include <memory>
 
 #include "stack.h"
+#include "utils.h"
 #include "pjmodule.h"
 #include "acr.h"
+#include "small_vector.h"
 
 
 /// Class implementing basic SIP proxy functionality.  Various methods in
@@ -68,6 +71,24 @@ protected:
     pjsip_transport* transport;
   };
 
+  /// Class holding messages that other messages share memory with (see
+  /// PJUtils::clone_msg_sharing_body and PJUtils::clone_msg_sharing_hdrs).
+  /// The messages are kept until this is destroyed, so it is shared between
+  /// a UASTsx and its UACTsxs, which may outlive it.
+  class SharedMsgs
+  {
+  public:
+    SharedMsgs() : _msgs() {}
+    ~SharedMsgs();
+
+    /// Keeps a message (if it isn't already kept).  This must be called
+    /// with the transaction's group lock held.
+    void keep(pjsip_tx_data* tdata);
+
+  private:
+    SmallSet<pjsip_tx_data*, 4> _msgs;
+  };
+
   class UACTsx;
 
   /// Class tracking the UAS-related state for a proxied transaction.
@@ -190,6 +211,10 @@ protected:
     /// Returns the SAS trail identifier attached to the transaction.
     SAS::TrailId trail() const { return _trail; }
 
+    /// Keeps a message that a request sent by this transaction shares memory
+    /// with - see SharedMsgs.
+    void keep_shared_msg(pjsip_tx_data* tdata);
+
     /// Owning proxy object.
     BasicProxy* _proxy;
 
@@ -227,6 +252,11 @@ protected:
     /// initialised to a 408 Request Timeout response.
     pjsip_tx_data* _final_rsp;
 
+    /// Messages that requests sent by this transaction share memory with.
+    /// This is only created once there is a message to keep, as most
+    /// transactions don't share any.
+    std::shared_ptr<SharedMsgs> _shared_msgs;
+
     bool _pending_destroy;
     int _context_count;
 
@@ -255,7 +285,8 @@ protected:
     /// Initializes a UAC transaction.
     virtual pj_status_t init(pjsip_tx_data* tdata);
 
-    /// Sends the initial request on this UAC transaction.
+    /// Sends the initial request on this UAC transaction.  If the next hop
+    /// has to be resolved first, this may return before the request is sent.
     virtual void send_request();
 
     /// Cancels the pending transaction, using the specified status code in the
@@ -288,6 +319,12 @@ protected:
     /// Returns the SAS trail identifier attached to the transaction.
     SAS::TrailId trail() const { return _trail; }
 
+    /// Called when the next hop has been resolved asynchronously.
+    void on_next_hop_resolved(const std::vector<AddrInfo>& servers);
+
+    /// Sends the request to the resolved servers.
+    void dispatch_request();
+
     /// Starts Timer C on the UAC transaction.
     void start_timer_c();
 
@@ -297,6 +334,13 @@ protected:
     /// Called when timer C expires.
     void timer_c_expired();
 
+    /// Starts timing the response from the current server.
+    void start_server_latency();
+
+    /// Records how long the current server took to respond, if it hasn't
+    /// been recorded already.
+    void record_server_latency();
+
     /// Owning proxy object.
     BasicProxy* _proxy;
 
@@ -320,10 +364,25 @@ protected:
     /// after it has been passed to PJSIP for sending.
     pjsip_tx_data* _tdata;
 
+    /// Messages that the request shares memory with, shared with the UASTsx
+    /// (or NULL if it doesn't share any).
+    std::shared_ptr<SharedMsgs> _shared_msgs;
+
     /// The resolved server addresses for this transaction.
     std::vector<AddrInfo> _servers;
     int _current_server;
 
+    /// Whether the next hop is being resolved, whether it has been, and
+    /// whether the request was cancelled while it was being resolved.
+    bool _resolving;
+    bool _resolved;
+    bool _cancelled;
+
+    /// Times the first response from the current server, so the resolver
+    /// can favour servers that respond quickly.
+    Utils::StopWatch _server_stopwatch;
+    bool _server_latency_pending;
+
     /// Pointer to the associated PJSIP UAC transaction used to send a
     /// CANCEL request.  NULL if no CANCEL has been sent.
     pjsip_transaction* _cancel_tsx;
@@ -358,6 +417,9 @@ protected:
   /// Rejects a received request statelessly.
   virtual void reject_request(pjsip_rx_data* rdata, int status_code);
 
+  /// Forwards a response that doesn't match a transaction upstream.
+  void forward_response_stateless(pjsip_rx_data* rdata);
+
   /// Utility method to create a UASTsx objects for incoming requests.
   virtual BasicProxy::UASTsx* create_uas_tsx();
 
@@ -16,13 +16,18 @@
 #define BGCFSERVICE_H__
 
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
 
 #include <functional>
 #include "updater.h"
 #include "sas.h"
+#include "prefix_trie.h"
+#include "routing_db.h"
+#include "snapshot.h"
 
 class BgcfService
 {
@@ -38,15 +43,66 @@ public:
   std::vector<std::string> get_route_from_number(const std::string &number,
                                                  SAS::TrailId trail) const;
 
+  /// Compiles a bgcf.json file into a routing database that the service can
+  /// load instead (see RoutingDb).
+  ///
+  /// @return - Whether the database was written successfully.
+  static bool compile(const std::string& json_file, const std::string& db_file);
+
 private:
-  std::map<std::string, std::vector<std::string>> _domain_routes;
-  std::map<std::string, std::vector<std::string>> _number_routes;
+  /// A single configured route, along with its string form for SAS logging.
+  struct Route
+  {
+    std::vector<std::string> uris;
+    std::string sas_string;
+  };
+
+  /// A route read from bgcf.json.
+  struct RouteEntry
+  {
+    bool is_domain;
+
+    // The domain, or the number prefix with visual separators removed.
+    std::string key;
+
+    Route route;
+  };
+
+  /// The routes compiled from bgcf.json, or mapped from a compiled routing
+  /// database.  This is never modified once built - update_routes builds a
+  /// new table and swaps it in.
+  ///
+  /// Domain routes are keyed by domain.  A key of the form "*.example.com"
+  /// matches any subdomain of example.com, and "*" matches any domain.
+  struct RoutingTable
+  {
+    const Route* find_domain(const std::string& domain) const;
+    const Route* match_number(const std::string& number,
+                              std::string& matched_prefix) const;
+
+    std::unordered_map<std::string, Route> domain_routes;
+    PrefixTrie<RouteEntry> number_routes;
+
+    // If the routes came from a compiled database, the database and its
+    // route values (indexed by value index) are used instead.
+    std::unique_ptr<RoutingDb> db;
+    std::vector<Route> db_routes;
+  };
+
+  static bool read_json(const std::string& configuration,
+                        std::vector<RouteEntry>& entries);
+
+  static std::shared_ptr<RoutingTable> load_db(const std::string& db_file);
+
+  const Route* find_domain_route(const RoutingTable& table,
+                                 const std::string& domain) const;
+
+  // The current routing table.  Each thread reads its own reference to the
+  // table, which it only refreshes (under a lock) after the table has been
+  // reloaded - see Snapshot.
+  Snapshot<RoutingTable> _routing_table;
   std::string _configuration;
   Updater<void, BgcfService>* _updater;
-
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _routes_rw_lock;
 };
 
 #endif
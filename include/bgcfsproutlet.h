@@ -27,6 +27,7 @@ extern "C" {
 #include "bgcfservice.h"
 #include "sproutlet.h"
 #include "enumservice.h"
+#include "object_pool.h"
 
 #include <map>
 #include <vector>
@@ -56,6 +57,11 @@ public:
                         pj_pool_t* pool,
                         SAS::TrailId trail);
 
+  /// The BGCF makes a single routing decision for each request, so it can
+  /// forward requests statelessly if it isn't sending ACRs and doesn't need
+  /// an asynchronous ENUM lookup.
+  bool supports_stateless(const pjsip_msg* req) const;
+
   inline bool should_override_npdi() const
   {
     return _override_npdi;
@@ -99,7 +105,8 @@ private:
 };
 
 
-class BGCFSproutletTsx : public SproutletTsx
+class BGCFSproutletTsx : public SproutletTsx,
+                         public PooledObject<BGCFSproutletTsx>
 {
 public:
   BGCFSproutletTsx(BGCFSproutlet* bgcf);
@@ -110,11 +117,22 @@ public:
   virtual void on_rx_response(pjsip_msg* rsp, int fork_id) override;
   virtual void on_tx_response(pjsip_msg* rsp) override;
   virtual void on_rx_cancel(int status_code, pjsip_msg* req) override;
+  virtual void on_timer_expiry(void* context) override;
 
 private:
+  /// Route the request once any number portability data has been looked up.
+  void route_request(pjsip_msg* req);
+
   BGCFSproutlet* _bgcf;
 
   ACR* _acr;
+
+  bool _cancelled;
+
+  /// The request waiting for an asynchronous ENUM lookup, and the result of
+  /// the lookup.
+  pjsip_msg* _enum_req;
+  std::string _enum_result;
 };
 
 #endif
@@ -306,6 +306,7 @@ private:
   pj_grp_lock_t*       _lock;       //< Lock to protect this UACTransaction and the underlying PJSIP transaction
   pjsip_transaction*   _tsx;
   pjsip_tx_data*       _tdata;
+  pjsip_tx_data*       _shared_req; //< Request that _tdata shares its headers and body with
   pj_bool_t            _from_store; /* If true, the aor and binding_id
                                        identify the binding. */
   pj_str_t             _aor;
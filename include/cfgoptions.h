@@ -25,6 +25,7 @@
 #include "ralf_processor.h"
 #include "sproutlet_options.h"
 #include "impistore.h"
+#include "digest_av_cache.h"
 #include "analyticslogger.h"
 #include "fifcservice.h"
 #include "mmfservice.h"
@@ -86,10 +87,12 @@ struct options
   std::vector<std::string>             impi_stores;
   std::string                          ralf_server;
   int                                  ralf_threads;
+  int                                  store_op_threads;
   std::vector<std::string>             dns_servers;
   std::vector<std::string>             enum_servers;
   std::string                          enum_suffix;
   std::string                          enum_file;
+  int                                  enum_negative_cache_ttl;
   bool                                 default_tel_uri_translation;
   bool                                 analytics_enabled;
   std::string                          analytics_directory;
@@ -117,6 +120,9 @@ struct options
   int                                  cass_target_latency_us;
   int                                  exception_max_ttl;
   int                                  sip_blacklist_duration;
+  bool                                 sip_target_cache;
+  bool                                 sip_latency_weighting;
+  int                                  sip_resolver_threads;
   int                                  http_blacklist_duration;
   int                                  astaire_blacklist_duration;
   int                                  sip_tcp_connect_timeout;
@@ -138,6 +144,8 @@ struct options
   SPROUTLET_MACRO(SPROUTLET_CFG_OPTIONS)
   ImpiStore::Mode                      impi_store_mode;
   bool                                 nonce_count_supported;
+  std::string                          stateless_nonce_key;
+  int                                  digest_av_cache_ttl;
   std::string                          scscf_node_uri;
   bool                                 sas_signaling_if;
   bool                                 disable_tcp_switch;
@@ -161,6 +169,7 @@ extern SubscriberDataManager* local_sdm;
 extern std::vector<SubscriberDataManager*> remote_sdms;
 extern ImpiStore* local_impi_store;
 extern std::vector<ImpiStore*> remote_impi_stores;
+extern DigestAvCache* digest_av_cache;
 extern RalfProcessor* ralf_processor;
 extern DnsCachedResolver* dns_resolver;
 extern HttpResolver* http_resolver;
@@ -0,0 +1,110 @@
+/**
+ * @file digest_av_cache.h  Per-node cache of SIP digest authentication vectors.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DIGEST_AV_CACHE_H_
+#define DIGEST_AV_CACHE_H_
+
+#include <map>
+#include <string>
+#include <atomic>
+#include <pthread.h>
+#include <time.h>
+
+#include "snmp_counter_table.h"
+
+/// Short-lived cache of SIP digest authentication vectors retrieved from the
+/// HSS, so that periodic re-registrations of the same subscriber can be
+/// challenged without a Homestead round trip.
+///
+/// Entries are keyed off the private identity, public identity and realm of
+/// the request being challenged.  Only SIP digest vectors are cached - AKA
+/// vectors are single use and must always come from the HSS.  All entries for
+/// a private identity are invalidated if authentication fails for it, or if
+/// the HSS deregisters it.
+class DigestAvCache
+{
+public:
+  /// The cached parts of a digest authentication vector.
+  struct Av
+  {
+    std::string ha1;
+    std::string qop;
+    std::string realm;
+  };
+
+  /// Constructor.
+  ///
+  /// @param ttl        - How long (in seconds) to cache each vector for.
+  /// @param hits_tbl   - Counter table incremented on each cache hit.
+  /// @param misses_tbl - Counter table incremented on each cache miss.
+  DigestAvCache(int ttl,
+                SNMP::CounterTable* hits_tbl,
+                SNMP::CounterTable* misses_tbl);
+
+  /// Destructor.
+  virtual ~DigestAvCache();
+
+  /// Looks up a cached vector.
+  ///
+  /// @param impi  - The private identity being challenged.
+  /// @param impu  - The public identity being challenged.
+  /// @param realm - The realm from the request's credentials (if any).
+  /// @param av    - OUT: the cached vector, if there is one.
+  ///
+  /// @return      - Whether an unexpired vector was found.
+  bool get(const std::string& impi,
+           const std::string& impu,
+           const std::string& realm,
+           Av& av);
+
+  /// Caches a vector retrieved from the HSS.
+  void add(const std::string& impi,
+           const std::string& impu,
+           const std::string& realm,
+           const Av& av);
+
+  /// Discards all vectors cached for a private identity.
+  void invalidate(const std::string& impi);
+
+  /// Cache statistics, since the cache was created.
+  uint64_t hits() const { return _hits; }
+  uint64_t misses() const { return _misses; }
+
+private:
+  struct Entry
+  {
+    Av av;
+    time_t expires;
+  };
+
+  // Removes expired entries.  Must be called with the lock held.
+  void purge_expired(time_t now);
+
+  const int _ttl;
+
+  // A lock that protects the cached entries.
+  pthread_mutex_t _lock;
+
+  // Cached entries, indexed by private identity and then by public identity
+  // and realm, so that all entries for a private identity can be invalidated
+  // at once.
+  std::map<std::string, std::map<std::string, Entry>> _entries;
+
+  // The time at which to next purge expired entries.
+  time_t _next_purge;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+};
+
+#endif
@@ -20,6 +20,7 @@
 #include <ares.h>
 #include "sas.h"
 #include "baseresolver.h"
+#include "async_dnsresolver.h"
 
 /// @class DNSResolver
 ///
@@ -36,10 +37,15 @@ public:
   static void destroy(DNSResolver* resolver);
   // Perform a NAPTR query for the specified domain, returning the results in
   // the naptr_reply structure, and logging to the trail.  The caller must
-  // call free_naptr_reply when it has finished with naptr_reply.
-  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail);
+  // call free_naptr_reply when it has finished with naptr_reply.  ttl is set
+  // to the lowest TTL of the NAPTR records in the response (or 0 if there are
+  // none).
+  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail);
   // Free a naptr_reply structure.
   virtual void free_naptr_reply(struct ares_naptr_reply* naptr_reply) const;
+  // Finds the lowest TTL of the NAPTR records in the answer section of a
+  // response, or 0 if there are none or the response can't be parsed.
+  static int min_naptr_ttl(const unsigned char* abuf, int alen);
 
 private:
   // Send a query for the specified domain.
@@ -74,6 +80,9 @@ private:
   // The reply data structure.  Only valid between ares_callback and
   // perform_naptr_query returning, and only if _status is ARES_SUCCESS.
   struct ares_naptr_reply* _naptr_reply;
+  // The TTL of the reply.  Only valid under the same conditions as
+  // _naptr_reply.
+  int _ttl;
   // Pointer to a linked list of servers
   struct ares_addr_node _ares_addrs[3];
 
@@ -90,6 +99,8 @@ public:
   virtual ~DNSResolverFactory() {}
   // Create a new resolver.
   virtual DNSResolver* new_resolver(const std::vector<struct IP46Address>& servers) const;
+  // Create a new asynchronous resolver.
+  virtual AsyncDNSResolver* new_async_resolver(const std::vector<struct IP46Address>& servers) const;
 
 };
 
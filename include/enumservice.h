@@ -16,7 +16,14 @@
 #define ENUMSERVICE_H__
 
 #include <list>
+#include <functional>
+#include <mutex>
+#include <memory>
 #include <string>
+#include <atomic>
+#include <unordered_map>
+#include <pthread.h>
+#include <time.h>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
 #include <netinet/in.h>
@@ -24,8 +31,14 @@
 #include "sas.h"
 #include "baseresolver.h"
 #include "dnsresolver.h"
+#include "async_dnsresolver.h"
 #include "communicationmonitor.h"
+#include "snmp_counter_table.h"
 #include "updater.h"
+#include "prefix_trie.h"
+#include "number_utils.h"
+#include "routing_db.h"
+#include "snapshot.h"
 
 /// @class EnumService
 ///
@@ -41,6 +54,21 @@ public:
   /// Translate a PSTN number to a SIP URI.
   virtual std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const = 0;
 
+  /// Called with the result of an asynchronous lookup (which is empty if the
+  /// lookup failed).
+  typedef std::function<void(const std::string& uri)> LookupCallback;
+
+  /// Translate a PSTN number to a SIP URI without blocking.  The callback may
+  /// be called before this returns (on this thread), or later on another
+  /// thread.  By default this just does a synchronous lookup.
+  virtual void lookup_uri_from_user_async(const std::string& user,
+                                          SAS::TrailId trail,
+                                          LookupCallback callback) const;
+
+  /// Whether lookups may block (on network I/O), and so should be done
+  /// asynchronously where possible.
+  virtual bool is_async() const { return false; }
+
   // Parse a string of the form !<regex>!<replace>! into a regular expression
   // and a replacement string.
   static bool parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace);
@@ -50,8 +78,7 @@ public:
   // first character, or just 0-9 for subsequent characters.  Since the ENUM
   // "First Well Known Rule" is the identity, the Application Unique String is
   // also the first key to use.
-  static const boost::regex CHARS_TO_STRIP_FROM_UAS;
-  static std::string user_to_aus(const std::string& user) { return boost::regex_replace(user, CHARS_TO_STRIP_FROM_UAS, std::string("")); };
+  static std::string user_to_aus(const std::string& user) { return NumberUtils::normalize(user, NumberUtils::user_to_aus); };
 
 };
 
@@ -87,29 +114,64 @@ public:
 
   std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const;
 
+  /// Compiles an enum.json file into a routing database that the service can
+  /// load instead (see RoutingDb).
+  ///
+  /// @return - Whether the database was written successfully.
+  static bool compile(const std::string& json_file, const std::string& db_file);
+
 private:
   struct NumberPrefix
   {
     std::string prefix;
+    std::string regex;
     boost::regex match;
     std::string replace;
   };
 
-  std::vector<NumberPrefix> _number_prefixes;
-  std::map<std::string, NumberPrefix> _prefix_regex_map;
+  /// The number prefixes read from enum.json, or mapped from a compiled
+  /// routing database.  This is never modified once built - update_enum
+  /// builds a new set and swaps it in.
+  struct NumberPrefixes
+  {
+    // Number prefixes indexed by prefix, so that lookups are proportional to
+    // the length of the number rather than the size of the numbering plan.
+    PrefixTrie<NumberPrefix> prefix_trie;
+
+    // If the number prefixes came from a compiled database, the database and
+    // its rules (indexed by value index) are used instead.
+    std::unique_ptr<RoutingDb> db;
+    std::vector<NumberPrefix> db_rules;
+  };
+
+  static bool read_json(const std::string& configuration,
+                        std::vector<NumberPrefix>& number_prefixes);
+
+  static std::shared_ptr<NumberPrefixes> load_db(const std::string& db_file);
+
+  // The current number prefixes.  Each thread reads its own reference to
+  // them, which it only refreshes (under a lock) after they have been
+  // reloaded - see Snapshot.
+  Snapshot<NumberPrefixes> _number_prefixes;
   std::string _configuration;
   Updater<void, JSONEnumService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _number_prefixes_rw_lock;
-
-  const NumberPrefix* prefix_match(const std::string& number) const;
+  // Returns the best match for the number, which is only valid for as long
+  // as the caller holds a reference to number_prefixes, and sets
+  // matched_prefix to the prefix that matched.  (Rules loaded from a compiled
+  // database are shared between prefixes, so their prefix member is empty.)
+  static const NumberPrefix* prefix_match(const NumberPrefixes& number_prefixes,
+                                          const std::string& number,
+                                          std::string& matched_prefix);
 };
 
 /// @class DNSEnumService
 ///
 /// Provides an ENUM service based on DNS queries from an ENUM server.
+///
+/// The parsed rules for each ENUM domain are cached for the lowest TTL of the
+/// NAPTR records they came from, and domains that don't exist are cached for
+/// a configurable negative TTL.  The cache is shared by all threads.
 class DNSEnumService : public EnumService
 {
 public:
@@ -117,14 +179,26 @@ public:
                  const std::string& dns_suffix = ".e164.arpa",
                  const DNSResolverFactory* resolver_factory = 
                                                        new DNSResolverFactory(),
-                 CommunicationMonitor* comm_monitor = NULL);
+                 CommunicationMonitor* comm_monitor = NULL,
+                 int negative_cache_ttl = 0,
+                 SNMP::CounterTable* cache_hits_tbl = NULL,
+                 SNMP::CounterTable* cache_misses_tbl = NULL);
   ~DNSEnumService();
 
   std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const;
 
-  // Characters to strip from a key before turning it into a domain.  This is
-  // all non-digit characters.
-  static const boost::regex CHARS_TO_STRIP_FROM_DOMAIN;
+  /// Asynchronous lookups share a single event loop thread (started on first
+  /// use), and call back on that thread unless the lookup can be satisfied
+  /// from the cache.
+  void lookup_uri_from_user_async(const std::string& user,
+                                  SAS::TrailId trail,
+                                  LookupCallback callback) const;
+  bool is_async() const { return true; }
+
+  /// Cache statistics (counted per ENUM domain looked up), since the service
+  /// was created.
+  uint64_t cache_hits() const { return _cache_hits; }
+  uint64_t cache_misses() const { return _cache_misses; }
 
 private:
   /// @class Rule
@@ -160,13 +234,82 @@ private:
 
   };
 
+  /// The result of the NAPTR query for an ENUM domain, as held in the cache.
+  struct CacheEntry
+  {
+    // Either ARES_SUCCESS or ARES_ENOTFOUND.
+    int status;
+    // The sorted rules from the NAPTR records (if status is ARES_SUCCESS).
+    std::shared_ptr<const std::vector<Rule>> rules;
+    time_t expires;
+  };
+
   // Maximum number of DNS queries per request.
   static const int MAX_DNS_QUERIES = 5;
 
+  // How often (in seconds) to sweep expired entries out of the cache.
+  static const int CACHE_PURGE_INTERVAL = 60;
+
+  /// The state of a lookup, which may span several DNS queries.
+  struct Lookup
+  {
+    Lookup(const std::string& user, SAS::TrailId trail, LookupCallback callback);
+
+    bool in_progress() const
+    {
+      return (!complete) && (!failed) && (dns_queries < MAX_DNS_QUERIES);
+    }
+
+    std::string user;
+    // The Application Unique String (AUS) from the user.  This is used to
+    // form the first key, and also as the input into the regular
+    // expressions.
+    std::string aus;
+    // The current key (or the result, once complete).
+    std::string string;
+    bool complete;
+    bool failed;
+    bool server_failed;
+    // Whether any query went to the ENUM server (rather than the cache).
+    bool queried;
+    int dns_queries;
+    SAS::TrailId trail;
+    // Only used by asynchronous lookups.
+    LookupCallback callback;
+  };
+
   // Converts a key to an ENUM domain name.
   std::string key_to_domain(const std::string& key) const;
   // Gets a resolver (from thread-local data).
   DNSResolver* get_resolver() const;
+  // Gets the shared asynchronous resolver, creating it if necessary.
+  AsyncDNSResolver* get_async_resolver() const;
+  // Issues queries for an asynchronous lookup until it either needs to wait
+  // for the ENUM server or is finished, in which case the callback is called.
+  void continue_async_lookup(std::shared_ptr<Lookup> lookup) const;
+  // Applies the result of a query (the ares status and, on success, the
+  // sorted rules) to a lookup.
+  void process_rules(Lookup& lookup,
+                     int status,
+                     std::shared_ptr<const std::vector<Rule>> rules) const;
+  // Logs the result of a lookup and updates the communication monitor.
+  // Returns the resulting URI (or an empty string on failure).
+  std::string complete_lookup(Lookup& lookup) const;
+  // Gets the result of a query for an ENUM domain from the cache.  Returns
+  // false if there's no valid cache entry.
+  bool get_cached_rules(const std::string& domain,
+                        int& status,
+                        std::shared_ptr<const std::vector<Rule>>& rules) const;
+  // Parses the response to a query for an ENUM domain into sorted rules,
+  // which are returned, and caches them as appropriate.
+  std::shared_ptr<const std::vector<Rule>>
+    store_rules(const std::string& domain,
+                int status,
+                const struct ares_naptr_reply* naptr_reply,
+                int ttl) const;
+  // Removes expired entries from the cache.  Must be called with the cache
+  // lock held.
+  void purge_expired_cache(time_t now) const;
   // Parses a naptr_reply into a list of Rule objects.
   static void parse_naptr_reply(const struct ares_naptr_reply* naptr_reply,
                                 std::vector<DNSEnumService::Rule>& rules);
@@ -179,10 +322,27 @@ private:
   pthread_key_t _thread_local;
   // DNSResolverFactory, used for constructing DNSResolvers when required.
   const DNSResolverFactory* _resolver_factory;
+  // The resolver used for asynchronous lookups.
+  mutable std::once_flag _async_resolver_once;
+  mutable AsyncDNSResolver* _async_resolver;
 
   // Helper used to track enum communication state, and issue/clear alarms
   // based upon recent activity.
   CommunicationMonitor* _comm_monitor;
+
+  // How long to cache domains that don't exist for.
+  const int _negative_cache_ttl;
+
+  // Cached query results, indexed by ENUM domain, and the lock that protects
+  // them.  These are mutable as lookups (which are const) fill the cache.
+  mutable pthread_mutex_t _cache_lock;
+  mutable std::unordered_map<std::string, CacheEntry> _cache;
+  mutable time_t _next_cache_purge;
+
+  mutable std::atomic<uint64_t> _cache_hits;
+  mutable std::atomic<uint64_t> _cache_misses;
+  SNMP::CounterTable* _cache_hits_tbl;
+  SNMP::CounterTable* _cache_misses_tbl;
 };
 
 #endif
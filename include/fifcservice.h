@@ -9,6 +9,7 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <memory>
 #include <string>
 #include <boost/thread.hpp>
 #include "rapidxml/rapidxml.hpp"
@@ -16,6 +17,7 @@
 #include "updater.h"
 #include "ifc.h"
 #include "alarm.h"
+#include "snapshot.h"
 
 #ifndef FIFCSERVICE_H__
 #define FIFCSERVICE_H__
@@ -38,14 +40,15 @@ public:
 
 private:
   Alarm* _alarm;
-  std::vector<std::string> _fallback_ifcs;
+
+  // The current fallback iFCs, in priority order.  This list is never
+  // modified once published - update_fifcs builds a new one and publishes
+  // it, and each thread reads its own reference to the list, which it only
+  // refreshes (under a lock) after it has been reloaded - see Snapshot.
+  Snapshot<std::vector<std::string>> _fallback_ifcs;
   std::string _configuration;
   Updater<void, FIFCService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the calss, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _sets_rw_lock;
-
   // Helper functions to set/clear the alarm.
   void set_alarm();
   void clear_alarm();
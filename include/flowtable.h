@@ -23,6 +23,8 @@ extern "C" {
 #include <cassert>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <string>
 #include <atomic>
 
@@ -69,8 +71,6 @@ public:
                                          pjsip_transport_state state,
                                          const pjsip_transport_state_info *info);
 
-  static void on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e);
-
   friend class FlowTable;
 
 private:
@@ -80,10 +80,9 @@ private:
   static const int TOKEN_LENGTH = 10;
 
   void select_default_identity();
-  void restart_timer(int id, int timeout);
-  void expiry_timer();
+  void check_expiry(int now);
 
-  void inc_ref();
+  bool inc_ref();
 
   FlowTable* _flow_table;
   pjsip_transport* _transport;
@@ -91,10 +90,20 @@ private:
   pj_sockaddr _remote_addr;
   std::string _token;
 
-  /// Timer used to expire the associated registration bindings.  This is also
-  /// used to expire idle UDP flows (ie. when there are no more associated
-  /// registration bindings.
-  pj_timer_entry _timer;
+  /// Which of the expiry timer or the idle timer is running (or zero if
+  /// neither is).  The expiry timer expires the associated registration
+  /// bindings.  The idle timer expires idle UDP flows (ie. when there are no
+  /// more associated registration bindings).  Rather than each flow having a
+  /// PJSIP timer, the FlowTable checks the flow when the timer is due.  This
+  /// is protected by the _flow_lock.
+  int _timer_id;
+
+  /// The time the flow was last touched, which the idle timer runs from.
+  std::atomic<int> _last_active;
+
+  /// When the FlowTable will next check this flow (or zero if it isn't going
+  /// to).  This is protected by the FlowTable::_expiry_lock.
+  int _check_time;
 
   /// Lock used to protect accesses to the various data structures managing
   /// the identifiers authorized on this flow.
@@ -118,12 +127,13 @@ private:
   /// The default identity for this flow.
   std::string _default_id;
 
-  /// Counts the references to this Flow.  This can only be updated or tested
-  /// by a thread which currently holds the FlowTable::_flow_map_lock.
-  int _refs;
+  /// Counts the references to this Flow.  Once this reaches zero the flow
+  /// is being removed from the FlowTable, and no more references can be
+  /// added to it.
+  std::atomic<int> _refs;
 
   // Counts the number of active dialogs on this flow. This can be
-  // updated or tested without FlowTable::_flow_map_lock being held.
+  // updated or tested without any FlowTable locks being held.
   std::atomic_long _dialogs;
 
   /// Timer identifiers - the timer either runs as an expiry timer (when there
@@ -143,7 +153,13 @@ private:
 class FlowTable : public QuiesceFlowsInterface
 {
 public:
-  FlowTable(QuiescingManager* qm, SNMP::U32Scalar* connection_count);
+  /// The shard lock statistics (see stats()) are reported to the
+  /// lock_acquisitions and lock_contentions scalars, if supplied, each time
+  /// the flows are swept for expiry.
+  FlowTable(QuiescingManager* qm,
+            SNMP::U32Scalar* connection_count,
+            SNMP::U32Scalar* lock_acquisitions = NULL,
+            SNMP::U32Scalar* lock_contentions = NULL);
   virtual ~FlowTable();
 
   /// Create a flow corresponding to the specified received message.
@@ -162,6 +178,20 @@ public:
   /// Removes a flow from the flow table.
   void remove_flow(Flow* flow);
 
+  /// Statistics since the flow table was created.
+  struct Stats
+  {
+    // Flows currently in the table.
+    size_t flows;
+    // Times a shard lock was taken.
+    uint64_t lock_acquisitions;
+    // Times a shard lock was already held by another thread, so had to be
+    // waited for.
+    uint64_t lock_contentions;
+  };
+
+  Stats stats() const;
+
   // Functions for quiescing a Bono.
   void check_quiescing_state();
   void quiesce();
@@ -186,37 +216,74 @@ private:
     {
     }
 
-    /// Override operator< so this can be used as a map key.
-    bool operator< (const FlowKey& other) const
+    bool operator== (const FlowKey& other) const
     {
-      // Compare the transport type first.
-      if (_type < other._type)
-      {
-        return true;
-      }
-      else if (_type > other._type)
-      {
-        return false;
-      }
-      else
-      {
-        // The transport is the same, so check the remote addresses.
-        return (pj_sockaddr_cmp(&_raddr, &other._raddr) < 0);
-      }
+      return ((_type == other._type) &&
+              (pj_sockaddr_cmp(&_raddr, &other._raddr) == 0));
     }
 
+    /// Hashes the transport type and remote address and port.
+    struct Hash
+    {
+      size_t operator()(const FlowKey& key) const;
+    };
+
   private:
     int _type;
     pj_sockaddr _raddr;
   };
 
-  pthread_mutex_t _flow_map_lock;
-  std::map<FlowKey, Flow*> _tp2flow_map;        // map from transport addresses to flow
-  std::map<std::string, Flow*> _tk2flow_map;    // map from token to flow
+  /// The flows are split across a number of shards, each with its own lock,
+  /// so that threads handling messages on different flows don't contend.
+  /// A flow is indexed by its transport and remote address in one shard,
+  /// and by its token in another (picked by hashing each).  A thread never
+  /// holds more than one shard lock at a time.
+  static const int NUM_SHARDS = 64;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::unordered_map<FlowKey, Flow*, FlowKey::Hash> tp2flow_map;  // map from transport addresses to flow
+    std::unordered_map<std::string, Flow*> tk2flow_map;             // map from token to flow
+    std::atomic<uint64_t> lock_acquisitions;
+    std::atomic<uint64_t> lock_contentions;
+  };
+
+  Shard& tp_shard(const FlowKey& key);
+  Shard& tk_shard(const std::string& token);
+  static void lock_shard(Shard& shard);
+
+  Shard _shards[NUM_SHARDS];
+
+  /// Flows are checked for expiry by a sweeper that runs every
+  /// EXPIRY_BUCKET_SECS, using a wheel of buckets of the flows due to be
+  /// checked in each interval.  Flows due further in the future than the
+  /// wheel covers are checked early, and put back in the wheel.
+  static const int EXPIRY_BUCKET_SECS = 1;
+  static const int NUM_EXPIRY_BUCKETS = 1024;
+
+  /// Schedules a flow to be checked at (or shortly after) the specified
+  /// time, unless it is already due to be checked before then.
+  void schedule_check(Flow* flow, int check_time);
+
+  /// Stops checking a flow that is being removed.
+  void unschedule_check(Flow* flow);
+
+  static void on_sweep_timer(pj_timer_heap_t* th, pj_timer_entry* e);
+  void sweep();
+
+  pthread_mutex_t _expiry_lock;
+  std::vector<std::unordered_set<Flow*> > _expiry_buckets;
+  int _last_swept;
+  pj_timer_entry _sweep_timer;
 
   // Statistics
   void report_flow_count();
+  void report_lock_stats();
+  std::atomic<size_t> _flow_count;
   SNMP::U32Scalar* _conn_count;
+  SNMP::U32Scalar* _lock_acquisitions;
+  SNMP::U32Scalar* _lock_contentions;
   bool _quiescing;
   QuiescingManager* _qm;
 
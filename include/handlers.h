@@ -19,6 +19,7 @@
 #include "subscriber_data_manager.h"
 #include "sipresolver.h"
 #include "impistore.h"
+#include "digest_av_cache.h"
 
 /// Common factory for all handlers that deal with chronos timer pops. This is
 /// a subclass of SpawningHandler that requests HTTP flows to be
@@ -89,13 +90,15 @@ public:
            HSSConnection* hss,
            SIPResolver* sipresolver,
            ImpiStore* local_impi_store,
-           std::vector<ImpiStore*> remote_impi_stores) :
+           std::vector<ImpiStore*> remote_impi_stores,
+           DigestAvCache* digest_av_cache = NULL) :
       _sdm(sdm),
       _remote_sdms(remote_sdms),
       _hss(hss),
       _sipresolver(sipresolver),
       _local_impi_store(local_impi_store),
-      _remote_impi_stores(remote_impi_stores)
+      _remote_impi_stores(remote_impi_stores),
+      _digest_av_cache(digest_av_cache)
     {}
     SubscriberDataManager* _sdm;
     std::vector<SubscriberDataManager*> _remote_sdms;
@@ -103,6 +106,7 @@ public:
     SIPResolver* _sipresolver;
     ImpiStore* _local_impi_store;
     std::vector<ImpiStore*> _remote_impi_stores;
+    DigestAvCache* _digest_av_cache;
   };
 
 
@@ -115,14 +119,29 @@ public:
   void run();
   HTTPCode handle_request();
   HTTPCode parse_request(std::string body);
-  SubscriberDataManager::AoRPair* deregister_bindings(
+
+  /// Deregisters a batch of AoRs, pipelining the store accesses.
+  ///
+  /// @param bindings           - Map of AoR ID to the private ID whose
+  ///                             bindings should be removed (or "" to remove
+  ///                             all bindings).
+  /// @param previous_aor_pairs - AoR pairs (keyed by AoR ID) to restore
+  ///                             bindings from if the current SDM has none.
+  /// @param stop_at_failure    - Whether to leave the AoRs after the first one
+  ///                             that can't be read alone, as happens when
+  ///                             the AoRs are deregistered one at a time.
+  ///
+  /// @return                   - Map of AoR ID to the AoR pair that was
+  ///                             written, or NULL if the AoR could not be
+  ///                             updated.  The caller owns the AoR pairs.
+  std::map<std::string, SubscriberDataManager::AoRPair*> deregister_bindings(
                     SubscriberDataManager* current_sdm,
                     HSSConnection* hss,
-                    std::string aor_id,
-                    std::string private_id,
-                    SubscriberDataManager::AoRPair* previous_aor_data,
+                    const std::map<std::string, std::string>& bindings,
+                    const std::map<std::string, SubscriberDataManager::AoRPair*>& previous_aor_pairs,
                     std::vector<SubscriberDataManager*> remote_sdms,
-                    std::set<std::string>& impis_to_delete);
+                    std::set<std::string>& impis_to_delete,
+                    bool stop_at_failure);
 
 protected:
   void delete_impi_from_store(ImpiStore* store, const std::string& impi);
@@ -147,7 +166,7 @@ public:
   AuthTimeoutTask(HttpStack::Request& req,
                   const Config* cfg,
                   SAS::TrailId trail) :
-    HttpStackUtils::Task(req, trail), _cfg(cfg)
+    HttpStackUtils::Task(req, trail), _cfg(cfg), _stateless(false)
   {};
 
   void run();
@@ -157,6 +176,7 @@ protected:
   std::string _impi;
   std::string _impu;
   std::string _nonce;
+  bool _stateless;
 };
 
 
@@ -244,4 +264,31 @@ private:
   const Config* _cfg;
 };
 
+class SproutletProxy;
+
+/// Task for reporting the resource usage of each Sproutlet (invocations,
+/// time spent in callbacks, messages cloned and pool memory used) as JSON.
+class SproutletStatsTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config(SproutletProxy* proxy) :
+      _proxy(proxy)
+    {}
+
+    SproutletProxy* _proxy;
+  };
+
+  SproutletStatsTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail), _cfg(cfg)
+  {};
+  virtual ~SproutletStatsTask() {}
+
+  void run();
+
+private:
+  const Config* _cfg;
+};
+
 #endif
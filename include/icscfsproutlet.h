@@ -30,6 +30,7 @@ extern "C" {
 #include "icscfrouter.h"
 #include "acr.h"
 #include "sproutlet.h"
+#include "object_pool.h"
 #include "snmp_success_fail_count_by_request_type_table.h"
 #include "snmp_success_fail_count_table.h"
 
@@ -62,6 +63,11 @@ public:
                         pj_pool_t* pool,
                         SAS::TrailId trail);
 
+  /// Non-REGISTER requests can be routed statelessly if ACRs aren't being
+  /// sent, although the I-CSCF can't then retry an alternative S-CSCF if the
+  /// selected one fails.
+  bool supports_stateless(const pjsip_msg* req) const;
+
 private:
 
   /// Returns the configured BGCF URI for this system.
@@ -117,7 +123,8 @@ private:
 };
 
 
-class ICSCFSproutletTsx : public SproutletTsx
+class ICSCFSproutletTsx : public SproutletTsx,
+                          public PooledObject<ICSCFSproutletTsx>
 {
 public:
   ICSCFSproutletTsx(ICSCFSproutlet* icscf,
@@ -19,7 +19,9 @@ extern "C" {
 
 #include <string>
 #include <vector>
+#include <map>
 #include <memory>
+#include <boost/regex.hpp>
 
 #include "rapidxml/rapidxml.hpp"
 #include "sessioncase.h"
@@ -41,6 +43,62 @@ struct AsInvocation
   bool include_register_response;
 };
 
+/// Per-request index of a message's headers, used to evaluate SIPHeader
+/// service point triggers across every iFC in a set in a single pass.
+//
+// Header names and values are converted to strings once, each distinct
+// Header/Content regex is compiled once, and the outcome of each distinct
+// SIPHeader trigger is recorded so that the same trigger appearing in several
+// iFCs is only evaluated once.
+class SPTMatchCache
+{
+public:
+  SPTMatchCache(pjsip_msg* msg);
+
+  /// The outcome of evaluating a SIPHeader service point trigger.
+  enum HeaderResult
+  {
+    MATCH,
+    NO_MATCH,
+    INVALID_HEADER_REGEX,
+    INVALID_CONTENT_REGEX
+  };
+
+  /// Evaluates a SIPHeader trigger against the indexed message.
+  ///
+  /// @param header_re    - The (case-insensitive) Header regex.
+  /// @param content_re   - The Content regex, or NULL if the trigger has no
+  ///                       Content element.
+  HeaderResult header_matches(const std::string& header_re,
+                              const std::string* content_re);
+
+  /// Number of distinct SIPHeader triggers evaluated so far.
+  size_t triggers_evaluated() const { return _results.size(); }
+
+private:
+  struct IndexedHeader
+  {
+    pjsip_hdr* hdr;
+    std::string name;
+    std::string value;
+    bool value_set;
+  };
+
+  const std::string& header_value(IndexedHeader& header);
+
+  // Returns the indices of the headers whose names match the regex, or NULL
+  // if the regex is invalid.
+  const std::vector<size_t>* headers_matching(const std::string& header_re);
+
+  // Returns the compiled content regex, or NULL if it is invalid.
+  const boost::regex* content_regex(const std::string& content_re);
+
+  std::vector<IndexedHeader> _headers;
+  std::map<std::string, std::vector<size_t>> _name_matches;
+  std::map<std::string, boost::regex> _content_regexes;
+  std::map<std::string, HeaderResult> _results;
+};
+
 /// A single Initial Filter Criterion (iFC).
 class Ifc
 {
@@ -59,7 +117,8 @@ public:
                       bool is_registered,
                       bool is_initial_registration,
                       pjsip_msg* msg,
-                      SAS::TrailId trail) const;
+                      SAS::TrailId trail,
+                      SPTMatchCache* cache = NULL) const;
 
   AsInvocation as_invocation() const;
 
@@ -71,7 +130,8 @@ private:
                           rapidxml::xml_node<>* spt,
                           std::string ifc_str,
                           std::string server_name,
-                          SAS::TrailId trail);
+                          SAS::TrailId trail,
+                          SPTMatchCache* cache);
 
   static void invalid_ifc(std::string error,
                           std::string server_name,
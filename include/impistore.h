@@ -12,7 +12,11 @@
 #ifndef IMPISTORE_H_
 #define IMPISTORE_H_
 
+#include <functional>
+#include <vector>
+
 #include "store.h"
+#include "parallel_store_ops.h"
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
@@ -302,7 +306,10 @@ public:
   /// Constructor.
   /// @param data_store    A pointer to the underlying data store.
   /// @param mode          The mode to use when accessing the data store.
-  ImpiStore(Store* data_store, Mode mode);
+  /// @param parallel_ops  If not NULL, used to issue the store operations for
+  ///                      an IMPI and its AVs concurrently rather than one at
+  ///                      a time.
+  ImpiStore(Store* data_store, Mode mode, ParallelStoreOps* parallel_ops = NULL);
 
   /// Destructor.
   virtual ~ImpiStore();
@@ -362,6 +369,33 @@ private:
   /// The mode to use when accessing the data store.
   Mode _mode;
 
+  /// Used to issue independent store operations concurrently (may be NULL).
+  ParallelStoreOps* _parallel_ops;
+
+  /// Runs a batch of independent store operations.  If parallel operations
+  /// are enabled, they are all in flight at once, so the batch costs a single
+  /// store round trip rather than one per operation.
+  void run_store_ops(std::vector<std::function<void()>>& ops);
+
+  /// Retrieves the IMPI for the specified private user identity and, if
+  /// nonce is not NULL, the AV for that nonce at the same time.
+  Impi* get_impi_and_avs(const std::string& impi,
+                         const std::string* nonce,
+                         SAS::TrailId trail);
+
+  /// Writes the AV for a single AuthChallenge.  Only used when using
+  /// Mode::READ_AV_IMPI_WRITE_AV_IMPI.
+  Store::Status set_av(const std::string& impi,
+                       AuthChallenge* auth_challenge,
+                       int now,
+                       SAS::TrailId trail);
+
+  /// Deletes the AV for a single nonce.  Only used when using
+  /// Mode::READ_AV_IMPI_WRITE_AV_IMPI.
+  Store::Status delete_av(const std::string& impi,
+                          const std::string& nonce,
+                          SAS::TrailId trail);
+
   /// Retrieves an authentication challenge from the AV store for the specified
   /// private user identity and nonce.  Only used when using
   /// Mode::READ_AV_IMPI_WRITE_AV_IMPI.
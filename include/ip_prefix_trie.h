@@ -0,0 +1,178 @@
+/**
+ * @file ip_prefix_trie.h  Set of IPv4 and IPv6 subnets.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IP_PREFIX_TRIE_H__
+#define IP_PREFIX_TRIE_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+/// @class IPPrefixTrie
+///
+/// A set of IP subnets (such as 10.1.0.0/16 or 2001:db8::/32, or single
+/// addresses), which can be searched for the subnet containing an address in
+/// time proportional to the length of the address rather than the number of
+/// subnets.  IPv4 and IPv6 subnets are held in separate binary tries, whose
+/// nodes are stored contiguously.
+///
+/// The trie isn't thread-safe - it should be built before it is searched.
+class IPPrefixTrie
+{
+public:
+  IPPrefixTrie() : _v4(1), _v6(1), _size(0) {}
+
+  /// Adds a subnet, written as an address with an optional prefix length
+  /// (for example "10.1.0.0/16").  An address without a prefix length is a
+  /// single host.  Any bits of the address beyond the prefix length are
+  /// ignored.
+  ///
+  /// @return - Whether the subnet was valid.
+  bool insert(const std::string& subnet)
+  {
+    std::string host = subnet;
+    int prefix_len = -1;
+
+    size_t slash = subnet.find('/');
+    if (slash != std::string::npos)
+    {
+      host = subnet.substr(0, slash);
+      std::string len = subnet.substr(slash + 1);
+      char* end = NULL;
+      prefix_len = strtol(len.c_str(), &end, 10);
+
+      if ((len.empty()) || (*end != '\0') || (prefix_len < 0))
+      {
+        return false;
+      }
+    }
+
+    pj_str_t host_str;
+    pj_cstr(&host_str, host.c_str());
+    pj_sockaddr addr;
+    if (pj_sockaddr_parse(pj_AF_UNSPEC(), 0, &host_str, &addr) != PJ_SUCCESS)
+    {
+      return false;
+    }
+
+    int max_len = (addr.addr.sa_family == pj_AF_INET()) ? 32 : 128;
+    if (prefix_len == -1)
+    {
+      prefix_len = max_len;
+    }
+    else if (prefix_len > max_len)
+    {
+      return false;
+    }
+
+    insert(addr, prefix_len);
+    return true;
+  }
+
+  /// Adds the subnet made up of the first prefix_len bits of an address.
+  void insert(const pj_sockaddr& addr, int prefix_len)
+  {
+    std::vector<Node>& nodes = (addr.addr.sa_family == pj_AF_INET()) ? _v4 : _v6;
+    const unsigned char* bytes = (const unsigned char*)pj_sockaddr_get_addr(&addr);
+    size_t node = 0;
+
+    for (int ii = 0; ii < prefix_len; ++ii)
+    {
+      int bit = (bytes[ii / 8] >> (7 - (ii % 8))) & 1;
+
+      if (nodes[node].children[bit] == 0)
+      {
+        nodes[node].children[bit] = nodes.size();
+        nodes.push_back(Node());
+      }
+
+      node = nodes[node].children[bit];
+    }
+
+    if (!nodes[node].subnet)
+    {
+      nodes[node].subnet = true;
+      _size++;
+    }
+  }
+
+  /// Returns whether an address (ignoring its port) is in any of the
+  /// subnets.
+  bool contains(const pj_sockaddr& addr) const
+  {
+    const std::vector<Node>* nodes;
+    int bits;
+
+    if (addr.addr.sa_family == pj_AF_INET())
+    {
+      nodes = &_v4;
+      bits = 32;
+    }
+    else if (addr.addr.sa_family == pj_AF_INET6())
+    {
+      nodes = &_v6;
+      bits = 128;
+    }
+    else
+    {
+      return false;
+    }
+
+    const unsigned char* bytes = (const unsigned char*)pj_sockaddr_get_addr(&addr);
+    size_t node = 0;
+
+    for (int ii = 0; !(*nodes)[node].subnet; ++ii)
+    {
+      if (ii == bits)
+      {
+        return false;
+      }
+
+      int bit = (bytes[ii / 8] >> (7 - (ii % 8))) & 1;
+      node = (*nodes)[node].children[bit];
+
+      if (node == 0)
+      {
+        // The root is never a child, so this means there's no such child.
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+private:
+  struct Node
+  {
+    Node() : subnet(false) { children[0] = 0; children[1] = 0; }
+
+    // Indexes of the child nodes for a 0 and 1 bit, or zero if there is no
+    // child.
+    uint32_t children[2];
+
+    // Whether the prefix up to this node is one of the subnets.
+    bool subnet;
+  };
+
+  std::vector<Node> _v4;
+  std::vector<Node> _v6;
+  size_t _size;
+};
+
+#endif
@@ -16,6 +16,7 @@
 #include "mmftargets.h"
 #include "updater.h"
 #include "alarm.h"
+#include "snapshot.h"
 
 
 #ifndef MMFSERVICE_H__
@@ -55,13 +56,14 @@ private:
   std::string _configuration;
   Updater<void, MMFService>* _updater;
 
-  /// Locking of the mmf_config relies on the atomic nature of shared pointers.
-  /// The updater method replaces the config with an entire new map, and the
-  /// accessor methods take a shared_ptr to the MMFMap.
-
+  /// The current MMF config.  The updater method replaces the config with an
+  /// entire new map, and each thread reads its own reference to the current
+  /// map, which it only refreshes (under a lock) after the config has been
+  /// reloaded - see Snapshot.
+  ///
   /// This is never modified dynamically, nor read incrementally.  If you wish
   /// to do either of the above, you must think about the locking consequences
-  std::shared_ptr<MMFService::MMFMap> _mmf_config;
+  Snapshot<MMFService::MMFMap> _mmf_config;
 
   /// Helper functions to set/clear the alarm.
   void set_alarm();
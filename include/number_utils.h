@@ -0,0 +1,92 @@
+/**
+ * @file number_utils.h  Character class filters for telephone numbers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef NUMBER_UTILS_H__
+#define NUMBER_UTILS_H__
+
+#include <string>
+
+extern "C" {
+#include <pjlib.h>
+}
+
+/// Classifies and normalizes telephone numbers (and the user parts of URIs
+/// that may hold them).  Each filter is a single pass over the string using
+/// a lookup table, so these are much cheaper than the equivalent regular
+/// expressions.
+///
+/// The normalizers work in place on a pj_str_t (whose buffer must be
+/// writable), shortening it by adjusting its length, so don't allocate
+/// memory.
+namespace NumberUtils
+{
+  /// A set of characters, held as a table indexed by character.
+  class CharSet
+  {
+  public:
+    /// Constructor.
+    ///
+    /// @param chars - The characters in the set.
+    CharSet(const char* chars);
+
+    inline bool contains(char c) const { return _table[(unsigned char)c]; }
+
+  private:
+    bool _table[256];
+  };
+
+  /// The digits 0-9.
+  extern const CharSet DIGITS;
+
+  /// The visual separators that are stripped from numbers before matching
+  /// them against number ranges: ".-()".
+  extern const CharSet VISUAL_SEPARATORS;
+
+  /// Whether every character of the string is in the set.
+  bool all_of(const pj_str_t& str, const CharSet& set);
+
+  /// Removes every character in the set from the string.
+  void strip(pj_str_t& str, const CharSet& set);
+
+  /// Removes every character that isn't in the set from the string.
+  void keep_only(pj_str_t& str, const CharSet& set);
+
+  /// Whether the string is a global number - a "+" followed by any
+  /// combination of digits and the visual separators ",-()".
+  bool is_global_number(const pj_str_t& str);
+
+  /// Whether the string is a local number - any combination of hex digits
+  /// (upper case), "*", "#" and the visual separators ",-()".
+  bool is_local_number(const pj_str_t& str);
+
+  /// Whether the string is made up only of digits and the characters
+  /// "+-.()[]".
+  bool is_user_numeric(const pj_str_t& str);
+
+  /// Removes visual separators from the number.
+  void remove_visual_separators(pj_str_t& number);
+
+  /// Converts a user to an ENUM Application Unique String by removing
+  /// anything other than 0-9 (or 0-9 and "+" for the first character).
+  void user_to_aus(pj_str_t& user);
+
+  /// Gets the user part of a SIP URI minus any parameters - that is, the
+  /// first ';' separated token that isn't empty once surrounding whitespace
+  /// is trimmed (as Utils::split_string with trimming does).  The token
+  /// points into the user's buffer.  Returns false if there's no such token.
+  bool user_minus_params(const pj_str_t& user, pj_str_t& token);
+
+  /// Copies the string and applies one of the normalizers above to the copy.
+  std::string normalize(const std::string& str, void (*normalizer)(pj_str_t&));
+  std::string normalize(const pj_str_t& str, void (*normalizer)(pj_str_t&));
+};
+
+#endif
@@ -0,0 +1,358 @@
+/**
+ * @file object_pool.h  Per-thread pools of fixed size objects.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef OBJECT_POOL_H__
+#define OBJECT_POOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @class ObjectPool
+///
+/// Recycles the memory for objects of type T, so that objects that are
+/// created and destroyed for every request don't go to the heap once the
+/// pool has warmed up.
+///
+/// Each thread keeps its own list of free blocks, so allocating and freeing
+/// doesn't take a lock.  Objects can be freed on a different thread to the
+/// one that allocated them - the block just goes to the freeing thread's
+/// list.
+///
+/// Objects are often created on one thread and freed on another (e.g.
+/// created on a SIP worker thread and freed on a Sproutlet's executor), so
+/// each thread keeps at most MAX_FREE blocks and passes any more, BATCH at a
+/// time, to a shared depot.  A thread whose list is empty takes a batch from
+/// the depot before going to the heap, so blocks flow back to the threads
+/// that allocate them, and the depot's lock is only taken once per BATCH
+/// allocations or frees.  The depot holds at most MAX_DEPOT_BATCHES batches,
+/// and returns any more to the heap.
+///
+/// The statistics are also kept per thread, next to the free list, and are
+/// only totalled when they are read.
+template <class T>
+class ObjectPool
+{
+public:
+  /// The most free blocks each thread keeps.
+  static const size_t MAX_FREE = 1024;
+
+  /// The number of blocks passed to or taken from the depot at once.
+  static const size_t BATCH = 256;
+
+  /// The most batches the depot keeps.
+  static const size_t MAX_DEPOT_BATCHES = 64;
+
+  /// Pool statistics, totalled across all threads since the process
+  /// started.
+  struct Stats
+  {
+    // Allocations that came from the heap (because the pool was empty).
+    uint64_t heap_allocs;
+    // Allocations that reused a block from the pool.
+    uint64_t pool_allocs;
+    // Frees that went back to the heap (because the thread's pool and the
+    // depot were full).
+    uint64_t heap_frees;
+    // Objects currently allocated.
+    uint64_t in_use;
+  };
+
+  /// Allocates a block for an object of the specified size.  Blocks are only
+  /// pooled if they are the size of a T.
+  static void* allocate(size_t size)
+  {
+    if (size != sizeof(T))
+    {
+      return ::operator new(size);
+    }
+
+    FreeList& free_list = thread_free_list();
+
+    if (free_list.head == NULL)
+    {
+      take_batch(free_list);
+    }
+
+    if (free_list.head != NULL)
+    {
+      Block* block = free_list.head;
+      free_list.head = block->next;
+      free_list.count--;
+      increment(free_list.counters.pool_allocs);
+      return block;
+    }
+
+    increment(free_list.counters.heap_allocs);
+    return ::operator new(sizeof(Block));
+  }
+
+  /// Frees a block allocated by allocate.
+  static void deallocate(void* ptr, size_t size)
+  {
+    if (ptr == NULL)
+    {
+      return;
+    }
+
+    if (size != sizeof(T))
+    {
+      ::operator delete(ptr);
+      return;
+    }
+
+    FreeList& free_list = thread_free_list();
+    increment(free_list.counters.frees);
+
+    if (free_list.count >= MAX_FREE)
+    {
+      give_batch(free_list);
+    }
+
+    Block* block = (Block*)ptr;
+    block->next = free_list.head;
+    free_list.head = block;
+    free_list.count++;
+  }
+
+  /// Returns the pool statistics.
+  static Stats stats()
+  {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+
+    Counters total;
+    total.add(reg.exited);
+
+    for (typename std::vector<FreeList*>::const_iterator i = reg.threads.begin();
+         i != reg.threads.end();
+         ++i)
+    {
+      total.add((*i)->counters);
+    }
+
+    // Objects can be freed on a different thread to the one that allocated
+    // them, so only the totals across all threads are meaningful.
+    Stats stats;
+    stats.heap_allocs = total.heap_allocs.load(std::memory_order_relaxed);
+    stats.pool_allocs = total.pool_allocs.load(std::memory_order_relaxed);
+    stats.heap_frees = total.heap_frees.load(std::memory_order_relaxed);
+    stats.in_use = stats.heap_allocs + stats.pool_allocs -
+                   total.frees.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+private:
+  // A free block, which is big enough to hold a T.
+  union Block
+  {
+    Block* next;
+    char storage[sizeof(T)];
+  };
+
+  // Statistics for a thread.  These are only written by the thread that
+  // owns them, so are updated with relaxed loads and stores rather than
+  // read-modify-writes, and are atomic only so that stats() can read them.
+  struct Counters
+  {
+    Counters() : heap_allocs(0), pool_allocs(0), heap_frees(0), frees(0) {}
+
+    void add(const Counters& other)
+    {
+      heap_allocs += other.heap_allocs.load(std::memory_order_relaxed);
+      pool_allocs += other.pool_allocs.load(std::memory_order_relaxed);
+      heap_frees += other.heap_frees.load(std::memory_order_relaxed);
+      frees += other.frees.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> heap_allocs;
+    std::atomic<uint64_t> pool_allocs;
+    std::atomic<uint64_t> heap_frees;
+    std::atomic<uint64_t> frees;
+  };
+
+  static void increment(std::atomic<uint64_t>& counter, uint64_t value = 1)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  }
+
+  struct FreeList;
+
+  // Batches of free blocks passed between threads.  Each batch is a list of
+  // BATCH blocks.
+  struct Depot
+  {
+    Depot() : lock(), batches()
+    {
+      batches.reserve(MAX_DEPOT_BATCHES);
+    }
+
+    ~Depot()
+    {
+      for (typename std::vector<Block*>::const_iterator i = batches.begin();
+           i != batches.end();
+           ++i)
+      {
+        free_blocks(*i);
+      }
+    }
+
+    std::mutex lock;
+    std::vector<Block*> batches;
+  };
+
+  static Depot& depot()
+  {
+    static Depot depot;
+    return depot;
+  }
+
+  static void free_blocks(Block* head)
+  {
+    while (head != NULL)
+    {
+      Block* block = head;
+      head = block->next;
+      ::operator delete(block);
+    }
+  }
+
+  // Moves a batch of blocks from the depot to a thread's (empty) free list,
+  // if the depot has one.
+  static void take_batch(FreeList& free_list)
+  {
+    Depot& dep = depot();
+    std::lock_guard<std::mutex> guard(dep.lock);
+
+    if (!dep.batches.empty())
+    {
+      free_list.head = dep.batches.back();
+      free_list.count = BATCH;
+      dep.batches.pop_back();
+    }
+  }
+
+  // Moves a batch of blocks from a thread's (full) free list to the depot,
+  // or to the heap if the depot is full.
+  static void give_batch(FreeList& free_list)
+  {
+    Block* batch = free_list.head;
+    Block* last = batch;
+
+    for (size_t ii = 1; ii < BATCH; ++ii)
+    {
+      last = last->next;
+    }
+
+    free_list.head = last->next;
+    free_list.count -= BATCH;
+    last->next = NULL;
+
+    {
+      Depot& dep = depot();
+      std::lock_guard<std::mutex> guard(dep.lock);
+
+      if (dep.batches.size() < MAX_DEPOT_BATCHES)
+      {
+        dep.batches.push_back(batch);
+        batch = NULL;
+      }
+    }
+
+    if (batch != NULL)
+    {
+      increment(free_list.counters.heap_frees, BATCH);
+      free_blocks(batch);
+    }
+  }
+
+  // The free lists of the running threads, and the statistics of the
+  // threads that have exited.
+  struct Registry
+  {
+    std::mutex lock;
+    std::vector<FreeList*> threads;
+    Counters exited;
+  };
+
+  // The free blocks and statistics for a thread.  The blocks are returned to
+  // the heap when the thread exits, and the statistics are kept in the
+  // registry.
+  struct FreeList
+  {
+    FreeList() : head(NULL), count(0), counters()
+    {
+      Registry& reg = registry();
+      std::lock_guard<std::mutex> guard(reg.lock);
+      reg.threads.push_back(this);
+    }
+
+    ~FreeList()
+    {
+      free_blocks(head);
+
+      Registry& reg = registry();
+      std::lock_guard<std::mutex> guard(reg.lock);
+      reg.exited.add(counters);
+      reg.threads.erase(std::find(reg.threads.begin(),
+                                  reg.threads.end(),
+                                  this));
+    }
+
+    Block* head;
+    size_t count;
+    Counters counters;
+  };
+
+  static FreeList& thread_free_list()
+  {
+    static thread_local FreeList free_list;
+    return free_list;
+  }
+
+  // The registry is created by the first FreeList, so it outlives them all.
+  static Registry& registry()
+  {
+    static Registry registry;
+    return registry;
+  }
+};
+
+/// @class PooledObject
+///
+/// Base class for objects whose memory comes from an ObjectPool.  Use as
+///
+///   class Foo : public PooledObject<Foo>
+///
+/// and Foos are created and destroyed with new and delete as usual.
+/// Subclasses of Foo that are a different size to it are allocated from the
+/// heap.
+template <class T>
+class PooledObject
+{
+public:
+  static void* operator new(size_t size)
+  {
+    return ObjectPool<T>::allocate(size);
+  }
+
+  static void operator delete(void* ptr, size_t size)
+  {
+    ObjectPool<T>::deallocate(ptr, size);
+  }
+};
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * @file parallel_store_ops.h  Helper for issuing store operations in parallel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PARALLEL_STORE_OPS_H_
+#define PARALLEL_STORE_OPS_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "threadpool.h"
+#include "exception_handler.h"
+
+/// @class ParallelStoreOps
+///
+/// Runs batches of independent store operations with several of them in
+/// flight at once, so that a batch costs a few store round trips rather than
+/// one per operation.
+///
+/// The operations are run on a fixed pool of threads, created at start of
+/// day and shared by every batch, together with the thread that submitted
+/// the batch.  The submitting thread keeps taking operations from its own
+/// batch until there are none left, so a batch always completes even if all
+/// the pool threads are busy with other batches.
+class ParallelStoreOps
+{
+public:
+  /// Constructor.
+  /// @param num_threads        Number of pool threads to start.
+  /// @param exception_handler  Exception handler.
+  ParallelStoreOps(unsigned int num_threads,
+                   ExceptionHandler* exception_handler);
+
+  /// Destructor.  Stops the pool threads.
+  virtual ~ParallelStoreOps();
+
+  /// Runs a batch of operations, and returns once every operation has
+  /// completed.
+  ///
+  /// The operations must be safe to run on any thread, so they must only
+  /// access the store (and SAS/logging), not the PJSIP stack.
+  void run(std::vector<std::function<void()>>& ops);
+
+private:
+  /// A batch of operations, shared between the submitting thread and any
+  /// pool threads helping with it.
+  struct Batch
+  {
+    Batch(std::vector<std::function<void()>>& ops_arg) :
+      ops(ops_arg), num_ops(ops_arg.size()), next(0), done(0)
+    {}
+
+    std::vector<std::function<void()>>& ops;
+    size_t num_ops;
+
+    /// The index of the next operation to run.
+    std::atomic<size_t> next;
+
+    /// The number of operations that have completed, protected by the lock.
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t done;
+  };
+
+  /// Runs operations from a batch until there are none left to start.
+  static void run_ops(Batch* batch);
+
+  static void exception_callback(std::shared_ptr<Batch> batch)
+  {
+    // No recovery behaviour - the submitting thread will finish the batch.
+  }
+
+  /// @class Pool
+  /// The thread pool that helps with batches.  Each item of work asks a
+  /// thread to help with a batch, and is a no-op if the batch has already
+  /// been finished.
+  class Pool : public ThreadPool<std::shared_ptr<Batch>>
+  {
+  public:
+    Pool(ExceptionHandler* exception_handler, unsigned int num_threads);
+    virtual ~Pool();
+
+  private:
+    virtual void process_work(std::shared_ptr<Batch>& batch);
+  };
+
+  unsigned int _num_threads;
+  Pool* _thread_pool;
+};
+
+#endif
@@ -125,6 +125,26 @@ pjsip_tx_data* clone_msg(pjsip_endpoint* endpt,
 pjsip_tx_data* clone_msg(pjsip_endpoint* endpt,
                          pjsip_tx_data* tdata);
 
+/// Clones the message in a tdata, except that the body is shared with the
+/// original rather than copied.  The original must be kept until the clone
+/// (and anything cloned from it in the same way) is freed, or the body is
+/// unshared with unshare_body.
+pjsip_tx_data* clone_msg_sharing_body(pjsip_endpoint* endpt,
+                                      pjsip_tx_data* tdata);
+
+/// Clones the message in a tdata for a fork, sharing the body and the
+/// contents of the headers with the original.  Only the Request-URI and the
+/// headers themselves are copied, so the fork can have its own Request-URI
+/// and headers can be added to, removed from or replaced in it, but the
+/// values, URIs and parameters in its headers must not be modified in place
+/// (in either message).  The original must be kept until the clone is freed.
+pjsip_tx_data* clone_msg_sharing_hdrs(pjsip_endpoint* endpt,
+                                      pjsip_tx_data* tdata);
+
+/// Gives a message its own copy of a body that it may be sharing with
+/// another message.
+void unshare_body(pjsip_tx_data* tdata);
+
 pj_status_t create_response(pjsip_endpoint *endpt,
                             const pjsip_rx_data *rdata,
                             int st_code,
@@ -164,8 +184,16 @@ void resolve_next_hop(pjsip_tx_data* tdata,
                       std::vector<AddrInfo>& servers,
                       SAS::TrailId trail);
 
+bool resolve_next_hop_async(pjsip_tx_data* tdata,
+                            int retries,
+                            std::vector<AddrInfo>& servers,
+                            SAS::TrailId trail,
+                            SIPResolver::ResolveCallback callback);
+
 void blacklist_server(AddrInfo& server);
 
+void record_server_latency(const AddrInfo& server, unsigned long latency_us);
+
 void set_dest_info(pjsip_tx_data* tdata, const AddrInfo& ai);
 
 void generate_new_branch_id(pjsip_tx_data* tdata);
@@ -187,8 +215,11 @@ pj_status_t send_request(pjsip_tx_data* tdata,
                          send_callback_builder cb=NULL,
                          bool log_sas_branch = false);
 
+// If new_branch is false, a retry to another server keeps the branch of the
+// request (so it still matches a CANCEL or ACK sent the same way).
 pj_status_t send_request_stateless(pjsip_tx_data* tdata,
-                                   int retries=0);
+                                   int retries=0,
+                                   bool new_branch=true);
 
 pj_status_t respond_stateless(pjsip_endpoint* endpt,
                               pjsip_rx_data* rdata,
@@ -279,6 +310,21 @@ void update_request_uri_np_data(pjsip_msg* req,
                                 bool should_override_npdi,
                                 SAS::TrailId trail);
 
+// The two halves of translate_request_uri (np_data_only false) and
+// update_request_uri_np_data (np_data_only true), for callers that do the
+// ENUM lookup asynchronously.  should_query_enum returns whether the
+// Request-URI should be translated, and if so the user to look up.
+bool should_query_enum(pjsip_msg* req,
+                       bool np_data_only,
+                       std::string& user);
+
+void apply_enum_result(pjsip_msg* req,
+                       pj_pool_t* pool,
+                       std::string new_uri_str,
+                       bool np_data_only,
+                       bool should_override_npdi,
+                       SAS::TrailId trail);
+
 bool should_update_np_data(URIClass old_uri_class,
                            URIClass new_uri_class,
                            std::string& new_uri_str,
@@ -0,0 +1,143 @@
+/**
+ * @file prefix_trie.h  Trie for longest-prefix matching of number ranges.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PREFIX_TRIE_H__
+#define PREFIX_TRIE_H__
+
+#include <map>
+#include <memory>
+#include <string>
+
+/// @class PrefixTrie
+///
+/// Maps string prefixes (typically telephone number ranges) to values, and
+/// finds the most specific prefix for a key in time proportional to the
+/// length of the key rather than the number of prefixes.
+///
+/// The trie isn't thread-safe - users should build a new trie and swap it in
+/// under a lock when the configuration changes.
+template <class T>
+class PrefixTrie
+{
+public:
+  PrefixTrie() : _root(new Node()), _size(0) {}
+
+  PrefixTrie(PrefixTrie&& other) = default;
+  PrefixTrie& operator=(PrefixTrie&& other) = default;
+
+  /// Adds a prefix to the trie.  If the prefix is already present, the
+  /// existing value is kept.
+  ///
+  /// @return - Whether the prefix was added.
+  bool insert(const std::string& prefix, const T& value)
+  {
+    Node* node = _root.get();
+
+    for (char c : prefix)
+    {
+      std::unique_ptr<Node>& child = node->children[c];
+
+      if (!child)
+      {
+        child.reset(new Node());
+      }
+
+      node = child.get();
+    }
+
+    if (node->value)
+    {
+      return false;
+    }
+
+    node->value.reset(new T(value));
+    _size++;
+    return true;
+  }
+
+  /// Finds the value for the longest prefix in the trie that is a prefix of
+  /// (or equal to) the key.
+  ///
+  /// @return - The value, or NULL if no prefix matches.  The value is owned by
+  ///           the trie.
+  const T* longest_prefix_match(const std::string& key) const
+  {
+    const Node* node = _root.get();
+    const T* match = node->value.get();
+
+    for (char c : key)
+    {
+      typename Children::const_iterator it = node->children.find(c);
+
+      if (it == node->children.end())
+      {
+        break;
+      }
+
+      node = it->second.get();
+
+      if (node->value)
+      {
+        match = node->value.get();
+      }
+    }
+
+    return match;
+  }
+
+  /// Finds the value for the lexicographically greatest prefix in the trie
+  /// that starts with (or is equal to) the key.
+  ///
+  /// @return - The value, or NULL if there is no such prefix.  The value is
+  ///           owned by the trie.
+  const T* last_with_prefix(const std::string& key) const
+  {
+    const Node* node = _root.get();
+
+    for (char c : key)
+    {
+      typename Children::const_iterator it = node->children.find(c);
+
+      if (it == node->children.end())
+      {
+        return NULL;
+      }
+
+      node = it->second.get();
+    }
+
+    // A prefix sorts before all its extensions, so keep taking the greatest
+    // child until we reach a leaf.  Every leaf holds a value.
+    while (!node->children.empty())
+    {
+      node = node->children.rbegin()->second.get();
+    }
+
+    return node->value.get();
+  }
+
+  size_t size() const { return _size; }
+
+private:
+  struct Node;
+  typedef std::map<char, std::unique_ptr<Node>> Children;
+
+  struct Node
+  {
+    Children children;
+    std::unique_ptr<T> value;
+  };
+
+  std::unique_ptr<Node> _root;
+  size_t _size;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file routing_db.h  Compiled, memory-mapped ENUM and BGCF routing tables.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ROUTING_DB_H_
+#define ROUTING_DB_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/// A routing database compiled offline from enum.json or bgcf.json (see
+/// sprout_routing_db_compiler).  The file is mapped read-only, so loading it
+/// doesn't depend on the number of routes, and the pages are shared between
+/// processes through the page cache.
+///
+/// The file holds a table of distinct route values (an ENUM regex rule, or a
+/// newline separated list of BGCF route URIs), and sorted tables of number
+/// prefixes and domains that each refer to a value.  All integers are in host
+/// byte order, so a database must be compiled on the same architecture that
+/// uses it.
+class RoutingDb
+{
+public:
+  enum Type
+  {
+    ENUM = 1,
+    BGCF = 2
+  };
+
+  /// The current file format version.
+  static const uint32_t VERSION = 1;
+
+  /// Returned by lookups that don't find a route.
+  static const uint32_t NOT_FOUND = 0xFFFFFFFF;
+
+  /// Maps a routing database into memory.
+  ///
+  /// @return - The database, or NULL if the file doesn't exist, isn't a
+  ///           routing database of the correct type and version, or is
+  ///           corrupt.
+  static RoutingDb* open(const std::string& path, Type type);
+
+  ~RoutingDb();
+
+  /// Returns the path of the compiled database for a JSON configuration file
+  /// (e.g. "/etc/clearwater/enum.json" becomes "/etc/clearwater/enum.db").
+  static std::string compiled_path(const std::string& json_path);
+
+  /// Whether a service should load the compiled database rather than the JSON
+  /// file.  This is the case if the database exists and is at least as new as
+  /// the JSON file, so that an out of date database is never used.
+  static bool use_compiled(const std::string& json_path,
+                           const std::string& db_path);
+
+  uint32_t num_values() const { return _header->num_values; }
+  uint32_t num_numbers() const { return _header->num_numbers; }
+  uint32_t num_domains() const { return _header->num_domains; }
+
+  /// Returns a route value.
+  std::string value(uint32_t index) const;
+
+  /// Finds the route for a number, with the same semantics as the in-memory
+  /// number tables - the greatest prefix that extends the number, or failing
+  /// that the longest prefix of the number.
+  ///
+  /// @param prefix - If not NULL, set to the matching prefix.
+  ///
+  /// @return - The index of the route value, or NOT_FOUND.
+  uint32_t match_number(const std::string& number,
+                        std::string* prefix = NULL) const;
+
+  /// Finds the route for a domain, which must match exactly.
+  ///
+  /// @return - The index of the route value, or NOT_FOUND.
+  uint32_t find_domain(const std::string& domain) const;
+
+  /// Builds a routing database and writes it to disk.
+  class Builder
+  {
+  public:
+    Builder(Type type) : _type(type) {}
+
+    /// Adds a route value, returning its index.  Identical values are only
+    /// stored once.
+    uint32_t add_value(const std::string& value);
+
+    /// Adds a number prefix or domain.  As with the in-memory tables, if the
+    /// key is already present the existing route is kept.
+    void add_number(const std::string& prefix, uint32_t value_index);
+    void add_domain(const std::string& domain, uint32_t value_index);
+
+    /// Writes the database.  This writes to a temporary file and renames it
+    /// into place, so that a service reloading the database never sees a
+    /// partially written file.
+    ///
+    /// @return - Whether the database was written successfully.
+    bool write(const std::string& path) const;
+
+  private:
+    Type _type;
+    std::vector<std::string> _values;
+    std::map<std::string, uint32_t> _value_indexes;
+    std::map<std::string, uint32_t> _numbers;
+    std::map<std::string, uint32_t> _domains;
+  };
+
+private:
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t type;
+    uint32_t num_values;
+    uint32_t num_numbers;
+    uint32_t num_domains;
+    uint32_t strings_len;
+  };
+
+  // An offset and length in the string pool.
+  struct StringRef
+  {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  struct Entry
+  {
+    StringRef key;
+    uint32_t value_index;
+  };
+
+  static const char MAGIC[8];
+
+  RoutingDb(void* addr, size_t len);
+
+  bool validate(Type type) const;
+
+  // Returns the key of an entry.
+  std::string key(const Entry& entry) const;
+
+  // Compares the first len characters of a key with a string.
+  int compare_key(const Entry& entry, const std::string& s, size_t len) const;
+
+  // Finds an exact match for a key in a sorted table of entries.
+  uint32_t find_exact(const Entry* entries,
+                      uint32_t num_entries,
+                      const std::string& key) const;
+
+  void* _addr;
+  size_t _len;
+
+  // Pointers into the mapped file.
+  const Header* _header;
+  const StringRef* _values;
+  const Entry* _numbers;
+  const Entry* _domains;
+  const char* _strings;
+};
+
+#endif
@@ -35,6 +35,7 @@ extern "C" {
 #include "aschain.h"
 #include "acr.h"
 #include "sproutlet.h"
+#include "object_pool.h"
 #include "snmp_counter_table.h"
 #include "session_expires_helper.h"
 #include "as_communication_tracker.h"
@@ -251,7 +252,8 @@ private:
 };
 
 
-class SCSCFSproutletTsx : public SproutletTsx
+class SCSCFSproutletTsx : public SproutletTsx,
+                          public PooledObject<SCSCFSproutletTsx>
 {
 public:
   SCSCFSproutletTsx(SCSCFSproutlet* scscf, pjsip_method_e req_type);
@@ -316,6 +318,16 @@ private:
   /// Route the request to the appropriate onward target.
   void route_to_target(pjsip_msg* req);
 
+  /// Route the request at the end of originating processing, once ENUM
+  /// translation is complete.
+  void route_translated_request(pjsip_msg* req);
+
+  /// Start an asynchronous ENUM translation of the Request-URI, if possible.
+  bool translate_request_uri_async(pjsip_msg* req);
+
+  /// Handle the completion of an asynchronous ENUM translation.
+  void on_enum_complete();
+
   /// Route the request to UE bindings retrieved from the registration store.
   void route_to_ue_bindings(pjsip_msg* req);
 
@@ -435,6 +447,11 @@ private:
   /// responding.
   TimerID _liveness_timer;
 
+  /// The request waiting for an asynchronous ENUM lookup, and the result of
+  /// the lookup (the address of which is also used as the timer context).
+  pjsip_msg* _enum_req;
+  std::string _enum_result;
+
   /// Track if this transaction has already record-routed itself to prevent
   /// us accidentally record routing twice.
   bool _record_routed;
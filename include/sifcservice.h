@@ -13,6 +13,7 @@
 #define SIFCSERVICE_H__
 
 #include <map>
+#include <memory>
 #include <string>
 #include <boost/thread.hpp>
 #include "rapidxml/rapidxml.hpp"
@@ -23,6 +24,7 @@
 #include "ifc.h"
 #include "alarm.h"
 #include "snmp_counter_table.h"
+#include "snapshot.h"
 
 class SIFCService
 {
@@ -47,16 +49,20 @@ public:
                                 SAS::TrailId trail) const;
 
 private:
+  /// Map from set ID to the (priority, IFC XML) pairs in that set.
+  typedef std::map<int32_t, std::vector<std::pair<int32_t, std::string>>> SharedIfcSets;
+
   Alarm* _alarm;
   SNMP::CounterTable* _no_shared_ifcs_set_tbl;
-  std::map<int32_t, std::vector<std::pair<int32_t, std::string>>> _shared_ifc_sets;
+
+  // The current shared IFC sets.  These are never modified once published -
+  // update_sets builds a new map and publishes it, and each thread reads its
+  // own reference to the sets, which it only refreshes (under a lock) after
+  // they have been reloaded - see Snapshot.
+  Snapshot<SharedIfcSets> _shared_ifc_sets;
   std::string _configuration;
   Updater<void, SIFCService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _sets_rw_lock;
-
   // Helper functions to set/clear the alarm.
   void set_alarm();
   void clear_alarm();
@@ -12,8 +12,18 @@
 #ifndef SIPRESOLVER_H__
 #define SIPRESOLVER_H__
 
+#include <map>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <tuple>
+#include <atomic>
+#include <pthread.h>
+#include <time.h>
+
 #include "baseresolver.h"
 #include "sas.h"
+#include "snmp_counter_table.h"
 
 class SIPResolver : public BaseResolver
 {
@@ -30,10 +40,279 @@ public:
                std::vector<AddrInfo>& targets,
                SAS::TrailId trail = 0);
 
+  /// Called with the result of an asynchronous resolution.
+  typedef std::function<void(const std::vector<AddrInfo>& targets)> ResolveCallback;
+
+  /// Resolves a name without blocking on DNS, if asynchronous resolution is
+  /// enabled.
+  ///
+  /// @return - true if the targets were available straight away (because
+  ///           the name is an IP address or its targets are cached, or
+  ///           asynchronous resolution isn't enabled), in which case they are
+  ///           returned in targets and the callback isn't called.  Otherwise
+  ///           false, and the callback is called with the targets on one of
+  ///           the resolver's threads.
+  bool resolve_async(const std::string& name,
+                     int af,
+                     int port,
+                     int transport,
+                     int retries,
+                     std::vector<AddrInfo>& targets,
+                     SAS::TrailId trail,
+                     ResolveCallback callback);
+
+  /// Enables asynchronous resolution, on a pool of the specified number of
+  /// threads.  This must be called before the resolver is used.
+  void enable_async_resolution(int num_threads);
+
+  /// Blacklists a target.  If latency weighting is enabled, the target's
+  /// traffic is also ramped up once the blacklist expires.
+  void blacklist(const AddrInfo& ai);
+  void blacklist(const AddrInfo& ai, int blacklist_ttl);
+  void clear_blacklist();
+
+  /// Enables the target cache.  This must be called before the resolver is
+  /// used.
+  ///
+  /// Once enabled, the resolver keeps the complete set of targets (with
+  /// their SRV priorities and weights) that each name, address family, port
+  /// and transport resolves to, for the lowest TTL of the DNS records they
+  /// came from.  Requests select targets from the cached set in the same way
+  /// as a fresh resolution would, and only names that aren't cached are
+  /// resolved on the calling thread.
+  ///
+  /// Names that are used while their targets are cached are refreshed in
+  /// the background when the TTL expires.  Until the refresh completes, or
+  /// if it fails, the expired targets continue to be used (for up to
+  /// TARGET_CACHE_MAX_STALE seconds).  Targets with a TTL of 0 aren't
+  /// cached.
+  ///
+  /// @param stale_served_tbl     - Counts the requests that used expired
+  ///                               targets.
+  /// @param refresh_failures_tbl - Counts the background refreshes that
+  ///                               failed.
+  /// @param refresh_thread       - Whether to start the thread that
+  ///                               refreshes the cache.  If not, the owner
+  ///                               must call refresh_target_cache.
+  void enable_target_cache(SNMP::CounterTable* stale_served_tbl = NULL,
+                           SNMP::CounterTable* refresh_failures_tbl = NULL,
+                           bool refresh_thread = true);
+
+  /// Enables latency-weighted target selection from the target cache (which
+  /// must also be enabled).  The resolver keeps a moving average of each
+  /// target's response latency (see record_latency), and within each SRV
+  /// priority, targets are selected in inverse proportion to their latency
+  /// relative to the fastest target (as well as by SRV weight).  Targets
+  /// coming off the blacklist have their traffic ramped up over
+  /// LATENCY_SLOW_START seconds.
+  void enable_latency_weighting();
+
+  /// Records how long a target took to respond to a request.
+  void record_latency(const AddrInfo& ai, unsigned long latency_us);
+
+  /// Refreshes any cached targets that have expired and have been used since
+  /// they were last refreshed, and removes any that are no longer needed.
+  void refresh_target_cache();
+
+  /// Target cache statistics, since the cache was enabled.
+  uint64_t stale_served() const { return _stale_served; }
+  uint64_t refresh_failures() const { return _refresh_failures; }
+
   /// Default duration to blacklist hosts after we fail to connect to them.
   static const int DEFAULT_BLACKLIST_DURATION = 30;
 
+  /// How long after their TTL cached targets may still be used if they
+  /// can't be refreshed.  This matches how long DnsCachedResolver keeps
+  /// expired records to protect against DNS server failure.
+  static const int TARGET_CACHE_MAX_STALE = 300;
+
+  /// How long to wait before retrying a failed refresh.
+  static const int TARGET_CACHE_RETRY_INTERVAL = 5;
+
+  /// The weight given to each new latency measurement in a target's moving
+  /// average.
+  static constexpr double LATENCY_EWMA_ALPHA = 0.1;
+
+  /// The least a target is favoured relative to the fastest, however slow
+  /// it is.
+  static constexpr double LATENCY_MIN_FACTOR = 0.01;
+
+  /// How long to ramp up traffic to a target after its blacklist expires.
+  static const int LATENCY_SLOW_START = 30;
+
+  /// How long a target's latency is remembered without any new measurements.
+  static const int LATENCY_MAX_AGE = 300;
+
+  /// The number of independently locked shards the target cache is split
+  /// into.
+  static const int TARGET_CACHE_SHARDS = 16;
+
   std::string get_transport_str(int transport);
+
+private:
+  /// The outcome of the NAPTR and SRV steps of resolving a name - either an
+  /// SRV name, or the name, port and transport for A/AAAA lookups.
+  struct Plan
+  {
+    int transport;
+    std::string srv_name;
+    std::string a_name;
+    int port;
+
+    // The lowest TTL of the records used to make the plan (or -1 if none).
+    int ttl;
+  };
+
+  /// A host that a name resolves to.
+  struct CachedHost
+  {
+    int priority;
+    int weight;
+    std::vector<AddrInfo> targets;
+  };
+
+  /// The cached resolution of a name.
+  struct TargetCacheEntry
+  {
+    // The hosts sorted by priority.  This is shared with any requests that
+    // are selecting targets from it, so is never modified.
+    std::shared_ptr<const std::vector<CachedHost>> hosts;
+    time_t expires;
+    // When to next try to refresh the targets, once they've expired.
+    time_t refresh_at;
+    // Whether the targets have been used since they were last refreshed.
+    bool used;
+  };
+
+  typedef std::tuple<std::string, int, int, int> TargetCacheKey;
+
+  /// A shard of the target cache.
+  struct TargetCacheShard
+  {
+    pthread_mutex_t lock;
+    std::map<TargetCacheKey, TargetCacheEntry> entries;
+  };
+
+  /// The moving average latency of a target.
+  struct LatencyStats
+  {
+    double ewma_us;
+    time_t updated;
+  };
+
+  /// Orders targets by address, port and transport.
+  struct TargetCompare
+  {
+    bool operator()(const AddrInfo& ai1, const AddrInfo& ai2) const
+    {
+      int rc = ai1.address.compare(ai2.address);
+      return (rc != 0) ? (rc < 0) :
+             (ai1.port != ai2.port) ? (ai1.port < ai2.port) :
+             (ai1.transport < ai2.transport);
+    }
+  };
+
+  // Carries out the NAPTR and SRV steps of RFC3263 section 4 for a name.
+  void get_plan(const std::string& name,
+                int port,
+                int transport,
+                Plan& plan,
+                SAS::TrailId trail);
+
+  // Resolves a name via the target cache.
+  void resolve_cached(const std::string& name,
+                      int af,
+                      int port,
+                      int transport,
+                      int retries,
+                      std::vector<AddrInfo>& targets,
+                      SAS::TrailId trail);
+
+  // Resolves a name to all its hosts, sorted by priority.  Returns the TTL
+  // of the result, or -1 if the name doesn't resolve to any targets.
+  int resolve_hosts(const TargetCacheKey& key,
+                    std::vector<CachedHost>& hosts,
+                    SAS::TrailId trail);
+
+  // Selects targets from a set of hosts: in order of priority, in a
+  // weighted random order within each priority, and putting blacklisted
+  // targets last.  This doesn't hold any locks while selecting, so the
+  // hosts must not be modified by anything else.
+  void select_targets(const std::vector<CachedHost>& hosts,
+                      int retries,
+                      std::vector<AddrInfo>& targets);
+
+  // Gets the latency of each of a set of hosts' targets (or 0 if not known),
+  // and how far through its slow start each target is (from 0 to 1).
+  void get_latencies(const std::vector<CachedHost>& hosts,
+                     std::vector<std::vector<double>>& latencies_us,
+                     std::vector<std::vector<double>>& slow_start);
+
+  // Records when a blacklisted target's blacklist expires, so its traffic can
+  // be ramped up afterwards.
+  void start_slow_start(const AddrInfo& ai, int blacklist_ttl);
+
+  // The shard of the target cache that holds a key.
+  TargetCacheShard& target_cache_shard(const TargetCacheKey& key);
+
+  // The number of entries in the target cache.
+  size_t target_cache_size();
+
+  static void* refresh_thread_fn(void* arg);
+  void refresh_thread();
+
+  // Whether the targets for a name are in the target cache and can be used.
+  bool is_target_cached(const TargetCacheKey& key);
+
+  /// A request for an asynchronous resolution.
+  struct AsyncRequest
+  {
+    std::string name;
+    int af;
+    int port;
+    int transport;
+    int retries;
+    SAS::TrailId trail;
+    ResolveCallback callback;
+  };
+
+  static void* async_thread_fn(void* arg);
+  void async_thread();
+
+  int _blacklist_duration;
+
+  bool _target_cache_enabled;
+  SNMP::CounterTable* _stale_served_tbl;
+  SNMP::CounterTable* _refresh_failures_tbl;
+  std::atomic<uint64_t> _stale_served;
+  std::atomic<uint64_t> _refresh_failures;
+
+  bool _latency_weighting;
+
+  // The target cache, sharded by name so that requests for different names
+  // rarely contend.
+  TargetCacheShard _target_cache[TARGET_CACHE_SHARDS];
+
+  // Protects the latencies, and when recently blacklisted targets come off
+  // the blacklist (for slow start).  Blacklisting itself is left to the
+  // BaseResolver.
+  pthread_mutex_t _latency_lock;
+  std::map<AddrInfo, LatencyStats, TargetCompare> _latencies;
+  std::map<AddrInfo, time_t, TargetCompare> _slow_start;
+
+  // Signalled (under the lock) to stop the refresh thread.
+  pthread_mutex_t _refresh_lock;
+  pthread_cond_t _refresh_cond;
+  bool _refresh_thread_running;
+  bool _terminate;
+  pthread_t _refresh_thread;
+
+  // The queue of asynchronous resolutions, and the threads that process it.
+  pthread_mutex_t _async_lock;
+  pthread_cond_t _async_cond;
+  std::deque<AsyncRequest> _async_q;
+  std::vector<pthread_t> _async_threads;
+  bool _async_terminate;
 };
 
 #endif
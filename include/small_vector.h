@@ -0,0 +1,300 @@
+/**
+ * @file small_vector.h  Vector and map with inline storage for a few entries.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SMALL_VECTOR_H__
+#define SMALL_VECTOR_H__
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <stddef.h>
+
+/// @class SmallVector
+///
+/// A vector that holds up to N entries inside the object itself, and only
+/// allocates from the heap if it grows beyond that.  This is for the small
+/// per-transaction collections that are created and destroyed for every
+/// request, which almost never hold more than a few entries.
+///
+/// T must be default constructible and copyable.  Unused entries are default
+/// constructed, so T should be cheap to construct (e.g. pointers, ints or
+/// small structs of them).  As with std::vector, growing the vector (beyond
+/// N, or beyond the size of the last heap allocation) invalidates iterators.
+template <class T, size_t N>
+class SmallVector
+{
+public:
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  SmallVector() : _data(_inline), _size(0), _capacity(N) {}
+
+  ~SmallVector()
+  {
+    if (_data != _inline)
+    {
+      delete[] _data;
+    }
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+  iterator begin() { return _data; }
+  iterator end() { return _data + _size; }
+  const_iterator begin() const { return _data; }
+  const_iterator end() const { return _data + _size; }
+
+  T& operator[](size_t ii) { return _data[ii]; }
+  const T& operator[](size_t ii) const { return _data[ii]; }
+
+  T& back() { return _data[_size - 1]; }
+
+  void push_back(const T& value)
+  {
+    reserve(_size + 1);
+    _data[_size++] = value;
+  }
+
+  /// Resizes the vector.  New entries are set to T().
+  void resize(size_t size)
+  {
+    reserve(size);
+
+    for (size_t ii = _size; ii < size; ++ii)
+    {
+      _data[ii] = T();
+    }
+
+    _size = size;
+  }
+
+  /// Inserts a value before pos, returning an iterator to it.
+  iterator insert(iterator pos, const T& value)
+  {
+    size_t index = pos - _data;
+    reserve(_size + 1);
+    std::copy_backward(_data + index, _data + _size, _data + _size + 1);
+    _data[index] = value;
+    _size++;
+    return _data + index;
+  }
+
+  /// Removes the entry at pos, keeping the order of the rest.
+  iterator erase(iterator pos)
+  {
+    std::copy(pos + 1, end(), pos);
+    _size--;
+    _data[_size] = T();
+    return pos;
+  }
+
+  void clear()
+  {
+    for (size_t ii = 0; ii < _size; ++ii)
+    {
+      _data[ii] = T();
+    }
+
+    _size = 0;
+  }
+
+  /// Whether the entries have outgrown the inline storage.
+  bool on_heap() const { return (_data != _inline); }
+
+private:
+  // Copying isn't needed, so isn't supported.
+  SmallVector(const SmallVector&);
+  SmallVector& operator=(const SmallVector&);
+
+  void reserve(size_t capacity)
+  {
+    if (capacity > _capacity)
+    {
+      size_t new_capacity = std::max(capacity, _capacity * 2);
+      T* new_data = new T[new_capacity];
+      std::copy(_data, _data + _size, new_data);
+
+      if (_data != _inline)
+      {
+        delete[] _data;
+      }
+
+      _data = new_data;
+      _capacity = new_capacity;
+    }
+  }
+
+  T _inline[N];
+  T* _data;
+  size_t _size;
+  size_t _capacity;
+};
+
+/// @class SmallMap
+///
+/// A map with the same interface as std::map (for the operations that are
+/// supported), held as a sorted SmallVector of key/value pairs.  Lookups are
+/// binary searches, so this is only suitable for small maps.
+///
+/// Unlike std::map, inserting or erasing an entry invalidates iterators to
+/// the other entries.
+template <class K, class V, size_t N, class Compare = std::less<K> >
+class SmallMap
+{
+public:
+  typedef std::pair<K, V> value_type;
+  typedef typename SmallVector<value_type, N>::iterator iterator;
+  typedef typename SmallVector<value_type, N>::const_iterator const_iterator;
+
+  size_t size() const { return _entries.size(); }
+  bool empty() const { return _entries.empty(); }
+
+  iterator begin() { return _entries.begin(); }
+  iterator end() { return _entries.end(); }
+  const_iterator begin() const { return _entries.begin(); }
+  const_iterator end() const { return _entries.end(); }
+
+  iterator find(const K& key)
+  {
+    iterator it = lower_bound(key);
+    return ((it != end()) && !_compare(key, it->first)) ? it : end();
+  }
+
+  const_iterator find(const K& key) const
+  {
+    const_iterator it = lower_bound(key);
+    return ((it != end()) && !_compare(key, it->first)) ? it : end();
+  }
+
+  /// Returns the value for the key, adding it (with value V()) if there isn't
+  /// one.
+  V& operator[](const K& key)
+  {
+    iterator it = lower_bound(key);
+
+    if ((it == end()) || _compare(key, it->first))
+    {
+      it = _entries.insert(it, value_type(key, V()));
+    }
+
+    return it->second;
+  }
+
+  void erase(iterator pos)
+  {
+    _entries.erase(pos);
+  }
+
+  /// Removes the entry for the key, returning the number of entries removed.
+  size_t erase(const K& key)
+  {
+    iterator it = find(key);
+
+    if (it == end())
+    {
+      return 0;
+    }
+
+    _entries.erase(it);
+    return 1;
+  }
+
+  void clear() { _entries.clear(); }
+
+private:
+  struct KeyCompare
+  {
+    bool operator()(const value_type& entry, const K& key) const
+    {
+      return Compare()(entry.first, key);
+    }
+  };
+
+  iterator lower_bound(const K& key)
+  {
+    return std::lower_bound(begin(), end(), key, KeyCompare());
+  }
+
+  const_iterator lower_bound(const K& key) const
+  {
+    return std::lower_bound(begin(), end(), key, KeyCompare());
+  }
+
+  SmallVector<value_type, N> _entries;
+  Compare _compare;
+};
+
+/// @class SmallSet
+///
+/// A set with the same interface as std::set (for the operations that are
+/// supported), held as a sorted SmallVector of keys.  As with SmallMap,
+/// lookups are binary searches, so this is only suitable for small sets, and
+/// inserting or erasing a key invalidates iterators to the other keys.
+template <class K, size_t N, class Compare = std::less<K> >
+class SmallSet
+{
+public:
+  typedef typename SmallVector<K, N>::iterator iterator;
+  typedef typename SmallVector<K, N>::const_iterator const_iterator;
+
+  size_t size() const { return _entries.size(); }
+  bool empty() const { return _entries.empty(); }
+
+  iterator begin() { return _entries.begin(); }
+  iterator end() { return _entries.end(); }
+  const_iterator begin() const { return _entries.begin(); }
+  const_iterator end() const { return _entries.end(); }
+
+  iterator find(const K& key)
+  {
+    iterator it = lower_bound(key);
+    return ((it != end()) && !_compare(key, *it)) ? it : end();
+  }
+
+  /// Adds the key, if it isn't already in the set.
+  void insert(const K& key)
+  {
+    iterator it = lower_bound(key);
+
+    if ((it == end()) || _compare(key, *it))
+    {
+      _entries.insert(it, key);
+    }
+  }
+
+  /// Removes the key, returning the number of keys removed.
+  size_t erase(const K& key)
+  {
+    iterator it = find(key);
+
+    if (it == end())
+    {
+      return 0;
+    }
+
+    _entries.erase(it);
+    return 1;
+  }
+
+  void clear() { _entries.clear(); }
+
+private:
+  iterator lower_bound(const K& key)
+  {
+    return std::lower_bound(begin(), end(), key, _compare);
+  }
+
+  SmallVector<K, N> _entries;
+  Compare _compare;
+};
+
+#endif
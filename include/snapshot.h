@@ -0,0 +1,115 @@
+/**
+ * @file snapshot.h  Configuration that is replaced as a whole and read on
+ * every request.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SNAPSHOT_H__
+#define SNAPSHOT_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @class Snapshot
+///
+/// Holds the current version of a piece of configuration that is never
+/// modified once published, only replaced by a new version when it is
+/// reloaded.
+///
+/// Each thread keeps a reference to the version it last read, and only takes
+/// the lock to pick up the current version when the generation number has
+/// changed since then.  Reading the configuration is therefore normally just
+/// a relaxed load of the generation number, with no lock and no reference
+/// count updates.  An old version is freed once every thread that read it
+/// has picked up a newer one (or exited).
+///
+/// The reference returned by get() is only valid until the calling thread
+/// next calls get() on the same Snapshot, so callers must not hold on to it
+/// across anything that might read the same configuration again.
+template <class T>
+class Snapshot
+{
+public:
+  Snapshot(const std::shared_ptr<const T>& value) :
+    _id(next_id()),
+    _lock(),
+    _current(value),
+    _generation(1)
+  {
+  }
+
+  /// Publishes a new version of the configuration.
+  void set(const std::shared_ptr<const T>& value)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _current = value;
+    _generation.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Returns the current version of the configuration.
+  const T& get() const
+  {
+    Cached& cached = cache();
+
+    if (cached.generation != _generation.load(std::memory_order_relaxed))
+    {
+      // The configuration has changed since this thread last read it, so
+      // pick up the new version.
+      std::lock_guard<std::mutex> guard(_lock);
+      cached.value = _current;
+      cached.generation = _generation.load(std::memory_order_relaxed);
+    }
+
+    return *cached.value;
+  }
+
+private:
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  /// The version of the configuration a thread last read.
+  struct Cached
+  {
+    Cached() : generation(0), value() {}
+
+    uint64_t generation;
+    std::shared_ptr<const T> value;
+  };
+
+  /// Returns this thread's cached version of this Snapshot.  Each Snapshot
+  /// of a given type has its own index into a per-thread table.
+  Cached& cache() const
+  {
+    static thread_local std::vector<Cached> caches;
+
+    if (caches.size() <= _id)
+    {
+      caches.resize(_id + 1);
+    }
+
+    return caches[_id];
+  }
+
+  static size_t next_id()
+  {
+    static std::atomic<size_t> id(0);
+    return id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const size_t _id;
+  mutable std::mutex _lock;
+  std::shared_ptr<const T> _current;
+  std::atomic<uint64_t> _generation;
+};
+
+#endif
@@ -20,6 +20,7 @@ extern "C" {
 }
 
 #include <list>
+#include <functional>
 #include "sas.h"
 #include "snmp_success_fail_count_by_request_type_table.h"
 
@@ -61,6 +62,11 @@ public:
   /// Returns a mutable clone of the original request.  This can be modified
   /// and sent by the Sproutlet using the send_request call.
   ///
+  /// The clone's body is shared with the original request (and the clone
+  /// gets its own copy if it leaves the process), so the body must be
+  /// replaced rather than modified in place.  The same applies to clones
+  /// made with clone_request and clone_msg.
+  ///
   /// @returns             - A clone of the original request message.
   ///
   virtual pjsip_msg* original_request() = 0;
@@ -112,6 +118,13 @@ public:
   /// different request modifications are required on each fork or for storing
   /// off to handle late forking.
   ///
+  /// The clone has its own Request-URI, but shares the contents of its
+  /// headers (as well as its body) with the request, so headers that differ
+  /// between forks must be added, removed or replaced rather than modified
+  /// in place, in either the clone or the request.  (A clone sent to another
+  /// local Sproutlet is given its own copy of the headers first, so that
+  /// Sproutlet can modify them in place.)
+  ///
   /// @returns             - The cloned request message.
   /// @param  req          - The request message to clone.
   ///
@@ -239,6 +252,21 @@ public:
   ///
   virtual bool timer_running(TimerID id) = 0;
 
+  /// Starts a timer that expires when an asynchronous operation completes,
+  /// rather than after a fixed period.  The returned function must be called
+  /// exactly once, from any thread, when the operation completes - the
+  /// on_timer_expiry callback is then called with the context parameter on
+  /// a worker thread.  The transaction is kept alive until then.
+  ///
+  /// @returns             - The function to call on completion, or an empty
+  ///                        function if asynchronous operations aren't
+  ///                        supported (in which case the operation should be
+  ///                        done synchronously).
+  /// @param  context      - Context parameter returned on the callback.
+  ///
+  virtual std::function<void()> start_async_timer(void* context)
+    {return std::function<void()>();}
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -412,7 +440,9 @@ protected:
     {return _helper->create_request();}
 
   /// Clones the request.  This is typically used when forking a request if
-  /// different request modifications are required on each fork.
+  /// different request modifications are required on each fork.  The clone
+  /// shares the contents of its headers with the request (see
+  /// SproutletTsxHelper::clone_request).
   ///
   /// WARNING: This method is DEPRECATED and only exists for backwards
   ///          compatibilty.
@@ -560,6 +590,20 @@ protected:
   bool timer_running(TimerID id)
     {return _helper->timer_running(id);}
 
+  /// Starts a timer that expires when an asynchronous operation completes,
+  /// rather than after a fixed period.  The returned function must be called
+  /// exactly once, from any thread, when the operation completes - the
+  /// on_timer_expiry callback is then called with the context parameter on
+  /// a worker thread.
+  ///
+  /// @returns             - The function to call on completion, or an empty
+  ///                        function if asynchronous operations aren't
+  ///                        supported.
+  /// @param  context      - Context parameter returned on the callback.
+  ///
+  std::function<void()> start_async_timer(void* context)
+    {return _helper->start_async_timer(context);}
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -683,6 +727,17 @@ public:
   virtual const std::list<std::string> aliases() const
     { return std::list<std::string>(); }
 
+  /// Returns whether the Sproutlet can process this request without a
+  /// transaction, if stateless forwarding has been enabled for it.  A
+  /// Sproutlet that returns true must make its routing decision
+  /// synchronously in on_rx_initial_request (or on_rx_in_dialog_request),
+  /// and then either forward the request once, respond to it or free it.
+  /// It doesn't see responses, CANCELs or timers, so shouldn't need them (for
+  /// example to send ACRs).  Requests received over unreliable transports
+  /// are always handled statefully, so it isn't passed retransmissions.
+  virtual bool supports_stateless(const pjsip_msg* req) const
+    { return false; }
+
 protected:
   /// Constructor.
   Sproutlet(const std::string& service_name,
@@ -0,0 +1,124 @@
+/**
+ * @file sproutlet_executor.h  Dedicated worker threads for a Sproutlet.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SPROUTLET_EXECUTOR_H__
+#define SPROUTLET_EXECUTOR_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "eventq.h"
+#include "utils.h"
+#include "pjutils.h"
+
+/// @class SproutletExecutor
+///
+/// A bounded queue and pool of worker threads for a single Sproutlet, so that
+/// a slow Sproutlet (for example, one waiting on an application server's
+/// backend) only uses its own threads and can't starve the other Sproutlets
+/// of the shared SIP worker threads.
+///
+/// The threads are registered with PJSIP, so callbacks can take transaction
+/// locks.
+class SproutletExecutor
+{
+public:
+  /// Default maximum number of callbacks that can be queued.
+  static const int DEFAULT_MAX_QUEUE_DEPTH = 1000;
+
+  /// Constructor.
+  ///
+  /// @param service_name    - The service name of the Sproutlet, for logs.
+  /// @param num_threads     - The number of worker threads.
+  /// @param max_queue_depth - The most callbacks that can be queued before
+  ///                          new work is rejected.
+  SproutletExecutor(const std::string& service_name,
+                    int num_threads,
+                    int max_queue_depth = DEFAULT_MAX_QUEUE_DEPTH);
+
+  /// Destructor.  Stops the worker threads.  This must only be called on
+  /// shutdown, as any callbacks still queued are not run.
+  ~SproutletExecutor();
+
+  /// Starts the worker threads.
+  pj_status_t start(pj_pool_t* pool);
+
+  /// Queues new work to run on one of the worker threads, if there is room in
+  /// the queue.  If not, the work should be rejected, and this counts the
+  /// rejection.  The callback is deleted once it has run, but is left with
+  /// the caller if it isn't queued.
+  ///
+  /// @returns true if the callback was queued.
+  bool try_queue(PJUtils::Callback* cb);
+
+  /// Queues a callback to run on one of the worker threads, regardless of the
+  /// depth of the queue.  This is for further work on something that has
+  /// already been admitted (such as a response to a queued request), which
+  /// can't be rejected.  The callback is deleted once it has run.
+  void queue(PJUtils::Callback* cb);
+
+  /// Runs any queued callbacks on the calling thread, rather than the worker
+  /// threads.  This is for the UTs, which don't start the worker threads.
+  ///
+  /// @returns the number of callbacks run.
+  int run_queued_callbacks();
+
+  /// Statistics since the executor was created.
+  struct Stats
+  {
+    // Callbacks currently queued.
+    size_t queue_depth;
+    // Callbacks run.
+    uint64_t processed;
+    // Work rejected because the queue was full.
+    uint64_t rejected;
+    // Average time callbacks spent queued, and running.
+    uint64_t avg_queue_us;
+    uint64_t avg_service_us;
+  };
+
+  Stats stats() const;
+
+  const std::string& service_name() const { return _service_name; }
+
+private:
+  struct QueueEntry
+  {
+    PJUtils::Callback* cb;
+    Utils::StopWatch stop_watch;
+  };
+
+  static int worker_thread(void* p);
+  void run();
+  void push(PJUtils::Callback* cb);
+  void run_callback(QueueEntry* qe);
+
+  std::string _service_name;
+  int _num_threads;
+  size_t _max_queue_depth;
+
+  eventq<QueueEntry*> _q;
+  std::vector<pj_thread_t*> _threads;
+
+  std::atomic<size_t> _queue_depth;
+
+  std::atomic<uint64_t> _processed;
+  std::atomic<uint64_t> _rejected;
+  std::atomic<uint64_t> _total_queue_us;
+  std::atomic<uint64_t> _total_service_us;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * @file sproutlet_stats.h  Per-Sproutlet resource usage statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SPROUTLET_STATS_H__
+#define SPROUTLET_STATS_H__
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "snmp_event_accumulator_table.h"
+#include "snmp_counter_table.h"
+
+/// @class SproutletStats
+///
+/// Counts the resources used by a Sproutlet (or by requests that were routed
+/// to a Sproutlet using one of its aliases), so that CPU and latency can be
+/// attributed to individual Sproutlets.
+///
+/// Callback times only cover the time spent in the Sproutlet's own
+/// callbacks (on_rx_initial_request, on_rx_response and so on), not the
+/// processing the SproutletProxy does on the Sproutlet's behalf, or the
+/// processing of other Sproutlets that it passes messages to.
+class SproutletStats
+{
+public:
+  /// Constructor.
+  ///
+  /// @param name - The service name or alias.
+  SproutletStats(const std::string& name);
+
+  /// The SNMP tables that the statistics are also reported to.  Any of them
+  /// may be NULL.
+  struct Tables
+  {
+    Tables() :
+      callback_latency(NULL),
+      callback_cpu(NULL),
+      invocations(NULL),
+      msgs_cloned(NULL),
+      pool_bytes(NULL)
+    {}
+
+    // The wall clock and thread CPU time of each callback, in microseconds.
+    SNMP::EventAccumulatorTable* callback_latency;
+    SNMP::EventAccumulatorTable* callback_cpu;
+    SNMP::CounterTable* invocations;
+    SNMP::CounterTable* msgs_cloned;
+    // The PJSIP pool memory allocated for each message created for the
+    // Sproutlet.
+    SNMP::EventAccumulatorTable* pool_bytes;
+  };
+
+  /// Sets the SNMP tables that the statistics are reported to.
+  void set_tables(const Tables& tables) { _tables = tables; }
+
+  /// Records a callback into the Sproutlet.
+  void add_callback(unsigned long wall_us, unsigned long cpu_us);
+
+  /// Records a message being cloned for the Sproutlet.
+  void add_msg_cloned();
+
+  /// Records the PJSIP pool memory allocated for a message created for the
+  /// Sproutlet (not including anything it shares with other messages, such
+  /// as the body).
+  void add_pool_bytes(size_t bytes);
+
+  /// Records an alias of this Sproutlet, so that its statistics are reported
+  /// with the Sproutlet's.
+  void add_alias(SproutletStats* alias) { _aliases.push_back(alias); }
+
+  /// Writes the statistics (and those of any aliases) as a JSON object.
+  void to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) const;
+
+  const std::string& name() const { return _name; }
+  uint64_t invocations() const { return _invocations; }
+  uint64_t wall_us() const { return _wall_us; }
+  uint64_t cpu_us() const { return _cpu_us; }
+  uint64_t msgs_cloned() const { return _msgs_cloned; }
+  uint64_t pool_bytes() const { return _pool_bytes; }
+
+  /// Times a callback into a Sproutlet, for as long as it is in scope, and
+  /// records it against the Sproutlet and the alias it was invoked with
+  /// (either of which may be NULL).
+  class CallbackTimer
+  {
+  public:
+    CallbackTimer(SproutletStats* stats, SproutletStats* alias_stats);
+    ~CallbackTimer();
+
+  private:
+    SproutletStats* _stats;
+    SproutletStats* _alias_stats;
+    struct timespec _wall_start;
+    struct timespec _cpu_start;
+  };
+
+private:
+  std::string _name;
+
+  std::atomic<uint64_t> _invocations;
+  std::atomic<uint64_t> _wall_us;
+  std::atomic<uint64_t> _cpu_us;
+  std::atomic<uint64_t> _msgs_cloned;
+  std::atomic<uint64_t> _pool_bytes;
+
+  Tables _tables;
+
+  std::vector<SproutletStats*> _aliases;
+};
+
+#endif
@@ -13,6 +13,7 @@
 #define SPROUTLETPROXY_H__
 
 #include <map>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <list>
@@ -21,8 +22,14 @@
 #include "sproutlet.h"
 #include "snmp_sip_request_types.h"
 #include "sproutlet_options.h"
+#include "object_pool.h"
+#include "small_vector.h"
+#include "sproutlet_executor.h"
+#include "sproutlet_stats.h"
 
+class SproutletWrapperBase;
 class SproutletWrapper;
+class StatelessSproutletWrapper;
 
 class SproutletProxy : public BasicProxy, SproutletHelper
 {
@@ -45,6 +52,54 @@ public:
   /// Destructor.
   virtual ~SproutletProxy();
 
+  /// Gives a Sproutlet its own worker threads.  Requests for the Sproutlet
+  /// are queued for these threads rather than being processed on the thread
+  /// that routes them to the Sproutlet, and are rejected with a 503 if the
+  /// queue is full.  This must be called before the proxy handles any
+  /// requests.
+  ///
+  /// @return - Whether the threads were started.
+  ///
+  /// @param  service_name      - The Sproutlet's service name.
+  /// @param  num_threads       - The number of threads.
+  /// @param  max_queue_depth   - How many requests can be queued.
+  bool add_executor(const std::string& service_name,
+                    int num_threads,
+                    int max_queue_depth);
+
+  /// Returns the executor for a Sproutlet, or NULL if it doesn't have its
+  /// own threads.
+  SproutletExecutor* executor(const Sproutlet* sproutlet) const;
+
+  /// Enables stateless forwarding for a Sproutlet.  Requests that the
+  /// Sproutlet supports handling statelessly (see
+  /// Sproutlet::supports_stateless) are then passed to it without creating
+  /// any PJSIP transactions, on the thread that received them, and the
+  /// request it forwards is sent statelessly.  The proxy then forwards the
+  /// responses to it by their Via branch.  Requests received over unreliable
+  /// transports are still handled statefully.  This must be called before
+  /// the proxy handles any requests.
+  ///
+  /// @return - Whether stateless forwarding was enabled.
+  ///
+  /// @param  service_name      - The Sproutlet's service name.
+  bool enable_stateless(const std::string& service_name);
+
+  /// Finds requests for Sproutlets that are forwarding statelessly, before
+  /// passing any others to the BasicProxy.
+  virtual pj_bool_t on_rx_request(pjsip_rx_data* rdata);
+
+  /// Forwards responses that don't match a transaction.
+  virtual pj_bool_t on_rx_response(pjsip_rx_data* rdata);
+
+  /// Returns the resource usage statistics for a Sproutlet service name or
+  /// alias, or NULL if there is no such Sproutlet.
+  SproutletStats* stats(const std::string& name) const;
+
+  /// Returns the resource usage statistics of all the Sproutlets (and the
+  /// state of any executors) as a JSON document.
+  std::string stats_json() const;
+
   /// Static callback for timers
   static void on_timer_pop(pj_timer_heap_t* th, pj_timer_entry* tentry);
 
@@ -61,6 +116,25 @@ protected:
   /// Create Sproutlet UAS transaction objects.
   BasicProxy::UASTsx* create_uas_tsx();
 
+  /// The target Sproutlet for a received request, found when deciding
+  /// whether to handle the request statelessly and passed on to the UASTsx
+  /// (in the proxy module's data in the pjsip_rx_data) if not.
+  struct RxTarget
+  {
+    Sproutlet* sproutlet;
+    std::string alias;
+  };
+
+  /// Processes a request without a transaction, using a Sproutlet that's
+  /// forwarding statelessly.
+  ///
+  /// @return - Whether the request was processed.  If not (because the
+  ///           Sproutlet didn't want to handle it, or would forward it over
+  ///           an unreliable transport) it must be handled statefully.
+  bool process_stateless_request(pjsip_rx_data* rdata,
+                                 Sproutlet* sproutlet,
+                                 const std::string& alias);
+
   /// Registers a sproutlet.
   bool register_sproutlet(Sproutlet* sproutlet);
 
@@ -90,9 +164,9 @@ protected:
                                                const std::string& name,
                                                pjsip_sip_uri* existing_uri) const;
 
-  Sproutlet* service_from_host(pjsip_sip_uri* uri);
-  Sproutlet* service_from_user(pjsip_sip_uri* uri);
-  Sproutlet* service_from_params(pjsip_sip_uri* uri);
+  /// Returns the Sproutlet with the specified service name or alias, or
+  /// NULL if there isn't one.
+  Sproutlet* find_service(const pj_str_t* name) const;
 
   void report_sproutlet_selection_event(int selection_type,
                                         std::string service_name,
@@ -118,7 +192,12 @@ protected:
   bool cancel_timer(pj_timer_entry* tentry);
   bool timer_running(pj_timer_entry* tentry);
 
-  class UASTsx : public BasicProxy::UASTsx
+  /// UASTsxs are allocated from a per-thread pool, and their own collections
+  /// hold the first few entries inline, to cut the heap allocations made for
+  /// each transaction.  (The collections in BasicProxy::UASTsx, and callbacks
+  /// queued for an executor that capture more than a couple of pointers,
+  /// still use the heap.)
+  class UASTsx : public BasicProxy::UASTsx, public PooledObject<UASTsx>
   {
   public:
     /// Constructor.
@@ -162,6 +241,10 @@ protected:
     bool schedule_timer(SproutletWrapper* tsx, void* context, TimerID& id, int duration);
     bool cancel_timer(TimerID id);
     bool timer_running(TimerID id);
+    std::function<void()> start_async_timer(SproutletWrapper* tsx,
+                                            void* context,
+                                            TimerID& id);
+    class AsyncTimerCallback;
 
     void tx_response(SproutletWrapper* sproutlet,
                      pjsip_tx_data* rsp);
@@ -170,13 +253,67 @@ protected:
                    int fork_id,
                    pjsip_tx_data* cancel);
 
+    /// Passes a request to a Sproutlet, either directly or via the
+    /// Sproutlet's executor if it has one.  The request is rejected if the
+    /// executor's queue is full.
+    void dispatch_request(SproutletWrapper* sproutlet, pjsip_tx_data* req);
+
+    /// Runs a callback into a Sproutlet (passing it a response, CANCEL, error
+    /// or timer pop), either directly or via the Sproutlet's executor if it
+    /// has one.  A Sproutlet's callbacks are always run in the order they are
+    /// passed to this method.
+    void run_on_sproutlet(SproutletWrapper* sproutlet,
+                          const std::function<void()>& callback);
+
+    /// Runs the next callback queued for a Sproutlet's executor.
+    void process_dispatched_callback(SproutletWrapper* sproutlet);
+    class DispatchCallback;
+
+    /// Passes a CANCEL to a Sproutlet.  If the request hasn't reached the
+    /// Sproutlet yet, it is rejected with the specified status code when it
+    /// comes off the queue instead.
+    void cancel_sproutlet(SproutletWrapper* sproutlet,
+                          pjsip_tx_data* cancel,
+                          int status_code);
+
+    /// Passes an error on the UAS transaction to the root Sproutlet.
+    void error_sproutlet(SproutletWrapper* sproutlet, int status_code);
+
+    /// If a Sproutlet's request is still queued for its executor, arranges
+    /// for it to be rejected with the specified status code.
+    ///
+    /// @returns true if the request was still queued.
+    bool reject_queued_request(SproutletWrapper* sproutlet, int status_code);
+
+    /// Whether a Sproutlet has callbacks queued for its executor (in which
+    /// case it must not be destroyed).
+    bool callbacks_queued(SproutletWrapper* sproutlet) const;
+
+    /// Clones a message for a Sproutlet, sharing its body (and, for forks,
+    /// the contents of its headers) with the original - see
+    /// PJUtils::clone_msg_sharing_body and PJUtils::clone_msg_sharing_hdrs.
+    /// The original is kept until the UASTsx and any UACTsxs that might be
+    /// sending a message that shares it are destroyed.
+    pjsip_tx_data* clone_msg(pjsip_tx_data* tdata, bool fork = false);
+
+    /// Gives a response that is leaving the UASTsx its own copy of its body,
+    /// if it was cloned with clone_msg.
+    void unshare_body(pjsip_tx_data* rsp);
+
+    /// Gives a fork that is being passed to a local Sproutlet its own copy
+    /// of its headers, so the Sproutlet can modify them in place.  Returns
+    /// the request to pass on, which replaces the fork if it was copied.
+    pjsip_tx_data* unshare_hdrs(pjsip_tx_data* req);
+
     /// Checks to see if it is safe to destroy the UASTsx.
     void check_destroy();
 
-    /// Finds a SproutletTsx willing to handle a request
+    /// Finds a SproutletTsx willing to handle a request.  If the target
+    /// Sproutlet has already been found, it is passed in as rx_target.
     SproutletTsx* get_sproutlet_tsx(pjsip_tx_data* req,
                                     int port,
-                                    std::string& alias);
+                                    std::string& alias,
+                                    const RxTarget* rx_target = NULL);
 
     /// The root Sproutlet for this transaction.
     SproutletWrapper* _root;
@@ -186,8 +323,8 @@ protected:
     template<typename T>
     struct DMap
     {
-      typedef std::map<std::pair<SproutletWrapper*, int>, T> type;
-      typedef typename std::map<std::pair<SproutletWrapper*, int>, T>::iterator iterator;
+      typedef SmallMap<std::pair<SproutletWrapper*, int>, T, 4> type;
+      typedef typename type::iterator iterator;
     };
 
     /// Mapping from upstream Sproutlet/fork to downstream Sproutlet.
@@ -198,7 +335,7 @@ protected:
 
     /// Mapping from downstream Sproutlet or UAC transaction to upstream
     /// Sproutlet/fork.
-    typedef std::map<void*, std::pair<SproutletWrapper*, int> > UMap;
+    typedef SmallMap<void*, std::pair<SproutletWrapper*, int>, 8> UMap;
     UMap _umap;
 
     /// Queue of pending requests to be scheduled.
@@ -207,7 +344,7 @@ protected:
       pjsip_tx_data* req;
       std::pair<SproutletWrapper*, int> upstream;
     } PendingRequest;
-    std::queue<PendingRequest> _pending_req_q;
+    SmallVector<PendingRequest, 4> _pending_req_q;
 
     /// Parent proxy object
     SproutletProxy* _sproutlet_proxy;
@@ -217,12 +354,39 @@ protected:
     /// (they are not freed when a timer pops or is cancelled for example).
     /// This prevents race conditions (such as a double free caused by one
     /// thread popping a timer and another thread cancelling it).
-    std::set<pj_timer_entry*> _timers;
+    SmallSet<pj_timer_entry*, 4> _timers;
 
     /// This set holds all the timers created by sproutlet tsx that are
     /// children of this UASTsx that have not popped or been cancelled yet.
     /// The UASTsx will persist while there are pending timers.
-    std::set<pj_timer_entry*> _pending_timers;
+    SmallSet<pj_timer_entry*, 4> _pending_timers;
+
+    /// Responses that share a body with another message.  Responses get
+    /// their own copy of the body when they leave the UASTsx, but requests
+    /// keep sharing it (as the UACTsxs keep the messages it belongs to).
+    SmallSet<pjsip_tx_data*, 4> _shared_body_rsps;
+
+    /// Forks that share the contents of their headers with another request,
+    /// and the requests they were cloned from.  They keep sharing them if
+    /// they leave through a UACTsx, but are copied before being passed to a
+    /// local Sproutlet.
+    SmallSet<pjsip_tx_data*, 4> _shared_hdr_reqs;
+
+    /// The callbacks queued for a Sproutlet's executor.  Only one is queued
+    /// on the executor at a time, so that they run in order.
+    struct Dispatch : public PooledObject<Dispatch>
+    {
+      Dispatch() : callbacks(), queued_req(NULL) {}
+
+      SmallVector<std::function<void()>, 2> callbacks;
+
+      // The Sproutlet's request, while it is still queued (in which case it
+      // is the first callback).
+      pjsip_tx_data* queued_req;
+    };
+
+    /// Sproutlets with callbacks queued for their executor.
+    SmallMap<SproutletWrapper*, Dispatch*, 2> _dispatching;
 
     friend class SproutletWrapper;
   };
@@ -230,22 +394,155 @@ protected:
   pjsip_sip_uri* _root_uri;
   std::map<std::string, pjsip_sip_uri*> _root_uris;
 
-  std::unordered_set<std::string> _host_aliases;
+  /// Hash and equality functions for pj_str_t keys in the routing index.
+  /// Service names are case sensitive, but host names aren't.
+  struct PjStrHash
+  {
+    size_t operator()(const pj_str_t& str) const;
+  };
+  struct PjStrEqual
+  {
+    bool operator()(const pj_str_t& str1, const pj_str_t& str2) const
+    {
+      return (pj_strcmp(&str1, &str2) == 0);
+    }
+  };
+  struct PjStrCaseHash
+  {
+    size_t operator()(const pj_str_t& str) const;
+  };
+  struct PjStrCaseEqual
+  {
+    bool operator()(const pj_str_t& str1, const pj_str_t& str2) const
+    {
+      return (pj_stricmp(&str1, &str2) == 0);
+    }
+  };
+
+  /// The routing index, which is built as Sproutlets are registered (when
+  /// the proxy is created) and not changed after that, so it can be read
+  /// without locking.  Lookups are done on the pj_str_ts in the request
+  /// without copying them.
+  ///
+  /// The keys refer to strings in _index_strs (or the root URI).
+  std::unordered_set<pj_str_t, PjStrCaseHash, PjStrCaseEqual> _local_hosts;
+  std::unordered_map<pj_str_t, Sproutlet*, PjStrHash, PjStrEqual> _services;
+  std::unordered_map<int, Sproutlet*> _ports;
+  std::deque<std::string> _index_strs;
+
+  /// The executors for Sproutlets that have their own worker threads.
+  std::unordered_map<const Sproutlet*, SproutletExecutor*> _executors;
 
-  std::map<std::string, Sproutlet*> _services;
+  /// The Sproutlets that forward statelessly.
+  std::unordered_set<const Sproutlet*> _stateless_sproutlets;
 
-  std::map<int, Sproutlet*> _ports;
+  /// The resource usage statistics, keyed on service name and alias.  The
+  /// statistics for service names are also held in registration order in
+  /// _service_stats, and aliases are reported with the service they belong
+  /// to.
+  std::map<std::string, SproutletStats*> _stats;
+  std::vector<SproutletStats*> _service_stats;
+
+  /// Adds a string to the storage for the routing index, returning a
+  /// pj_str_t that refers to it.
+  pj_str_t index_str(const std::string& str);
 
   std::list<Sproutlet*> _sproutlets;
 
   static const pj_str_t STR_SERVICE;
 
   friend class UASTsx;
+  friend class SproutletWrapperBase;
   friend class SproutletWrapper;
+  friend class StatelessSproutletWrapper;
+};
+
+
+/// Common base of the wrappers that pass a request to a SproutletTsx.  This
+/// keeps track of the messages the Sproutlet is working on, and implements
+/// the parts of SproutletTsxHelper that are the same whether or not there's
+/// a transaction.
+class SproutletWrapperBase : public SproutletTsxHelper
+{
+public:
+  /// Virtual destructor.  Subclasses must destroy the SproutletTsx
+  /// themselves, as it may call back into them while it is destroyed.
+  virtual ~SproutletWrapperBase();
+
+  const std::string& service_name() const;
+
+  /// See SproutletTsxHelper for the function comments for the following.
+  pjsip_msg* original_request();
+  const char* msg_info(pjsip_msg*);
+  const pjsip_route_hdr* route_hdr() const;
+  pjsip_msg* clone_msg(pjsip_msg* msg);
+  pjsip_msg* create_response(pjsip_msg* req,
+                             pjsip_status_code status_code,
+                             const std::string& status_text="");
+  void free_msg(pjsip_msg*& msg);
+  pj_pool_t* get_pool(const pjsip_msg* msg);
+  SAS::TrailId trail() const;
+  bool is_uri_reflexive(const pjsip_uri*) const;
+  pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
+  pjsip_sip_uri* next_hop_uri(const std::string& service,
+                              const pjsip_route_hdr* route,
+                              pj_pool_t* pool) const;
+
+protected:
+  /// Constructor.  The wrapper takes ownership of the request, and of the
+  /// SproutletTsx (or creates a default one if sproutlet_tsx is NULL).
+  SproutletWrapperBase(SproutletProxy* proxy,
+                       Sproutlet* sproutlet,
+                       SproutletTsx* sproutlet_tsx,
+                       const std::string& sproutlet_alias,
+                       pjsip_tx_data* req,
+                       SAS::TrailId trail_id);
+
+  /// Clones a message for the Sproutlet.  If fork is true the message is a
+  /// request that is being forked, so can share its headers with the
+  /// original.
+  virtual pjsip_tx_data* clone_tdata(pjsip_tx_data* tdata, bool fork) = 0;
+
+  /// Clones a message the Sproutlet is working on and registers the clone.
+  pjsip_msg* clone_registered_msg(pjsip_msg* msg, bool fork);
+
+  bool is_uri_local(const pjsip_uri*) const;
+  void register_tdata(pjsip_tx_data* tdata);
+  void deregister_tdata(pjsip_tx_data* tdata);
+  /// Records a message created for the Sproutlet (and whether it was
+  /// cloned from another message) in its statistics.
+  void count_msg_allocated(pjsip_tx_data* tdata, bool cloned);
+
+  SproutletProxy* _proxy;
+
+  Sproutlet* _sproutlet;
+
+  SproutletTsx* _sproutlet_tsx;
+
+  std::string _service_name;
+
+  /// Reference to the original request. This can been modified by the Sproutlet
+  /// Proxy depending on where it sends this message. A clone of this is passed
+  /// to the root Sproutlet.
+  pjsip_tx_data* _req;
+
+  typedef SmallMap<const pjsip_msg*, pjsip_tx_data*, 8> Packets;
+  Packets _packets;
+
+  SAS::TrailId _trail_id;
+
+  /// Where the Sproutlet's resource usage is recorded - against the service
+  /// and, if the request was routed using an alias, the alias.  Either may
+  /// be NULL.
+  SproutletStats* _stats;
+  SproutletStats* _alias_stats;
 };
 
 
-class SproutletWrapper : public SproutletTsxHelper
+/// SproutletWrappers are allocated from a per-thread pool - see
+/// SproutletProxy::UASTsx.
+class SproutletWrapper : public SproutletWrapperBase,
+                         public PooledObject<SproutletWrapper>
 {
 public:
   /// Constructor
@@ -261,49 +558,35 @@ public:
   /// Virtual destructor.
   virtual ~SproutletWrapper();
 
-  const std::string& service_name() const;
-
-  /// This implementation has concrete implementations for all of the virtual
-  /// functions from SproutletTsxHelper.  See there for function comments for
-  /// the following.
+  /// Together with SproutletWrapperBase, this has concrete implementations
+  /// for all of the virtual functions from SproutletTsxHelper.  See there for
+  /// function comments for the following.
   void add_to_dialog(const std::string& dialog_id="");
-  pjsip_msg* original_request();
   void copy_original_transport(pjsip_msg*);
-  const char* msg_info(pjsip_msg*);
-  const pjsip_route_hdr* route_hdr() const;
   const std::string& dialog_id() const;
   pjsip_msg* create_request();
   pjsip_msg* clone_request(pjsip_msg* req);
-  pjsip_msg* clone_msg(pjsip_msg* msg);
-  pjsip_msg* create_response(pjsip_msg* req,
-                             pjsip_status_code status_code,
-                             const std::string& status_text="");
   int send_request(pjsip_msg*& req);
   void send_response(pjsip_msg*& rsp);
   void cancel_fork(int fork_id, int reason=0);
   void cancel_pending_forks(int reason=0);
   const ForkState& fork_state(int fork_id);
-  void free_msg(pjsip_msg*& msg);
-  pj_pool_t* get_pool(const pjsip_msg* msg);
   bool schedule_timer(void* context, TimerID& id, int duration);
   void cancel_timer(TimerID id);
   bool timer_running(TimerID id);
-  SAS::TrailId trail() const;
-  bool is_uri_reflexive(const pjsip_uri*) const;
-  pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
-  pjsip_sip_uri* next_hop_uri(const std::string& service,
-                              const pjsip_route_hdr* route,
-                              pj_pool_t* pool) const;
+  std::function<void()> start_async_timer(void* context);
+
+protected:
+  pjsip_tx_data* clone_tdata(pjsip_tx_data* tdata, bool fork);
 
 private:
   void rx_request(pjsip_tx_data* req);
+  void reject_request(pjsip_tx_data* req, int status_code);
   void rx_response(pjsip_tx_data* rsp, int fork_id);
   void rx_cancel(pjsip_tx_data* cancel);
   void rx_error(int status_code);
   void rx_fork_error(pjsip_event_id_e event, int fork_id);
   void on_timer_pop(TimerID id, void* context);
-  void register_tdata(pjsip_tx_data* tdata);
-  void deregister_tdata(pjsip_tx_data* tdata);
 
   void process_actions(bool complete_after_actions);
   void aggregate_response(pjsip_tx_data* rsp);
@@ -311,40 +594,25 @@ private:
   void tx_response(pjsip_tx_data* rsp);
   void tx_cancel(int fork_id);
   int compare_sip_sc(int sc1, int sc2);
-  bool is_uri_local(const pjsip_uri*) const;
   void log_inter_sproutlet(pjsip_tx_data* tdata, bool downstream);
 
-  SproutletProxy* _proxy;
-
   SproutletProxy::UASTsx* _proxy_tsx;
 
-  Sproutlet* _sproutlet;
-
-  SproutletTsx* _sproutlet_tsx;
-
-  std::string _service_name;
   std::string _service_host;
 
   /// Identifier for this SproutletTsx instance - currently a concatenation
   /// of the service name and the address of the object.
   std::string _id;
 
-  /// Reference to the original request. This can been modified by the Sproutlet
-  /// Proxy depending on where it sends this message. A clone of this is passed
-  /// to the root Sproutlet.
-  pjsip_tx_data* _req;
   SNMP::SIPRequestTypes _req_type;
 
   // Immutable reference to the transport used by the original request.
   pjsip_transport* _original_transport;
 
-  typedef std::unordered_map<const pjsip_msg*, pjsip_tx_data*> Packets;
-  Packets _packets;
-
-  typedef std::map<int, pjsip_tx_data*> Requests;
+  typedef SmallMap<int, pjsip_tx_data*, 4> Requests;
   Requests _send_requests;
 
-  typedef std::list<pjsip_tx_data*> Responses;
+  typedef SmallVector<pjsip_tx_data*, 2> Responses;
   Responses _send_responses;
 
   int _pending_sends;
@@ -371,16 +639,79 @@ private:
     bool pending_cancel;
     int cancel_reason;
   } ForkStatus;
-  std::vector<ForkStatus> _forks;
+  SmallVector<ForkStatus, 4> _forks;
 
   /// Set keeping track of pending timers for this SproutletWrapper.  The
   /// SproutletWrapper (and the SproutletTsx it wraps) won't be deleted
   /// until all these timers have popped or been cancelled.
-  std::set<TimerID> _pending_timers;
-
-  SAS::TrailId _trail_id;
+  SmallSet<TimerID, 4> _pending_timers;
 
   friend class SproutletProxy::UASTsx;
 };
 
+
+/// Runs a Sproutlet's processing of a request without a transaction, for
+/// Sproutlets that are forwarding statelessly.  The Sproutlet can forward
+/// the request once, or respond to it, and the message is sent statelessly
+/// once the Sproutlet has returned.  Forking, timers and responses aren't
+/// supported.
+class StatelessSproutletWrapper : public SproutletWrapperBase
+{
+public:
+  /// Constructor.  The wrapper takes ownership of the SproutletTsx and the
+  /// request.
+  StatelessSproutletWrapper(SproutletProxy* proxy,
+                            Sproutlet* sproutlet,
+                            SproutletTsx* sproutlet_tsx,
+                            const std::string& sproutlet_alias,
+                            pjsip_tx_data* req,
+                            pjsip_rx_data* rdata,
+                            SAS::TrailId trail_id);
+
+  /// Destructor.
+  virtual ~StatelessSproutletWrapper();
+
+  /// Passes the request to the Sproutlet and sends whatever it forwards or
+  /// responds with.
+  ///
+  /// @return - false if the Sproutlet forwarded the request over an
+  ///           unreliable transport, which a stateless send wouldn't
+  ///           retransmit on.  Nothing has been sent and the request must
+  ///           be handled statefully instead.
+  bool process_request();
+
+  /// See SproutletTsxHelper for the function comments for the following.
+  void copy_original_transport(pjsip_msg*);
+  pjsip_msg* create_request();
+  pjsip_msg* clone_request(pjsip_msg* req);
+  int send_request(pjsip_msg*& req);
+  void send_response(pjsip_msg*& rsp);
+  void cancel_fork(int fork_id, int reason=0);
+  void cancel_pending_forks(int reason=0);
+  const ForkState& fork_state(int fork_id);
+  bool schedule_timer(void* context, TimerID& id, int duration);
+  void cancel_timer(TimerID id);
+  bool timer_running(TimerID id);
+
+  /// The magic cookie and prefix of the Via branch on requests that are
+  /// forwarded statelessly, which identifies the responses to them.
+  static const pj_str_t BRANCH_PREFIX;
+
+protected:
+  pjsip_tx_data* clone_tdata(pjsip_tx_data* tdata, bool fork);
+
+private:
+  bool forwards_reliably(pjsip_tx_data* req);
+  void tx_request(pjsip_tx_data* req);
+  void tx_response(pjsip_tx_data* rsp);
+
+  /// The received message, which responses are sent to the source of.  This
+  /// is only valid until process_request returns.
+  pjsip_rx_data* _rdata;
+
+  /// The request the Sproutlet forwarded, or the response it sent.
+  pjsip_tx_data* _send_request;
+  pjsip_tx_data* _send_response;
+};
+
 #endif
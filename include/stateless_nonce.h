@@ -0,0 +1,98 @@
+/**
+ * @file stateless_nonce.h  Self-contained digest authentication nonces.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STATELESS_NONCE_H_
+#define STATELESS_NONCE_H_
+
+#include <string>
+#include <stdint.h>
+
+#include "impistore.h"
+
+/// Encodes digest authentication challenges into the nonce itself, so that
+/// issuing a challenge doesn't require writing it to the IMPI store.
+///
+/// The challenge (IMPI, realm, QoP, HA1, correlator and expiry) is encrypted
+/// and authenticated with AES-256-GCM under a key derived from a secret shared
+/// by every node in the cluster, so any node can check a response to a
+/// challenge issued by any other. The HA1 is never visible to the client.
+///
+/// Stateless nonces are only used for SIP digest. AKA challenges still go
+/// through the IMPI store, and the challenge is added to the store when a
+/// response to it is accepted, so that the response can't be replayed and
+/// later nonce counts can be checked.
+class StatelessNonce
+{
+public:
+  /// @param key  - The cluster-wide secret used to protect nonces.
+  StatelessNonce(const std::string& key);
+  ~StatelessNonce();
+
+  /// The result of decoding a nonce.
+  enum Result
+  {
+    OK,
+    NOT_STATELESS,
+    INVALID,
+    EXPIRED
+  };
+
+  /// Encodes a digest challenge into a nonce.
+  ///
+  /// @param impi      - The private identity being challenged.
+  /// @param challenge - The challenge. Its realm, qop, ha1, correlator and
+  ///                    expires fields are encoded into the nonce.
+  ///
+  /// @return          - The nonce, or an empty string on error.
+  std::string encode(const std::string& impi,
+                     const ImpiStore::DigestAuthChallenge* challenge);
+
+  /// Decodes a nonce previously created by encode().
+  ///
+  /// @param impi      - The private identity that responded to the challenge.
+  ///                    This must match the identity the nonce was issued to.
+  /// @param nonce     - The nonce from the response.
+  /// @param challenge - OUT: on success, the decoded challenge. The caller
+  ///                    owns this object.
+  ///
+  /// @return          - NOT_STATELESS if the nonce wasn't created by this
+  ///                    class (so the IMPI store must be checked), INVALID if
+  ///                    it fails authentication or was issued to a different
+  ///                    IMPI, EXPIRED if it has expired, or OK.
+  Result decode(const std::string& impi,
+                const std::string& nonce,
+                ImpiStore::DigestAuthChallenge*& challenge);
+
+  /// Whether a nonce has the stateless nonce format.
+  static bool is_stateless(const std::string& nonce);
+
+private:
+  bool encrypt(const std::string& plaintext,
+               std::string& ciphertext);
+  bool decrypt(const std::string& ciphertext,
+               std::string& plaintext);
+
+  static void append_field(std::string& buf, const std::string& field);
+  static bool read_field(const std::string& buf,
+                         size_t& offset,
+                         std::string& field);
+
+  // Prefix identifying stateless nonces (and the version of their format).
+  static const std::string PREFIX;
+
+  static const size_t KEY_LEN = 32;
+  static const size_t IV_LEN = 12;
+  static const size_t TAG_LEN = 16;
+
+  uint8_t _key[KEY_LEN];
+};
+
+#endif
@@ -20,11 +20,13 @@ extern "C" {
 
 #include <string>
 #include <list>
+#include <vector>
 #include <map>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "store.h"
+#include "parallel_store_ops.h"
 #include "chronosconnection.h"
 #include "sas.h"
 #include "analyticslogger.h"
@@ -375,7 +377,8 @@ public:
   {
     Connector(Store* data_store,
               SerializerDeserializer*& serializer,
-              std::vector<SerializerDeserializer*>& deserializers);
+              std::vector<SerializerDeserializer*>& deserializers,
+              ParallelStoreOps* parallel_ops = NULL);
 
     ~Connector();
 
@@ -386,6 +389,18 @@ public:
                                int expiry,
                                SAS::TrailId trail);
 
+    /// Pipelined versions of get_aor_data and set_aor_data.  The results
+    /// are in the same order as the AoR IDs.  The store operations are only
+    /// issued concurrently if the Connector has a ParallelStoreOps.
+    std::vector<AoR*> get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                         SAS::TrailId trail);
+
+    std::vector<Store::Status> set_aor_data_multi(
+                                      const std::vector<std::string>& aor_ids,
+                                      const std::vector<AoR*>& aor_data,
+                                      const std::vector<int>& expiries,
+                                      SAS::TrailId trail);
+
     std::string serialize_aor(AoR* aor_data);
     AoR* deserialize_aor(const std::string& aor_id, const std::string& s);
 
@@ -397,8 +412,11 @@ public:
     friend class SubscriberDataManager;
 
   private:
+    void run_store_ops(std::vector<std::function<void()>>& ops);
+
     SerializerDeserializer* _serializer;
     std::vector<SerializerDeserializer*> _deserializers;
+    ParallelStoreOps* _parallel_ops;
   };
 
   /// @class SubscriberDataManager::ChronosTimerRequestSender
@@ -532,12 +550,16 @@ public:
   /// @param analytics_logger   - AnalyticsLogger for reporting registration events.
   /// @param is_primary         - Whether the underlying data store is the local
   ///                             store or remote.
+  /// @param parallel_ops       - If not NULL, used to issue the store
+  ///                             operations for get_aor_data_multi and
+  ///                             set_aor_data_multi concurrently.
   SubscriberDataManager(Store* data_store,
                         SerializerDeserializer*& serializer,
                         std::vector<SerializerDeserializer*>& deserializers,
                         ChronosConnection* chronos_connection,
                         AnalyticsLogger* analytics_logger,
-                        bool is_primary);
+                        bool is_primary,
+                        ParallelStoreOps* parallel_ops = NULL);
 
   /// Alternative SubscriberDataManager constructor that creates a SubscriberDataManager using just the
   /// default (de)serializer.
@@ -583,7 +605,76 @@ public:
                                      SAS::TrailId trail,
                                      bool& all_bindings_expired = unused_bool);
 
+  /// Get the data for several addresses of record at once.  The store reads
+  /// are pipelined, so this costs a single store round trip.  Returns one
+  /// AoRPair per AoR ID, in the same order, each of which may be NULL in case
+  /// of error.  The results are owned by the caller.
+  ///
+  /// @param aor_ids   The AoRs to retrieve
+  /// @param trail     SAS trail
+  virtual std::vector<AoRPair*> get_aor_data_multi(
+                                         const std::vector<std::string>& aor_ids,
+                                         SAS::TrailId trail);
+
+  /// A single AoR update in a call to set_aor_data_multi.
+  struct AoRUpdate
+  {
+    AoRUpdate(const std::string& aor_id_arg,
+              AssociatedURIs* associated_uris_arg,
+              AoRPair* aor_pair_arg) :
+      aor_id(aor_id_arg),
+      associated_uris(associated_uris_arg),
+      aor_pair(aor_pair_arg),
+      status(Store::Status::OK),
+      all_bindings_expired(false)
+    {}
+
+    std::string aor_id;
+    AssociatedURIs* associated_uris;
+    AoRPair* aor_pair;
+
+    /// Set on return to the result of writing this AoR, with the same meaning
+    /// as the return code from set_aor_data.  Each AoR is written
+    /// independently, so some may succeed while others hit contention.
+    Store::Status status;
+
+    /// Set on return to whether all bindings in this AoR have expired.
+    bool all_bindings_expired;
+  };
+
+  /// Update the data for several addresses of record at once.  Each AoR is
+  /// handled as for set_aor_data, except that the store writes are
+  /// pipelined.
+  ///
+  /// @param updates   The AoRs to write.  The status and
+  ///                  all_bindings_expired fields are filled in.
+  /// @param trail     SAS trail
+  virtual void set_aor_data_multi(std::vector<AoRUpdate>& updates,
+                                  SAS::TrailId trail);
+
 private:
+  // The parts of set_aor_data before and after the store write.
+  //
+  // prepare_aor_write expires old bindings and subscriptions, logs removed
+  // or shortened bindings, sends any Chronos timer requests and bumps the
+  // NOTIFY CSeq.  It returns the expiry to write the AoR with.
+  //
+  // complete_aor_write logs new or extended bindings and sends any NOTIFYs.
+  // It must only be called if the write succeeded.
+  int prepare_aor_write(const std::string& aor_id,
+                        AoRPair* aor_pair,
+                        int now,
+                        SAS::TrailId trail,
+                        bool& all_bindings_expired,
+                        ClassifiedBindings& classified_bindings);
+
+  void complete_aor_write(const std::string& aor_id,
+                          AssociatedURIs* associated_uris,
+                          AoRPair* aor_pair,
+                          int now,
+                          SAS::TrailId trail,
+                          ClassifiedBindings& classified_bindings);
+
   // Expire any out of date bindings in the current AoR
   //
   // @param aor_pair  The AoRPair to expire
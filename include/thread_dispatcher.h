@@ -34,7 +34,13 @@ pj_status_t start_worker_threads();
 pj_status_t stop_worker_threads();
 
 // Add a Callback object to the queue, to be run on a worker thread.
-// This MUST be called from the main PJSIP transport thread.
+// This MUST be called from the main PJSIP transport thread, or from a thread
+// that isn't registered with PJSIP (such as the ENUM event loop).
 void add_callback_to_queue(PJUtils::Callback*);
 
+// Run the callbacks on the queue (including any that they queue) on the
+// calling thread, and return how many were run.  This is only for UTs, which
+// don't start worker threads.
+int process_queued_callbacks();
+
 #endif
@@ -138,6 +138,11 @@ ACR* ACRFactory::get_acr(SAS::TrailId trail,
   return new ACR();
 }
 
+bool ACRFactory::sends_acrs() const
+{
+  return false;
+}
+
 RalfACR::RalfACR(RalfProcessor* ralf,
                  SAS::TrailId trail,
                  Node node_functionality,
@@ -1789,3 +1794,8 @@ ACR* RalfACRFactory::get_acr(SAS::TrailId trail,
   return (ACR*)new RalfACR(_ralf, trail, _node_functionality, initiator, role);
 }
 
+bool RalfACRFactory::sends_acrs() const
+{
+  return true;
+}
+
@@ -0,0 +1,324 @@
+/**
+ * @file async_dnsresolver.cpp  Asynchronous NAPTR resolver sharing one c-ares
+ * event loop.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/nameser.h>
+#include <algorithm>
+
+#include "async_dnsresolver.h"
+#include "dnsresolver.h"
+#include "log.h"
+#include "sproutsasevent.h"
+
+AsyncDNSResolver::AsyncDNSResolver(const std::vector<struct IP46Address>& servers,
+                                   int port) :
+  _terminate(false)
+{
+  // Use the same options as DNSResolver, so that queries fail over between
+  // servers and time out as quickly as the synchronous resolver's do.
+  struct ares_options options;
+  options.flags = ARES_FLAG_STAYOPEN;
+  options.timeout = 1000;
+  options.tries = servers.size();
+  options.ndots = 0;
+  options.servers = NULL;
+  options.nservers = 0;
+  ares_init_options(&_channel,
+                    &options,
+                    ARES_OPT_FLAGS |
+                    ARES_OPT_TIMEOUTMS |
+                    ARES_OPT_TRIES |
+                    ARES_OPT_NDOTS |
+                    ARES_OPT_SERVERS);
+
+  size_t server_count = std::min((size_t)3u, servers.size());
+  for (size_t ii = 0; ii < server_count; ii++)
+  {
+    struct ares_addr_port_node* ares_addr = &_ares_addrs[ii];
+    memset(ares_addr, 0, sizeof(struct ares_addr_port_node));
+    if (ii > 0)
+    {
+      _ares_addrs[ii - 1].next = ares_addr;
+    }
+
+    ares_addr->family = servers[ii].af;
+    ares_addr->udp_port = port;
+    ares_addr->tcp_port = port;
+    if (servers[ii].af == AF_INET)
+    {
+      memcpy(&ares_addr->addr.addr4, &servers[ii].addr.ipv4, sizeof(ares_addr->addr.addr4));
+    }
+    else
+    {
+      memcpy(&ares_addr->addr.addr6, &servers[ii].addr.ipv6, sizeof(ares_addr->addr.addr6));
+    }
+  }
+  ares_set_servers_ports(_channel, &(_ares_addrs[0]));
+
+  pthread_mutex_init(&_lock, NULL);
+
+  if (pipe(_wakeup_pipe) != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create DNS event loop wakeup pipe: %s", strerror(errno));
+    _wakeup_pipe[0] = -1;
+    _wakeup_pipe[1] = -1;
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    fcntl(_wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+
+  int rc = pthread_create(&_thread, NULL, &AsyncDNSResolver::loop_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create DNS event loop thread: %d", rc);
+    // LCOV_EXCL_STOP
+  }
+}
+
+
+AsyncDNSResolver::~AsyncDNSResolver()
+{
+  pthread_mutex_lock(&_lock);
+  _terminate = true;
+  pthread_mutex_unlock(&_lock);
+
+  char c = 0;
+  (void)write(_wakeup_pipe[1], &c, 1);
+  pthread_join(_thread, NULL);
+
+  close(_wakeup_pipe[0]);
+  close(_wakeup_pipe[1]);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AsyncDNSResolver::perform_naptr_query(const std::string& domain,
+                                           NaptrCallback callback,
+                                           SAS::TrailId trail)
+{
+  Query* query = new Query;
+  query->resolver = this;
+  query->domain = domain;
+  query->trail = trail;
+  query->callback = callback;
+
+  // Log the query.
+  SAS::Event event(trail, SASEvent::TX_ENUM_REQ, 0);
+  event.add_var_param(domain);
+  SAS::report_event(event);
+
+  // Queue the query and wake the event loop to send it.
+  pthread_mutex_lock(&_lock);
+  _queue.push_back(query);
+  pthread_mutex_unlock(&_lock);
+
+  char c = 0;
+  (void)write(_wakeup_pipe[1], &c, 1);
+}
+
+
+void* AsyncDNSResolver::loop_thread_fn(void* arg)
+{
+  ((AsyncDNSResolver*)arg)->run_loop();
+  return NULL;
+}
+
+
+void AsyncDNSResolver::run_loop()
+{
+  bool terminate = false;
+
+  while (!terminate)
+  {
+    send_queued_queries();
+
+    // Build the list of file descriptors to wait on - the wakeup pipe, and
+    // the sockets ares is using.
+    struct pollfd fds[ARES_GETSOCK_MAXNUM + 1];
+    int num_fds = 0;
+
+    fds[num_fds].fd = _wakeup_pipe[0];
+    fds[num_fds].events = POLLIN;
+    fds[num_fds].revents = 0;
+    num_fds++;
+
+    ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+    int rw_bits = ares_getsock(_channel, socks, ARES_GETSOCK_MAXNUM);
+    for (int sock_idx = 0; sock_idx < ARES_GETSOCK_MAXNUM; sock_idx++)
+    {
+      struct pollfd* fd = &fds[num_fds];
+      fd->fd = socks[sock_idx];
+      fd->events = 0;
+      fd->revents = 0;
+      if (ARES_GETSOCK_READABLE(rw_bits, sock_idx))
+      {
+        fd->events |= POLLRDNORM | POLLIN;
+      }
+      if (ARES_GETSOCK_WRITABLE(rw_bits, sock_idx))
+      {
+        fd->events |= POLLWRNORM | POLLOUT;
+      }
+      if (fd->events != 0)
+      {
+        num_fds++;
+      }
+    }
+
+    // Wait until the next ares timeout, or indefinitely if there are no
+    // queries outstanding.
+    struct timeval tv;
+    int timeout_ms = -1;
+    if (ares_timeout(_channel, NULL, &tv) != NULL)
+    {
+      timeout_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+
+    int rc = poll(fds, num_fds, timeout_ms);
+
+    if (rc > 0)
+    {
+      if (fds[0].revents != 0)
+      {
+        // Drain the wakeup pipe.  Any queued queries are sent at the top of
+        // the loop.
+        char buf[64];
+        while (read(_wakeup_pipe[0], buf, sizeof(buf)) > 0)
+        {
+        }
+      }
+
+      for (int fd_idx = 1; fd_idx < num_fds; fd_idx++)
+      {
+        struct pollfd* fd = &fds[fd_idx];
+        if (fd->revents != 0)
+        {
+          ares_process_fd(_channel,
+                          fd->revents & (POLLRDNORM | POLLIN) ? fd->fd : ARES_SOCKET_BAD,
+                          fd->revents & (POLLWRNORM | POLLOUT) ? fd->fd : ARES_SOCKET_BAD);
+        }
+      }
+    }
+    else if (rc == 0)
+    {
+      // No events, so just call into ares with no file descriptor to let it
+      // handle timeouts.
+      ares_process_fd(_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+    }
+
+    pthread_mutex_lock(&_lock);
+    terminate = _terminate;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Fail any queries that were queued but never sent, then destroy the
+  // channel, which fails any that are outstanding.
+  pthread_mutex_lock(&_lock);
+  std::deque<Query*> queue;
+  queue.swap(_queue);
+  pthread_mutex_unlock(&_lock);
+
+  for (Query* query : queue)
+  {
+    query->callback(ARES_EDESTRUCTION, NULL, 0);
+    delete query;
+  }
+
+  ares_destroy(_channel);
+}
+
+
+void AsyncDNSResolver::send_queued_queries()
+{
+  pthread_mutex_lock(&_lock);
+  std::deque<Query*> queue;
+  queue.swap(_queue);
+  pthread_mutex_unlock(&_lock);
+
+  for (Query* query : queue)
+  {
+    ares_query(_channel,
+               query->domain.c_str(),
+               ns_c_in,
+               ns_t_naptr,
+               &AsyncDNSResolver::ares_callback,
+               query);
+  }
+}
+
+
+void AsyncDNSResolver::ares_callback(void* arg,
+                                     int status,
+                                     int timeouts,
+                                     unsigned char* abuf,
+                                     int alen)
+{
+  Query* query = (Query*)arg;
+  query->resolver->ares_callback(query, status, abuf, alen);
+  delete query;
+}
+
+
+void AsyncDNSResolver::ares_callback(Query* query,
+                                     int status,
+                                     unsigned char* abuf,
+                                     int alen)
+{
+  struct ares_naptr_reply* naptr_reply = NULL;
+  int ttl = 0;
+
+  if (status == ARES_SUCCESS)
+  {
+    // Log that we've succeeded.
+    SAS::Event event(query->trail, SASEvent::RX_ENUM_RSP, 0);
+    event.add_var_param(query->domain);
+    event.add_var_param(alen, abuf);
+    SAS::report_event(event);
+
+    // Parse the reply.
+    status = ares_parse_naptr_reply(abuf, alen, &naptr_reply);
+    if (status != ARES_SUCCESS)
+    {
+      TRC_WARNING("Unparseable DNS ENUM response from host %s: %s",
+                  query->domain.c_str(), ares_strerror(status));
+    }
+    else
+    {
+      ttl = DNSResolver::min_naptr_ttl(abuf, alen);
+    }
+  }
+  else
+  {
+    // Log that we've failed.
+    TRC_WARNING("DNS ENUM query failed for host %s: %s",
+                query->domain.c_str(), ares_strerror(status));
+    SAS::Event event(query->trail, SASEvent::RX_ENUM_ERR, 0);
+    event.add_static_param(status);
+    event.add_var_param(query->domain);
+    SAS::report_event(event);
+  }
+
+  query->callback(status, naptr_reply, ttl);
+
+  if (naptr_reply != NULL)
+  {
+    ares_free_data(naptr_reply);
+  }
+}
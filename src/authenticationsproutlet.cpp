@@ -57,7 +57,9 @@ AuthenticationSproutlet::AuthenticationSproutlet(const std::string& name,
                                                  AnalyticsLogger* analytics_logger,
                                                  SNMP::AuthenticationStatsTables* auth_stats_tbls,
                                                  bool nonce_count_supported_arg,
-                                                 get_expiry_for_binding_fn get_expiry_for_binding_arg) :
+                                                 get_expiry_for_binding_fn get_expiry_for_binding_arg,
+                                                 const std::string& stateless_nonce_key,
+                                                 DigestAvCache* digest_av_cache) :
   Sproutlet(name, port, uri),
   _aka_realm((realm_name != "") ?
     pj_strdup3(stack_data.pool, realm_name.c_str()) :
@@ -70,6 +72,9 @@ AuthenticationSproutlet::AuthenticationSproutlet(const std::string& name,
   _analytics(analytics_logger),
   _auth_stats_tables(auth_stats_tbls),
   _nonce_count_supported(nonce_count_supported_arg),
+  _stateless_nonce(stateless_nonce_key.empty() ?
+                     NULL : new StatelessNonce(stateless_nonce_key)),
+  _digest_av_cache(digest_av_cache),
   _get_expiry_for_binding(get_expiry_for_binding_arg),
   _non_register_auth_mode(non_register_auth_mode_param),
   _next_hop_service(next_hop_service),
@@ -77,7 +82,10 @@ AuthenticationSproutlet::AuthenticationSproutlet(const std::string& name,
 {
 }
 
-AuthenticationSproutlet::~AuthenticationSproutlet() {}
+AuthenticationSproutlet::~AuthenticationSproutlet()
+{
+  delete _stateless_nonce; _stateless_nonce = NULL;
+}
 
 bool AuthenticationSproutlet::init()
 {
@@ -547,6 +555,40 @@ AuthenticationVector* AuthenticationSproutletTsx::get_av_from_store(const std::s
   return av;
 }
 
+/// Get a digest challenge from a stateless nonce, without going to the IMPI
+/// store.
+///
+/// @param impi         - The IMPI in the response.
+/// @param nonce        - The nonce in the response.
+/// @param is_stateless - OUT: whether the nonce is a stateless nonce (in which
+///                       case there is no point looking for it in the store).
+///
+/// @return             - The challenge (owned by the caller), or NULL if the
+///                       nonce is invalid, has expired or isn't stateless.
+ImpiStore::AuthChallenge* AuthenticationSproutletTsx::get_stateless_challenge(const std::string& impi,
+                                                                              const std::string& nonce,
+                                                                              bool& is_stateless)
+{
+  ImpiStore::DigestAuthChallenge* challenge = NULL;
+  is_stateless = false;
+
+  if (_authentication->_stateless_nonce != NULL)
+  {
+    StatelessNonce::Result result =
+      _authentication->_stateless_nonce->decode(impi, nonce, challenge);
+    is_stateless = (result != StatelessNonce::NOT_STATELESS);
+
+    if ((result == StatelessNonce::INVALID) ||
+        (result == StatelessNonce::EXPIRED))
+    {
+      TRC_DEBUG("Stateless nonce %s is not valid for %s (%d)",
+                nonce.c_str(), impi.c_str(), result);
+    }
+  }
+
+  return challenge;
+}
+
 void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* credentials,
                                                   pj_bool_t stale,
                                                   std::string resync,
@@ -595,24 +637,55 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
     // by treating it like a REGISTER. Get the Authentication Vector from the
     // HSS.
     PJUtils::get_impi_and_impu(req, impi, impu_for_hss);
-    TRC_DEBUG("Get AV from HSS for impi=%s impu=%s",
-              impi.c_str(), impu_for_hss.c_str());
-
-    rapidjson::Document* doc = NULL;
-    HTTPCode http_code = _authentication->_hss->get_auth_vector(impi,
-                                                                impu_for_hss,
-                                                                auth_type,
-                                                                resync,
-                                                                doc,
-                                                                trail());
-    av_source_unavailable = ((http_code == HTTP_SERVER_UNAVAILABLE) ||
-                             (http_code == HTTP_GATEWAY_TIMEOUT));
-
-    if (doc != NULL)
+
+    // If we're caching digest AVs, and neither AKA nor a resync has been
+    // requested, see if we have a recent one for this subscriber.
+    DigestAvCache* cache = _authentication->_digest_av_cache;
+    bool cacheable = ((cache != NULL) && (auth_type.empty()) && (resync.empty()));
+    std::string cache_realm = (credentials != NULL) ?
+                                PJUtils::pj_str_to_string(&credentials->realm) : "";
+    DigestAvCache::Av cached_av;
+
+    if ((cacheable) && (cache->get(impi, impu_for_hss, cache_realm, cached_av)))
+    {
+      TRC_DEBUG("Using cached AV for impi=%s impu=%s",
+                impi.c_str(), impu_for_hss.c_str());
+      DigestAv* digest = new DigestAv();
+      digest->ha1 = cached_av.ha1;
+      digest->qop = cached_av.qop;
+      digest->realm = cached_av.realm;
+      av = digest;
+    }
+    else
     {
-      av = verify_auth_vector(doc, impi);
+      TRC_DEBUG("Get AV from HSS for impi=%s impu=%s",
+                impi.c_str(), impu_for_hss.c_str());
+
+      rapidjson::Document* doc = NULL;
+      HTTPCode http_code = _authentication->_hss->get_auth_vector(impi,
+                                                                  impu_for_hss,
+                                                                  auth_type,
+                                                                  resync,
+                                                                  doc,
+                                                                  trail());
+      av_source_unavailable = ((http_code == HTTP_SERVER_UNAVAILABLE) ||
+                               (http_code == HTTP_GATEWAY_TIMEOUT));
+
+      if (doc != NULL)
+      {
+        av = verify_auth_vector(doc, impi);
+      }
+      delete doc; doc = NULL;
+
+      if ((cacheable) && (av != NULL) && (av->is_digest()))
+      {
+        DigestAv* digest = (DigestAv*)av;
+        cached_av.ha1 = digest->ha1;
+        cached_av.qop = digest->qop;
+        cached_av.realm = digest->realm;
+        cache->add(impi, impu_for_hss, cache_realm, cached_av);
+      }
     }
-    delete doc; doc = NULL;
   }
   else
   {
@@ -674,6 +747,7 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
     pj_pool_t* rsp_pool = get_pool(rsp);
 
     ImpiStore::AuthChallenge* auth_challenge;
+    bool stateless_challenge = false;
     if (av->is_aka())
     {
       // AKA authentication.
@@ -767,42 +841,70 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
       SAS::Event event(trail(), SASEvent::AUTHENTICATION_CHALLENGE_DIGEST, 0);
       SAS::report_event(event);
 
+      // Build the AuthChallenge so that we can store it in the ImpiStore (or
+      // encode it into the nonce).
+      auth_challenge = new ImpiStore::DigestAuthChallenge("",
+                                                          digest->realm,
+                                                          digest->qop,
+                                                          digest->ha1,
+                                                          time(NULL) + AUTH_CHALLENGE_INIT_EXPIRES);
+
+      if (_authentication->_stateless_nonce != NULL)
+      {
+        // The challenge is carried in the nonce itself, so needs the
+        // correlator filling in now.
+        pjsip_via_hdr* via_hdr = (pjsip_via_hdr*)pjsip_msg_find_hdr(req, PJSIP_H_VIA, NULL);
+        auth_challenge->correlator =
+          (via_hdr != NULL) ? PJUtils::pj_str_to_string(&via_hdr->branch_param) : "";
+        nonce = _authentication->_stateless_nonce->encode(
+                          impi,
+                          (ImpiStore::DigestAuthChallenge*)auth_challenge);
+        stateless_challenge = !nonce.empty();
+      }
+
+      if (!stateless_challenge)
+      {
+        pj_create_random_string(buf, sizeof(buf));
+        nonce.assign(buf, sizeof(buf));
+      }
+
+      auth_challenge->nonce = nonce;
+
       pj_strdup2(rsp_pool, &hdr->challenge.digest.realm, digest->realm.c_str());
       hdr->challenge.digest.algorithm = STR_MD5;
-      pj_create_random_string(buf, sizeof(buf));
-      nonce.assign(buf, sizeof(buf));
-      pj_strdup(rsp_pool, &hdr->challenge.digest.nonce, &random);
+      pj_strdup2(rsp_pool, &hdr->challenge.digest.nonce, nonce.c_str());
       pj_create_random_string(buf, sizeof(buf));
       pj_strdup(rsp_pool, &hdr->challenge.digest.opaque, &random);
       pj_strdup2(rsp_pool, &hdr->challenge.digest.qop, digest->qop.c_str());
       hdr->challenge.digest.stale = stale;
-
-      // Now build the AuthChallenge so that we can store it in the ImpiStore.
-      auth_challenge = new ImpiStore::DigestAuthChallenge(nonce,
-                                                          digest->realm,
-                                                          digest->qop,
-                                                          digest->ha1,
-                                                          time(NULL) + AUTH_CHALLENGE_INIT_EXPIRES);
     }
 
     // Add the header to the message.
     pjsip_msg_add_hdr(rsp, (pjsip_hdr*)hdr);
 
-    // Store the branch parameter in memcached for correlation purposes
-    pjsip_via_hdr* via_hdr = (pjsip_via_hdr*)pjsip_msg_find_hdr(req, PJSIP_H_VIA, NULL);
-    auth_challenge->correlator =
-      (via_hdr != NULL) ? PJUtils::pj_str_to_string(&via_hdr->branch_param) : "";
-
-    // Write the new authentication challenge to the IMPI store
-    TRC_DEBUG("Write authentication challenge to IMPI store");
-    Store::Status status;
-
-    // Save off the nonce. We will need it to reclaim the auth challenge from
-    // the IMPI at the end of the loop.
+    // Save off the nonce. We will need it for the Chronos timer once we've
+    // freed the auth challenge.
     std::string nonce = auth_challenge->nonce;
+    Store::Status status;
 
-    // Write the challenge back to the store.
-    status = _authentication->write_challenge(impi, auth_challenge, impi_obj, trail());
+    if (stateless_challenge)
+    {
+      // The challenge is entirely contained in the nonce, so there is nothing
+      // to write to the IMPI store.
+      TRC_DEBUG("Issued stateless digest challenge - not writing to IMPI store");
+      status = Store::OK;
+    }
+    else
+    {
+      // Store the branch parameter in memcached for correlation purposes
+      pjsip_via_hdr* via_hdr = (pjsip_via_hdr*)pjsip_msg_find_hdr(req, PJSIP_H_VIA, NULL);
+      auth_challenge->correlator =
+        (via_hdr != NULL) ? PJUtils::pj_str_to_string(&via_hdr->branch_param) : "";
+
+      // Write the new authentication challenge to the IMPI store
+      TRC_DEBUG("Write authentication challenge to IMPI store");
+      status = _authentication->write_challenge(impi, auth_challenge, impi_obj, trail());
+    }
 
     // We're done with the auth challenge and IMPI object now.
     delete auth_challenge; auth_challenge = NULL;
@@ -814,14 +916,15 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
       {
         TRC_DEBUG("Set chronos timer for AUTHENTICATION_TIMEOUT SAR");
 
-        // We've written the challenge into the store, so need to set a Chronos
-        // timer so that an AUTHENTICATION_TIMEOUT SAR is sent to the
-        // HSS when it expires.
+        // We've issued the challenge, so need to set a Chronos timer so that
+        // an AUTHENTICATION_TIMEOUT SAR is sent to the HSS when it expires.
+        // A stateless challenge is only written to the store once it has
+        // been used, so the timer tells the handler not to expect it there.
         std::string timer_id;
         std::string chronos_body = "{\"impi\": \"" + impi +
                                 "\", \"impu\": \"" + impu_for_hss +
                                 "\", \"nonce\": \"" + nonce +
-                                "\"}";
+                                (stateless_challenge ? "\", \"stateless\": true}" : "\"}");
         TRC_DEBUG("Sending %s to Chronos to set AV timer", chronos_body.c_str());
         _authentication->_chronos->send_post(timer_id,
                                              30,
@@ -880,16 +983,36 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
   pjsip_digest_credential* credentials = get_credentials(req);
 
   ImpiStore::Impi* impi_obj = NULL;
+  ImpiStore::AuthChallenge* stateless_challenge = NULL;
   if ((credentials != NULL) &&
       (credentials->response.slen != 0))
   {
     std::string impi = PJUtils::pj_str_to_string(&credentials->username);
     std::string nonce = PJUtils::pj_str_to_string(&credentials->nonce);
-    impi_obj = _authentication->read_impi(impi, nonce, trail());
     ImpiStore::AuthChallenge* auth_challenge = NULL;
-    if (impi_obj != NULL)
+
+    // Calculate the nonce count on the request (if it is not present default
+    // to 1).
+    unsigned long nonce_count = pj_strtoul2(&credentials->nc, NULL, 16);
+    nonce_count = (nonce_count == 0) ? 1 : nonce_count;
+
+    // The first response to a stateless challenge can be checked using just
+    // the nonce. Later responses must be checked against the store so that
+    // replayed nonce counts are spotted.
+    bool is_stateless = false;
+    if (nonce_count == 1)
+    {
+      stateless_challenge = get_stateless_challenge(impi, nonce, is_stateless);
+      auth_challenge = stateless_challenge;
+    }
+
+    if (!is_stateless || (nonce_count > 1))
     {
-      auth_challenge = impi_obj->get_auth_challenge(nonce);
+      impi_obj = _authentication->read_impi(impi, nonce, trail());
+      if (impi_obj != NULL)
+      {
+        auth_challenge = impi_obj->get_auth_challenge(nonce);
+      }
     }
 
     if (!is_register)
@@ -930,11 +1053,6 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
       auth_stats_table->increment_attempts();
     }
 
-    // Calculate the nonce count on the request (if it is not present default
-    // to 1).
-    unsigned long nonce_count = pj_strtoul2(&credentials->nc, NULL, 16);
-    nonce_count = (nonce_count == 0) ? 1 : nonce_count;
-
     if ((auth_challenge != NULL) && (auth_challenge->nonce_count > 1))
     {
       // A nonce count > 1 is supplied. Check that it is acceptable. If it is
@@ -989,17 +1107,6 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 
       if (status == PJ_SUCCESS)
       {
-        // The authentication information in the request was verified.
-        TRC_DEBUG("Request authenticated successfully");
-
-        SAS::Event event(trail(), SASEvent::AUTHENTICATION_SUCCESS, 0);
-        SAS::report_event(event);
-
-        if (auth_stats_table != NULL)
-        {
-          auth_stats_table->increment_successes();
-        }
-
         // Increment the nonce count and set it back to the AV store, handling
         // contention.  We don't check for overflow - it will take ~2^32
         // authentications before it happens.
@@ -1029,17 +1136,53 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
           }
         }
 
-        // Write the challenge back to the store.
-        Store::Status store_status =
-          _authentication->write_challenge(impi, auth_challenge, impi_obj, trail());
+        if (auth_challenge == stateless_challenge)
+        {
+          // Nothing in a stateless nonce stops the response being replayed, so
+          // record that the nonce has been used by adding the challenge to the
+          // store. This only succeeds for the first response to the challenge.
+          if (!_authentication->record_stateless_challenge(impi,
+                                                           auth_challenge,
+                                                           trail()))
+          {
+            TRC_INFO("Stateless nonce %s for %s has already been used - ignore it",
+                     nonce.c_str(), impi.c_str());
+            SAS::Event event(trail(), SASEvent::AUTHENTICATION_NC_TOO_LOW, 0);
+            event.add_static_param(nonce_count);
+            event.add_static_param(auth_challenge->nonce_count);
+            SAS::report_event(event);
+
+            status = PJSIP_EAUTHACCNOTFOUND;
+          }
+        }
+        else
+        {
+          // Write the challenge back to the store.
+          Store::Status store_status =
+            _authentication->write_challenge(impi, auth_challenge, impi_obj, trail());
+
+          if (store_status != Store::OK)
+          {
+            // LCOV_EXCL_START
+            TRC_ERROR("Tried to update IMPI for %s/%s after processing an authentication, but failed",
+                      impi.c_str(),
+                      nonce.c_str());
+            // LCOV_EXCL_STOP
+          }
+        }
+      }
+
+      if (status == PJ_SUCCESS)
+      {
+        // The authentication information in the request was verified.
+        TRC_DEBUG("Request authenticated successfully");
+
+        SAS::Event event(trail(), SASEvent::AUTHENTICATION_SUCCESS, 0);
+        SAS::report_event(event);
 
-        if (store_status != Store::OK)
+        if (auth_stats_table != NULL)
         {
-          // LCOV_EXCL_START
-          TRC_ERROR("Tried to update IMPI for %s/%s after processing an authentication, but failed",
-                    impi.c_str(),
-                    nonce.c_str());
-          // LCOV_EXCL_STOP
+          auth_stats_table->increment_successes();
         }
 
         // If doing AKA authentication, check for an AUTS parameter.  We only
@@ -1109,8 +1252,10 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
             ((pj_strlen(&credentials->algorithm) == 0) ||
              (pj_stricmp2(&credentials->algorithm, "md5") == 0));
 
-          // Free off the IMPI object before returning.
+          // Free off the IMPI object (and any stateless challenge) before
+          // returning.
           delete impi_obj;
+          delete stateless_challenge;
 
           forward_request(req); return;
         }
@@ -1125,6 +1270,7 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 
   // We're done with the IMPI object now so delete it.
   delete impi_obj; impi_obj = NULL;
+  delete stateless_challenge; stateless_challenge = NULL;
 
   // The message either has insufficient authentication information, or
   // has failed authentication.  In either case, the message will be
@@ -1177,6 +1323,14 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
     {
       auth_stats_table->increment_failures();
     }
+
+    // Don't challenge this subscriber with a cached AV again, in case the
+    // failure was because their credentials have changed.
+    if (_authentication->_digest_av_cache != NULL)
+    {
+      _authentication->_digest_av_cache->invalidate(
+                           PJUtils::pj_str_to_string(&credentials->username));
+    }
     SAS::Event event(trail(), SASEvent::AUTHENTICATION_FAILED, 0);
     event.add_var_param(error_msg);
     SAS::report_event(event);
@@ -1354,6 +1508,64 @@ Store::Status AuthenticationSproutlet::
   return status;
 }
 
+bool AuthenticationSproutlet::
+  record_stateless_challenge(const std::string& impi,
+                             ImpiStore::AuthChallenge* auth_challenge,
+                             SAS::TrailId trail)
+{
+  Store::Status status;
+  const std::string nonce = auth_challenge->nonce;
+
+  do
+  {
+    TRC_DEBUG("Lookup IMPI %s (with nonce %s)", impi.c_str(), nonce.c_str());
+    ImpiStore::Impi* impi_obj = _impi_store->get_impi_with_nonce(impi, nonce, trail);
+    if (impi_obj == NULL)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to read IMPI for %s to record stateless nonce", impi.c_str());
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    if (impi_obj->get_auth_challenge(nonce) != NULL)
+    {
+      // Someone has already responded to this challenge.
+      delete impi_obj;
+      return false;
+    }
+
+    // Add the challenge and write the IMPI back.  The CAS on the IMPI (and,
+    // when writing AVs, the fact that the challenge is new) means that this
+    // fails with contention if another response to the challenge got there
+    // first, in which case we'll find it when we go round again.
+    impi_obj->auth_challenges.push_back(auth_challenge);
+    status = _impi_store->set_impi(impi_obj, trail);
+
+    // Take the challenge back - the caller still owns it.
+    impi_obj->auth_challenges.pop_back();
+    delete impi_obj;
+  } while (status == Store::DATA_CONTENTION);
+
+  if (status != Store::OK)
+  {
+    TRC_ERROR("Failed to record stateless nonce %s for %s", nonce.c_str(), impi.c_str());
+    return false;
+  }
+
+  if (!_remote_impi_stores.empty())
+  {
+    TRC_DEBUG("Replicate challenge to backup stores");
+
+    for (ImpiStore* store: _remote_impi_stores)
+    {
+      write_challenge_to_store(store, impi, auth_challenge, NULL, trail);
+    }
+  }
+
+  return true;
+}
+
 ImpiStore::Impi* AuthenticationSproutlet::read_impi(const std::string& impi,
                                                     const std::string& nonce,
                                                     SAS::TrailId trail)
@@ -79,78 +79,86 @@ pj_bool_t BasicProxy::on_rx_request(pjsip_rx_data* rdata)
 // immediately, so we need to forward the subsequent 2xx/OK
 // retransmission statelessly.
 pj_bool_t BasicProxy::on_rx_response(pjsip_rx_data *rdata)
+{
+  // Only forward responses to INVITES
+  if (rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD)
+  {
+    forward_response_stateless(rdata);
+  }
+
+  return PJ_TRUE;
+}
+
+
+/// Forwards a response that doesn't match a transaction upstream, to the
+/// address in the Via header below ours.
+void BasicProxy::forward_response_stateless(pjsip_rx_data* rdata)
 {
   pjsip_tx_data *tdata;
   pjsip_response_addr res_addr;
   pjsip_via_hdr *hvia;
   pj_status_t status;
 
-  TRC_DEBUG("Statelessly forwarding late response");
+  TRC_DEBUG("Statelessly forwarding response");
 
-  // Only forward responses to INVITES
-  if (rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD)
+  // Create response to be forwarded upstream (Via will be stripped here)
+  status = PJUtils::create_response_fwd(stack_data.endpt, rdata, 0, &tdata);
+  if (status != PJ_SUCCESS)
   {
-    // Create response to be forwarded upstream (Via will be stripped here)
-    status = PJUtils::create_response_fwd(stack_data.endpt, rdata, 0, &tdata);
-    if (status != PJ_SUCCESS)
-    {
-      // LCOV_EXCL_START
-      TRC_ERROR("Error creating response, %s",
-                PJUtils::pj_status_to_string(status).c_str());
-      return PJ_TRUE;
-      // LCOV_EXCL_STOP
-    }
+    // LCOV_EXCL_START
+    TRC_ERROR("Error creating response, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    return;
+    // LCOV_EXCL_STOP
+  }
 
-    // Get topmost Via header
-    hvia = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
-    if (hvia == NULL)
-    {
-      // Invalid response! Just drop it
-      pjsip_tx_data_dec_ref(tdata);
-      return PJ_TRUE;
-    }
+  // Get topmost Via header
+  hvia = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+  if (hvia == NULL)
+  {
+    // Invalid response! Just drop it
+    pjsip_tx_data_dec_ref(tdata);
+    return;
+  }
 
-    // Calculate the address to forward the response
-    pj_bzero(&res_addr, sizeof(res_addr));
-    res_addr.dst_host.type = pjsip_transport_get_type_from_name(&hvia->transport);
-    res_addr.dst_host.flag =
-                     pjsip_transport_get_flag_from_type(res_addr.dst_host.type);
+  // Calculate the address to forward the response
+  pj_bzero(&res_addr, sizeof(res_addr));
+  res_addr.dst_host.type = pjsip_transport_get_type_from_name(&hvia->transport);
+  res_addr.dst_host.flag =
+                   pjsip_transport_get_flag_from_type(res_addr.dst_host.type);
 
-    // Destination address is Via's received param
-    res_addr.dst_host.addr.host = hvia->recvd_param;
-    if (res_addr.dst_host.addr.host.slen == 0)
-    {
-      // Someone has messed up our Via header!
-      res_addr.dst_host.addr.host = hvia->sent_by.host;
-    }
+  // Destination address is Via's received param
+  res_addr.dst_host.addr.host = hvia->recvd_param;
+  if (res_addr.dst_host.addr.host.slen == 0)
+  {
+    // Someone has messed up our Via header!
+    res_addr.dst_host.addr.host = hvia->sent_by.host;
+  }
 
-    // Destination port is the rport
-    if (hvia->rport_param != 0 && hvia->rport_param != -1)
-    {
-      res_addr.dst_host.addr.port = hvia->rport_param;
-    }
+  // Destination port is the rport
+  if (hvia->rport_param != 0 && hvia->rport_param != -1)
+  {
+    res_addr.dst_host.addr.port = hvia->rport_param;
+  }
 
-    if (res_addr.dst_host.addr.port == 0)
-    {
-      // Ugh, original sender didn't put rport!
-      // At best, can only send the response to the port in Via.
-      res_addr.dst_host.addr.port = hvia->sent_by.port;
-    }
+  if (res_addr.dst_host.addr.port == 0)
+  {
+    // Ugh, original sender didn't put rport!
+    // At best, can only send the response to the port in Via.
+    res_addr.dst_host.addr.port = hvia->sent_by.port;
+  }
 
-    // Forward response
-    status = pjsip_endpt_send_response(stack_data.endpt, &res_addr, tdata, NULL, NULL);
+  // Forward response
+  status = pjsip_endpt_send_response(stack_data.endpt, &res_addr, tdata, NULL, NULL);
 
-    if (status != PJ_SUCCESS)
-    {
-      // LCOV_EXCL_START
-      TRC_ERROR("Error forwarding response, %s",
-                PJUtils::pj_status_to_string(status).c_str());
-      return PJ_TRUE;
-      // LCOV_EXCL_STOP
-    }
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Error forwarding response, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    return;
+    // LCOV_EXCL_STOP
   }
-
-  return PJ_TRUE;
 }
 
 
@@ -416,6 +424,27 @@ BasicProxy::UASTsx* BasicProxy::create_uas_tsx()
 // LCOV_EXCL_STOP
 
 
+BasicProxy::SharedMsgs::~SharedMsgs()
+{
+  for (SmallSet<pjsip_tx_data*, 4>::const_iterator it = _msgs.begin();
+       it != _msgs.end();
+       ++it)
+  {
+    pjsip_tx_data_dec_ref(*it);
+  }
+}
+
+
+void BasicProxy::SharedMsgs::keep(pjsip_tx_data* tdata)
+{
+  if (_msgs.find(tdata) == _msgs.end())
+  {
+    _msgs.insert(tdata);
+    pjsip_tx_data_add_ref(tdata);
+  }
+}
+
+
 /// UAS Transaction constructor
 BasicProxy::UASTsx::UASTsx(BasicProxy* proxy) :
   _proxy(proxy),
@@ -429,6 +458,7 @@ BasicProxy::UASTsx::UASTsx(BasicProxy* proxy) :
   _pending_sends(0),
   _pending_responses(0),
   _final_rsp(NULL),
+  _shared_msgs(),
   _pending_destroy(false),
   _context_count(0)
 {
@@ -888,8 +918,11 @@ pj_status_t BasicProxy::UASTsx::forward_to_targets()
 
   while (!_targets.empty())
   {
+    // Each fork shares the body and headers of the original request, and
+    // only has its own Request-URI and the headers that are added to it.
     TRC_DEBUG("Allocating transaction and data for target");
-    pjsip_tx_data* uac_tdata = PJUtils::clone_tdata(_req);
+    pjsip_tx_data* uac_tdata = PJUtils::clone_msg_sharing_hdrs(stack_data.endpt,
+                                                               _req);
 
     if (uac_tdata == NULL)
     {
@@ -901,6 +934,8 @@ pj_status_t BasicProxy::UASTsx::forward_to_targets()
       // LCOV_EXCL_STOP
     }
 
+    keep_shared_msg(_req);
+
     // Set the target information in the request.
     Target* target = _targets.front();
     _targets.pop_front();
@@ -1432,6 +1467,21 @@ BasicProxy::UACTsx* BasicProxy::UASTsx::create_uac_tsx(size_t index)
 }
 
 
+/// Keeps a message that a request sent by this transaction shares memory
+/// with.  UACTsxs take a reference to the kept messages when they are
+/// created, which is always after the messages their request shares memory
+/// with have been kept.
+void BasicProxy::UASTsx::keep_shared_msg(pjsip_tx_data* tdata)
+{
+  if (_shared_msgs == NULL)
+  {
+    _shared_msgs = std::make_shared<SharedMsgs>();
+  }
+
+  _shared_msgs->keep(tdata);
+}
+
+
 /// Enters this transaction's context.  While in the transaction's
 /// context, it will not be destroyed.  Whenever enter_context is called,
 /// exit_context must be called before the end of the method.
@@ -1525,8 +1575,14 @@ BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
   _index(index),
   _tsx(NULL),
   _tdata(NULL),
+  _shared_msgs(uas_tsx->_shared_msgs),
   _servers(),
   _current_server(0),
+  _resolving(false),
+  _resolved(false),
+  _cancelled(false),
+  _server_stopwatch(),
+  _server_latency_pending(false),
   _cancel_tsx(NULL),
   _timer_c(),
   _trail(0),
@@ -1634,11 +1690,16 @@ pj_status_t BasicProxy::UACTsx::init(pjsip_tx_data* tdata)
   _tdata = tdata;
   pjsip_tx_data_add_ref(_tdata);
 
-  if (tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT)
+  if ((tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT) &&
+      (tdata->msg->line.req.method.id == PJSIP_ACK_METHOD))
   {
     // Resolve the next hop destination for this request to a set of target
-    // servers (IP address/port/transport tuples).
+    // servers (IP address/port/transport tuples).  Other requests are
+    // resolved when they're sent (see send_request), but ACKs aren't
+    // protected by a group lock, so it isn't safe to resume them on another
+    // thread.
     PJUtils::resolve_next_hop(tdata, 0, _servers, trail());
+    _resolved = true;
   }
 
   // Work out whether this UAC transaction is to a stateless proxy.
@@ -1660,12 +1721,79 @@ void BasicProxy::UACTsx::send_request()
 {
   enter_context();
 
+  if ((_tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT) && (!_resolved))
+  {
+    // Resolve the next hop destination for this request to a set of target
+    // servers (IP address/port/transport tuples).  If the servers aren't
+    // known straight away, we send the request once they are, and this
+    // thread is free to process other messages in the meantime.  The
+    // transaction is kept in context until then so it isn't destroyed.
+    _resolving = true;
+    _context_count++;
+
+    if (PJUtils::resolve_next_hop_async(
+          _tdata,
+          0,
+          _servers,
+          trail(),
+          [this](const std::vector<AddrInfo>& servers)
+          {
+            on_next_hop_resolved(servers);
+          }))
+    {
+      _resolving = false;
+      _resolved = true;
+      _context_count--;
+    }
+    else
+    {
+      exit_context();
+      return;
+    }
+  }
+
+  dispatch_request();
+
+  exit_context();
+}
+
+
+/// Called on a worker thread when the next hop for the request has been
+/// resolved asynchronously.
+void BasicProxy::UACTsx::on_next_hop_resolved(const std::vector<AddrInfo>& servers)
+{
+  enter_context();
+
+  // We're now in context, so release the context held during resolution.
+  _context_count--;
+  _resolving = false;
+  _resolved = true;
+  _servers = servers;
+
+  TRC_DEBUG("Resolved next hop to %d servers", _servers.size());
+  dispatch_request();
+
+  exit_context();
+}
+
+
+/// Sends the request to the resolved servers (or pre-selected transport).
+/// Must be called in context.
+void BasicProxy::UACTsx::dispatch_request()
+{
   pj_status_t status = PJ_SUCCESS;
 
   TRC_DEBUG("Sending request for %s",
             PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, _tdata->msg->line.req.uri).c_str());
 
-  if (_tdata->tp_sel.type == PJSIP_TPSELECTOR_TRANSPORT)
+  if ((_cancelled) || (_uas_tsx == NULL))
+  {
+    // The request was cancelled (or the UAS transaction has gone away) while
+    // we were resolving the next hop, so don't send it.
+    TRC_DEBUG("Request cancelled before it was sent");
+    status = PJ_ECANCELLED;
+  }
+  else if (_tdata->tp_sel.type == PJSIP_TPSELECTOR_TRANSPORT)
   {
     // The transport has already been selected for this request, so
     // add it to the transaction otherwise it will get overwritten.
@@ -1701,6 +1829,7 @@ void BasicProxy::UACTsx::send_request()
     else
     {
       // Send non-ACK request statefully.
+      start_server_latency();
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if ((status == PJ_SUCCESS) &&
@@ -1725,24 +1854,49 @@ void BasicProxy::UACTsx::send_request()
     // attempt a retry and do not blacklist the selected destination.
     TRC_DEBUG("Failed to send request (%d %s)",
               status, PJUtils::pj_status_to_string(status).c_str());
+    pjsip_tx_data* rsp = NULL;
+
+    if ((status == PJ_ECANCELLED) &&
+        (_uas_tsx != NULL) &&
+        (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD))
+    {
+      // A cancelled INVITE gets a 487 response, as it would have done from
+      // downstream.
+      if (PJUtils::create_response(stack_data.endpt,
+                                   _tdata,
+                                   PJSIP_SC_REQUEST_TERMINATED,
+                                   NULL,
+                                   &rsp) == PJ_SUCCESS)
+      {
+        // Remove the top Via header (we must do this as we built the response
+        // from a request where we've added an extra Via).
+        pjsip_msg_find_remove_hdr(rsp->msg, PJSIP_H_VIA, NULL);
+      }
+    }
+
     pjsip_tx_data_dec_ref(_tdata);
 
     // The UAC transaction will have been destroyed when it failed to send
     // the request, so there's no need to destroy it.  However, we do need to
     // tell the UAS transaction.
-    if ((_uas_tsx != NULL) &&
-        (_tdata->msg->line.req.method.id != PJSIP_ACK_METHOD))
+    if (rsp != NULL)
+    {
+      _uas_tsx->on_new_client_response(this, rsp);
+    }
+    else if ((_uas_tsx != NULL) &&
+             (_tdata->msg->line.req.method.id != PJSIP_ACK_METHOD))
     {
       // Remove the top Via from the request before reporting the error in
       // case the request is used to build an error response.
       PJUtils::remove_top_via(_tdata);
-      _uas_tsx->on_client_not_responding(this, PJSIP_EVENT_TRANSPORT_ERROR);
+      _uas_tsx->on_client_not_responding(this,
+                                         (status == PJ_ECANCELLED) ?
+                                           PJSIP_EVENT_USER :
+                                           PJSIP_EVENT_TRANSPORT_ERROR);
     }
 
     _pending_destroy = true;
   }
-
-  exit_context();
 }
 
 
@@ -1750,7 +1904,13 @@ void BasicProxy::UACTsx::send_request()
 /// Reason header.
 void BasicProxy::UACTsx::cancel_pending_tsx(int st_code)
 {
-  if (_tsx != NULL)
+  if (_resolving)
+  {
+    // The request hasn't been sent yet, so just make sure it isn't.
+    TRC_DEBUG("Cancel request that is waiting for the next hop to resolve");
+    _cancelled = true;
+  }
+  else if (_tsx != NULL)
   {
     enter_context();
 
@@ -1862,6 +2022,11 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
       stop_timer_c();
     }
 
+    if (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG)
+    {
+      record_server_latency();
+    }
+
     if (!_servers.empty())
     {
       // Check to see if the destination server has failed so we can blacklist
@@ -2084,6 +2249,7 @@ bool BasicProxy::UACTsx::retry_request()
       // Copy across the destination information for a retry and try to
       // resend the request.
       PJUtils::set_dest_info(_tdata, _servers[_current_server]);
+      start_server_latency();
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if (status == PJ_SUCCESS)
@@ -2224,6 +2390,37 @@ void BasicProxy::UACTsx::timer_c_expired()
 }
 
 
+/// Starts timing the response from the current server.
+void BasicProxy::UACTsx::start_server_latency()
+{
+  // We don't time stateless proxies, as their responses come from further
+  // downstream.
+  _server_latency_pending = ((!_stateless_proxy) &&
+                             (_current_server < (int)_servers.size()));
+
+  if (_server_latency_pending)
+  {
+    _server_stopwatch.start();
+  }
+}
+
+
+/// Records how long the current server took to respond, if it hasn't been
+/// recorded already.
+void BasicProxy::UACTsx::record_server_latency()
+{
+  unsigned long latency_us = 0;
+
+  if ((_server_latency_pending) &&
+      (_server_stopwatch.read(latency_us)))
+  {
+    PJUtils::record_server_latency(_servers[_current_server], latency_us);
+  }
+
+  _server_latency_pending = false;
+}
+
+
 /// Static function called when a timer expires.
 void BasicProxy::UACTsx::timer_expired(pj_timer_heap_t *timer_heap,
                                        struct pj_timer_entry *entry)
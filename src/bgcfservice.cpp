@@ -24,6 +24,7 @@
 #include "sprout_pd_definitions.h"
 
 BgcfService::BgcfService(std::string configuration) :
+  _routing_table(std::make_shared<RoutingTable>()),
   _configuration(configuration),
   _updater(NULL)
 {
@@ -32,23 +33,64 @@ BgcfService::BgcfService(std::string configuration) :
 }
 
 void BgcfService::update_routes()
+{
+  std::string db_file = RoutingDb::compiled_path(_configuration);
+  std::shared_ptr<RoutingTable> new_routing_table;
+
+  if (RoutingDb::use_compiled(_configuration, db_file))
+  {
+    new_routing_table = load_db(db_file);
+  }
+
+  if (new_routing_table == NULL)
+  {
+    std::vector<RouteEntry> entries;
+
+    if (!read_json(_configuration, entries))
+    {
+      return;
+    }
+
+    new_routing_table.reset(new RoutingTable());
+
+    for (const RouteEntry& entry : entries)
+    {
+      if (entry.is_domain)
+      {
+        new_routing_table->domain_routes.insert(std::make_pair(entry.key,
+                                                               entry.route));
+      }
+      else
+      {
+        new_routing_table->number_routes.insert(entry.key, entry);
+      }
+    }
+  }
+
+  // Publish the new table.  The old one is freed once every thread that used
+  // it has picked up the new one.
+  _routing_table.set(new_routing_table);
+}
+
+bool BgcfService::read_json(const std::string& configuration,
+                            std::vector<RouteEntry>& entries)
 {
   // Check whether the file exists.
   struct stat s;
-  TRC_DEBUG("stat(%s) returns %d", _configuration.c_str(), stat(_configuration.c_str(), &s));
-  if ((stat(_configuration.c_str(), &s) != 0) &&
+  TRC_DEBUG("stat(%s) returns %d", configuration.c_str(), stat(configuration.c_str(), &s));
+  if ((stat(configuration.c_str(), &s) != 0) &&
       (errno == ENOENT))
   {
     TRC_STATUS("No BGCF configuration (file %s does not exist)",
-               _configuration.c_str());
+               configuration.c_str());
     CL_SPROUT_BGCF_FILE_MISSING.log();
-    return;
+    return false;
   }
 
-  TRC_STATUS("Loading BGCF configuration from %s", _configuration.c_str());
+  TRC_STATUS("Loading BGCF configuration from %s", configuration.c_str());
 
   // Read from the file
-  std::ifstream fs(_configuration.c_str());
+  std::ifstream fs(configuration.c_str());
   std::string bgcf_str((std::istreambuf_iterator<char>(fs)),
                         std::istreambuf_iterator<char>());
 
@@ -56,9 +98,9 @@ void BgcfService::update_routes()
   {
     // LCOV_EXCL_START
     TRC_ERROR("Failed to read BGCF configuration data from %s",
-              _configuration.c_str());
+              configuration.c_str());
     CL_SPROUT_BGCF_FILE_EMPTY.log();
-    return;
+    return false;
     // LCOV_EXCL_STOP
   }
 
@@ -72,14 +114,11 @@ void BgcfService::update_routes()
               bgcf_str.c_str(),
               rapidjson::GetParseError_En(doc.GetParseError()));
     CL_SPROUT_BGCF_FILE_INVALID.log();
-    return;
+    return false;
   }
 
   try
   {
-    std::map<std::string, std::vector<std::string>> new_domain_routes;
-    std::map<std::string, std::vector<std::string>> new_number_routes;
-
     JSON_ASSERT_CONTAINS(doc, "routes");
     JSON_ASSERT_ARRAY(doc["routes"]);
     const rapidjson::Value& routes_arr = doc["routes"];
@@ -99,7 +138,7 @@ void BgcfService::update_routes()
           ((*routes_it).HasMember("route") &&
            (*routes_it)["route"].IsArray()))
       {
-        std::vector<std::string> route_vec;
+        RouteEntry entry;
         const rapidjson::Value& route_arr = (*routes_it)["route"];
 
         for (rapidjson::Value::ConstValueIterator route_it = route_arr.Begin();
@@ -108,7 +147,8 @@ void BgcfService::update_routes()
         {
           std::string route_uri = (*route_it).GetString();
           TRC_DEBUG("  %s", route_uri.c_str());
-          route_vec.push_back(route_uri);
+          entry.route.uris.push_back(route_uri);
+          entry.route.sas_string += route_uri + ";";
         }
 
         std::string routing_value;
@@ -116,17 +156,17 @@ void BgcfService::update_routes()
         if ((*routes_it).HasMember("domain"))
         {
           routing_value = (*routes_it)["domain"].GetString();
-          new_domain_routes.insert(std::make_pair(routing_value, route_vec));
+          entry.is_domain = true;
+          entry.key = routing_value;
         }
         else
         {
           routing_value = (*routes_it)["number"].GetString();
-          new_number_routes.insert(
-                    std::make_pair(PJUtils::remove_visual_separators(routing_value),
-                                   route_vec));
+          entry.is_domain = false;
+          entry.key = PJUtils::remove_visual_separators(routing_value);
         }
 
-        route_vec.clear();
+        entries.push_back(entry);
 
         TRC_DEBUG("Add route for %s", routing_value.c_str());
       }
@@ -136,17 +176,95 @@ void BgcfService::update_routes()
         CL_SPROUT_BGCF_FILE_INVALID.log();
       }
     }
-
-    // Take a write lock on the mutex in RAII style
-    boost::lock_guard<boost::shared_mutex> write_lock(_routes_rw_lock);
-    _domain_routes = new_domain_routes;
-    _number_routes = new_number_routes;
   }
   catch (JsonFormatError err)
   {
     TRC_ERROR("Badly formed BGCF configuration file - missing routes object");
     CL_SPROUT_BGCF_FILE_INVALID.log();
+    return false;
+  }
+
+  return true;
+}
+
+std::shared_ptr<BgcfService::RoutingTable> BgcfService::load_db(
+                                                     const std::string& db_file)
+{
+  RoutingDb* db = RoutingDb::open(db_file, RoutingDb::BGCF);
+
+  if (db == NULL)
+  {
+    TRC_WARNING("Unable to load compiled BGCF routes from %s", db_file.c_str());
+    return NULL;
   }
+
+  std::shared_ptr<RoutingTable> table(new RoutingTable());
+  table->db.reset(db);
+
+  // Each value is a newline separated list of route URIs.
+  for (uint32_t ii = 0; ii < db->num_values(); ++ii)
+  {
+    std::string value = db->value(ii);
+    Route route;
+    size_t start = 0;
+
+    while (start < value.size())
+    {
+      size_t end = value.find('\n', start);
+
+      if (end == std::string::npos)
+      {
+        end = value.size();
+      }
+
+      route.uris.push_back(value.substr(start, end - start));
+      route.sas_string += route.uris.back() + ";";
+      start = end + 1;
+    }
+
+    table->db_routes.push_back(route);
+  }
+
+  TRC_STATUS("Loaded %u number and %u domain BGCF routes from %s",
+             db->num_numbers(), db->num_domains(), db_file.c_str());
+
+  return table;
+}
+
+bool BgcfService::compile(const std::string& json_file,
+                          const std::string& db_file)
+{
+  std::vector<RouteEntry> entries;
+
+  if (!read_json(json_file, entries))
+  {
+    return false;
+  }
+
+  RoutingDb::Builder builder(RoutingDb::BGCF);
+
+  for (const RouteEntry& entry : entries)
+  {
+    std::string value;
+
+    for (const std::string& uri : entry.route.uris)
+    {
+      value += (value.empty() ? "" : "\n") + uri;
+    }
+
+    uint32_t value_index = builder.add_value(value);
+
+    if (entry.is_domain)
+    {
+      builder.add_domain(entry.key, value_index);
+    }
+    else
+    {
+      builder.add_number(entry.key, value_index);
+    }
+  }
+
+  return builder.write(db_file);
 }
 
 BgcfService::~BgcfService()
@@ -156,56 +274,115 @@ BgcfService::~BgcfService()
   _updater = NULL;
 }
 
-std::vector<std::string> BgcfService::get_route_from_domain(
-                                                const std::string &domain,
-                                                SAS::TrailId trail) const
+const BgcfService::Route* BgcfService::RoutingTable::find_domain(
+                                                const std::string& domain) const
 {
-  TRC_DEBUG("Getting route for URI domain %s via BGCF lookup", domain.c_str());
+  if (db != NULL)
+  {
+    uint32_t index = db->find_domain(domain);
+    return (index != RoutingDb::NOT_FOUND) ? &db_routes[index] : NULL;
+  }
+
+  std::unordered_map<std::string, Route>::const_iterator i =
+                                                   domain_routes.find(domain);
+  return (i != domain_routes.end()) ? &i->second : NULL;
+}
+
+const BgcfService::Route* BgcfService::RoutingTable::match_number(
+                                          const std::string& number,
+                                          std::string& matched_prefix) const
+{
+  if (db != NULL)
+  {
+    uint32_t index = db->match_number(number, &matched_prefix);
+    return (index != RoutingDb::NOT_FOUND) ? &db_routes[index] : NULL;
+  }
+
+  // A route matches if either its prefix or the number is a prefix of the
+  // other, and the lexicographically greatest matching prefix wins.  Prefixes
+  // that extend the number sort after those that the number extends, so
+  // check those first, then fall back to the longest prefix of the number.
+  const RouteEntry* entry = number_routes.last_with_prefix(number);
+
+  if (entry == NULL)
+  {
+    entry = number_routes.longest_prefix_match(number);
+  }
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
+  if (entry == NULL)
+  {
+    return NULL;
+  }
 
+  matched_prefix = entry->key;
+  return &entry->route;
+}
+
+const BgcfService::Route* BgcfService::find_domain_route(
+                                                const RoutingTable& table,
+                                                const std::string& domain) const
+{
   // First try the specified domain.
-  std::map<std::string, std::vector<std::string>>::const_iterator i =
-                                                    _domain_routes.find(domain);
-  if (i != _domain_routes.end())
+  const Route* route = table.find_domain(domain);
+
+  if (route != NULL)
   {
     TRC_INFO("Found route to domain %s", domain.c_str());
+    return route;
+  }
 
-    SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE_DOMAIN, 0);
-    event.add_var_param(domain);
-    std::string route_string;
+  // Then try wildcard routes for each parent domain, most specific first.
+  for (size_t dot = domain.find('.');
+       dot != std::string::npos;
+       dot = domain.find('.', dot + 1))
+  {
+    std::string wildcard = "*" + domain.substr(dot);
+    route = table.find_domain(wildcard);
 
-    for (std::vector<std::string>::const_iterator ii = i->second.begin(); ii != i->second.end(); ++ii)
+    if (route != NULL)
     {
-      route_string = route_string + *ii + ";";
+      TRC_INFO("Found route to domain %s via %s",
+               domain.c_str(), wildcard.c_str());
+      return route;
     }
+  }
+
+  return NULL;
+}
 
-    event.add_var_param(route_string);
+std::vector<std::string> BgcfService::get_route_from_domain(
+                                                const std::string &domain,
+                                                SAS::TrailId trail) const
+{
+  TRC_DEBUG("Getting route for URI domain %s via BGCF lookup", domain.c_str());
+
+  const RoutingTable& table = _routing_table.get();
+
+  const Route* route = find_domain_route(table, domain);
+
+  if (route != NULL)
+  {
+    SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE_DOMAIN, 0);
+    event.add_var_param(domain);
+    event.add_var_param(route->sas_string);
     SAS::report_event(event);
 
-    return i->second;
+    return route->uris;
   }
 
   // Then try the default domain (*).
-  i = _domain_routes.find("*");
-  if (i != _domain_routes.end())
+  route = table.find_domain("*");
+
+  if (route != NULL)
   {
     TRC_INFO("Found default route");
 
     SAS::Event event(trail, SASEvent::BGCF_DEFAULT_ROUTE_DOMAIN, 0);
     event.add_var_param(domain);
-    std::string route_string;
-
-    for (std::vector<std::string>::const_iterator ii = i->second.begin(); ii != i->second.end(); ++ii)
-    {
-      route_string = route_string + *ii + ";";
-    }
-
-    event.add_var_param(route_string);
+    event.add_var_param(route->sas_string);
     SAS::report_event(event);
 
-    return i->second;
+    return route->uris;
   }
 
   SAS::Event event(trail, SASEvent::BGCF_NO_ROUTE_DOMAIN, 0);
@@ -219,44 +396,25 @@ std::vector<std::string> BgcfService::get_route_from_number(
                                                 const std::string &number,
                                                 SAS::TrailId trail) const
 {
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
-
-  // The number routes map is ordered by length of key. Start from the end of
-  // the map to get the longest prefixes first.
-  for (std::map<std::string, std::vector<std::string>>::const_reverse_iterator it =
-        _number_routes.rbegin();
-       it != _number_routes.rend();
-       it++)
-  {
-    int len = std::min(number.size(), (*it).first.size());
-
-    if (PJUtils::remove_visual_separators(number).compare(0,
-                                                          len,
-                                                          (*it).first,
-                                                          0,
-                                                          len) == 0)
-    {
-      // Found a match, so return it
-      TRC_DEBUG("Match found. Number: %s, prefix: %s",
-                number.c_str(), (*it).first.c_str());
-
-      SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE_NUMBER, 0);
-      event.add_var_param(number);
-      std::string route_string;
+  const RoutingTable& table = _routing_table.get();
 
-      for (std::vector<std::string>::const_iterator ii = (*it).second.begin();
-                                                    ii != (*it).second.end();
-                                                    ++ii)
-      {
-        route_string = route_string + *ii + ";";
-      }
+  std::string digits = PJUtils::remove_visual_separators(number);
+  std::string matched_prefix;
+  const Route* route = table.match_number(digits, matched_prefix);
 
-      event.add_var_param(route_string);
-      SAS::report_event(event);
+  if (route != NULL)
+  {
+    TRC_DEBUG("Match found. Number: %s, prefix: %s, route: %s",
+              number.c_str(),
+              matched_prefix.c_str(),
+              route->sas_string.c_str());
+
+    SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE_NUMBER, 0);
+    event.add_var_param(number);
+    event.add_var_param(route->sas_string);
+    SAS::report_event(event);
 
-      return (*it).second;
-    }
+    return route->uris;
   }
 
   SAS::Event event(trail, SASEvent::BGCF_NO_ROUTE_NUMBER, 0);
@@ -54,6 +54,23 @@ SproutletTsx* BGCFSproutlet::get_tsx(SproutletHelper* helper,
 }
 
 
+/// The BGCF can route a request statelessly unless it needs to see the
+/// responses (to send ACRs for them), or would have to block the thread on
+/// an ENUM lookup (which is only done without blocking when stateful).
+bool BGCFSproutlet::supports_stateless(const pjsip_msg* req) const
+{
+  if (_acr_factory->sends_acrs())
+  {
+    return false;
+  }
+
+  std::string user;
+  return ((_enum_service == NULL) ||
+          (!_enum_service->is_async()) ||
+          (!PJUtils::should_query_enum((pjsip_msg*)req, true, user)));
+}
+
+
 /// Look up a route from the configured rules.
 ///
 /// @return            - The URIs to route the message on to (in order).
@@ -90,7 +107,10 @@ ACR* BGCFSproutlet::get_acr(SAS::TrailId trail)
 BGCFSproutletTsx::BGCFSproutletTsx(BGCFSproutlet* bgcf) :
   SproutletTsx(bgcf),
   _bgcf(bgcf),
-  _acr(NULL)
+  _acr(NULL),
+  _cancelled(false),
+  _enum_req(NULL),
+  _enum_result()
 {
 }
 
@@ -112,14 +132,76 @@ void BGCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
   _acr = _bgcf->get_acr(trail());
   _acr->rx_request(req);
 
-  std::vector<std::string> bgcf_routes;
-  std::string routing_value;
-  bool routing_with_number = false;
+  // Look up any number portability data for the Request-URI.  If the
+  // lookup is done asynchronously, routing continues when it completes (in
+  // on_timer_expiry).
+  std::string user;
+  if ((_bgcf->_enum_service != NULL) &&
+      (_bgcf->_enum_service->is_async()) &&
+      (PJUtils::should_query_enum(req, true, user)))
+  {
+    std::function<void()> complete = start_async_timer(&_enum_result);
+    if (complete)
+    {
+      TRC_DEBUG("Performing asynchronous ENUM lookup for user %s", user.c_str());
+      _enum_req = req;
+      std::string* result = &_enum_result;
+      _bgcf->_enum_service->lookup_uri_from_user_async(
+        user,
+        trail(),
+        [result, complete](const std::string& uri)
+        {
+          // The transaction (and so the result string) is kept alive until
+          // the completion function is called.
+          *result = uri;
+          complete();
+        });
+      return;
+    }
+  }
+
   PJUtils::update_request_uri_np_data(req,
                                       get_pool(req),
                                       _bgcf->_enum_service,
                                       _bgcf->_override_npdi,
                                       trail());
+  route_request(req);
+}
+
+
+/// Handles the completion of an asynchronous ENUM lookup.
+void BGCFSproutletTsx::on_timer_expiry(void* context)
+{
+  pjsip_msg* req = _enum_req;
+  _enum_req = NULL;
+
+  if (_cancelled)
+  {
+    // The request was cancelled while the lookup was in progress, so there's
+    // no point routing it.
+    TRC_DEBUG("Request cancelled during ENUM lookup");
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TERMINATED);
+    send_response(rsp);
+    free_msg(req);
+    return;
+  }
+
+  PJUtils::apply_enum_result(req,
+                             get_pool(req),
+                             _enum_result,
+                             true,
+                             _bgcf->_override_npdi,
+                             trail());
+  route_request(req);
+}
+
+
+/// Routes a request using the configured BGCF routes.
+void BGCFSproutletTsx::route_request(pjsip_msg* req)
+{
+  std::vector<std::string> bgcf_routes;
+  std::string routing_value;
+  bool routing_with_number = false;
   pjsip_uri* req_uri = (pjsip_uri*)req->line.req.uri;
   URIClass uri_class = URIClassifier::classify_uri(req_uri);
 
@@ -262,9 +344,10 @@ void BGCFSproutletTsx::on_tx_response(pjsip_msg* rsp)
 }
 
 
-// LCOV_EXCL_START - TODO add to UTs
 void BGCFSproutletTsx::on_rx_cancel(int status_code, pjsip_msg* cancel_req)
 {
+  _cancelled = true;
+
   if ((status_code == PJSIP_SC_REQUEST_TERMINATED) &&
       (cancel_req != NULL))
   {
@@ -278,4 +361,3 @@ void BGCFSproutletTsx::on_rx_cancel(int status_code, pjsip_msg* cancel_req)
     delete acr;
   }
 }
-// LCOV_EXCL_STOP
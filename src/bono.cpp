@@ -89,6 +89,7 @@ extern "C" {
 #include "bgcfservice.h"
 #include "sip_connection_pool.h"
 #include "flowtable.h"
+#include "ip_prefix_trie.h"
 #include "trustboundary.h"
 #include "sessioncase.h"
 #include "ifchandler.h"
@@ -122,6 +123,8 @@ static SIPConnectionPool* upstream_conn_pool = NULL;
 
 static SNMP::IPCountTable* sprout_ip_tbl = NULL;
 static SNMP::U32Scalar* flow_count = NULL;
+static SNMP::U32Scalar* flow_lock_acquisitions = NULL;
+static SNMP::U32Scalar* flow_lock_contentions = NULL;
 
 static FlowTable* flow_table;
 static DialogTracker* dialog_tracker;
@@ -133,8 +136,8 @@ static bool icscf = false;
 static bool scscf = false;
 static bool allow_emergency_reg = false;
 
-PJUtils::host_list_t trusted_hosts(&PJUtils::compare_pj_sockaddr);
-PJUtils::host_list_t pbx_hosts(&PJUtils::compare_pj_sockaddr);
+IPPrefixTrie trusted_hosts;
+IPPrefixTrie pbx_hosts;
 std::string pbx_service_route;
 
 //
@@ -1479,14 +1482,9 @@ int proxy_process_access_routing(pjsip_rx_data *rdata,
 /// known, not that we trust any headers it sets.
 static bool is_pbx(const pj_sockaddr& addr)
 {
-  // Check whether the source IP address of the message is in the list of
-  // trusted hosts.  Zero out the source port before doing the search.
-  pj_sockaddr sockaddr;
-  pj_sockaddr_cp(&sockaddr, &addr);
-  pj_sockaddr_set_port(&sockaddr, 0);
-  PJUtils::host_list_t::const_iterator i = pbx_hosts.find(sockaddr);
-
-  return (i != pbx_hosts.end());
+  // Check whether the IP address is in one of the PBX subnets.  The port is
+  // ignored.
+  return pbx_hosts.contains(addr);
 }
 
 
@@ -1495,14 +1493,9 @@ static bool is_pbx(const pj_sockaddr& addr)
 /// known, not that we trust any headers it sets.
 static bool ibcf_trusted_peer(const pj_sockaddr& addr)
 {
-  // Check whether the source IP address of the message is in the list of
-  // trusted hosts.  Zero out the source port before doing the search.
-  pj_sockaddr sockaddr;
-  pj_sockaddr_cp(&sockaddr, &addr);
-  pj_sockaddr_set_port(&sockaddr, 0);
-  PJUtils::host_list_t::const_iterator i = trusted_hosts.find(sockaddr);
-
-  return (i != trusted_hosts.end());
+  // Check whether the IP address is in one of the trusted subnets.  The port
+  // is ignored.
+  return trusted_hosts.contains(addr);
 }
 
 
@@ -2460,9 +2453,10 @@ pj_status_t UASTransaction::init_uac_transactions(TargetList& targets)
          it != targets.end();
          ++it)
     {
-      // First UAC transaction can use existing tdata, others must clone.
+      // Each fork shares the body and headers of the original request, and
+      // only has its own Request-URI and the headers that are added to it.
       TRC_DEBUG("Allocating transaction and data for target %d", ii);
-      uac_tdata = PJUtils::clone_tdata(_req);
+      uac_tdata = PJUtils::clone_msg_sharing_hdrs(stack_data.endpt, _req);
       PJUtils::add_top_via(uac_tdata);
 
       // Copy the targets onto the tdata as Route headers at this
@@ -2493,6 +2487,8 @@ pj_status_t UASTransaction::init_uac_transactions(TargetList& targets)
 
       // Attach data to the UAC transaction.
       uac_data = new UACTransaction(this, ii, uac_tsx, uac_tdata);
+      uac_data->_shared_req = _req;
+      pjsip_tx_data_add_ref(_req);
       _uac_data[ii] = uac_data;
       ii++;
     }
@@ -2612,6 +2608,7 @@ UACTransaction::UACTransaction(UASTransaction* uas_data,
   _target(target),
   _tsx(tsx),
   _tdata(tdata),
+  _shared_req(NULL),
   _from_store(false),
   _aor(),
   _binding_id(),
@@ -2655,6 +2652,12 @@ UACTransaction::~UACTransaction()
     _tdata = NULL;
   }
 
+  if (_shared_req != NULL)
+  {
+    pjsip_tx_data_dec_ref(_shared_req);
+    _shared_req = NULL;
+  }
+
   if (_liveness_timer.id == LIVENESS_TIMER)
   {
     // The liveness timer is running, so cancel it.
@@ -3252,7 +3255,14 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
   // and handle access proxy quiescing.
   flow_count = new SNMP::U32Scalar("bono_connected_clients",
                                    ".1.2.826.0.1.1578918.9.2.1");
-  flow_table = new FlowTable(quiescing_manager, flow_count);
+  flow_lock_acquisitions = new SNMP::U32Scalar("bono_flow_table_lock_acquisitions",
+                                               ".1.2.826.0.1.1578918.9.2.7");
+  flow_lock_contentions = new SNMP::U32Scalar("bono_flow_table_lock_contentions",
+                                              ".1.2.826.0.1.1578918.9.2.8");
+  flow_table = new FlowTable(quiescing_manager,
+                             flow_count,
+                             flow_lock_acquisitions,
+                             flow_lock_contentions);
   quiescing_manager->register_flows_handler(flow_table);
 
   // Create a dialog tracker to count dialogs on each flow
@@ -3286,18 +3296,12 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
         i != hosts.end();
         ++i)
     {
-      pj_str_t host;
-      pj_cstr(&host, (*i).c_str());
-      pj_sockaddr sockaddr;
-      pj_status_t status = pj_sockaddr_parse(pj_AF_UNSPEC(), 0, &host, &sockaddr);
-      if (status != PJ_SUCCESS)
+      if (!trusted_hosts.insert(*i))
       {
-        TRC_ERROR("Badly formatted trusted host %.*s", host.slen, host.ptr);
-        return status;
+        TRC_ERROR("Badly formatted trusted host %s", (*i).c_str());
+        return PJ_EINVAL;
       }
-      char buf[100];
-      TRC_STATUS("Adding host %s to list", pj_sockaddr_print(&sockaddr, buf, sizeof(buf), 1));
-      trusted_hosts.insert(std::make_pair(sockaddr, true));
+      TRC_STATUS("Adding host %s to list", (*i).c_str());
     }
   }
 
@@ -3308,18 +3312,12 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
        i != hosts.end();
        ++i)
   {
-    pj_str_t host;
-    pj_cstr(&host, (*i).c_str());
-    pj_sockaddr sockaddr;
-    pj_status_t status = pj_sockaddr_parse(pj_AF_UNSPEC(), 0, &host, &sockaddr);
-    if (status != PJ_SUCCESS)
+    if (!pbx_hosts.insert(*i))
     {
-      TRC_ERROR("Badly formatted PBX IP %.*s", host.slen, host.ptr);
-      return status;
+      TRC_ERROR("Badly formatted PBX IP %s", (*i).c_str());
+      return PJ_EINVAL;
     }
-    char buf[100];
-    TRC_STATUS("Adding PBX %s to list", pj_sockaddr_print(&sockaddr, buf, sizeof(buf), 1));
-    pbx_hosts.insert(std::make_pair(sockaddr, true));
+    TRC_STATUS("Adding PBX %s to list", (*i).c_str());
   }
 
   // If present, check the PBX service route is valid.
@@ -3365,11 +3363,15 @@ void destroy_stateful_proxy()
   delete upstream_conn_pool; upstream_conn_pool = NULL;
   delete sprout_ip_tbl; sprout_ip_tbl = NULL;
 
-  // Destroy the flow table.
-  delete flow_count;
-  flow_count = NULL;
+  // Destroy the flow table, and then the statistics it reports to.
   delete flow_table;
   flow_table = NULL;
+  delete flow_count;
+  flow_count = NULL;
+  delete flow_lock_acquisitions;
+  flow_lock_acquisitions = NULL;
+  delete flow_lock_contentions;
+  flow_lock_contentions = NULL;
 
   delete dialog_tracker;
   dialog_tracker = NULL;
@@ -0,0 +1,157 @@
+/**
+ * @file digest_av_cache.cpp  Per-node cache of SIP digest authentication vectors.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "digest_av_cache.h"
+
+DigestAvCache::DigestAvCache(int ttl,
+                             SNMP::CounterTable* hits_tbl,
+                             SNMP::CounterTable* misses_tbl) :
+  _ttl(ttl),
+  _next_purge(time(NULL) + ttl),
+  _hits(0),
+  _misses(0),
+  _hits_tbl(hits_tbl),
+  _misses_tbl(misses_tbl)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+DigestAvCache::~DigestAvCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool DigestAvCache::get(const std::string& impi,
+                        const std::string& impu,
+                        const std::string& realm,
+                        Av& av)
+{
+  bool found = false;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, std::map<std::string, Entry>>::iterator impi_it =
+                                                         _entries.find(impi);
+  if (impi_it != _entries.end())
+  {
+    std::map<std::string, Entry>::iterator entry_it =
+                                       impi_it->second.find(impu + '\0' + realm);
+    if (entry_it != impi_it->second.end())
+    {
+      if (entry_it->second.expires > now)
+      {
+        av = entry_it->second.av;
+        found = true;
+      }
+      else
+      {
+        impi_it->second.erase(entry_it);
+        if (impi_it->second.empty())
+        {
+          _entries.erase(impi_it);
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (found)
+  {
+    TRC_DEBUG("Found cached digest AV for impi=%s impu=%s",
+              impi.c_str(), impu.c_str());
+    _hits++;
+    if (_hits_tbl != NULL)
+    {
+      _hits_tbl->increment();
+    }
+  }
+  else
+  {
+    _misses++;
+    if (_misses_tbl != NULL)
+    {
+      _misses_tbl->increment();
+    }
+  }
+
+  return found;
+}
+
+void DigestAvCache::add(const std::string& impi,
+                        const std::string& impu,
+                        const std::string& realm,
+                        const Av& av)
+{
+  time_t now = time(NULL);
+  TRC_DEBUG("Caching digest AV for impi=%s impu=%s for %ds",
+            impi.c_str(), impu.c_str(), _ttl);
+
+  pthread_mutex_lock(&_lock);
+
+  Entry& entry = _entries[impi][impu + '\0' + realm];
+  entry.av = av;
+  entry.expires = now + _ttl;
+
+  // Entries are only removed on lookup if they're looked up again, so
+  // periodically sweep the whole cache so that it doesn't grow without bound.
+  if (now >= _next_purge)
+  {
+    purge_expired(now);
+    _next_purge = now + _ttl;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void DigestAvCache::invalidate(const std::string& impi)
+{
+  pthread_mutex_lock(&_lock);
+  size_t erased = _entries.erase(impi);
+  pthread_mutex_unlock(&_lock);
+
+  if (erased > 0)
+  {
+    TRC_DEBUG("Invalidated cached digest AVs for impi=%s", impi.c_str());
+  }
+}
+
+void DigestAvCache::purge_expired(time_t now)
+{
+  std::map<std::string, std::map<std::string, Entry>>::iterator impi_it =
+                                                            _entries.begin();
+  while (impi_it != _entries.end())
+  {
+    std::map<std::string, Entry>::iterator entry_it = impi_it->second.begin();
+    while (entry_it != impi_it->second.end())
+    {
+      if (entry_it->second.expires <= now)
+      {
+        impi_it->second.erase(entry_it++);
+      }
+      else
+      {
+        ++entry_it;
+      }
+    }
+
+    if (impi_it->second.empty())
+    {
+      _entries.erase(impi_it++);
+    }
+    else
+    {
+      ++impi_it;
+    }
+  }
+}
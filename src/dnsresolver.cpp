@@ -29,7 +29,8 @@ DNSResolver::DNSResolver(const std::vector<struct IP46Address>& servers) :
                          _trail(0),
                          _domain(""),
                          _status(ARES_SUCCESS),
-                         _naptr_reply(NULL)
+                         _naptr_reply(NULL),
+                         _ttl(0)
 {
   // Set options to ensure we always get a response as quickly as possible -
   // we are on the call path!
@@ -104,18 +105,20 @@ void DNSResolver::destroy(DNSResolver* resolver)
 }
 
 
-int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail)
+int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail)
 {
   send_naptr_query(domain, trail);
   wait_for_response();
 
   // Save off the results...
   naptr_reply = _naptr_reply;
+  ttl = _ttl;
   int status = _status;
   // ...and then clear out our state.
   _trail = 0;
   _domain = "";
   _naptr_reply = NULL;
+  _ttl = 0;
   _status = ARES_SUCCESS;
 
   return status;
@@ -245,6 +248,12 @@ void DNSResolver::ares_callback(int status,
     {
       TRC_WARNING("Unparseable DNS ENUM response from host %s: %s", _domain.c_str(), ares_strerror(status));
     }
+    else
+    {
+      // ares_parse_naptr_reply doesn't return the TTLs, so find them
+      // ourselves.
+      _ttl = min_naptr_ttl(abuf, alen);
+    }
   }
   else
   {
@@ -259,7 +268,85 @@ void DNSResolver::ares_callback(int status,
 }
 
 
+int DNSResolver::min_naptr_ttl(const unsigned char* abuf, int alen)
+{
+  if (alen < NS_HFIXEDSZ)
+  {
+    return 0; // LCOV_EXCL_LINE
+  }
+
+  const unsigned char* aend = abuf + alen;
+  const unsigned char* aptr = abuf + 4;
+  int qdcount;
+  int ancount;
+  NS_GET16(qdcount, aptr);
+  NS_GET16(ancount, aptr);
+  aptr = abuf + NS_HFIXEDSZ;
+
+  // Skip over the questions.
+  for (int ii = 0; ii < qdcount; ii++)
+  {
+    char* name;
+    long len;
+
+    if ((ares_expand_name(aptr, abuf, alen, &name, &len) != ARES_SUCCESS) ||
+        (aptr + len + NS_QFIXEDSZ > aend))
+    {
+      return 0; // LCOV_EXCL_LINE
+    }
+
+    ares_free_string(name);
+    aptr += len + NS_QFIXEDSZ;
+  }
+
+  int min_ttl = -1;
+
+  for (int ii = 0; ii < ancount; ii++)
+  {
+    char* name;
+    long len;
+
+    if ((ares_expand_name(aptr, abuf, alen, &name, &len) != ARES_SUCCESS) ||
+        (aptr + len + NS_RRFIXEDSZ > aend))
+    {
+      return 0; // LCOV_EXCL_LINE
+    }
+
+    ares_free_string(name);
+    aptr += len;
+
+    int type;
+    int cls;
+    uint32_t ttl;
+    int rdlen;
+    NS_GET16(type, aptr);
+    NS_GET16(cls, aptr);
+    NS_GET32(ttl, aptr);
+    NS_GET16(rdlen, aptr);
+    aptr += rdlen;
+    (void)cls;
+
+    // TTLs are only meaningful up to 2^31 - 1 (RFC 2181).
+    int rr_ttl = (int)(ttl & 0x7FFFFFFF);
+
+    if ((type == ns_t_naptr) &&
+        ((min_ttl < 0) || (rr_ttl < min_ttl)))
+    {
+      min_ttl = rr_ttl;
+    }
+  }
+
+  return (min_ttl < 0) ? 0 : min_ttl;
+}
+
+
 DNSResolver* DNSResolverFactory::new_resolver(const std::vector<struct IP46Address>& servers) const
 {
   return new DNSResolver(servers);
 }
+
+
+AsyncDNSResolver* DNSResolverFactory::new_async_resolver(const std::vector<struct IP46Address>& servers) const
+{
+  return new AsyncDNSResolver(servers);
+}
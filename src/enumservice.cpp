@@ -30,8 +30,14 @@
 #include "sprout_pd_definitions.h"
 
 
-const boost::regex EnumService::CHARS_TO_STRIP_FROM_UAS = boost::regex("([^0-9+]|(?<=.)[^0-9])");
-const boost::regex DNSEnumService::CHARS_TO_STRIP_FROM_DOMAIN = boost::regex("[^0-9]");
+
+void EnumService::lookup_uri_from_user_async(const std::string& user,
+                                             SAS::TrailId trail,
+                                             LookupCallback callback) const
+{
+  // By default, just do the lookup synchronously.
+  callback(lookup_uri_from_user(user, trail));
+}
 
 std::string DummyEnumService::lookup_uri_from_user(const std::string &user, SAS::TrailId trail) const
 {
@@ -94,6 +100,7 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
 
 
 JSONEnumService::JSONEnumService(std::string configuration):
+  _number_prefixes(std::make_shared<NumberPrefixes>()),
   _configuration(configuration),
   _updater(NULL)
 {
@@ -103,22 +110,56 @@ JSONEnumService::JSONEnumService(std::string configuration):
 }
 
 void JSONEnumService::update_enum()
+{
+  std::string db_file = RoutingDb::compiled_path(_configuration);
+  std::shared_ptr<NumberPrefixes> new_number_prefixes;
+
+  if (RoutingDb::use_compiled(_configuration, db_file))
+  {
+    new_number_prefixes = load_db(db_file);
+  }
+
+  if (new_number_prefixes == NULL)
+  {
+    std::vector<NumberPrefix> number_prefixes;
+
+    if (!read_json(_configuration, number_prefixes))
+    {
+      return;
+    }
+
+    // Build a trie so we can match numbers to the most specific prefixes.
+    new_number_prefixes.reset(new NumberPrefixes());
+
+    for (const NumberPrefix& pfix : number_prefixes)
+    {
+      new_number_prefixes->prefix_trie.insert(pfix.prefix, pfix);
+    }
+  }
+
+  // Publish the new prefixes.  The old ones are freed once every thread that
+  // used them has picked up the new ones.
+  _number_prefixes.set(new_number_prefixes);
+}
+
+bool JSONEnumService::read_json(const std::string& configuration,
+                                std::vector<NumberPrefix>& number_prefixes)
 {
   // Check whether the file exists.
   struct stat s;
-  if ((stat(_configuration.c_str(), &s) != 0) &&
+  if ((stat(configuration.c_str(), &s) != 0) &&
       (errno == ENOENT))
   {
     TRC_STATUS("No ENUM configuration (file %s does not exist)",
-               _configuration.c_str());
-    CL_SPROUT_ENUM_FILE_MISSING.log(_configuration.c_str());
-    return;
+               configuration.c_str());
+    CL_SPROUT_ENUM_FILE_MISSING.log(configuration.c_str());
+    return false;
   }
 
-  TRC_STATUS("Loading ENUM configuration from %s", _configuration.c_str());
+  TRC_STATUS("Loading ENUM configuration from %s", configuration.c_str());
 
   // Read from the file
-  std::ifstream fs(_configuration.c_str());
+  std::ifstream fs(configuration.c_str());
   std::string enum_str((std::istreambuf_iterator<char>(fs)),
                         std::istreambuf_iterator<char>());
 
@@ -126,9 +167,9 @@ void JSONEnumService::update_enum()
   {
     // LCOV_EXCL_START
     TRC_ERROR("Failed to read ENUM configuration data from %s",
-              _configuration.c_str());
-    CL_SPROUT_ENUM_FILE_EMPTY.log(_configuration.c_str());
-    return;
+              configuration.c_str());
+    CL_SPROUT_ENUM_FILE_EMPTY.log(configuration.c_str());
+    return false;
     // LCOV_EXCL_STOP
   }
 
@@ -141,15 +182,12 @@ void JSONEnumService::update_enum()
     TRC_ERROR("Failed to read ENUM configuration data: %s\nError: %s",
               enum_str.c_str(),
               rapidjson::GetParseError_En(doc.GetParseError()));
-    CL_SPROUT_ENUM_FILE_INVALID.log(_configuration.c_str());
-    return;
+    CL_SPROUT_ENUM_FILE_INVALID.log(configuration.c_str());
+    return false;
   }
 
   try
   {
-    std::vector<NumberPrefix> new_number_prefixes;
-    std::map<std::string, NumberPrefix> new_prefix_regex_map;
-
     JSON_ASSERT_CONTAINS(doc, "number_blocks");
     JSON_ASSERT_ARRAY(doc["number_blocks"]);
     const rapidjson::Value& nb_arr = doc["number_blocks"];
@@ -170,14 +208,12 @@ void JSONEnumService::update_enum()
         NumberPrefix pfix;
         prefix = PJUtils::remove_visual_separators(prefix);
         pfix.prefix = prefix;
+        pfix.regex = regex;
 
         if (parse_regex_replace(regex, pfix.match, pfix.replace))
         {
-          // Create an array in order of entries in json file, and a map
-          // (automatically sorted in order of key length) so we can later
-          // match numbers to the most specific prefixes
-          new_number_prefixes.push_back(pfix);
-          new_prefix_regex_map.insert(std::make_pair(prefix, pfix));
+          // Create an array in order of entries in json file.
+          number_prefixes.push_back(pfix);
           TRC_STATUS("  Adding number prefix %s, regex=%s",
                      pfix.prefix.c_str(), regex.c_str());
         }
@@ -192,20 +228,76 @@ void JSONEnumService::update_enum()
         // Badly formed number block.
         TRC_WARNING("Badly formed ENUM number block (hit error at %s:%d)",
                     err._file, err._line);
-        CL_SPROUT_ENUM_FILE_INVALID.log(_configuration.c_str());
+        CL_SPROUT_ENUM_FILE_INVALID.log(configuration.c_str());
       }
     }
-
-    // Take a write lock on the mutex in RAII style
-    boost::lock_guard<boost::shared_mutex> write_lock(_number_prefixes_rw_lock);
-    _number_prefixes = new_number_prefixes;
-    _prefix_regex_map = new_prefix_regex_map;
   }
   catch (JsonFormatError err)
   {
     TRC_ERROR("Badly formed ENUM configuration data - missing number_blocks object");
-    CL_SPROUT_ENUM_FILE_INVALID.log(_configuration.c_str());
+    CL_SPROUT_ENUM_FILE_INVALID.log(configuration.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+std::shared_ptr<JSONEnumService::NumberPrefixes> JSONEnumService::load_db(
+                                                     const std::string& db_file)
+{
+  RoutingDb* db = RoutingDb::open(db_file, RoutingDb::ENUM);
+
+  if (db == NULL)
+  {
+    TRC_WARNING("Unable to load compiled ENUM configuration from %s",
+                db_file.c_str());
+    return NULL;
+  }
+
+  std::shared_ptr<NumberPrefixes> number_prefixes(new NumberPrefixes());
+  number_prefixes->db.reset(db);
+
+  // Each value is a !<regex>!<replace>! rule.  There are typically far fewer
+  // of these than number prefixes, so parse them all up front.
+  number_prefixes->db_rules.resize(db->num_values());
+
+  for (uint32_t ii = 0; ii < db->num_values(); ++ii)
+  {
+    NumberPrefix& pfix = number_prefixes->db_rules[ii];
+    pfix.regex = db->value(ii);
+
+    if (!parse_regex_replace(pfix.regex, pfix.match, pfix.replace))
+    {
+      TRC_WARNING("Badly formed regular expression %s in %s",
+                  pfix.regex.c_str(), db_file.c_str());
+      return NULL;
+    }
   }
+
+  TRC_STATUS("Loaded %u ENUM number prefixes from %s",
+             db->num_numbers(), db_file.c_str());
+
+  return number_prefixes;
+}
+
+bool JSONEnumService::compile(const std::string& json_file,
+                              const std::string& db_file)
+{
+  std::vector<NumberPrefix> number_prefixes;
+
+  if (!read_json(json_file, number_prefixes))
+  {
+    return false;
+  }
+
+  RoutingDb::Builder builder(RoutingDb::ENUM);
+
+  for (const NumberPrefix& pfix : number_prefixes)
+  {
+    builder.add_number(pfix.prefix, builder.add_value(pfix.regex));
+  }
+
+  return builder.write(db_file);
 }
 
 
@@ -230,10 +322,14 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 
   std::string aus = user_to_aus(user);
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_number_prefixes_rw_lock);
+  // The matching prefix stays valid until this thread next reads the
+  // prefixes.
+  const NumberPrefixes& number_prefixes = _number_prefixes.get();
 
-  const struct NumberPrefix* pfix = prefix_match(aus);
+  std::string matched_prefix;
+  const struct NumberPrefix* pfix = prefix_match(number_prefixes,
+                                                 aus,
+                                                 matched_prefix);
 
   if (pfix == NULL)
   {
@@ -260,7 +356,8 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
     // LCOV_EXCL_STOP
   }
 
-  TRC_INFO("Number %s found, translated URI = %s", user.c_str(), uri.c_str());
+  TRC_INFO("Number %s found (prefix %s), translated URI = %s",
+           user.c_str(), matched_prefix.c_str(), uri.c_str());
   SAS::Event event(trail, SASEvent::ENUM_COMPLETE, 0);
   event.add_var_param(user);
   event.add_var_param(uri);
@@ -270,44 +367,72 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 }
 
 
-// This function returns a pointer to a struct that may be destroyed by the
-// updater. Callers must therefore ensure that they have the read lock before
-// calling this function and only release the lock once they no longer need
-// the object.
-const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(const std::string& number) const
+const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(
+                                       const NumberPrefixes& number_prefixes,
+                                       const std::string& number,
+                                       std::string& matched_prefix)
 {
-  // Iterate through map in reverse order (already sorted by key length during 
-  // construction) to find the most specific matching prefix
-  for (std::map<std::string, NumberPrefix>::const_reverse_iterator it = 
-                                                     _prefix_regex_map.rbegin();
-       it != _prefix_regex_map.rend();
-       it++)
+  // Strip visual separators once up front, rather than for every prefix.
+  std::string digits = PJUtils::remove_visual_separators(number);
+  const NumberPrefix* pfix = NULL;
+
+  if (number_prefixes.db != NULL)
+  {
+    uint32_t index = number_prefixes.db->match_number(digits, &matched_prefix);
+
+    if (index != RoutingDb::NOT_FOUND)
+    {
+      pfix = &number_prefixes.db_rules[index];
+    }
+  }
+  else
   {
-    int len = std::min(number.size(), (*it).first.size());
+    // A prefix matches if either it or the number is a prefix of the other,
+    // and the lexicographically greatest matching prefix wins.  Prefixes that
+    // extend the number sort after those that the number extends, so check
+    // those first, then fall back to the longest prefix of the number.
+    pfix = number_prefixes.prefix_trie.last_with_prefix(digits);
 
-    TRC_DEBUG("Comparing first %d numbers of %s against prefix %s",
-              len, number.c_str(), (*it).first.c_str());
+    if (pfix == NULL)
+    {
+      pfix = number_prefixes.prefix_trie.longest_prefix_match(digits);
+    }
 
-    if (PJUtils::remove_visual_separators(number).
-                                      compare(0, len, (*it).first, 0, len) == 0)
+    if (pfix != NULL)
     {
-      // Found a match, so return it. 
-      TRC_DEBUG("Match found");
-      return &((*it).second);
+      matched_prefix = pfix->prefix;
     }
   }
 
-  return NULL;
+  if (pfix != NULL)
+  {
+    TRC_DEBUG("Number %s matches prefix %s",
+              digits.c_str(), matched_prefix.c_str());
+  }
+
+  return pfix;
 }
 
 DNSEnumService::DNSEnumService(const std::vector<std::string>& dns_servers,
                                const std::string& dns_suffix,
                                const DNSResolverFactory* resolver_factory,
-                               CommunicationMonitor* comm_monitor) :
+                               CommunicationMonitor* comm_monitor,
+                               int negative_cache_ttl,
+                               SNMP::CounterTable* cache_hits_tbl,
+                               SNMP::CounterTable* cache_misses_tbl) :
                                _dns_suffix(dns_suffix),
                                _resolver_factory(resolver_factory),
-                               _comm_monitor(comm_monitor)
+                               _async_resolver(NULL),
+                               _comm_monitor(comm_monitor),
+                               _negative_cache_ttl(negative_cache_ttl),
+                               _next_cache_purge(time(NULL) + CACHE_PURGE_INTERVAL),
+                               _cache_hits(0),
+                               _cache_misses(0),
+                               _cache_hits_tbl(cache_hits_tbl),
+                               _cache_misses_tbl(cache_misses_tbl)
 {
+  pthread_mutex_init(&_cache_lock, NULL);
+
   // Initialize the ares library.  This might have already been done by curl
   // but it's safe to do it twice.
   ares_library_init(ARES_LIB_INIT_ALL);
@@ -357,6 +482,11 @@ DNSEnumService::DNSEnumService(const std::vector<std::string>& dns_servers,
 
 DNSEnumService::~DNSEnumService()
 {
+  // Stop the event loop first, as any lookups it completes call back into
+  // this service.
+  delete _async_resolver;
+  _async_resolver = NULL;
+
   // Clean up this thread's connection now, rather than waiting for
   // pthread_exit.  This is to support use by single-threaded code
   // (e.g., UTs), where pthread_exit is never called.
@@ -369,6 +499,25 @@ DNSEnumService::~DNSEnumService()
 
   delete _resolver_factory;
   _resolver_factory = NULL;
+
+  pthread_mutex_destroy(&_cache_lock);
+}
+
+
+DNSEnumService::Lookup::Lookup(const std::string& user,
+                               SAS::TrailId trail,
+                               LookupCallback callback) :
+  user(user),
+  aus(user_to_aus(user)),
+  string(aus),
+  complete(false),
+  failed(false),
+  server_failed(false),
+  queried(false),
+  dns_queries(0),
+  trail(trail),
+  callback(callback)
+{
 }
 
 
@@ -385,111 +534,178 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
   event.add_var_param(user);
   SAS::report_event(event);
 
-  // Determine the Application Unique String (AUS) from the user.  This is
-  // used to form the first key, and also as the input into the regular
-  // expressions.
-  std::string aus = user_to_aus(user);
-  std::string string = aus;
-  // Get the resolver to use.  This comes from thread-local data.
-  DNSResolver* resolver = get_resolver();
   // Spin round until we've finished (successfully or otherwise) or we've done
   // the maximum number of queries.
-  bool complete = false;
-  bool failed = false;
-  bool server_failed = false;
-  int dns_queries = 0;
-  while ((!complete) &&
-         (!failed) &&
-         (dns_queries < MAX_DNS_QUERIES))
-  {
-    // Translate the key into a domain and issue a query for it.
-    std::string domain = key_to_domain(string);
-    struct ares_naptr_reply* naptr_reply = NULL;
-    int status = resolver->perform_naptr_query(domain, naptr_reply, trail);
-    if (status == ARES_SUCCESS)
+  Lookup lookup(user, trail, NULL);
+  while (lookup.in_progress())
+  {
+    // Translate the key into a domain and get the rules for it.
+    std::string domain = key_to_domain(lookup.string);
+    std::shared_ptr<const std::vector<Rule>> rules;
+    int status;
+
+    if (!get_cached_rules(domain, status, rules))
     {
-      // Parse the reply into a sorted list of rules.
-      std::vector<Rule> rules;
-      parse_naptr_reply(naptr_reply, rules);
-      // Now spin through the rules, looking for the first match.
-      std::vector<DNSEnumService::Rule>::const_iterator rule;
-      for (rule = rules.begin();
-           rule != rules.end();
-           ++rule)
+      // Not in the cache, so issue a query using the resolver for this
+      // thread.
+      DNSResolver* resolver = get_resolver();
+      struct ares_naptr_reply* naptr_reply = NULL;
+      int ttl = 0;
+      status = resolver->perform_naptr_query(domain, naptr_reply, ttl, trail);
+      lookup.queried = true;
+      rules = store_rules(domain, status, naptr_reply, ttl);
+
+      // Free off the NAPTR reply if we have one.
+      if (naptr_reply != NULL)
       {
-        if (rule->matches(string))
-        {
-          // We found a match, so apply the regular expression to the AUS (not
-          // the previous string - this is what ENUM mandates).  If this was a
-          // terminal rule, we now have a SIP URI and we're finished.
-          // Otherwise, the output of the regular expression is used as the
-          // next key.
-          try
-          {
-            string = rule->replace(aus, trail);
-            complete = rule->is_terminal();
-          }
-          catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
-          {
-            TRC_ERROR("Failed to translate number with regex");
-            failed = true;
-            // LCOV_EXCL_STOP
-          }
-          break;
-        }
+        resolver->free_naptr_reply(naptr_reply);
+        naptr_reply = NULL;
       }
-      // If we didn't find a match (and so hit the end of the list), consider
-      // this a failure.
-      failed = failed || (rule == rules.end());
-    }
-    else if (status == ARES_ENOTFOUND)
-    {
-      // Our DNS query failed, so give up, but this is not an ENUM server issue -
-      // we just tried to look up an unknown name.
-      failed = true;
     }
-    else
+
+    process_rules(lookup, status, rules);
+  }
+
+  return complete_lookup(lookup);
+}
+
+
+void DNSEnumService::lookup_uri_from_user_async(const std::string& user,
+                                                SAS::TrailId trail,
+                                                LookupCallback callback) const
+{
+  if (user.empty())
+  {
+    TRC_INFO("No dial string supplied, so don't do ENUM lookup");
+    callback(std::string());
+    return;
+  }
+
+  // Log starting ENUM processing.
+  SAS::Event event(trail, SASEvent::ENUM_START, 0);
+  event.add_var_param(user);
+  SAS::report_event(event);
+
+  continue_async_lookup(std::make_shared<Lookup>(user, trail, callback));
+}
+
+
+void DNSEnumService::continue_async_lookup(std::shared_ptr<Lookup> lookup) const
+{
+  while (lookup->in_progress())
+  {
+    std::string domain = key_to_domain(lookup->string);
+    std::shared_ptr<const std::vector<Rule>> rules;
+    int status;
+
+    if (!get_cached_rules(domain, status, rules))
     {
-      // Our DNS query failed. Give up, and track an ENUM server failure.
-      failed = true;
-      server_failed = true;
+      // Not in the cache, so query the ENUM server through the shared event
+      // loop, and pick up where we left off when the response arrives.
+      lookup->queried = true;
+      get_async_resolver()->perform_naptr_query(
+        domain,
+        [this, lookup, domain](int status,
+                               const struct ares_naptr_reply* naptr_reply,
+                               int ttl)
+        {
+          process_rules(*lookup,
+                        status,
+                        store_rules(domain, status, naptr_reply, ttl));
+          continue_async_lookup(lookup);
+        },
+        lookup->trail);
+      return;
     }
 
+    process_rules(*lookup, status, rules);
+  }
+
+  lookup->callback(complete_lookup(*lookup));
+}
+
 
-    // Free off the NAPTR reply if we have one.
-    if (naptr_reply != NULL)
+void DNSEnumService::process_rules(Lookup& lookup,
+                                   int status,
+                                   std::shared_ptr<const std::vector<Rule>> rules) const
+{
+  if (status == ARES_SUCCESS)
+  {
+    // Now spin through the rules, looking for the first match.
+    std::vector<DNSEnumService::Rule>::const_iterator rule;
+    for (rule = rules->begin();
+         rule != rules->end();
+         ++rule)
     {
-      resolver->free_naptr_reply(naptr_reply);
-      naptr_reply = NULL;
+      if (rule->matches(lookup.string))
+      {
+        // We found a match, so apply the regular expression to the AUS (not
+        // the previous string - this is what ENUM mandates).  If this was a
+        // terminal rule, we now have a SIP URI and we're finished.
+        // Otherwise, the output of the regular expression is used as the
+        // next key.
+        try
+        {
+          lookup.string = rule->replace(lookup.aus, lookup.trail);
+          lookup.complete = rule->is_terminal();
+        }
+        catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
+        {
+          TRC_ERROR("Failed to translate number with regex");
+          lookup.failed = true;
+          // LCOV_EXCL_STOP
+        }
+        break;
+      }
     }
-
-    dns_queries++;
+    // If we didn't find a match (and so hit the end of the list), consider
+    // this a failure.
+    lookup.failed = lookup.failed || (rule == rules->end());
+  }
+  else if (status == ARES_ENOTFOUND)
+  {
+    // Our DNS query failed, so give up, but this is not an ENUM server issue -
+    // we just tried to look up an unknown name.
+    lookup.failed = true;
+  }
+  else
+  {
+    // Our DNS query failed. Give up, and track an ENUM server failure.
+    lookup.failed = true;
+    lookup.server_failed = true;
   }
 
+  lookup.dns_queries++;
+}
+
+
+std::string DNSEnumService::complete_lookup(Lookup& lookup) const
+{
   // Log that we've finished processing (and whether it was successful or not).
-  if (complete)
+  if (lookup.complete)
   {
-    TRC_DEBUG("Enum lookup completes: %s", string.c_str());
-    SAS::Event event(trail, SASEvent::ENUM_COMPLETE, 0);
-    event.add_var_param(user);
-    event.add_var_param(string);
+    TRC_DEBUG("Enum lookup completes: %s", lookup.string.c_str());
+    SAS::Event event(lookup.trail, SASEvent::ENUM_COMPLETE, 0);
+    event.add_var_param(lookup.user);
+    event.add_var_param(lookup.string);
     SAS::report_event(event);
   }
   else
   {
-    TRC_WARNING("Enum lookup did not complete for user %s", user.c_str());
-    SAS::Event event(trail, SASEvent::ENUM_INCOMPLETE, 0);
-    event.add_var_param(user);
+    TRC_WARNING("Enum lookup did not complete for user %s", lookup.user.c_str());
+    SAS::Event event(lookup.trail, SASEvent::ENUM_INCOMPLETE, 0);
+    event.add_var_param(lookup.user);
     SAS::report_event(event);
     // On failure, we must return an empty (rather than incomplete) string.
-    string = std::string("");
+    lookup.string = std::string("");
   }
 
   // Report state of last communication attempt (which may potentially set/clear
-  // an associated alarm).
-  if (_comm_monitor)
+  // an associated alarm).  There's nothing to report if all the results came
+  // from the cache.
+  if ((_comm_monitor) && (lookup.queried))
   {
-    if (server_failed)
+    if (lookup.server_failed)
     {
       _comm_monitor->inform_failure();
     }
@@ -499,23 +715,25 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
     }
   }
 
-  return string;
+  return lookup.string;
 }
 
 
 std::string DNSEnumService::key_to_domain(const std::string& key) const
 {
-  // First strip all non-numeric characters from the key.
-  std::string number = boost::regex_replace(key, CHARS_TO_STRIP_FROM_DOMAIN, std::string(""));
-  // Then spin backwards through the number, adding each digit separated by
-  // dots.
+  // Spin backwards through the key, adding each digit separated by dots (and
+  // skipping any non-numeric characters).
   std::string domain;
-  for (int ch_idx = number.length() - 1; ch_idx >= 0; ch_idx--)
+  domain.reserve(key.length() * 2 + _dns_suffix.length());
+  for (int ch_idx = key.length() - 1; ch_idx >= 0; ch_idx--)
   {
-    domain.push_back(number[ch_idx]);
-    if (ch_idx != 0)
+    if (NumberUtils::DIGITS.contains(key[ch_idx]))
     {
-      domain.push_back('.');
+      if (!domain.empty())
+      {
+        domain.push_back('.');
+      }
+      domain.push_back(key[ch_idx]);
     }
   }
   // Finally, append the suffix.
@@ -538,6 +756,133 @@ DNSResolver* DNSEnumService::get_resolver() const
 }
 
 
+AsyncDNSResolver* DNSEnumService::get_async_resolver() const
+{
+  // The event loop is only started the first time it's needed, so services
+  // that only ever do synchronous lookups don't have an idle thread.
+  std::call_once(_async_resolver_once, [this]()
+  {
+    _async_resolver = _resolver_factory->new_async_resolver(_servers);
+  });
+  return _async_resolver;
+}
+
+
+bool DNSEnumService::get_cached_rules(const std::string& domain,
+                                      int& status,
+                                      std::shared_ptr<const std::vector<Rule>>& rules) const
+{
+  time_t now = time(NULL);
+  bool found = false;
+
+  pthread_mutex_lock(&_cache_lock);
+
+  std::unordered_map<std::string, CacheEntry>::const_iterator it =
+                                                           _cache.find(domain);
+  if ((it != _cache.end()) && (it->second.expires > now))
+  {
+    status = it->second.status;
+    rules = it->second.rules;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&_cache_lock);
+
+  if (found)
+  {
+    TRC_DEBUG("Found cached ENUM result for %s (status %d)",
+              domain.c_str(), status);
+    _cache_hits++;
+    if (_cache_hits_tbl != NULL)
+    {
+      _cache_hits_tbl->increment();
+    }
+  }
+  else
+  {
+    _cache_misses++;
+    if (_cache_misses_tbl != NULL)
+    {
+      _cache_misses_tbl->increment();
+    }
+  }
+
+  return found;
+}
+
+
+std::shared_ptr<const std::vector<DNSEnumService::Rule>>
+  DNSEnumService::store_rules(const std::string& domain,
+                              int status,
+                              const struct ares_naptr_reply* naptr_reply,
+                              int ttl) const
+{
+  std::shared_ptr<const std::vector<Rule>> rules;
+
+  if (status == ARES_SUCCESS)
+  {
+    // Parse the reply into a sorted list of rules.  This compiles the
+    // regular expressions, so is worth caching along with the reply.
+    std::shared_ptr<std::vector<Rule>> new_rules(new std::vector<Rule>());
+    parse_naptr_reply(naptr_reply, *new_rules);
+    rules = new_rules;
+  }
+  else if (status == ARES_ENOTFOUND)
+  {
+    ttl = _negative_cache_ttl;
+  }
+  else
+  {
+    // Don't cache server failures.
+    ttl = 0;
+  }
+
+  if (ttl > 0)
+  {
+    time_t now = time(NULL);
+    TRC_DEBUG("Caching ENUM result for %s (status %d) for %ds",
+              domain.c_str(), status, ttl);
+
+    pthread_mutex_lock(&_cache_lock);
+
+    CacheEntry& entry = _cache[domain];
+    entry.status = status;
+    entry.rules = rules;
+    entry.expires = now + ttl;
+
+    // Entries are only replaced if the domain is looked up again, so
+    // periodically sweep the whole cache so that it doesn't grow without
+    // bound.
+    if (now >= _next_cache_purge)
+    {
+      purge_expired_cache(now);
+      _next_cache_purge = now + CACHE_PURGE_INTERVAL;
+    }
+
+    pthread_mutex_unlock(&_cache_lock);
+  }
+
+  return rules;
+}
+
+
+void DNSEnumService::purge_expired_cache(time_t now) const
+{
+  std::unordered_map<std::string, CacheEntry>::iterator it = _cache.begin();
+  while (it != _cache.end())
+  {
+    if (it->second.expires <= now)
+    {
+      it = _cache.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+
 void DNSEnumService::parse_naptr_reply(const struct ares_naptr_reply* naptr_reply,
                                        std::vector<DNSEnumService::Rule>& rules)
 {
@@ -21,6 +21,7 @@
 FIFCService::FIFCService(Alarm* alarm,
                          std::string configuration):
   _alarm(alarm),
+  _fallback_ifcs(std::make_shared<std::vector<std::string>>()),
   _configuration(configuration),
   _updater(NULL)
 {
@@ -32,7 +33,6 @@ FIFCService::FIFCService(Alarm* alarm,
 FIFCService::~FIFCService()
 {
   delete _updater; _updater = NULL;
-  _fallback_ifcs.clear();
   delete _alarm; _alarm = NULL;
 }
 
@@ -100,10 +100,7 @@ void FIFCService::update_fifcs()
 
   // If we have reached this point, we are definitely going to update the current
   // fallback ifc list.
-  // Take a lock while we do so.
-  boost::lock_guard<boost::shared_mutex> write_lock(_sets_rw_lock);
   bool any_errors = false;
-  _fallback_ifcs.clear();
 
   // Parse any iFCs that are present.
   std::multimap<int32_t, std::string> ifc_map;
@@ -139,14 +136,14 @@ void FIFCService::update_fifcs()
     ifc_map.insert(std::make_pair(priority, ifc_str));
   }
 
-  std::vector<std::string> ifcs_vec;
+  std::shared_ptr<std::vector<std::string>> ifcs_vec(new std::vector<std::string>());
   for (std::pair<int32_t, std::string> ifc_pair : ifc_map)
   {
-    ifcs_vec.push_back(ifc_pair.second);
+    ifcs_vec->push_back(ifc_pair.second);
   }
 
-  TRC_DEBUG("Adding %lu fallback IFC(s)", ifcs_vec.size());
-  _fallback_ifcs = ifcs_vec;
+  TRC_DEBUG("Adding %lu fallback IFC(s)", ifcs_vec->size());
+  _fallback_ifcs.set(ifcs_vec);
 
   if (any_errors)
   {
@@ -163,11 +160,8 @@ void FIFCService::update_fifcs()
 
 std::vector<Ifc> FIFCService::get_fallback_ifcs(rapidxml::xml_document<>* ifc_doc) const
 {
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_sets_rw_lock);
-
   std::vector<Ifc> ifc_vec;
-  for (std::string ifc : _fallback_ifcs)
+  for (const std::string& ifc : _fallback_ifcs.get())
   {
     ifc_vec.push_back(Ifc(ifc, ifc_doc));
   }
@@ -16,6 +16,7 @@ extern "C" {
 }
 
 // Common STL includes.
+#include <algorithm>
 #include <cassert>
 #include <map>
 #include <string>
@@ -26,29 +27,94 @@ extern "C" {
 #include "stack.h"
 #include "flowtable.h"
 
-FlowTable::FlowTable(QuiescingManager* qm, SNMP::U32Scalar* connection_count) :
-  _tp2flow_map(),
-  _tk2flow_map(),
+FlowTable::FlowTable(QuiescingManager* qm,
+                     SNMP::U32Scalar* connection_count,
+                     SNMP::U32Scalar* lock_acquisitions,
+                     SNMP::U32Scalar* lock_contentions) :
+  _expiry_buckets(NUM_EXPIRY_BUCKETS),
+  _last_swept(time(NULL) / EXPIRY_BUCKET_SECS),
+  _flow_count(0),
   _conn_count(connection_count),
+  _lock_acquisitions(lock_acquisitions),
+  _lock_contentions(lock_contentions),
   _quiescing(false),
   _qm(qm)
 {
-  pthread_mutex_init(&_flow_map_lock, NULL);
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+    _shards[ii].lock_acquisitions = 0;
+    _shards[ii].lock_contentions = 0;
+  }
+  pthread_mutex_init(&_expiry_lock, NULL);
   report_flow_count();
+
+  // Start the expiry sweeper.
+  pj_timer_entry_init(&_sweep_timer, PJ_FALSE, (void*)this, &on_sweep_timer);
+  pj_time_val delay = {EXPIRY_BUCKET_SECS, 0};
+  pjsip_endpt_schedule_timer(stack_data.endpt, &_sweep_timer, &delay);
+  _sweep_timer.id = PJ_TRUE;
 }
 
 
 FlowTable::~FlowTable()
 {
+  if (_sweep_timer.id)
+  {
+    // Stop the expiry sweeper.
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_sweep_timer);
+    _sweep_timer.id = PJ_FALSE;
+  }
+
   // Delete all the existing flows.
-  for (std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.begin();
-       i != _tp2flow_map.end();
-       ++i)
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
   {
-    delete i->second;
+    for (std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i =
+                                            _shards[ii].tp2flow_map.begin();
+         i != _shards[ii].tp2flow_map.end();
+         ++i)
+    {
+      delete i->second;
+    }
+
+    pthread_mutex_destroy(&_shards[ii].lock);
   }
 
-  pthread_mutex_destroy(&_flow_map_lock);
+  pthread_mutex_destroy(&_expiry_lock);
+}
+
+
+size_t FlowTable::FlowKey::Hash::operator()(const FlowKey& key) const
+{
+  pj_uint16_t port = pj_sockaddr_get_port(&key._raddr);
+  pj_uint32_t hash = pj_hash_calc(key._type,
+                                  pj_sockaddr_get_addr(&key._raddr),
+                                  pj_sockaddr_get_addr_len(&key._raddr));
+  return pj_hash_calc(hash, &port, sizeof(port));
+}
+
+
+FlowTable::Shard& FlowTable::tp_shard(const FlowKey& key)
+{
+  return _shards[FlowKey::Hash()(key) % NUM_SHARDS];
+}
+
+
+FlowTable::Shard& FlowTable::tk_shard(const std::string& token)
+{
+  return _shards[std::hash<std::string>()(token) % NUM_SHARDS];
+}
+
+
+/// Takes a shard's lock, counting whether another thread was holding it.
+void FlowTable::lock_shard(Shard& shard)
+{
+  if (pthread_mutex_trylock(&shard.lock) != 0)
+  {
+    ++shard.lock_contentions;
+    pthread_mutex_lock(&shard.lock);
+  }
+  ++shard.lock_acquisitions;
 }
 
 
@@ -57,6 +123,7 @@ FlowTable::~FlowTable()
 Flow* FlowTable::find_create_flow(pjsip_transport* transport, const pj_sockaddr* raddr)
 {
   Flow* flow = NULL;
+  bool created = false;
   FlowKey key(transport->key.type, raddr);
 
   char buf[100];
@@ -64,35 +131,49 @@ Flow* FlowTable::find_create_flow(pjsip_transport* transport, const pj_sockaddr*
             transport->obj_name, transport->key.type,
             pj_sockaddr_print(raddr, buf, sizeof(buf), 3));
 
-  pthread_mutex_lock(&_flow_map_lock);
+  Shard& shard = tp_shard(key);
+  lock_shard(shard);
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
+  std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i =
+                                                  shard.tp2flow_map.find(key);
 
-  if (i == _tp2flow_map.end())
+  if ((i != shard.tp2flow_map.end()) &&
+      (i->second->inc_ref()))
   {
-    // No matching flow, so create a new one.
-    flow = new Flow(this, transport, raddr);
-
-    // Add the new flow to the maps.
-    _tp2flow_map.insert(std::make_pair(key, flow));
-    _tk2flow_map.insert(std::make_pair(flow->token(), flow));
-
-    TRC_DEBUG("Added flow record %p", flow);
+    // Found a matching flow, so return this one.
+    flow = i->second;
 
-    report_flow_count();
+    TRC_DEBUG("Found flow record %p", flow);
   }
   else
   {
-    // Found a matching flow, so return this one.
-    flow = i->second;
+    // No matching flow (or the matching flow is being removed), so create a
+    // new one.
+    flow = new Flow(this, transport, raddr);
+    shard.tp2flow_map[key] = flow;
+    created = true;
 
-    TRC_DEBUG("Found flow record %p", flow);
+    TRC_DEBUG("Added flow record %p", flow);
+
+    // Add a reference to the flow.
+    flow->inc_ref();
   }
 
-  // Add a reference to the flow.
-  flow->inc_ref();
+  pthread_mutex_unlock(&shard.lock);
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  if (created)
+  {
+    // Index the new flow by its token.  Nothing can look the token up until
+    // we've returned the flow, so this doesn't need to be atomic with adding
+    // it to the transport address map.
+    Shard& tk = tk_shard(flow->token());
+    lock_shard(tk);
+    tk.tk2flow_map[flow->token()] = flow;
+    pthread_mutex_unlock(&tk.lock);
+
+    ++_flow_count;
+    report_flow_count();
+  }
 
   return flow;
 }
@@ -110,22 +191,22 @@ Flow* FlowTable::find_flow(pjsip_transport* transport, const pj_sockaddr* raddr)
             transport->obj_name, transport->key.type,
             pj_sockaddr_print(raddr, buf, sizeof(buf), 3));
 
-  pthread_mutex_lock(&_flow_map_lock);
+  Shard& shard = tp_shard(key);
+  lock_shard(shard);
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
+  std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i =
+                                                  shard.tp2flow_map.find(key);
 
-  if (i != _tp2flow_map.end())
+  // Return the matching flow, if there is one and it isn't being removed.
+  if ((i != shard.tp2flow_map.end()) &&
+      (i->second->inc_ref()))
   {
-    // Found a matching flow, so return this one.
     flow = i->second;
 
-    // Increment the reference count on the flow.
-    flow->inc_ref();
-
     TRC_DEBUG("Found flow record %p", flow);
   }
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  pthread_mutex_unlock(&shard.lock);
 
   return flow;
 }
@@ -138,28 +219,30 @@ Flow* FlowTable::find_flow(const std::string& token)
 
   TRC_DEBUG("Find flow for flow token %s", token.c_str());
 
-  pthread_mutex_lock(&_flow_map_lock);
+  Shard& shard = tk_shard(token);
+  lock_shard(shard);
+
+  std::unordered_map<std::string, Flow*>::iterator i =
+                                              shard.tk2flow_map.find(token);
 
-  std::map<std::string, Flow*>::iterator i = _tk2flow_map.find(token);
-  if (i != _tk2flow_map.end())
+  // Return the flow matching the token, if there is one and it isn't being
+  // removed.
+  if ((i != shard.tk2flow_map.end()) &&
+      (i->second->inc_ref()))
   {
-    // Found a flow matching the token.
     flow = i->second;
 
-    // Add a reference to the flow.
-    flow->inc_ref();
-
     TRC_DEBUG("Found flow record %p", flow);
   }
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  pthread_mutex_unlock(&shard.lock);
 
   return flow;
 }
 
 void FlowTable::check_quiescing_state()
 {
-  if (_tp2flow_map.empty() && is_quiescing() && (_qm != NULL))
+  if ((_flow_count == 0) && is_quiescing() && (_qm != NULL))
   {
     TRC_DEBUG("Flow map is empty and we are quiescing - start transaction-based quiescing");
     _qm->flows_gone();
@@ -167,7 +250,7 @@ void FlowTable::check_quiescing_state()
   else
   {
     TRC_DEBUG("Checked quiescing state: flow_map is %s, is_quiescing() result is %s, _qm (QuiescingManager reference) is %s",
-              _tp2flow_map.empty() ? "empty" : "not empty",
+              (_flow_count == 0) ? "empty" : "not empty",
               is_quiescing()? "true" : "false",
               (_qm == NULL) ? "NULL" : "not NULL");
   }
@@ -175,50 +258,217 @@ void FlowTable::check_quiescing_state()
 
 void FlowTable::remove_flow(Flow* flow)
 {
-  pthread_mutex_lock(&_flow_map_lock);
-
   TRC_DEBUG("Remove flow %p", flow);
 
+  // Remove the flow from both of its shards.  Any thread that found the flow
+  // in either map did so holding the shard's lock, so has finished with it
+  // (failing to add a reference) once we've taken the lock.  A flow may
+  // already have been replaced in the transport address map, if it was
+  // being removed when a new message arrived on the flow.
   FlowKey key(flow->transport()->key.type, flow->remote_addr());
+  Shard& shard = tp_shard(key);
+  lock_shard(shard);
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
-  if (i != _tp2flow_map.end())
+  std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i =
+                                                  shard.tp2flow_map.find(key);
+  if ((i != shard.tp2flow_map.end()) &&
+      (i->second == flow))
   {
-    _tp2flow_map.erase(i);
+    shard.tp2flow_map.erase(i);
   }
 
-  std::map<std::string, Flow*>::iterator j = _tk2flow_map.find(flow->token());
-  if (j != _tk2flow_map.end())
+  pthread_mutex_unlock(&shard.lock);
+
+  Shard& tk = tk_shard(flow->token());
+  lock_shard(tk);
+
+  std::unordered_map<std::string, Flow*>::iterator j =
+                                          tk.tk2flow_map.find(flow->token());
+  if (j != tk.tk2flow_map.end())
   {
-    _tk2flow_map.erase(j);
+    tk.tk2flow_map.erase(j);
   }
 
+  pthread_mutex_unlock(&tk.lock);
+
+  unschedule_check(flow);
+
+  --_flow_count;
   report_flow_count();
 
   delete flow;
 
   check_quiescing_state();
+}
+
+FlowTable::Stats FlowTable::stats() const
+{
+  Stats stats;
+  stats.flows = _flow_count;
+  stats.lock_acquisitions = 0;
+  stats.lock_contentions = 0;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    stats.lock_acquisitions += _shards[ii].lock_acquisitions;
+    stats.lock_contentions += _shards[ii].lock_contentions;
+  }
+
+  return stats;
+}
+
+/// Puts a flow in the expiry bucket for the specified time, moving it from
+/// the bucket it is currently in if that is later.
+void FlowTable::schedule_check(Flow* flow, int check_time)
+{
+  pthread_mutex_lock(&_expiry_lock);
+
+  // Work out which interval the check falls in.  This must be one the
+  // sweeper hasn't processed yet, and not so far ahead that the wheel
+  // wraps.
+  int interval = check_time / EXPIRY_BUCKET_SECS;
+  interval = std::max(interval, _last_swept + 1);
+  interval = std::min(interval, _last_swept + NUM_EXPIRY_BUCKETS);
+  check_time = interval * EXPIRY_BUCKET_SECS;
+
+  if ((flow->_check_time == 0) ||
+      (check_time < flow->_check_time))
+  {
+    if (flow->_check_time != 0)
+    {
+      int old_interval = flow->_check_time / EXPIRY_BUCKET_SECS;
+      _expiry_buckets[old_interval % NUM_EXPIRY_BUCKETS].erase(flow);
+    }
+
+    _expiry_buckets[interval % NUM_EXPIRY_BUCKETS].insert(flow);
+    flow->_check_time = check_time;
+  }
+
+  pthread_mutex_unlock(&_expiry_lock);
+}
+
+
+void FlowTable::unschedule_check(Flow* flow)
+{
+  pthread_mutex_lock(&_expiry_lock);
+
+  if (flow->_check_time != 0)
+  {
+    int interval = flow->_check_time / EXPIRY_BUCKET_SECS;
+    _expiry_buckets[interval % NUM_EXPIRY_BUCKETS].erase(flow);
+    flow->_check_time = 0;
+  }
+
+  pthread_mutex_unlock(&_expiry_lock);
+}
 
-  pthread_mutex_unlock(&_flow_map_lock);
+
+/// Called by PJSIP when the expiry sweeper's timer expires.
+void FlowTable::on_sweep_timer(pj_timer_heap_t* th, pj_timer_entry* e)
+{
+  FlowTable* flow_table = (FlowTable*)e->user_data;
+  flow_table->sweep();
+
+  // Restart the timer for the next interval.
+  pj_time_val delay = {EXPIRY_BUCKET_SECS, 0};
+  pjsip_endpt_schedule_timer(stack_data.endpt, e, &delay);
+}
+
+
+/// Checks the flows in the expiry buckets for all the intervals since the
+/// last sweep.
+void FlowTable::sweep()
+{
+  int now = time(NULL);
+  int now_interval = now / EXPIRY_BUCKET_SECS;
+  std::vector<Flow*> flows;
+
+  pthread_mutex_lock(&_expiry_lock);
+
+  // If the sweeper has fallen more than a whole turn of the wheel behind,
+  // each bucket only needs checking once.
+  int first_interval = std::max(_last_swept + 1,
+                                now_interval - NUM_EXPIRY_BUCKETS + 1);
+
+  for (int interval = first_interval; interval <= now_interval; ++interval)
+  {
+    std::unordered_set<Flow*>& bucket =
+                              _expiry_buckets[interval % NUM_EXPIRY_BUCKETS];
+    for (std::unordered_set<Flow*>::iterator i = bucket.begin();
+         i != bucket.end();
+         )
+    {
+      Flow* flow = *i;
+
+      if (flow->_check_time > now)
+      {
+        // This flow is due in a later turn of the wheel.
+        ++i;
+        continue;
+      }
+
+      bucket.erase(i++);
+      flow->_check_time = 0;
+
+      // Flows can't be deleted while we hold the expiry lock, so it's safe to
+      // take a reference here, unless the flow is already being removed.
+      if (flow->inc_ref())
+      {
+        flows.push_back(flow);
+      }
+    }
+  }
+
+  _last_swept = now_interval;
+
+  pthread_mutex_unlock(&_expiry_lock);
+
+  if (!flows.empty())
+  {
+    TRC_DEBUG("Checking %d flows for expiry", flows.size());
+  }
+
+  for (std::vector<Flow*>::iterator i = flows.begin(); i != flows.end(); ++i)
+  {
+    (*i)->check_expiry(now);
+    (*i)->dec_ref();
+  }
+
+  report_lock_stats();
 }
 
 void FlowTable::report_flow_count()
 {
-  TRC_DEBUG("Reporting current flow count: %d", _tp2flow_map.size());
-  _conn_count->value = _tp2flow_map.size();
+  size_t flow_count = _flow_count;
+  TRC_DEBUG("Reporting current flow count: %d", flow_count);
+  _conn_count->value = flow_count;
+}
+
+/// Reports the shard lock statistics.  These are counts since the flow table
+/// was created, so wrap like any other 32-bit SNMP counter.
+void FlowTable::report_lock_stats()
+{
+  Stats current = stats();
+
+  if (_lock_acquisitions != NULL)
+  {
+    _lock_acquisitions->value = (uint32_t)current.lock_acquisitions;
+  }
+
+  if (_lock_contentions != NULL)
+  {
+    _lock_contentions->value = (uint32_t)current.lock_contentions;
+  }
 }
 
 void FlowTable::quiesce()
 {
   TRC_DEBUG("FlowTable was kicked to quiesce");
   _quiescing = true;
-  pthread_mutex_lock(&_flow_map_lock);
 
   // If we have no flows, quiesce now - otherwise we do this in
   // remove_flow when the last flow disappears
   check_quiescing_state();
-
-  pthread_mutex_unlock(&_flow_map_lock);
 }
 
 void FlowTable::unquiesce()
@@ -243,6 +493,9 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
   _tp_state_listener_key(NULL),
   _remote_addr(*remote_addr),
   _token(),
+  _timer_id(0),
+  _last_active(time(NULL)),
+  _check_time(0),
   _authorized_ids(),
   _default_id(),
   _refs(1),
@@ -268,12 +521,9 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
     TRC_DEBUG("Added transport listener for flow %p", this);
   }
 
-  // Initialize the timer.
-  pj_timer_entry_init(&_timer, PJ_FALSE, (void*)this, &on_timer_expiry);
-  _timer.id = 0;
-
   // Start the timer as an idle timer.
-  restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
+  _timer_id = IDLE_TIMER;
+  _flow_table->schedule_check(this, _last_active + IDLE_TIMEOUT);
 }
 
 
@@ -291,26 +541,17 @@ Flow::~Flow()
     pjsip_transport_dec_ref(_transport);
   }
 
-  if (_timer.id)
-  {
-    // Stop the keepalive timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
-  }
-
   pthread_mutex_destroy(&_flow_lock);
 }
 
 
 /// Called whenever a REGISTER is handled for this flow, to ensure the
-/// flow doesn't time out in the middle of processing the REGISTER.
+/// flow doesn't time out in the middle of processing the REGISTER.  This just
+/// records the time - if the idle timer is running, it is extended when it
+/// is next checked.
 void Flow::touch()
 {
-  if (_timer.id == IDLE_TIMER)
-  {
-    // Idle timer is running, so restart it.
-    restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
-  }
+  _last_active.store(time(NULL), std::memory_order_relaxed);
 }
 
 
@@ -420,14 +661,12 @@ void Flow::set_identity(const pjsip_uri* uri,
       _default_id = aor;
     }
 
-    // May need to (re)start the timer if either it's not running, or it's
-    // running as an idle timer, or the expires time for these identities is
-    // earlier than the timer will next pop.
-    if ((_timer.id != EXPIRY_TIMER) ||
-        (_timer._timer_value.sec > expires))
-    {
-      restart_timer(EXPIRY_TIMER, expires - time(NULL));
-    }
+    // Switch to the expiry timer, and make sure the flow is checked by the
+    // time these identities expire.  (If it is checked earlier, for example
+    // because it was running as an idle timer, the check works out when the
+    // next identity expires.)
+    _timer_id = EXPIRY_TIMER;
+    _flow_table->schedule_check(this, expires);
   }
   else
   {
@@ -466,17 +705,46 @@ void Flow::set_identity(const pjsip_uri* uri,
 }
 
 
-/// Called when the expiry timer pops.
-void Flow::expiry_timer()
+/// Called when the FlowTable checks the flow, because its timer is due.
+void Flow::check_expiry(int now)
 {
+  pthread_mutex_lock(&_flow_lock);
+
+  if (_timer_id == IDLE_TIMER)
+  {
+    int idle_expires = _last_active.load(std::memory_order_relaxed) +
+                       IDLE_TIMEOUT;
+
+    if (idle_expires > now)
+    {
+      // The flow has been touched since the idle timer started, so extend it.
+      _flow_table->schedule_check(this, idle_expires);
+      pthread_mutex_unlock(&_flow_lock);
+    }
+    else
+    {
+      // The idle timer has expired, so decrement the reference count so the
+      // flow will get deleted when there are no more references.
+      TRC_DEBUG("Idle timer expired for flow %p", this);
+      _timer_id = 0;
+      pthread_mutex_unlock(&_flow_lock);
+      dec_ref();
+    }
+    return;
+  }
+  else if (_timer_id != EXPIRY_TIMER)
+  {
+    pthread_mutex_unlock(&_flow_lock);
+    return;
+  }
+
+  TRC_DEBUG("Expiry timer expired for flow %p", this);
+
   // Scan through all the identities deleting any that have passed their
   // expiry time.  This is done as a simple scan because we don't expect
   // a single flow to have a large number of identities.  This may not be
   // a valid assumption if a downstream SBC or AGCF muxes a large number of
   // clients over a single flow.
-  pthread_mutex_lock(&_flow_lock);
-
-  int now = time(NULL);
   int min_expires = 0;
   for (auth_id_map::const_iterator i = _authorized_ids.begin();
        i != _authorized_ids.end();
@@ -521,13 +789,21 @@ void Flow::expiry_timer()
   {
     // No active registrations on a non-reliable transport, so restart the
     // timer as an idle timer.
-    restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
+    _timer_id = IDLE_TIMER;
+    _last_active.store(now, std::memory_order_relaxed);
+    _flow_table->schedule_check(this, now + IDLE_TIMEOUT);
     TRC_DEBUG("Started idle timer for flow %p", this);
   }
   else if (min_expires > now)
   {
     // Restart the timer to pop when the next identity(s) will expire.
-    restart_timer(EXPIRY_TIMER, min_expires - now);
+    _flow_table->schedule_check(this, min_expires);
+  }
+  else
+  {
+    // No active registrations on a reliable transport, so the flow lasts
+    // until the connection closes.
+    _timer_id = 0;
   }
 
   pthread_mutex_unlock(&_flow_lock);
@@ -550,28 +826,27 @@ void Flow::select_default_identity()
 }
 
 
-/// Restart the timer using the specified id and timeout.
-void Flow::restart_timer(int id, int timeout)
+/// Increment the reference count on the flow, unless it has already dropped
+/// to zero (so the flow is being removed).  This is always called with the
+/// lock held on a flow table shard the flow is in, so the flow can't be
+/// deleted while this is running.
+///
+/// @returns - Whether a reference was added.
+bool Flow::inc_ref()
 {
-  if (_timer.id)
+  int refs = _refs.load();
+  do
   {
-    // Stop the existing timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
+    if (refs == 0)
+    {
+      TRC_DEBUG("Flow %p is being removed", this);
+      return false;
+    }
   }
+  while (!_refs.compare_exchange_weak(refs, refs + 1));
 
-  pj_time_val delay = {timeout, 0};
-  pjsip_endpt_schedule_timer(stack_data.endpt, &_timer, &delay);
-  _timer.id = id;
-}
-
-
-/// Increment the reference count on the flow.  This is always called when
-/// the flowtable lock is held, so no need to lock.
-void Flow::inc_ref()
-{
-  ++_refs;
-  TRC_DEBUG("Dialog count now %d for flow %s", _refs, _default_id.c_str());
+  TRC_DEBUG("Dialog count now %d for flow %s", refs + 1, _default_id.c_str());
+  return true;
 }
 
 
@@ -579,17 +854,15 @@ void Flow::inc_ref()
 /// to zero.
 void Flow::dec_ref()
 {
-  pthread_mutex_lock(&_flow_table->_flow_map_lock);
+  int refs = --_refs;
 
-  if ((--_refs) == 0)
+  if (refs == 0)
   {
-    pthread_mutex_unlock(&_flow_table->_flow_map_lock);
     _flow_table->remove_flow(this);
   }
   else
   {
-    TRC_DEBUG("Dialog count now %d for flow %s", _refs, _default_id.c_str());
-    pthread_mutex_unlock(&_flow_table->_flow_map_lock);
+    TRC_DEBUG("Dialog count now %d for flow %s", refs, _default_id.c_str());
   }
 }
 
@@ -633,23 +906,3 @@ void Flow::on_transport_state_changed(pjsip_transport *tp,
   }
 }
 
-
-/// Called by PJSIP when the expiry/idle timer expires.
-void Flow::on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e)
-{
-  TRC_DEBUG("%s timer expired for flow %p",
-            (e->id == EXPIRY_TIMER) ? "Expiry" : "Idle",
-            e->user_data);
-  if (e->id == EXPIRY_TIMER)
-  {
-    // Timer is an expiry timer.
-    ((Flow*)e->user_data)->expiry_timer();
-  }
-  else
-  {
-    // Timer is an idle timer, so decrement the reference count so the flow
-    // will get deleted when there are no more references.
-    ((Flow*)e->user_data)->dec_ref();
-  }
-}
-
@@ -28,24 +28,22 @@ extern "C" {
 #include "pjutils.h"
 #include "sproutsasevent.h"
 #include "uri_classifier.h"
+#include "sproutletproxy.h"
 
 // If we can't find the AoR pair in the current SDM, we will either use the
 // backup_aor_pair or we will try and look up the AoR pair in the remote SDMs.
 // Therefore either the backup_aor_pair should be NULL, or remote_sdms should be empty.
-static bool sdm_access_common(SubscriberDataManager::AoRPair** aor_pair,
-                              std::string aor_id,
-                              SubscriberDataManager* current_sdm,
-                              std::vector<SubscriberDataManager*> remote_sdms,
-                              SubscriberDataManager::AoRPair* backup_aor_pair,
-                              SAS::TrailId trail)
+//
+// This checks an AoR pair that has already been read from the current SDM,
+// and fills in its bindings from the backups if it has none.
+static bool sdm_apply_backup(SubscriberDataManager::AoRPair* aor_pair,
+                             std::string aor_id,
+                             std::vector<SubscriberDataManager*> remote_sdms,
+                             SubscriberDataManager::AoRPair* backup_aor_pair,
+                             SAS::TrailId trail)
 {
-  // Find the current bindings for the AoR.
-  delete *aor_pair;
-  *aor_pair = current_sdm->get_aor_data(aor_id, trail);
-  TRC_DEBUG("Retrieved AoR data %p", *aor_pair);
-
-  if ((*aor_pair == NULL) ||
-      ((*aor_pair)->get_current() == NULL))
+  if ((aor_pair == NULL) ||
+      (aor_pair->get_current() == NULL))
   {
     // Failed to get data for the AoR because there is no connection
     // to the store.
@@ -54,7 +52,7 @@ static bool sdm_access_common(SubscriberDataManager::AoRPair** aor_pair,
   }
 
   // If we don't have any bindings, try the backup AoR and/or stores.
-  if ((*aor_pair)->get_current()->bindings().empty())
+  if (aor_pair->get_current()->bindings().empty())
   {
     bool found_binding = false;
     bool backup_aor_pair_alloced = false;
@@ -102,7 +100,7 @@ static bool sdm_access_common(SubscriberDataManager::AoRPair** aor_pair,
 
     if (found_binding)
     {
-      (*aor_pair)->get_current()->copy_subscriptions_and_bindings(backup_aor_pair->get_current());
+      aor_pair->get_current()->copy_subscriptions_and_bindings(backup_aor_pair->get_current());
     }
 
     if (backup_aor_pair_alloced)
@@ -115,6 +113,24 @@ static bool sdm_access_common(SubscriberDataManager::AoRPair** aor_pair,
   return true;
 }
 
+// If we can't find the AoR pair in the current SDM, we will either use the
+// backup_aor_pair or we will try and look up the AoR pair in the remote SDMs.
+// Therefore either the backup_aor_pair should be NULL, or remote_sdms should be empty.
+static bool sdm_access_common(SubscriberDataManager::AoRPair** aor_pair,
+                              std::string aor_id,
+                              SubscriberDataManager* current_sdm,
+                              std::vector<SubscriberDataManager*> remote_sdms,
+                              SubscriberDataManager::AoRPair* backup_aor_pair,
+                              SAS::TrailId trail)
+{
+  // Find the current bindings for the AoR.
+  delete *aor_pair;
+  *aor_pair = current_sdm->get_aor_data(aor_id, trail);
+  TRC_DEBUG("Retrieved AoR data %p", *aor_pair);
+
+  return sdm_apply_backup(*aor_pair, aor_id, remote_sdms, backup_aor_pair, trail);
+}
+
 static bool get_reg_data(HSSConnection* hss,
                          std::string aor_id,
                          AssociatedURIs& associated_uris,
@@ -471,57 +487,95 @@ HTTPCode DeregistrationTask::handle_request()
 {
   std::set<std::string> impis_to_delete;
 
-  for (std::map<std::string, std::string>::iterator it=_bindings.begin();
-       it!=_bindings.end();
-       ++it)
+  // The HSS has deregistered these subscribers, so don't reuse any digest AVs
+  // we've cached for them.
+  if (_cfg->_digest_av_cache != NULL)
   {
-    SubscriberDataManager::AoRPair* aor_pair =
-      deregister_bindings(_cfg->_sdm,
-                          _cfg->_hss,
-                          it->first,
-                          it->second,
-                          NULL,
-                          _cfg->_remote_sdms,
-                          impis_to_delete);
-
-    // LCOV_EXCL_START
-    if ((aor_pair != NULL) &&
-        (aor_pair->get_current() != NULL))
+    for (std::map<std::string, std::string>::iterator it=_bindings.begin();
+         it!=_bindings.end();
+         ++it)
     {
-      // If we have any remote stores, try to store this in them too.  We don't worry
-      // about failures in this case.
-      for (std::vector<SubscriberDataManager*>::const_iterator sdm = _cfg->_remote_sdms.begin();
-           sdm != _cfg->_remote_sdms.end();
-           ++sdm)
+      if (!it->second.empty())
       {
-        if ((*sdm)->has_servers())
-        {
-          SubscriberDataManager::AoRPair* remote_aor_pair =
-            deregister_bindings(*sdm,
-                                _cfg->_hss,
-                                it->first,
-                                it->second,
-                                aor_pair,
-                                {},
-                                impis_to_delete);
-          delete remote_aor_pair;
-        }
+        _cfg->_digest_av_cache->invalidate(it->second);
       }
     }
-    // LCOV_EXCL_STOP
+  }
+
+  // Deregister all the AoRs from the local store in one batch, so that the
+  // store accesses for the different AoRs are pipelined.
+  std::map<std::string, SubscriberDataManager::AoRPair*> aor_pairs =
+    deregister_bindings(_cfg->_sdm,
+                        _cfg->_hss,
+                        _bindings,
+                        {},
+                        _cfg->_remote_sdms,
+                        impis_to_delete,
+                        true);
+
+  std::map<std::string, std::string> deregistered_bindings;
+  bool failed = false;
+
+  for (std::map<std::string, SubscriberDataManager::AoRPair*>::iterator it =
+         aor_pairs.begin();
+       it != aor_pairs.end();
+       ++it)
+  {
+    if ((it->second != NULL) &&
+        (it->second->get_current() != NULL))
+    {
+      deregistered_bindings[it->first] = _bindings[it->first];
+    }
     else
     {
-      // Can't connect to memcached, return 500. If this isn't the first AoR being edited
-      // then this will lead to an inconsistency between the HSS and Sprout, as
-      // Sprout will have changed some of the AoRs, but HSS will believe they all failed.
-      // Sprout accepts changes to AoRs that don't exist though.
+      // Can't connect to memcached, return 500. If earlier AoRs were edited
+      // successfully then this will lead to an inconsistency between the HSS
+      // and Sprout, as Sprout will have changed some of the AoRs, but HSS will
+      // believe they all failed. Sprout accepts changes to AoRs that don't
+      // exist though.
       TRC_WARNING("Unable to connect to memcached for AoR %s", it->first.c_str());
+      failed = true;
+    }
+  }
 
-      delete aor_pair;
-      return HTTP_SERVER_ERROR;
+  // LCOV_EXCL_START
+  if (!deregistered_bindings.empty())
+  {
+    // If we have any remote stores, try to store the AoRs we deregistered
+    // locally in them too.  We don't worry about failures in this case.
+    for (std::vector<SubscriberDataManager*>::const_iterator sdm = _cfg->_remote_sdms.begin();
+         sdm != _cfg->_remote_sdms.end();
+         ++sdm)
+    {
+      if ((*sdm)->has_servers())
+      {
+        std::map<std::string, SubscriberDataManager::AoRPair*> remote_aor_pairs =
+          deregister_bindings(*sdm,
+                              _cfg->_hss,
+                              deregistered_bindings,
+                              aor_pairs,
+                              {},
+                              impis_to_delete,
+                              false);
+
+        for (std::pair<std::string, SubscriberDataManager::AoRPair*> remote_aor_pair :
+               remote_aor_pairs)
+        {
+          delete remote_aor_pair.second;
+        }
+      }
     }
+  }
+  // LCOV_EXCL_STOP
 
-    delete aor_pair;
+  for (std::pair<std::string, SubscriberDataManager::AoRPair*> aor_pair : aor_pairs)
+  {
+    delete aor_pair.second;
+  }
+
+  if (failed)
+  {
+    return HTTP_SERVER_ERROR;
   }
 
   // Delete IMPIs from the store.
@@ -531,6 +585,11 @@ HTTPCode DeregistrationTask::handle_request()
   {
     TRC_DEBUG("Delete %s from the IMPI store(s)", impi->c_str());
 
+    if (_cfg->_digest_av_cache != NULL)
+    {
+      _cfg->_digest_av_cache->invalidate(*impi);
+    }
+
     delete_impi_from_store(_cfg->_local_impi_store, *impi);
     for (ImpiStore* store: _cfg->_remote_impi_stores)
     {
@@ -565,98 +624,168 @@ void DeregistrationTask::delete_impi_from_store(ImpiStore* store,
 }
 
 
-SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
-                                        SubscriberDataManager* current_sdm,
-                                        HSSConnection* hss,
-                                        std::string aor_id,
-                                        std::string private_id,
-                                        SubscriberDataManager::AoRPair* previous_aor_pair,
-                                        std::vector<SubscriberDataManager*> remote_sdms,
-                                        std::set<std::string>& impis_to_delete)
+std::map<std::string, SubscriberDataManager::AoRPair*>
+  DeregistrationTask::deregister_bindings(
+             SubscriberDataManager* current_sdm,
+             HSSConnection* hss,
+             const std::map<std::string, std::string>& bindings,
+             const std::map<std::string, SubscriberDataManager::AoRPair*>& previous_aor_pairs,
+             std::vector<SubscriberDataManager*> remote_sdms,
+             std::set<std::string>& impis_to_delete,
+             bool stop_at_failure)
 {
-  SubscriberDataManager::AoRPair* aor_pair = NULL;
-  bool all_bindings_expired = false;
-  bool got_ifcs;
-  Store::Status set_rc;
-  std::vector<std::string> impis_to_dereg;
+  std::map<std::string, SubscriberDataManager::AoRPair*> aor_pairs;
+  std::map<std::string, AssociatedURIs> associated_uris;
+  std::map<std::string, std::map<std::string, Ifcs>> ifc_maps;
+  std::set<std::string> got_ifcs;
+  std::set<std::string> skipped_aor_ids;
+  std::vector<std::string> pending_aor_ids;
 
   // Get registration data
-  AssociatedURIs associated_uris;
-  std::map<std::string, Ifcs> ifc_map;
-  got_ifcs = get_reg_data(_cfg->_hss, aor_id, associated_uris, ifc_map, trail());
-
-  do
+  for (const std::pair<std::string, std::string>& binding : bindings)
   {
-    if (!sdm_access_common(&aor_pair,
-                           aor_id,
-                           current_sdm,
-                           remote_sdms,
-                           previous_aor_pair,
-                           trail()))
+    const std::string& aor_id = binding.first;
+    aor_pairs[aor_id] = NULL;
+    pending_aor_ids.push_back(aor_id);
+
+    if (get_reg_data(_cfg->_hss,
+                     aor_id,
+                     associated_uris[aor_id],
+                     ifc_maps[aor_id],
+                     trail()))
     {
-      break;
+      got_ifcs.insert(aor_id);
     }
+  }
 
-    std::vector<std::string> binding_ids;
+  // Read all the AoRs, remove the bindings and write them back.  Any AoRs
+  // that hit contention are reread and retried together.
+  //
+  // If stop_at_failure is set, the AoRs are handled in order, as they would
+  // be if they were deregistered one at a time, and we stop at the first one
+  // that we can't read - that fails the request, and the AoRs after it are
+  // left alone.
+  while (!pending_aor_ids.empty())
+  {
+    std::vector<SubscriberDataManager::AoRPair*> fetched_aor_pairs =
+      current_sdm->get_aor_data_multi(pending_aor_ids, trail());
+    std::vector<SubscriberDataManager::AoRUpdate> updates;
 
-    for (SubscriberDataManager::AoR::Bindings::const_iterator i =
-           aor_pair->get_current()->bindings().begin();
-         i != aor_pair->get_current()->bindings().end();
-         ++i)
+    for (size_t ii = 0; ii < pending_aor_ids.size(); ++ii)
     {
-      // Get a list of the bindings to iterate over
-      binding_ids.push_back(i->first);
-    }
+      const std::string& aor_id = pending_aor_ids[ii];
+      const std::string& private_id = bindings.at(aor_id);
+      SubscriberDataManager::AoRPair* aor_pair = fetched_aor_pairs[ii];
+      TRC_DEBUG("Retrieved AoR data %p", aor_pair);
+
+      std::map<std::string, SubscriberDataManager::AoRPair*>::const_iterator prev =
+        previous_aor_pairs.find(aor_id);
+      SubscriberDataManager::AoRPair* previous_aor_pair =
+        (prev != previous_aor_pairs.end()) ? prev->second : NULL;
+
+      if (!sdm_apply_backup(aor_pair,
+                            aor_id,
+                            remote_sdms,
+                            previous_aor_pair,
+                            trail()))
+      {
+        delete aor_pair;
 
-    for (std::vector<std::string>::const_iterator i = binding_ids.begin();
-         i != binding_ids.end();
-         ++i)
-    {
-      std::string b_id = *i;
-      SubscriberDataManager::AoR::Binding* b =
-                                  aor_pair->get_current()->get_binding(b_id);
+        if (stop_at_failure)
+        {
+          for (size_t jj = ii + 1; jj < pending_aor_ids.size(); ++jj)
+          {
+            TRC_DEBUG("Not deregistering AoR %s after failure",
+                      pending_aor_ids[jj].c_str());
+            skipped_aor_ids.insert(pending_aor_ids[jj]);
+            delete fetched_aor_pairs[jj];
+          }
+          break;
+        }
 
-      if (private_id.empty() || private_id == b->_private_id)
+        continue;
+      }
+
+      std::vector<std::string> binding_ids;
+
+      for (SubscriberDataManager::AoR::Bindings::const_iterator i =
+             aor_pair->get_current()->bindings().begin();
+           i != aor_pair->get_current()->bindings().end();
+           ++i)
       {
-        if (!b->_private_id.empty())
+        // Get a list of the bindings to iterate over
+        binding_ids.push_back(i->first);
+      }
+
+      for (std::vector<std::string>::const_iterator i = binding_ids.begin();
+           i != binding_ids.end();
+           ++i)
+      {
+        std::string b_id = *i;
+        SubscriberDataManager::AoR::Binding* b =
+                                    aor_pair->get_current()->get_binding(b_id);
+
+        if (private_id.empty() || private_id == b->_private_id)
         {
-          // Record the IMPIs that we need to delete as a result of deleting
-          // this binding.
-          impis_to_delete.insert(b->_private_id);
+          if (!b->_private_id.empty())
+          {
+            // Record the IMPIs that we need to delete as a result of deleting
+            // this binding.
+            impis_to_delete.insert(b->_private_id);
+          }
+          aor_pair->get_current()->remove_binding(b_id);
         }
-        aor_pair->get_current()->remove_binding(b_id);
       }
+
+      updates.push_back(SubscriberDataManager::AoRUpdate(aor_id,
+                                                         &associated_uris[aor_id],
+                                                         aor_pair));
     }
 
-    set_rc = current_sdm->set_aor_data(aor_id,
-                                       &associated_uris,
-                                       aor_pair,
-                                       trail(),
-                                       all_bindings_expired);
-    if (set_rc != Store::OK)
+    current_sdm->set_aor_data_multi(updates, trail());
+    pending_aor_ids.clear();
+
+    for (SubscriberDataManager::AoRUpdate& update : updates)
     {
-      delete aor_pair; aor_pair = NULL;
+      if (update.status == Store::OK)
+      {
+        aor_pairs[update.aor_id] = update.aor_pair;
+      }
+      else
+      {
+        delete update.aor_pair;
+
+        if (update.status == Store::DATA_CONTENTION)
+        {
+          pending_aor_ids.push_back(update.aor_id);
+        }
+      }
     }
   }
-  while (set_rc == Store::DATA_CONTENTION);
 
-  if (private_id == "")
+  for (const std::pair<std::string, std::string>& binding : bindings)
   {
-    // Deregister with any application servers
-    TRC_INFO("ID %s", aor_id.c_str());
+    const std::string& aor_id = binding.first;
 
-    if (got_ifcs)
+    if ((binding.second == "") &&
+        (skipped_aor_ids.find(aor_id) == skipped_aor_ids.end()))
     {
-      RegistrationUtils::deregister_with_application_servers(ifc_map[aor_id],
-                                                             current_sdm,
-                                                             remote_sdms,
-                                                             hss,
-                                                             aor_id,
-                                                             trail());
+      // Deregister with any application servers
+      TRC_INFO("ID %s", aor_id.c_str());
+
+      if (got_ifcs.find(aor_id) != got_ifcs.end())
+      {
+        RegistrationUtils::deregister_with_application_servers(ifc_maps[aor_id][aor_id],
+                                                               current_sdm,
+                                                               remote_sdms,
+                                                               hss,
+                                                               aor_id,
+                                                               trail());
+      }
     }
   }
 
-  return aor_pair;
+  return aor_pairs;
 }
 
 HTTPCode AuthTimeoutTask::handle_response(std::string body)
@@ -679,6 +808,11 @@ HTTPCode AuthTimeoutTask::handle_response(std::string body)
     JSON_GET_STRING_MEMBER(doc, "impi", _impi);
     JSON_GET_STRING_MEMBER(doc, "nonce", _nonce);
     report_sip_all_register_marker(trail(), _impu);
+
+    // Stateless challenges are only in the store once they've been used.
+    _stateless = ((doc.HasMember("stateless")) &&
+                  (doc["stateless"].IsBool()) &&
+                  (doc["stateless"].GetBool()));
   }
   catch (JsonFormatError err)
   {
@@ -703,15 +837,20 @@ HTTPCode AuthTimeoutTask::handle_response(std::string body)
   {
     auth_challenge = impi->get_auth_challenge(_nonce);
   }
-  if (auth_challenge != NULL)
+  if ((auth_challenge != NULL) || ((impi != NULL) && (_stateless)))
   {
     // Use the original REGISTER's branch parameter for SAS
     // correlation
-    correlate_trail_to_challenge(auth_challenge, trail());
+    if (auth_challenge != NULL)
+    {
+      correlate_trail_to_challenge(auth_challenge, trail());
+    }
 
-    // If authentication completed, we'll have incremented the nonce count.
-    // If not, authentication has timed out.
-    if (auth_challenge->nonce_count == ImpiStore::AuthChallenge::INITIAL_NONCE_COUNT)
+    // If authentication completed, we'll have incremented the nonce count
+    // (and, for a stateless challenge, written it to the store). If not,
+    // authentication has timed out.
+    if ((auth_challenge == NULL) ||
+        (auth_challenge->nonce_count == ImpiStore::AuthChallenge::INITIAL_NONCE_COUNT))
     {
       TRC_DEBUG("AV for %s:%s has timed out", _impi.c_str(), _nonce.c_str());
 
@@ -936,3 +1075,24 @@ void DeleteImpuTask::run()
   delete this;
   return;
 }
+
+//
+// API for retrieving Sproutlet resource usage.
+//
+
+void SproutletStatsTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(_cfg->_proxy->stats_json());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
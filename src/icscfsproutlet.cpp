@@ -106,6 +106,16 @@ SproutletTsx* ICSCFSproutlet::get_tsx(SproutletHelper* helper,
   }
 }
 
+/// REGISTER requests are always handled statefully, as the I-CSCF looks at
+/// the responses to them (to retry to an alternative S-CSCF).  Other
+/// requests can be routed statelessly, unless ACRs are being sent (as they
+/// need the responses).
+bool ICSCFSproutlet::supports_stateless(const pjsip_msg* req) const
+{
+  return ((req->line.req.method.id != PJSIP_REGISTER_METHOD) &&
+          (!_acr_factory->sends_acrs()));
+}
+
 /// Get an ACR instance from the factory.
 ///
 /// @param trail                SAS trail identifier to use for the ACR.
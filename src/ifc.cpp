@@ -44,6 +44,143 @@ using namespace rapidxml;
 #define ORIGINATING_UNREGISTERED 3
 #define ORIGINATING_CDIV 4
 
+SPTMatchCache::SPTMatchCache(pjsip_msg* msg)
+{
+  // Build the index of header names up front. Header values are only
+  // rendered if a Content regex needs to be tested against them.
+  for (pjsip_hdr* header = msg->hdr.next;
+       header != &msg->hdr;
+       header = header->next)
+  {
+    IndexedHeader indexed;
+    indexed.hdr = header;
+    indexed.name = PJUtils::pj_str_to_string(&header->name);
+    indexed.value_set = false;
+    _headers.push_back(indexed);
+  }
+}
+
+const std::string& SPTMatchCache::header_value(IndexedHeader& header)
+{
+  if (!header.value_set)
+  {
+    header.value = PJUtils::get_header_value(header.hdr);
+    header.value_set = true;
+  }
+
+  return header.value;
+}
+
+const std::vector<size_t>* SPTMatchCache::headers_matching(const std::string& header_re)
+{
+  std::map<std::string, std::vector<size_t>>::iterator it =
+                                                   _name_matches.find(header_re);
+  if (it == _name_matches.end())
+  {
+    boost::regex header_regex(header_re,
+                              boost::regex_constants::icase |
+                              boost::regex_constants::no_except);
+    if (header_regex.status())
+    {
+      return NULL;
+    }
+
+    // Run the regex over every header name in one pass, recording which
+    // headers it fired on.
+    std::vector<size_t> matches;
+    for (size_t ii = 0; ii < _headers.size(); ++ii)
+    {
+      if (boost::regex_search(_headers[ii].name, header_regex))
+      {
+        matches.push_back(ii);
+      }
+    }
+
+    it = _name_matches.insert(std::make_pair(header_re, matches)).first;
+  }
+
+  return &it->second;
+}
+
+const boost::regex* SPTMatchCache::content_regex(const std::string& content_re)
+{
+  std::map<std::string, boost::regex>::iterator it =
+                                               _content_regexes.find(content_re);
+  if (it == _content_regexes.end())
+  {
+    it = _content_regexes.insert(
+            std::make_pair(content_re,
+                           boost::regex(content_re,
+                                        boost::regex_constants::no_except))).first;
+  }
+
+  return (it->second.status() == 0) ? &it->second : NULL;
+}
+
+SPTMatchCache::HeaderResult SPTMatchCache::header_matches(const std::string& header_re,
+                                                          const std::string* content_re)
+{
+  // The key distinguishes a trigger with no Content element from one with an
+  // empty Content element.
+  std::string key = header_re;
+  key.push_back('\0');
+  if (content_re != NULL)
+  {
+    key.push_back('C');
+    key.append(*content_re);
+  }
+
+  std::map<std::string, HeaderResult>::const_iterator cached = _results.find(key);
+  if (cached != _results.end())
+  {
+    return cached->second;
+  }
+
+  HeaderResult result = NO_MATCH;
+  const std::vector<size_t>* matches = headers_matching(header_re);
+
+  if (matches == NULL)
+  {
+    result = INVALID_HEADER_REGEX;
+  }
+  else if (!matches->empty())
+  {
+    if (content_re == NULL)
+    {
+      // We've found a matching header, and don't have to match on content.
+      result = MATCH;
+    }
+    else
+    {
+      // The content regex is only compiled (and so only validated) if there
+      // is a header to test it against.
+      const boost::regex* regex = content_regex(*content_re);
+      if (regex == NULL)
+      {
+        result = INVALID_CONTENT_REGEX;
+      }
+      else
+      {
+        for (std::vector<size_t>::const_iterator ii = matches->begin();
+             ii != matches->end();
+             ++ii)
+        {
+          if (boost::regex_search(header_value(_headers[*ii]), *regex))
+          {
+            // We've found a matching header, and have matching content in
+            // one field.
+            result = MATCH;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  _results[key] = result;
+  return result;
+}
+
 Ifc::Ifc(std::string ifc_str,
          rapidxml::xml_document<>* ifc_doc) :
   _ifc(NULL)
@@ -85,7 +222,8 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
                       xml_node<>* spt,                  //< The Service Point Trigger node
                       std::string ifc_str,
                       std::string server_name,
-                      SAS::TrailId trail)
+                      SAS::TrailId trail,
+                      SPTMatchCache* cache)             //< Per-message cache of header matches
 {
   // Find the class node.
   xml_node<>* node = spt->first_node();
@@ -182,9 +320,6 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
   {
     xml_node<>* spt_header = node->first_node(RegDataXMLUtils::HEADER);
     xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
-    boost::regex header_regex;
-    boost::regex content_regex;
-    pjsip_hdr* header = NULL;
 
     if (!spt_header)
     {
@@ -192,51 +327,33 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
                   server_name, SASEvent::IFC_INVALID, 0, trail);
     }
 
-    header_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_header),
-                                boost::regex_constants::icase |
-                                boost::regex_constants::no_except);
-    if (header_regex.status())
+    std::string header_str = XMLUtils::get_text_or_cdata(spt_header);
+    std::string content_str;
+    if (spt_content)
     {
-      invalid_ifc("Invalid regular expression in Header element for SIPHeader service point trigger",
-                  server_name, SASEvent::IFC_INVALID, 0, trail);
+      content_str = XMLUtils::get_text_or_cdata(spt_content);
     }
 
-    for (header = msg->hdr.next; header != &msg->hdr; header = header->next)
+    switch (cache->header_matches(header_str,
+                                  spt_content ? &content_str : NULL))
     {
-      if (boost::regex_search(PJUtils::pj_str_to_string(&(header->name)), header_regex))
-      {
-        if (!spt_content)
-        {
-          // We've found a matching header, and don't have to match on content
-          ret = true;
-        }
-        else
-        {
-          std::string header_value = PJUtils::get_header_value(header);
-          // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once
-          if (content_regex.status())
-          {
-            content_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_content),
-                                         boost::regex_constants::no_except);
-            if (content_regex.status())
-            {
-              invalid_ifc("Invalid regular expression in Content element for SIPHeader service point trigger",
-                          server_name, SASEvent::IFC_INVALID, 0, trail);
-            }
-          }
+    case SPTMatchCache::MATCH:
+      ret = true;
+      break;
 
-          if (boost::regex_search(header_value, content_regex))
-          {
-            // We've found a matching header, and have matching content in one field
-            ret = true;
-          }
-        }
-      }
-      if (ret)
-      {
-        // Stop processing other headers once we have a match
-        break;
-      }
+    case SPTMatchCache::NO_MATCH:
+      ret = false;
+      break;
+
+    case SPTMatchCache::INVALID_HEADER_REGEX:
+      invalid_ifc("Invalid regular expression in Header element for SIPHeader service point trigger",
+                  server_name, SASEvent::IFC_INVALID, 0, trail);
+      break;
+
+    case SPTMatchCache::INVALID_CONTENT_REGEX:
+      invalid_ifc("Invalid regular expression in Content element for SIPHeader service point trigger",
+                  server_name, SASEvent::IFC_INVALID, 0, trail);
+      break;
     }
   }
   else if (strcmp(RegDataXMLUtils::SESSION_CASE, name) == 0)
@@ -402,7 +519,8 @@ bool Ifc::filter_matches(const SessionCase& session_case,
                          bool is_registered,
                          bool is_initial_registration,
                          pjsip_msg* msg,
-                         SAS::TrailId trail) const
+                         SAS::TrailId trail,
+                         SPTMatchCache* cache) const
 {
   std::string ifc_str;
   rapidxml::print(std::back_inserter(ifc_str), *_ifc, 0);
@@ -412,6 +530,15 @@ bool Ifc::filter_matches(const SessionCase& session_case,
   SAS::report_event(event);
   std::string server_name;
 
+  // If the caller hasn't supplied a cache (because it is only testing a single
+  // iFC) then use one local to this evaluation.
+  std::unique_ptr<SPTMatchCache> local_cache;
+  if (cache == NULL)
+  {
+    local_cache.reset(new SPTMatchCache(msg));
+    cache = local_cache.get();
+  }
+
   try
   {
     xml_node<>* as = _ifc->first_node(RegDataXMLUtils::APPLICATION_SERVER);
@@ -497,7 +624,8 @@ bool Ifc::filter_matches(const SessionCase& session_case,
                              spt,
                              ifc_str,
                              server_name,
-                             trail) != neg;
+                             trail,
+                             cache) != neg;
 
       for (xml_node<>* group_node = spt->first_node(RegDataXMLUtils::GROUP);
            group_node;
@@ -154,11 +154,21 @@ void Ifcs::interpret(const SessionCase& session_case,  //< The session case
                      SAS::TrailId trail) const  //< SAS trail
 {
   TRC_DEBUG("Interpreting %s IFC information", session_case.to_string().c_str());
+
+  // The message doesn't change while we're interpreting the iFCs, so index its
+  // headers once and share the results of SIPHeader triggers across all iFCs.
+  SPTMatchCache cache(msg);
+
   for (std::vector<Ifc>::const_iterator it = _ifcs.begin();
        it != _ifcs.end();
        ++it)
   {
-    if (it->filter_matches(session_case, is_registered, is_initial_registration, msg, trail))
+    if (it->filter_matches(session_case,
+                           is_registered,
+                           is_initial_registration,
+                           msg,
+                           trail,
+                           &cache))
     {
       application_servers.push_back(it->as_invocation());
     }
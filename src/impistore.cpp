@@ -15,6 +15,7 @@
 #include "log.h"
 #include "store.h"
 #include "impistore.h"
+#include "parallel_store_ops.h"
 #include "sas.h"
 #include "sproutsasevent.h"
 #include <rapidjson/writer.h>
@@ -604,8 +605,8 @@ int ImpiStore::Impi::get_expires()
   return expires;
 }
 
-ImpiStore::ImpiStore(Store* data_store, Mode mode) :
-  _data_store(data_store), _mode(mode)
+ImpiStore::ImpiStore(Store* data_store, Mode mode, ParallelStoreOps* parallel_ops) :
+  _data_store(data_store), _mode(mode), _parallel_ops(parallel_ops)
 {
 }
 
@@ -613,48 +614,70 @@ ImpiStore::~ImpiStore()
 {
 }
 
+void ImpiStore::run_store_ops(std::vector<std::function<void()>>& ops)
+{
+  if (_parallel_ops != NULL)
+  {
+    _parallel_ops->run(ops);
+  }
+  else
+  {
+    for (std::function<void()>& op : ops)
+    {
+      op();
+    }
+  }
+}
+
 Store::Status ImpiStore::set_impi(Impi* impi,
                                   SAS::TrailId trail)
 {
   int now = time(NULL);
+  std::vector<std::function<void()>> ops;
 
   // First serialize the IMPI and set it in the store.
-  std::string data = impi->to_json();
-  TRC_DEBUG("Storing IMPI for %s\n%s", impi->impi.c_str(), data.c_str());
-  Store::Status status = _data_store->set_data(TABLE_IMPI,
-                                               impi->impi,
-                                               data,
-                                               impi->_cas,
-                                               impi->get_expires() - now,
-                                               trail);
-  if (status == Store::Status::OK)
-  {
-    SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_SET_SUCCESS, 0);
-    event.add_var_param(impi->impi);
-    SAS::report_event(event);
-  }
-  else
+  Store::Status status = Store::Status::OK;
+  ops.push_back([this, impi, now, trail, &status]()
   {
-    // LCOV_EXCL_START
-    if (status != Store::Status::DATA_CONTENTION)
+    std::string data = impi->to_json();
+    TRC_DEBUG("Storing IMPI for %s\n%s", impi->impi.c_str(), data.c_str());
+    status = _data_store->set_data(TABLE_IMPI,
+                                   impi->impi,
+                                   data,
+                                   impi->_cas,
+                                   impi->get_expires() - now,
+                                   trail);
+    if (status == Store::Status::OK)
     {
-      TRC_ERROR("Failed to write IMPI for private_id %s", impi->impi.c_str());
+      SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_SET_SUCCESS, 0);
+      event.add_var_param(impi->impi);
+      SAS::report_event(event);
     }
+    else
+    {
+      // LCOV_EXCL_START
+      if (status != Store::Status::DATA_CONTENTION)
+      {
+        TRC_ERROR("Failed to write IMPI for private_id %s", impi->impi.c_str());
+      }
 
-    SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_SET_FAILURE, 0);
-    event.add_var_param(impi->impi);
-    SAS::report_event(event);
-    // LCOV_EXCL_STOP
-  }
+      SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_SET_FAILURE, 0);
+      event.add_var_param(impi->impi);
+      SAS::report_event(event);
+      // LCOV_EXCL_STOP
+    }
+  });
 
   // If we're in Mode::READ_AV_IMPI_WRITE_AV_IMPI, also set the AVs in the
-  // store.
+  // store.  These writes go out alongside the IMPI write.
+  std::vector<Store::Status> av_statuses;
   if (_mode == ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI)
   {
     // Build a list of nonces to delete.  We'll remove ones for which
     // AuthChallenges still exist as we go through serializing them, and then
     // delete the rest at the end.
     std::vector<std::string> nonces_to_delete = impi->_nonces;
+    std::vector<ImpiStore::AuthChallenge*> avs_to_set;
 
     for (std::vector<ImpiStore::AuthChallenge*>::iterator it = impi->auth_challenges.begin();
          it != impi->auth_challenges.end();
@@ -663,39 +686,8 @@ Store::Status ImpiStore::set_impi(Impi* impi,
       std::string nonce = (*it)->nonce;
       if ((*it)->expires > now)
       {
-        // The AuthChallenge hasn't expired, so serialize it and set it in the
-        // store.
-        data = (*it)->to_json_av();
-        TRC_DEBUG("Storing AV for %s/%s\n%s", impi->impi.c_str(), nonce.c_str(), data.c_str());
-        Store::Status local_status = _data_store->set_data(TABLE_AV,
-                                                           impi->impi + '\\' + nonce,
-                                                           data,
-                                                           (*it)->_cas,
-                                                           (*it)->expires - now,
-                                                           trail);
-        if (local_status == Store::Status::OK)
-        {
-          SAS::Event event(trail, SASEvent::IMPISTORE_AV_SET_SUCCESS, 0);
-          event.add_var_param(impi->impi);
-          event.add_var_param(nonce);
-          SAS::report_event(event);
-        }
-        else
-        {
-          // LCOV_EXCL_START
-          TRC_ERROR("Failed to set AV for %s/%s", impi->impi.c_str(), nonce.c_str());
-          SAS::Event event(trail, SASEvent::IMPISTORE_AV_SET_FAILURE, 0);
-          event.add_var_param(impi->impi);
-          event.add_var_param(nonce.c_str());
-          SAS::report_event(event);
-          // Update status, but only if it's not already DATA_CONTENTION - that's
-          // the most significant status.
-          if (status != Store::Status::DATA_CONTENTION)
-          {
-            status = local_status;
-          }
-          // LCOV_EXCL_STOP
-        }
+        // The AuthChallenge hasn't expired, so it needs setting in the store.
+        avs_to_set.push_back(*it);
       }
       else
       {
@@ -710,53 +702,156 @@ Store::Status ImpiStore::set_impi(Impi* impi,
                              nonces_to_delete.end());
     }
 
-    // Now spin through the nonces to delete, deleting them from the AV store.
-    for (std::vector<std::string>::iterator it = nonces_to_delete.begin();
-         it != nonces_to_delete.end();
-         it++)
+    // Size the status list up front so that the operations can safely write
+    // to it from other threads.
+    av_statuses.resize(avs_to_set.size() + nonces_to_delete.size(),
+                       Store::Status::OK);
+    size_t ii = 0;
+
+    for (ImpiStore::AuthChallenge* auth_challenge : avs_to_set)
     {
-      std::string nonce = *it;
-      TRC_DEBUG("Deleting AV for %s/%s", impi->impi.c_str(), nonce.c_str());
-      Store::Status local_status = _data_store->delete_data(TABLE_AV,
-                                                            impi->impi + '\\' + nonce,
-                                                            trail);
-      if (local_status == Store::Status::OK)
+      Store::Status* av_status = &av_statuses[ii++];
+      ops.push_back([this, impi, auth_challenge, now, trail, av_status]()
       {
-        SAS::Event event(trail, SASEvent::IMPISTORE_AV_DELETE_SUCCESS, 0);
-        event.add_var_param(impi->impi);
-        event.add_var_param(nonce);
-        SAS::report_event(event);
-      }
-      else
+        *av_status = set_av(impi->impi, auth_challenge, now, trail);
+      });
+    }
+
+    for (const std::string& nonce : nonces_to_delete)
+    {
+      Store::Status* av_status = &av_statuses[ii++];
+      ops.push_back([this, impi, nonce, trail, av_status]()
       {
-        // LCOV_EXCL_START
-        TRC_ERROR("Failed to delete AV for %s/%s", impi->impi.c_str(), nonce.c_str());
-        SAS::Event event(trail, SASEvent::IMPISTORE_AV_DELETE_FAILURE, 0);
-        event.add_var_param(impi->impi);
-        event.add_var_param(nonce.c_str());
-        SAS::report_event(event);
-        // Update status, but only if it's not already DATA_CONTENTION - that's
-        // the most significant status.
-        if (status != Store::Status::DATA_CONTENTION)
-        {
-          status = local_status;
-        }
-        // LCOV_EXCL_STOP
-      }
+        *av_status = delete_av(impi->impi, nonce, trail);
+      });
+    }
+  }
+
+  run_store_ops(ops);
+
+  for (Store::Status local_status : av_statuses)
+  {
+    // Update status, but only if it's not already DATA_CONTENTION - that's
+    // the most significant status.
+    if ((local_status != Store::Status::OK) &&
+        (status != Store::Status::DATA_CONTENTION))
+    {
+      status = local_status; // LCOV_EXCL_LINE
     }
   }
 
   return status;
 }
 
+Store::Status ImpiStore::set_av(const std::string& impi,
+                                ImpiStore::AuthChallenge* auth_challenge,
+                                int now,
+                                SAS::TrailId trail)
+{
+  std::string nonce = auth_challenge->nonce;
+  std::string data = auth_challenge->to_json_av();
+  TRC_DEBUG("Storing AV for %s/%s\n%s", impi.c_str(), nonce.c_str(), data.c_str());
+  Store::Status status = _data_store->set_data(TABLE_AV,
+                                               impi + '\\' + nonce,
+                                               data,
+                                               auth_challenge->_cas,
+                                               auth_challenge->expires - now,
+                                               trail);
+  if (status == Store::Status::OK)
+  {
+    SAS::Event event(trail, SASEvent::IMPISTORE_AV_SET_SUCCESS, 0);
+    event.add_var_param(impi);
+    event.add_var_param(nonce);
+    SAS::report_event(event);
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to set AV for %s/%s", impi.c_str(), nonce.c_str());
+    SAS::Event event(trail, SASEvent::IMPISTORE_AV_SET_FAILURE, 0);
+    event.add_var_param(impi);
+    event.add_var_param(nonce.c_str());
+    SAS::report_event(event);
+    // LCOV_EXCL_STOP
+  }
+
+  return status;
+}
+
+Store::Status ImpiStore::delete_av(const std::string& impi,
+                                   const std::string& nonce,
+                                   SAS::TrailId trail)
+{
+  TRC_DEBUG("Deleting AV for %s/%s", impi.c_str(), nonce.c_str());
+  Store::Status status = _data_store->delete_data(TABLE_AV,
+                                                  impi + '\\' + nonce,
+                                                  trail);
+  if (status == Store::Status::OK)
+  {
+    SAS::Event event(trail, SASEvent::IMPISTORE_AV_DELETE_SUCCESS, 0);
+    event.add_var_param(impi);
+    event.add_var_param(nonce);
+    SAS::report_event(event);
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to delete AV for %s/%s", impi.c_str(), nonce.c_str());
+    SAS::Event event(trail, SASEvent::IMPISTORE_AV_DELETE_FAILURE, 0);
+    event.add_var_param(impi);
+    event.add_var_param(nonce.c_str());
+    event.add_static_param(status);
+    SAS::report_event(event);
+    // LCOV_EXCL_STOP
+  }
+
+  return status;
+}
+
 ImpiStore::Impi* ImpiStore::get_impi(const std::string& impi,
                                      SAS::TrailId trail)
 {
-  // Get the IMPI data from the store and deserialize it.
+  return get_impi_and_avs(impi, NULL, trail);
+}
+
+ImpiStore::Impi* ImpiStore::get_impi_with_nonce(const std::string& impi,
+                                                const std::string& nonce,
+                                                SAS::TrailId trail)
+{
+  // If we're in Mode::READ_AV_IMPI_WRITE_AV_IMPI, look up the nonce
+  // explicitly, alongside the IMPI, in case the IMPI doesn't contain an
+  // AuthChallenge for it.
+  return get_impi_and_avs(impi,
+                          (_mode == ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI) ?
+                            &nonce : NULL,
+                          trail);
+}
+
+ImpiStore::Impi* ImpiStore::get_impi_and_avs(const std::string& impi,
+                                             const std::string* nonce,
+                                             SAS::TrailId trail)
+{
+  // Get the IMPI data from the store, and the AV for the nonce (if we've been
+  // given one) at the same time.
   ImpiStore::Impi* impi_obj = NULL;
+  ImpiStore::AuthChallenge* nonce_av = NULL;
   std::string data;
   uint64_t cas;
-  Store::Status status = _data_store->get_data(TABLE_IMPI, impi, data, cas, trail);
+  Store::Status status = Store::Status::OK;
+  std::vector<std::function<void()>> ops;
+  ops.push_back([this, &impi, &data, &cas, &status, trail]()
+  {
+    status = _data_store->get_data(TABLE_IMPI, impi, data, cas, trail);
+  });
+  if (nonce != NULL)
+  {
+    ops.push_back([this, &impi, nonce, &nonce_av, trail]()
+    {
+      nonce_av = get_av(impi, *nonce, trail);
+    });
+  }
+  run_store_ops(ops);
+
   if (status == Store::Status::OK)
   {
     TRC_DEBUG("Retrieved IMPI for %s\n%s", impi.c_str(), data.c_str());
@@ -770,23 +865,36 @@ ImpiStore::Impi* ImpiStore::get_impi(const std::string& impi,
       // If we're in Mode::READ_AV_IMPI_WRITE_AV_IMPI, spin through the
       // AuthChallenges, getting the version from the AV store if it exists.
       // In particular, this means we have the correct CAS for when we write
-      // back.  This might seem expensive but bear in mind that we expect to
-      // have very few AuthChallenges outstanding.
+      // back.  We expect to have very few AuthChallenges outstanding, and we
+      // look them all up at once.  We've already looked up the AV for the
+      // nonce we were given, so skip that one.
       if (_mode == ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI)
       {
-        for (std::vector<ImpiStore::AuthChallenge*>::iterator it = impi_obj->auth_challenges.begin();
-             it != impi_obj->auth_challenges.end();
-             it++)
+        size_t num_challenges = impi_obj->auth_challenges.size();
+        std::vector<ImpiStore::AuthChallenge*> avs(num_challenges, NULL);
+        std::vector<std::function<void()>> av_ops;
+        for (size_t ii = 0; ii < num_challenges; ii++)
+        {
+          const std::string& av_nonce = impi_obj->auth_challenges[ii]->nonce;
+          if ((nonce == NULL) || (av_nonce != *nonce))
+          {
+            ImpiStore::AuthChallenge** av = &avs[ii];
+            av_ops.push_back([this, &impi, &av_nonce, av, trail]()
+            {
+              *av = get_av(impi, av_nonce, trail);
+            });
+          }
+        }
+        run_store_ops(av_ops);
+
+        for (size_t ii = 0; ii < num_challenges; ii++)
         {
-          ImpiStore::AuthChallenge* auth_challenge_from_impi = *it;
-          ImpiStore::AuthChallenge* auth_challenge_from_av =
-            get_av(impi, auth_challenge_from_impi->nonce, trail);
-          if (auth_challenge_from_av != NULL)
+          if (avs[ii] != NULL)
           {
             // We got an AuthChallenge from the AV store, so replace the IMPI-
             // derived one.
-            *it = auth_challenge_from_av;
-            delete auth_challenge_from_impi;
+            delete impi_obj->auth_challenges[ii];
+            impi_obj->auth_challenges[ii] = avs[ii];
           }
         }
       }
@@ -810,96 +918,95 @@ ImpiStore::Impi* ImpiStore::get_impi(const std::string& impi,
     event.add_var_param(impi);
     SAS::report_event(event);
   }
-  return impi_obj;
-}
 
-ImpiStore::Impi* ImpiStore::get_impi_with_nonce(const std::string& impi,
-                                                const std::string& nonce,
-                                                SAS::TrailId trail)
-{
-  // First, get the IMPI without worrying about this nonce.
-  ImpiStore::Impi* impi_obj = get_impi(impi, trail);
-
-  // If we're in Mode::READ_AV_IMPI_WRITE_AV_IMPI and the IMPI doesn't already
-  // contain an AuthChallenge matching this nonce, look up the nonce
-  // explicitly.
-  if ((_mode == ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI) &&
-      (impi_obj != NULL) &&
-      (impi_obj->get_auth_challenge(nonce) == NULL))
+  if (nonce_av != NULL)
   {
-    ImpiStore::AuthChallenge* auth_challenge = get_av(impi, nonce, trail);
-    if (auth_challenge != NULL)
+    if (impi_obj != NULL)
     {
-      // Found an AuthChallenge - add it to the IMPI.
-      impi_obj->auth_challenges.push_back(auth_challenge);
-      impi_obj->_nonces.push_back(nonce);
+      // Found an AuthChallenge for the nonce - add it to the IMPI, replacing
+      // any IMPI-derived version.
+      std::vector<ImpiStore::AuthChallenge*>::iterator it =
+        std::find(impi_obj->auth_challenges.begin(),
+                  impi_obj->auth_challenges.end(),
+                  impi_obj->get_auth_challenge(*nonce));
+      if (it != impi_obj->auth_challenges.end())
+      {
+        delete *it;
+        *it = nonce_av;
+      }
+      else
+      {
+        impi_obj->auth_challenges.push_back(nonce_av);
+        impi_obj->_nonces.push_back(*nonce);
+      }
+    }
+    else
+    {
+      delete nonce_av;
     }
   }
+
   return impi_obj;
 }
 
 Store::Status ImpiStore::delete_impi(Impi* impi,
                                      SAS::TrailId trail)
 {
-  // First, delete the IMPI data from the store.
-  TRC_DEBUG("Deleting IMPI for %s", impi->impi.c_str());
-  Store::Status status = _data_store->delete_data(TABLE_IMPI,
-                                                  impi->impi,
-                                                  trail);
-  if (status == Store::Status::OK)
-  {
-    SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_DELETE_SUCCESS, 0);
-    event.add_var_param(impi->impi);
-    SAS::report_event(event);
-  }
-  else
+  std::vector<std::function<void()>> ops;
+
+  // Delete the IMPI data from the store.
+  Store::Status status = Store::Status::OK;
+  ops.push_back([this, impi, trail, &status]()
   {
-    // LCOV_EXCL_START
-    TRC_ERROR("Failed to delete IMPI for private_id %s", impi->impi.c_str());
-    SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_DELETE_FAILURE, 0);
-    event.add_var_param(impi->impi);
-    event.add_static_param(status);
-    SAS::report_event(event);
-    // LCOV_EXCL_STOP
-  }
+    TRC_DEBUG("Deleting IMPI for %s", impi->impi.c_str());
+    status = _data_store->delete_data(TABLE_IMPI,
+                                      impi->impi,
+                                      trail);
+    if (status == Store::Status::OK)
+    {
+      SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_DELETE_SUCCESS, 0);
+      event.add_var_param(impi->impi);
+      SAS::report_event(event);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to delete IMPI for private_id %s", impi->impi.c_str());
+      SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_DELETE_FAILURE, 0);
+      event.add_var_param(impi->impi);
+      event.add_static_param(status);
+      SAS::report_event(event);
+      // LCOV_EXCL_STOP
+    }
+  });
 
-  // If we're in Mode::READ_AV_IMPI_WRITE_AV_IMPI, also spin through the
-  // AuthChallenges, deleting them.
+  // If we're in Mode::READ_AV_IMPI_WRITE_AV_IMPI, also delete each of the
+  // AuthChallenges, alongside the IMPI.
+  std::vector<Store::Status> av_statuses;
   if (_mode == ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI)
   {
-    for (std::vector<ImpiStore::AuthChallenge*>::iterator it = impi->auth_challenges.begin();
-         it != impi->auth_challenges.end();
-         it++)
+    av_statuses.resize(impi->auth_challenges.size(), Store::Status::OK);
+    for (size_t ii = 0; ii < impi->auth_challenges.size(); ii++)
     {
-      std::string nonce = (*it)->nonce;
-      TRC_DEBUG("Deleting AV for %s/%s", impi->impi.c_str(), nonce.c_str());
-      Store::Status local_status = _data_store->delete_data(TABLE_AV,
-                                                            impi->impi + '\\' + nonce,
-                                                            trail);
-      if (local_status == Store::Status::OK)
-      {
-        SAS::Event event(trail, SASEvent::IMPISTORE_AV_DELETE_SUCCESS, 0);
-        event.add_var_param(impi->impi);
-        event.add_var_param(nonce);
-        SAS::report_event(event);
-      }
-      else
+      std::string nonce = impi->auth_challenges[ii]->nonce;
+      Store::Status* av_status = &av_statuses[ii];
+      ops.push_back([this, impi, nonce, trail, av_status]()
       {
-        // LCOV_EXCL_START
-        TRC_ERROR("Failed to delete AV for %s/%s", impi->impi.c_str(), nonce.c_str());
-        SAS::Event event(trail, SASEvent::IMPISTORE_AV_DELETE_FAILURE, 0);
-        event.add_var_param(impi->impi);
-        event.add_var_param(nonce.c_str());
-        event.add_static_param(local_status);
-        SAS::report_event(event);
-        // Update status, but only if it's not already DATA_CONTENTION - that's
-        // the most significant status.
-        if (status != Store::Status::DATA_CONTENTION)
-        {
-          status = local_status;
-        }
-        // LCOV_EXCL_STOP
-      }
+        *av_status = delete_av(impi->impi, nonce, trail);
+      });
+    }
+  }
+
+  run_store_ops(ops);
+
+  for (Store::Status local_status : av_statuses)
+  {
+    // Update status, but only if it's not already DATA_CONTENTION - that's
+    // the most significant status.
+    if ((local_status != Store::Status::OK) &&
+        (status != Store::Status::DATA_CONTENTION))
+    {
+      status = local_status; // LCOV_EXCL_LINE
     }
   }
 
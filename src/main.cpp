@@ -106,6 +106,9 @@ enum OptionTypes
   OPT_EXCEPTION_MAX_TTL,
   OPT_MAX_SESSION_EXPIRES,
   OPT_SIP_BLACKLIST_DURATION,
+  OPT_SIP_TARGET_CACHE,
+  OPT_SIP_LATENCY_WEIGHTING,
+  OPT_SIP_RESOLVER_THREADS,
   OPT_HTTP_BLACKLIST_DURATION,
   OPT_ASTAIRE_BLACKLIST_DURATION,
   OPT_SIP_TCP_CONNECT_TIMEOUT,
@@ -115,6 +118,7 @@ enum OptionTypes
   OPT_SESSION_TERMINATED_TIMEOUT_MS,
   OPT_STATELESS_PROXIES,
   OPT_RALF_THREADS,
+  OPT_STORE_OP_THREADS,
   OPT_NON_REGISTERING_PBXES,
   OPT_PBX_SERVICE_ROUTE,
   OPT_NON_REGISTER_AUTHENTICATION,
@@ -126,6 +130,9 @@ enum OptionTypes
   SPROUTLET_MACRO(SPROUTLET_OPTION_TYPES)
   OPT_IMPI_STORE_MODE,
   OPT_NONCE_COUNT_SUPPORTED,
+  OPT_STATELESS_NONCE_KEY,
+  OPT_DIGEST_AV_CACHE_TTL,
+  OPT_ENUM_NEGATIVE_CACHE_TTL,
   OPT_LOCAL_SITE_NAME,
   OPT_REGISTRATION_STORES,
   OPT_IMPI_STORES,
@@ -169,6 +176,7 @@ const static struct pj_getopt_option long_opt[] =
   { "enum",                         required_argument, 0, 'E'},
   { "enum-suffix",                  required_argument, 0, 'x'},
   { "enum-file",                    required_argument, 0, 'f'},
+  { "enum-negative-cache-ttl",      required_argument, 0, OPT_ENUM_NEGATIVE_CACHE_TTL},
   { "default-tel-uri-translation",  no_argument,       0, OPT_DEFAULT_TEL_URI_TRANSLATION},
   { "enforce-user-phone",           no_argument,       0, 'u'},
   { "enforce-global-only-lookups",  no_argument,       0, 'g'},
@@ -200,6 +208,9 @@ const static struct pj_getopt_option long_opt[] =
   { "cass-target-latency-us",       required_argument, 0, OPT_CASS_TARGET_LATENCY_US},
   { "exception-max-ttl",            required_argument, 0, OPT_EXCEPTION_MAX_TTL},
   { "sip-blacklist-duration",       required_argument, 0, OPT_SIP_BLACKLIST_DURATION},
+  { "sip-target-cache",             no_argument,       0, OPT_SIP_TARGET_CACHE},
+  { "sip-latency-weighting",        no_argument,       0, OPT_SIP_LATENCY_WEIGHTING},
+  { "sip-resolver-threads",         required_argument, 0, OPT_SIP_RESOLVER_THREADS},
   { "http-blacklist-duration",      required_argument, 0, OPT_HTTP_BLACKLIST_DURATION},
   { "astaire-blacklist-duration",   required_argument, 0, OPT_ASTAIRE_BLACKLIST_DURATION},
   { "sip-tcp-connect-timeout",      required_argument, 0, OPT_SIP_TCP_CONNECT_TIMEOUT},
@@ -210,6 +221,7 @@ const static struct pj_getopt_option long_opt[] =
   { "stateless-proxies",            required_argument, 0, OPT_STATELESS_PROXIES},
   { "non-registering-pbxes",        required_argument, 0, OPT_NON_REGISTERING_PBXES},
   { "ralf-threads",                 required_argument, 0, OPT_RALF_THREADS},
+  { "store-op-threads",             required_argument, 0, OPT_STORE_OP_THREADS},
   { "non-register-authentication",  required_argument, 0, OPT_NON_REGISTER_AUTHENTICATION},
   { "pbx-service-route",            required_argument, 0, OPT_PBX_SERVICE_ROUTE},
   { "force-3pr-body",               no_argument,       0, OPT_FORCE_THIRD_PARTY_REGISTER_BODY},
@@ -220,6 +232,8 @@ const static struct pj_getopt_option long_opt[] =
   SPROUTLET_MACRO(SPROUTLET_CFG_PJ_STRUCT)
   { "impi-store-mode",              required_argument, 0, OPT_IMPI_STORE_MODE},
   { "nonce-count-supported",        no_argument,       0, OPT_NONCE_COUNT_SUPPORTED},
+  { "stateless-nonce-key",          required_argument, 0, OPT_STATELESS_NONCE_KEY},
+  { "digest-av-cache-ttl",          required_argument, 0, OPT_DIGEST_AV_CACHE_TTL},
   { "scscf-node-uri",               required_argument, 0, OPT_SCSCF_NODE_URI},
   { "sas-use-signaling-interface",  no_argument,       0, OPT_SAS_USE_SIGNALING_IF},
   { "disable-tcp-switch",           no_argument,       0, OPT_DISABLE_TCP_SWITCH},
@@ -303,6 +317,9 @@ static void usage(void)
        "                            If 'pcscf,icscf,as', it also Record-Routes between every AS.\n"
        " -G, --ralf <server>        Name/IP address of Ralf (Rf) billing server.\n"
        "     --ralf-threads N       Number of Ralf threads (default: 25)\n"
+       "     --store-op-threads N   Number of threads shared by requests to issue independent IMPI and\n"
+       "                            registration store operations concurrently.  If 0, store\n"
+       "                            operations are issued one at a time (default: 16)\n"
        " -X, --xdms <server>        Name/IP address of XDM server\n"
        "     --dns-server <server>[,<server2>,<server3>]\n"
        "                            IP addresses of the DNS servers to use (defaults to 127.0.0.1)\n"
@@ -312,6 +329,10 @@ static void usage(void)
        " -x, --enum-suffix <suffix> Suffix appended to ENUM domains (default: .e164.arpa)\n"
        " -f, --enum-file <file>     JSON ENUM config file (can't be enabled at same time as\n"
        "                            -E)\n"
+       "     --enum-negative-cache-ttl <secs>\n"
+       "                            How long to cache ENUM domains that the ENUM server reports do not\n"
+       "                            exist. Other results are cached for the TTL of their NAPTR records\n"
+       "                            (default: 0, NXDOMAIN results are not cached)\n"
        "     --default-tel-uri-translation\n"
        "                            If no ENUM file or server is configured, always\n"
        "                            convert tel:+1234 to sip:+1234@homedomain\n"
@@ -375,6 +396,16 @@ static void usage(void)
        "                            The actual time is randomised.\n"
        "     --sip-blacklist-duration <secs>\n"
        "                            The amount of time to blacklist a SIP peer when it is unresponsive.\n"
+       "     --sip-target-cache     Cache the targets that SIP peers resolve to, and refresh them in the\n"
+       "                            background when they expire (default: false)\n"
+       "     --sip-latency-weighting\n"
+       "                            Favour SIP peers that respond quickly over others with the same\n"
+       "                            priority, and ramp up traffic to peers that have been blacklisted.\n"
+       "                            Implies --sip-target-cache (default: false)\n"
+       "     --sip-resolver-threads <n>\n"
+       "                            Number of threads used to resolve the next hop of proxied requests,\n"
+       "                            so that worker threads don't wait for DNS.  If 0, worker threads\n"
+       "                            resolve the next hop themselves (default: 4)\n"
        "     --http-blacklist-duration <secs>\n"
        "                            The amount of time to blacklist an HTTP peer when it is unresponsive.\n"
        "     --astaire-blacklist-duration <secs>\n"
@@ -424,6 +455,15 @@ static void usage(void)
        "     --nonce-count-supported\n"
        "                            Whether sprout accepts authentication responses with a nonce count\n"
        "                            greater than 1\n"
+       "     --stateless-nonce-key <key>\n"
+       "                            If set, SIP digest challenges are encrypted into the nonce using this\n"
+       "                            cluster-wide key rather than written to the IMPI store. The challenge\n"
+       "                            is only written once a response to it is accepted. AKA challenges\n"
+       "                            still use the store\n"
+       "     --digest-av-cache-ttl <secs>\n"
+       "                            How long to cache SIP digest authentication vectors retrieved from\n"
+       "                            the HSS, so that re-registrations can be challenged without querying\n"
+       "                            the HSS. AKA vectors are never cached (default: 0, no caching)\n"
        "     --scscf-node-uri <URI>\n"
        "                            The URI of this S-CSCF used by other servers, including AS, to contact\n"
        "                            this specific node. Defaults to \"sip:<localhost>:<port_scscf>\".\n"
@@ -451,7 +491,13 @@ static void usage(void)
        "     --http-acr-logging     Whether to include the bodies of ACR HTTP requests when they are logged \n"
        "                            to SAS\n"
        " -N, --plugin-option <plugin>,<name>,<value>\n"
-       "                            Provide an option value to a plugin.\n"
+       "                            Provide an option value to a plugin.  For any sproutlet, the\n"
+       "                            worker-threads option gives the sproutlet its own pool of that many\n"
+       "                            worker threads, and max-queue-depth sets how many requests can be\n"
+       "                            queued for them before new requests are rejected (default: 1000).\n"
+       "                            Setting the stateless option to true makes the icscf or bgcf\n"
+       "                            sproutlet forward requests received over TCP without creating\n"
+       "                            transactions, if it isn't sending ACRs.\n"
        " -F, --log-file <directory>\n"
        "                            Log to file in specified directory\n"
        " -L, --log-level N          Set log level to N (default: 4)\n"
@@ -796,6 +842,14 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_STORE_OP_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->store_op_threads,
+                           store_op_threads,
+                           Number of store operation threads);
+      }
+      break;
+
     case 'E':
       options->enum_servers.clear();
       Utils::split_string(std::string(pj_optarg), ',', options->enum_servers, 0, false);
@@ -813,6 +867,14 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("ENUM file set to %s", pj_optarg);
       break;
 
+    case OPT_ENUM_NEGATIVE_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->enum_negative_cache_ttl,
+                           enum_negative_cache_ttl,
+                           ENUM negative cache TTL);
+      }
+      break;
+
     case OPT_DEFAULT_TEL_URI_TRANSLATION:
       options->default_tel_uri_translation = true;
       TRC_INFO("Default TEL->SIP URI translation available as a fallback if no ENUM is configured");
@@ -1057,6 +1119,24 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_SIP_TARGET_CACHE:
+      options->sip_target_cache = true;
+      TRC_INFO("SIP target cache enabled");
+      break;
+
+    case OPT_SIP_LATENCY_WEIGHTING:
+      options->sip_latency_weighting = true;
+      TRC_INFO("SIP latency weighting enabled");
+      break;
+
+    case OPT_SIP_RESOLVER_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->sip_resolver_threads,
+                           sip_resolver_threads,
+                           SIP resolver threads);
+      }
+      break;
+
     case OPT_HTTP_BLACKLIST_DURATION:
       {
         VALIDATE_INT_PARAM(options->http_blacklist_duration,
@@ -1208,6 +1288,19 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Nonce counts supported");
       break;
 
+    case OPT_STATELESS_NONCE_KEY:
+      options->stateless_nonce_key = std::string(pj_optarg);
+      TRC_INFO("Stateless digest nonces enabled");
+      break;
+
+    case OPT_DIGEST_AV_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->digest_av_cache_ttl,
+                           digest_av_cache_ttl,
+                           Digest AV cache TTL);
+      }
+      break;
+
     case OPT_SAS_USE_SIGNALING_IF:
       options->sas_signaling_if = true;
       TRC_INFO("SAS connections created in the signaling namespace");
@@ -1410,6 +1503,49 @@ void reg_httpthread_with_pjsip(evhtp_t * htp, evthr_t * httpthread, void * arg)
 }
 
 
+/// Returns the index of the SNMP tables of a Sproutlet's resource stats
+/// under .1.2.826.0.1.1578918.9.3.49, for one of its service name or aliases.
+/// This only depends on the name (not on what other Sproutlets and aliases
+/// are loaded), so the OIDs don't change when the configuration does.  The
+/// built-in Sproutlets' default names have fixed indexes, and other names are
+/// hashed to an index of 100 or more.
+static int sproutlet_stats_index(const std::string& name)
+{
+  static const char* const BUILT_IN[] = {"scscf-proxy",
+                                         "scscf",
+                                         "authentication",
+                                         "registrar",
+                                         "subscription",
+                                         "icscf",
+                                         "bgcf",
+                                         "memento",
+                                         "mangelwurzel",
+                                         "gemini",
+                                         "cdiv",
+                                         "mmtel"};
+  static const int NUM_BUILT_IN = sizeof(BUILT_IN) / sizeof(BUILT_IN[0]);
+  static const uint32_t NUM_HASHED = 100000;
+
+  for (int ii = 0; ii < NUM_BUILT_IN; ++ii)
+  {
+    if (name == BUILT_IN[ii])
+    {
+      return ii + 1;
+    }
+  }
+
+  // FNV-1a, which (unlike std::hash) is the same on every build.
+  uint32_t hash = 2166136261u;
+
+  for (std::string::const_iterator c = name.begin(); c != name.end(); ++c)
+  {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+
+  return 100 + (int)(hash % NUM_HASHED);
+}
+
+
 void create_sdm_plugins(SubscriberDataManager::SerializerDeserializer*& serializer,
                         std::vector<SubscriberDataManager::SerializerDeserializer*>& deserializers,
                         MemcachedWriteFormat write_format)
@@ -1441,6 +1577,8 @@ SubscriberDataManager* local_sdm = NULL;
 std::vector<SubscriberDataManager*> remote_sdms;
 ImpiStore* local_impi_store = NULL;
 std::vector<ImpiStore*> remote_impi_stores;
+ParallelStoreOps* parallel_store_ops = NULL;
+DigestAvCache* digest_av_cache = NULL;
 RalfProcessor* ralf_processor = NULL;
 DnsCachedResolver* dns_resolver = NULL;
 HttpResolver* http_resolver = NULL;
@@ -1529,6 +1667,7 @@ int main(int argc, char* argv[])
   opt.external_icscf_uri = "";
   opt.auth_enabled = PJ_FALSE;
   opt.enum_suffix = ".e164.arpa";
+  opt.enum_negative_cache_ttl = 0;
   opt.default_tel_uri_translation = false;
 
   // If changing this default for reg_max_expires, note that
@@ -1566,6 +1705,9 @@ int main(int argc, char* argv[])
   opt.override_npdi = PJ_FALSE;
   opt.exception_max_ttl = 600;
   opt.sip_blacklist_duration = SIPResolver::DEFAULT_BLACKLIST_DURATION;
+  opt.sip_target_cache = false;
+  opt.sip_latency_weighting = false;
+  opt.sip_resolver_threads = 4;
   opt.http_blacklist_duration = HttpResolver::DEFAULT_BLACKLIST_DURATION;
   opt.astaire_blacklist_duration = AstaireResolver::DEFAULT_BLACKLIST_DURATION;
   opt.sip_tcp_connect_timeout = 2000;
@@ -1575,12 +1717,15 @@ int main(int argc, char* argv[])
   opt.session_terminated_timeout_ms = SCSCFSproutlet::DEFAULT_SESSION_TERMINATED_TIMEOUT;
   opt.stateless_proxies.clear();
   opt.ralf_threads = 25;
+  opt.store_op_threads = 16;
   opt.non_register_auth_mode = NonRegisterAuthentication::NEVER;
   opt.force_third_party_register_body = false;
   opt.listen_port = 0;
   SPROUTLET_MACRO(SPROUTLET_CFG_OPTIONS_DEFAULT_VALUES)
   opt.impi_store_mode = ImpiStore::Mode::READ_IMPI_WRITE_IMPI;
   opt.nonce_count_supported = false;
+  opt.stateless_nonce_key = "";
+  opt.digest_av_cache_ttl = 0;
   opt.scscf_node_uri = "";
   opt.sas_signaling_if = false;
   opt.disable_tcp_switch = false;
@@ -1810,6 +1955,12 @@ int main(int argc, char* argv[])
   SNMP::EventAccumulatorTable* homestead_uar_latency_table = NULL;
   SNMP::EventAccumulatorTable* homestead_lir_latency_table = NULL;
   SNMP::CounterTable* no_shared_ifcs_set_table = NULL;
+  SNMP::CounterTable* digest_av_cache_hits_table = NULL;
+  SNMP::CounterTable* digest_av_cache_misses_table = NULL;
+  SNMP::CounterTable* enum_cache_hits_table = NULL;
+  SNMP::CounterTable* enum_cache_misses_table = NULL;
+  SNMP::CounterTable* sip_target_cache_stale_served_table = NULL;
+  SNMP::CounterTable* sip_target_cache_refresh_failures_table = NULL;
 
   SNMP::ContinuousAccumulatorByScopeTable* token_rate_table = NULL;
   SNMP::ScalarByScopeTable* smoothed_latency_scalar = NULL;
@@ -1817,6 +1968,12 @@ int main(int argc, char* argv[])
   SNMP::ScalarByScopeTable* penalties_scalar = NULL;
   SNMP::ScalarByScopeTable* token_rate_scalar = NULL;
 
+  // Tables of the resources used by each Sproutlet, keyed on the service
+  // name or alias.  These are created once the Sproutlets are loaded (as all
+  // SNMP tables must be registered before the SNMP handler threads start),
+  // and attached to the Sproutlets once the SproutletProxy is created.
+  std::map<std::string, SproutletStats::Tables> sproutlet_stats_tables;
+
   if (opt.pcscf_enabled)
   {
     latency_table = SNMP::EventAccumulatorByScopeTable::create("bono_latency",
@@ -1853,6 +2010,14 @@ int main(int argc, char* argv[])
                                                                  ".1.2.826.0.1.1578918.9.3.3.6");
     no_shared_ifcs_set_table = SNMP::CounterTable::create("no_shared_ifcs_set",
                                                           ".1.2.826.0.1.1578918.9.3.40");
+    digest_av_cache_hits_table = SNMP::CounterTable::create("digest_av_cache_hits",
+                                                            ".1.2.826.0.1.1578918.9.3.43");
+    digest_av_cache_misses_table = SNMP::CounterTable::create("digest_av_cache_misses",
+                                                              ".1.2.826.0.1.1578918.9.3.44");
+    enum_cache_hits_table = SNMP::CounterTable::create("enum_cache_hits",
+                                                       ".1.2.826.0.1.1578918.9.3.45");
+    enum_cache_misses_table = SNMP::CounterTable::create("enum_cache_misses",
+                                                         ".1.2.826.0.1.1578918.9.3.46");
     token_rate_table = SNMP::ContinuousAccumulatorByScopeTable::create("sprout_token_rate",
                                                                        ".1.2.826.0.1.1578918.9.3.27");
     smoothed_latency_scalar = SNMP::ScalarByScopeTable::create("sprout_smoothed_latency",
@@ -1935,6 +2100,28 @@ int main(int argc, char* argv[])
   dns_resolver = new DnsCachedResolver(opt.dns_servers, opt.dns_timeout);
   sip_resolver = new SIPResolver(dns_resolver, opt.sip_blacklist_duration);
 
+  if ((opt.sip_target_cache) || (opt.sip_latency_weighting))
+  {
+    sip_target_cache_stale_served_table =
+      SNMP::CounterTable::create("sip_target_cache_stale_served",
+                                 ".1.2.826.0.1.1578918.9.3.47");
+    sip_target_cache_refresh_failures_table =
+      SNMP::CounterTable::create("sip_target_cache_refresh_failures",
+                                 ".1.2.826.0.1.1578918.9.3.48");
+    sip_resolver->enable_target_cache(sip_target_cache_stale_served_table,
+                                      sip_target_cache_refresh_failures_table);
+
+    if (opt.sip_latency_weighting)
+    {
+      sip_resolver->enable_latency_weighting();
+    }
+  }
+
+  if (opt.sip_resolver_threads > 0)
+  {
+    sip_resolver->enable_async_resolution(opt.sip_resolver_threads);
+  }
+
   // Create a new quiescing manager instance and register our completion handler
   // with it.
   quiescing_mgr = new QuiescingManager();
@@ -2010,6 +2197,14 @@ int main(int argc, char* argv[])
     CL_SPROUT_NO_RALF_CONFIGURED.log();
   }
 
+  if (opt.store_op_threads > 0)
+  {
+    // Create the pool of threads used to issue independent store operations
+    // concurrently.
+    parallel_store_ops = new ParallelStoreOps(opt.store_op_threads,
+                                              exception_handler);
+  }
+
   // Initialise the OPTIONS handling module.
   status = init_options();
 
@@ -2054,7 +2249,10 @@ int main(int argc, char* argv[])
     enum_service = new DNSEnumService(opt.enum_servers,
                                       opt.enum_suffix,
                                       new DNSResolverFactory(),
-                                      enum_comm_monitor);
+                                      enum_comm_monitor,
+                                      opt.enum_negative_cache_ttl,
+                                      enum_cache_hits_table,
+                                      enum_cache_misses_table);
   }
   else if (!opt.enum_file.empty())
   {
@@ -2221,7 +2419,8 @@ int main(int argc, char* argv[])
                                         deserializers,
                                         chronos_connection,
                                         analytics_logger,
-                                        true);
+                                        true,
+                                        parallel_store_ops);
 
 
   for (std::vector<Store*>::iterator it = remote_data_stores.begin();
@@ -2236,7 +2435,8 @@ int main(int argc, char* argv[])
                                                                   deserializers,
                                                                   chronos_connection,
                                                                   NULL,
-                                                                  false);
+                                                                  false,
+                                                                  parallel_store_ops);
     remote_sdms.push_back(remote_sdm);
   }
 
@@ -2284,7 +2484,9 @@ int main(int argc, char* argv[])
                                                                       astaire_resolver,
                                                                       false,
                                                                       astaire_comm_monitor);
-    local_impi_store = new ImpiStore(local_impi_data_store, opt.impi_store_mode);
+    local_impi_store = new ImpiStore(local_impi_data_store,
+                                     opt.impi_store_mode,
+                                     parallel_store_ops);
 
     // Only set up remote IMPI stores if some have been configured, and we need
     // the IMPI store to be GR.
@@ -2303,7 +2505,9 @@ int main(int argc, char* argv[])
                                                                              true,
                                                                              remote_astaire_comm_monitor);
         remote_impi_data_stores.push_back(remote_data_store);
-        remote_impi_stores.push_back(new ImpiStore(remote_data_store, opt.impi_store_mode));
+        remote_impi_stores.push_back(new ImpiStore(remote_data_store,
+                                                   opt.impi_store_mode,
+                                                   parallel_store_ops));
       }
     }
   }
@@ -2315,6 +2519,14 @@ int main(int argc, char* argv[])
     local_impi_store = new ImpiStore(local_data_store, opt.impi_store_mode);
   }
 
+  if (opt.digest_av_cache_ttl > 0)
+  {
+    TRC_STATUS("Caching digest AVs for %d seconds", opt.digest_av_cache_ttl);
+    digest_av_cache = new DigestAvCache(opt.digest_av_cache_ttl,
+                                        digest_av_cache_hits_table,
+                                        digest_av_cache_misses_table);
+  }
+
   // Load the sproutlet plugins.
   PluginLoader* loader = new PluginLoader("/usr/share/clearwater/sprout/plugins",
                                           opt);
@@ -2326,6 +2538,62 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if (!opt.pcscf_enabled)
+  {
+    // Create the tables of the resources used by each of the loaded
+    // Sproutlets, under each of its service name and aliases.
+    std::map<int, std::string> indexes;
+
+    for (std::list<Sproutlet*>::const_iterator it = sproutlets.begin();
+         it != sproutlets.end();
+         ++it)
+    {
+      std::list<std::string> names = (*it)->aliases();
+      names.push_front((*it)->service_name());
+
+      for (std::list<std::string>::const_iterator name = names.begin();
+           name != names.end();
+           ++name)
+      {
+        if (sproutlet_stats_tables.find(*name) != sproutlet_stats_tables.end())
+        {
+          // The name is already taken (which the SproutletProxy rejects).
+          continue;
+        }
+
+        int index = sproutlet_stats_index(*name);
+
+        if (indexes.find(index) != indexes.end())
+        {
+          TRC_ERROR("Sproutlet stats for %s would use the same OID as %s, so aren't reported",
+                    name->c_str(), indexes[index].c_str());
+          continue;
+        }
+
+        indexes[index] = *name;
+        TRC_STATUS("Report Sproutlet stats for %s under .1.2.826.0.1.1578918.9.3.49.%d",
+                   name->c_str(), index);
+
+        std::string prefix = "sprout_" + *name;
+        std::string oid = ".1.2.826.0.1.1578918.9.3.49." + std::to_string(index);
+        SproutletStats::Tables& tables = sproutlet_stats_tables[*name];
+        tables.callback_latency =
+          SNMP::EventAccumulatorTable::create(prefix + "_callback_latency",
+                                              oid + ".1");
+        tables.callback_cpu =
+          SNMP::EventAccumulatorTable::create(prefix + "_callback_cpu_time",
+                                              oid + ".2");
+        tables.invocations =
+          SNMP::CounterTable::create(prefix + "_invocations", oid + ".3");
+        tables.msgs_cloned =
+          SNMP::CounterTable::create(prefix + "_messages_cloned", oid + ".4");
+        tables.pool_bytes =
+          SNMP::EventAccumulatorTable::create(prefix + "_pool_bytes",
+                                              oid + ".5");
+      }
+    }
+  }
+
   // Must happen after all SNMP tables have been registered.
   if (opt.pcscf_enabled)
   {
@@ -2359,6 +2627,63 @@ int main(int argc, char* argv[])
       TRC_ERROR("Failed to create SproutletProxy");
       return 1;
     }
+
+    // Start worker threads for any sproutlets that are configured to have
+    // their own, and enable stateless forwarding for any that are configured
+    // to forward statelessly.
+    for (std::map<std::string, std::multimap<std::string, std::string>>::const_iterator it =
+           opt.plugin_options.begin();
+         it != opt.plugin_options.end();
+         ++it)
+    {
+      std::multimap<std::string, std::string>::const_iterator threads =
+                                             it->second.find("worker-threads");
+      if (threads != it->second.end())
+      {
+        int max_queue_depth = SproutletExecutor::DEFAULT_MAX_QUEUE_DEPTH;
+        std::multimap<std::string, std::string>::const_iterator depth =
+                                            it->second.find("max-queue-depth");
+        if (depth != it->second.end())
+        {
+          max_queue_depth = atoi(depth->second.c_str());
+        }
+
+        if (!sproutlet_proxy->add_executor(it->first,
+                                           atoi(threads->second.c_str()),
+                                           max_queue_depth))
+        {
+          TRC_ERROR("Failed to start worker threads for %s", it->first.c_str());
+          return 1;
+        }
+      }
+
+      std::multimap<std::string, std::string>::const_iterator stateless =
+                                                  it->second.find("stateless");
+      if ((stateless != it->second.end()) &&
+          (stateless->second == "true"))
+      {
+        if (!sproutlet_proxy->enable_stateless(it->first))
+        {
+          TRC_ERROR("Failed to enable stateless forwarding for %s",
+                    it->first.c_str());
+          return 1;
+        }
+      }
+    }
+
+    // Attach the SNMP tables to the statistics of the Sproutlets.  The
+    // statistics are also available on the management HTTP interface.
+    for (std::map<std::string, SproutletStats::Tables>::const_iterator it =
+                                                 sproutlet_stats_tables.begin();
+         it != sproutlet_stats_tables.end();
+         ++it)
+    {
+      SproutletStats* stats = sproutlet_proxy->stats(it->first);
+      if (stats != NULL)
+      {
+        stats->set_tables(it->second);
+      }
+    }
   }
 
   init_common_sip_processing(load_monitor,
@@ -2399,9 +2724,11 @@ int main(int argc, char* argv[])
                                                    hss_connection,
                                                    sip_resolver,
                                                    local_impi_store,
-                                                   remote_impi_stores);
+                                                   remote_impi_stores,
+                                                   digest_av_cache);
   GetCachedDataTask::Config get_cached_data_config(local_sdm, remote_sdms);
   DeleteImpuTask::Config delete_impu_config(local_sdm, remote_sdms, hss_connection);
+  SproutletStatsTask::Config sproutlet_stats_config(sproutlet_proxy);
 
   // The AoRTimeoutTask and AuthTimeoutTask both handle
   // chronos requests, so use the ChronosHandler.
@@ -2412,6 +2739,7 @@ int main(int argc, char* argv[])
   HttpStackUtils::SpawningHandler<GetBindingsTask, GetCachedDataTask::Config> get_bindings_handler(&get_cached_data_config);
   HttpStackUtils::SpawningHandler<GetSubscriptionsTask, GetCachedDataTask::Config> get_subscriptions_handler(&get_cached_data_config);
   HttpStackUtils::SpawningHandler<DeleteImpuTask, DeleteImpuTask::Config> delete_impu_handler(&delete_impu_config);
+  HttpStackUtils::SpawningHandler<SproutletStatsTask, SproutletStatsTask::Config> sproutlet_stats_handler(&sproutlet_stats_config);
 
   if (opt.enabled_scscf)
   {
@@ -2445,6 +2773,11 @@ int main(int argc, char* argv[])
                                         &get_subscriptions_handler);
       http_stack_mgmt->register_handler("^/impu/[^/]+$",
                                         &delete_impu_handler);
+      if (sproutlet_proxy != NULL)
+      {
+        http_stack_mgmt->register_handler("^/sproutlet-stats$",
+                                          &sproutlet_stats_handler);
+      }
       http_stack_mgmt->bind_unix_socket(SPROUT_HTTP_MGMT_SOCKET_PATH);
       http_stack_mgmt->start(&reg_httpthread_with_pjsip);
     }
@@ -2566,8 +2899,10 @@ int main(int argc, char* argv[])
 
   for (ImpiStore* store: remote_impi_stores) { delete store; }
   remote_impi_stores.clear();
+  delete digest_av_cache; digest_av_cache = NULL;
   for (Store* store: remote_impi_data_stores) { delete store; }
   remote_impi_data_stores.clear();
+  delete parallel_store_ops; parallel_store_ops = NULL;
 
   delete ralf_processor;
   delete ralf_connection;
@@ -2603,6 +2938,12 @@ int main(int argc, char* argv[])
   delete homestead_uar_latency_table;
   delete homestead_lir_latency_table;
   delete no_shared_ifcs_set_table;
+  delete digest_av_cache_hits_table;
+  delete digest_av_cache_misses_table;
+  delete enum_cache_hits_table;
+  delete enum_cache_misses_table;
+  delete sip_target_cache_stale_served_table;
+  delete sip_target_cache_refresh_failures_table;
 
   delete token_rate_table;
   delete smoothed_latency_scalar;
@@ -2610,6 +2951,18 @@ int main(int argc, char* argv[])
   delete penalties_scalar;
   delete token_rate_scalar;
 
+  for (std::map<std::string, SproutletStats::Tables>::iterator it =
+                                                 sproutlet_stats_tables.begin();
+       it != sproutlet_stats_tables.end();
+       ++it)
+  {
+    delete it->second.callback_latency;
+    delete it->second.callback_cpu;
+    delete it->second.invocations;
+    delete it->second.msgs_cloned;
+    delete it->second.pool_bytes;
+  }
+
   hc->stop_thread();
   delete hc;
 
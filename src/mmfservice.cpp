@@ -23,7 +23,7 @@ MMFService::MMFService(Alarm* alarm,
   _alarm(alarm),
   _configuration(configuration),
   _updater(NULL),
-  _mmf_config(std::shared_ptr<MMFService::MMFMap>(new MMFService::MMFMap))
+  _mmf_config(std::make_shared<MMFService::MMFMap>())
 {
   // Create an updater to keep the invoking of MMF configured correctly.
   _updater = new Updater<void, MMFService>
@@ -91,10 +91,10 @@ void MMFService::update_config()
     // This throws a JsonFormatError if the MMF configuration data is invalid
     mmf_config = read_config(doc);
 
-    // Now that we have the mmf config lock, free the memory from the old
-    // mmf config objects, and start pointing at the new ones.
-    TRC_DEBUG("Delete old MMF config.");
-    _mmf_config = mmf_config;
+    // Start pointing at the new mmf config objects.  The old ones are freed
+    // once every thread that used them has picked up the new ones.
+    TRC_DEBUG("Replace old MMF config.");
+    _mmf_config.set(mmf_config);
 
     clear_alarm();
     TRC_DEBUG("Updated MMF config.");
@@ -150,17 +150,16 @@ std::shared_ptr<MMFService::MMFMap> MMFService::read_config(rapidjson::Document&
 
 MMFService::MMFTargetPtr MMFService::get_config_for_server(std::string server_domain)
 {
-  std::shared_ptr<MMFService::MMFMap> mmf_config = _mmf_config;
+  const MMFMap& mmf_config = _mmf_config.get();
 
-  TRC_ERROR("JA4");
-  if (mmf_config->find(server_domain) != mmf_config->end())
+  MMFMap::const_iterator i = mmf_config.find(server_domain);
+
+  if (i != mmf_config.end())
   {
-    TRC_ERROR("JA5");
-    return mmf_config->at(server_domain);
+    return i->second;
   }
   else
   {
-    TRC_ERROR("JA6");
     return nullptr;
   }
 }
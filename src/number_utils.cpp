@@ -0,0 +1,169 @@
+/**
+ * @file number_utils.cpp  Character class filters for telephone numbers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "number_utils.h"
+
+NumberUtils::CharSet::CharSet(const char* chars)
+{
+  memset(_table, 0, sizeof(_table));
+
+  for (const char* c = chars; *c != '\0'; ++c)
+  {
+    _table[(unsigned char)*c] = true;
+  }
+}
+
+const NumberUtils::CharSet NumberUtils::DIGITS("0123456789");
+const NumberUtils::CharSet NumberUtils::VISUAL_SEPARATORS(".-()");
+
+// The characters allowed after the "+" of a global number, in a local number,
+// and in a numeric user part respectively.
+static const NumberUtils::CharSet GLOBAL_NUMBER_CHARS("0123456789,-()");
+static const NumberUtils::CharSet LOCAL_NUMBER_CHARS("0123456789ABCDEF*#,-()");
+static const NumberUtils::CharSet NUMERIC_USER_CHARS("0123456789+-.()[]");
+
+bool NumberUtils::all_of(const pj_str_t& str, const CharSet& set)
+{
+  for (pj_ssize_t ii = 0; ii < str.slen; ++ii)
+  {
+    if (!set.contains(str.ptr[ii]))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Removes characters from the string that are (or aren't) in the set.
+static void filter(pj_str_t& str, const NumberUtils::CharSet& set, bool keep)
+{
+  pj_ssize_t len = 0;
+
+  for (pj_ssize_t ii = 0; ii < str.slen; ++ii)
+  {
+    if (set.contains(str.ptr[ii]) == keep)
+    {
+      str.ptr[len++] = str.ptr[ii];
+    }
+  }
+
+  str.slen = len;
+}
+
+void NumberUtils::strip(pj_str_t& str, const CharSet& set)
+{
+  filter(str, set, false);
+}
+
+void NumberUtils::keep_only(pj_str_t& str, const CharSet& set)
+{
+  filter(str, set, true);
+}
+
+bool NumberUtils::is_global_number(const pj_str_t& str)
+{
+  if ((str.slen == 0) || (str.ptr[0] != '+'))
+  {
+    return false;
+  }
+
+  pj_str_t rest = {str.ptr + 1, str.slen - 1};
+  return all_of(rest, GLOBAL_NUMBER_CHARS);
+}
+
+bool NumberUtils::is_local_number(const pj_str_t& str)
+{
+  return all_of(str, LOCAL_NUMBER_CHARS);
+}
+
+bool NumberUtils::is_user_numeric(const pj_str_t& str)
+{
+  return all_of(str, NUMERIC_USER_CHARS);
+}
+
+void NumberUtils::remove_visual_separators(pj_str_t& number)
+{
+  strip(number, VISUAL_SEPARATORS);
+}
+
+void NumberUtils::user_to_aus(pj_str_t& user)
+{
+  if (user.slen == 0)
+  {
+    return;
+  }
+
+  // The first character may be a "+", so handle it separately.
+  char first = user.ptr[0];
+  pj_str_t rest = {user.ptr + 1, user.slen - 1};
+  keep_only(rest, DIGITS);
+
+  if ((first == '+') || (DIGITS.contains(first)))
+  {
+    user.slen = rest.slen + 1;
+  }
+  else
+  {
+    memmove(user.ptr, rest.ptr, rest.slen);
+    user.slen = rest.slen;
+  }
+}
+
+bool NumberUtils::user_minus_params(const pj_str_t& user, pj_str_t& token)
+{
+  const char* start = user.ptr;
+  const char* end = user.ptr + user.slen;
+
+  while (start < end)
+  {
+    const char* semicolon = (const char*)memchr(start, ';', end - start);
+    token.ptr = (char*)start;
+    token.slen = ((semicolon != NULL) ? semicolon : end) - start;
+    pj_strtrim(&token);
+
+    if (token.slen > 0)
+    {
+      return true;
+    }
+
+    if (semicolon == NULL)
+    {
+      break;
+    }
+
+    start = semicolon + 1;
+  }
+
+  return false;
+}
+
+std::string NumberUtils::normalize(const std::string& str,
+                                   void (*normalizer)(pj_str_t&))
+{
+  std::string result(str);
+  pj_str_t pj_result = {&result[0], (pj_ssize_t)result.size()};
+  normalizer(pj_result);
+  result.resize(pj_result.slen);
+  return result;
+}
+
+std::string NumberUtils::normalize(const pj_str_t& str,
+                                   void (*normalizer)(pj_str_t&))
+{
+  std::string result(str.ptr, str.slen);
+  pj_str_t pj_result = {&result[0], (pj_ssize_t)result.size()};
+  normalizer(pj_result);
+  result.resize(pj_result.slen);
+  return result;
+}
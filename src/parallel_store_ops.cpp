@@ -0,0 +1,98 @@
+/**
+ * @file parallel_store_ops.cpp  Helper for issuing store operations in parallel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "parallel_store_ops.h"
+
+ParallelStoreOps::ParallelStoreOps(unsigned int num_threads,
+                                   ExceptionHandler* exception_handler) :
+  _num_threads(num_threads),
+  _thread_pool(new Pool(exception_handler, num_threads))
+{
+  TRC_STATUS("Starting %u threads for parallel store operations", num_threads);
+  _thread_pool->start();
+}
+
+ParallelStoreOps::~ParallelStoreOps()
+{
+  if (_thread_pool != NULL)
+  {
+    _thread_pool->stop();
+    _thread_pool->join();
+    delete _thread_pool; _thread_pool = NULL;
+  }
+}
+
+void ParallelStoreOps::run(std::vector<std::function<void()>>& ops)
+{
+  if (ops.size() < 2)
+  {
+    for (std::function<void()>& op : ops)
+    {
+      op();
+    }
+    return;
+  }
+
+  // Ask pool threads to help with all but one of the operations, and start
+  // on them ourselves.  There's no point asking for more help than there are
+  // threads in the pool.
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>(ops);
+  size_t num_helpers = std::min(ops.size() - 1, (size_t)_num_threads);
+
+  for (size_t ii = 0; ii < num_helpers; ii++)
+  {
+    _thread_pool->add_work(batch);
+  }
+
+  run_ops(batch.get());
+
+  // Wait for any operations that the pool threads are still running.
+  std::unique_lock<std::mutex> lock(batch->lock);
+  batch->cond.wait(lock, [&batch]() { return batch->done == batch->num_ops; });
+}
+
+void ParallelStoreOps::run_ops(Batch* batch)
+{
+  // Only touch the operations if we've claimed one - once they've all been
+  // claimed and completed the submitting thread may have returned.
+  size_t ii;
+  while ((ii = batch->next++) < batch->num_ops)
+  {
+    batch->ops[ii]();
+
+    std::lock_guard<std::mutex> lock(batch->lock);
+    if (++batch->done == batch->num_ops)
+    {
+      batch->cond.notify_all();
+    }
+  }
+}
+
+ParallelStoreOps::Pool::Pool(ExceptionHandler* exception_handler,
+                             unsigned int num_threads) :
+  // The queue is unbounded, but each batch only queues as many items as there
+  // are threads, and items for finished batches are discarded straight away.
+  ThreadPool<std::shared_ptr<Batch>>(num_threads,
+                                     exception_handler,
+                                     &exception_callback,
+                                     0)
+{}
+
+ParallelStoreOps::Pool::~Pool()
+{}
+
+void ParallelStoreOps::Pool::process_work(std::shared_ptr<Batch>& batch)
+{
+  run_ops(batch.get());
+}
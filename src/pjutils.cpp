@@ -30,6 +30,7 @@ extern "C" {
 #include "sproutsasevent.h"
 #include "enumservice.h"
 #include "uri_classifier.h"
+#include "number_utils.h"
 #include "thread_dispatcher.h"
 
 
@@ -715,6 +716,94 @@ pjsip_tx_data* PJUtils::clone_msg(pjsip_endpoint* endpt,
 }
 
 
+/// Clones a message, sharing its body and (optionally) the contents of its
+/// headers with the original.
+static pjsip_tx_data* clone_msg_sharing(pjsip_endpoint* endpt,
+                                        pjsip_tx_data* tdata,
+                                        bool share_hdrs)
+{
+  pjsip_tx_data* clone = NULL;
+  pj_status_t status = pjsip_endpt_create_tdata(endpt, &clone);
+  if (status == PJ_SUCCESS)
+  {
+    pjsip_tx_data_add_ref(clone);
+    const pjsip_msg* src = tdata->msg;
+    pjsip_msg* dst = pjsip_msg_create(clone->pool, src->type);
+
+    // Copy the start line in the same way as pjsip_msg_clone.
+    if (src->type == PJSIP_REQUEST_MSG)
+    {
+      pjsip_method_copy(clone->pool, &dst->line.req.method, &src->line.req.method);
+      dst->line.req.uri = (pjsip_uri*)pjsip_uri_clone(clone->pool,
+                                                      src->line.req.uri);
+    }
+    else
+    {
+      dst->line.status.code = src->line.status.code;
+      pj_strdup(clone->pool, &dst->line.status.reason, &src->line.status.reason);
+    }
+
+    // A shallow clone of a header is a new header (so it can be removed from
+    // the clone or changed to a different value) that refers to the values,
+    // URIs and parameters of the original.
+    for (const pjsip_hdr* hdr = src->hdr.next;
+         hdr != &src->hdr;
+         hdr = hdr->next)
+    {
+      pjsip_hdr* hdr_clone = share_hdrs ?
+                     (pjsip_hdr*)pjsip_hdr_shallow_clone(clone->pool, hdr) :
+                     (pjsip_hdr*)pjsip_hdr_clone(clone->pool, hdr);
+      pjsip_msg_add_hdr(dst, hdr_clone);
+    }
+
+    // The body's content type is copied (as it has a parameter list that
+    // can't be shared), but its data is shared with the original.
+    if (src->body != NULL)
+    {
+      dst->body = PJ_POOL_ZALLOC_T(clone->pool, pjsip_msg_body);
+      pjsip_media_type_cp(clone->pool,
+                          &dst->body->content_type,
+                          &src->body->content_type);
+      dst->body->data = src->body->data;
+      dst->body->len = src->body->len;
+      dst->body->print_body = src->body->print_body;
+      dst->body->clone_data = src->body->clone_data;
+    }
+
+    clone->msg = dst;
+    set_trail(clone, get_trail(tdata));
+    TRC_DEBUG("Cloned %s to %s (sharing %s)",
+              tdata->obj_name,
+              clone->obj_name,
+              share_hdrs ? "headers and body" : "body");
+  }
+  return clone;
+}
+
+
+pjsip_tx_data* PJUtils::clone_msg_sharing_body(pjsip_endpoint* endpt,
+                                               pjsip_tx_data* tdata)
+{
+  return clone_msg_sharing(endpt, tdata, false);
+}
+
+
+pjsip_tx_data* PJUtils::clone_msg_sharing_hdrs(pjsip_endpoint* endpt,
+                                               pjsip_tx_data* tdata)
+{
+  return clone_msg_sharing(endpt, tdata, true);
+}
+
+
+void PJUtils::unshare_body(pjsip_tx_data* tdata)
+{
+  if (tdata->msg->body != NULL)
+  {
+    tdata->msg->body = pjsip_msg_body_clone(tdata->pool, tdata->msg->body);
+  }
+}
+
+
 pj_status_t PJUtils::create_response(pjsip_endpoint* endpt,
                                      const pjsip_rx_data* rdata,
                                      int st_code,
@@ -918,18 +1007,17 @@ void PJUtils::resolve(const std::string& name,
 }
 
 
-/// Resolves the next hop target of the SIP message
-void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
-                               int retries,
-                               std::vector<AddrInfo>& servers,
-                               SAS::TrailId trail)
+// Gets the name, port and transport to resolve for the next hop of a
+// request.
+static void get_next_hop_target(pjsip_tx_data* tdata,
+                                std::string& name,
+                                int& port,
+                                int& transport)
 {
-  // Get the next hop URI from the message and parse out the destination, port
-  // and transport.
   pjsip_sip_uri* next_hop = (pjsip_sip_uri*)PJUtils::next_hop(tdata->msg);
-  std::string name = std::string(next_hop->host.ptr, next_hop->host.slen);
-  int port = next_hop->port;
-  int transport = -1;
+  name = std::string(next_hop->host.ptr, next_hop->host.slen);
+  port = next_hop->port;
+  transport = -1;
   if (pj_stricmp2(&next_hop->transport_param, "TCP") == 0)
   {
     transport = IPPROTO_TCP;
@@ -938,6 +1026,21 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
   {
     transport = IPPROTO_UDP;
   }
+}
+
+
+/// Resolves the next hop target of the SIP message
+void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
+                               int retries,
+                               std::vector<AddrInfo>& servers,
+                               SAS::TrailId trail)
+{
+  // Get the next hop URI from the message and parse out the destination, port
+  // and transport.
+  std::string name;
+  int port;
+  int transport;
+  get_next_hop_target(tdata, name, port, transport);
 
   if (retries == 0)
   {
@@ -955,11 +1058,84 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
 
   TRC_INFO("Resolved destination URI %s to %d servers",
            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                  (pjsip_uri*)next_hop).c_str(),
+                                  PJUtils::next_hop(tdata->msg)).c_str(),
            servers.size());
 }
 
 
+/// Callback used to pass the result of an asynchronous resolution back to a
+/// worker thread.
+class ResolveCompleteCallback : public PJUtils::Callback
+{
+public:
+  ResolveCompleteCallback(SIPResolver::ResolveCallback callback,
+                          const std::vector<AddrInfo>& servers) :
+    _callback(callback),
+    _servers(servers)
+  {
+  }
+
+  void run()
+  {
+    _callback(_servers);
+  }
+
+private:
+  SIPResolver::ResolveCallback _callback;
+  std::vector<AddrInfo> _servers;
+};
+
+
+/// Resolves the next hop target of the SIP message without blocking on DNS.
+/// If the servers are available straight away they are returned and this
+/// returns true.  Otherwise this returns false, and the callback is called
+/// with the servers on a worker thread once they are known.
+bool PJUtils::resolve_next_hop_async(pjsip_tx_data* tdata,
+                                     int retries,
+                                     std::vector<AddrInfo>& servers,
+                                     SAS::TrailId trail,
+                                     SIPResolver::ResolveCallback callback)
+{
+  std::string name;
+  int port;
+  int transport;
+  get_next_hop_target(tdata, name, port, transport);
+
+  if (retries == 0)
+  {
+    // Used default number of retries.
+    retries = DEFAULT_RETRIES;
+  }
+
+  bool resolved = stack_data.sipresolver->resolve_async(
+    name,
+    stack_data.addr_family,
+    port,
+    transport,
+    retries,
+    servers,
+    trail,
+    [callback](const std::vector<AddrInfo>& servers)
+    {
+      add_callback_to_queue(new ResolveCompleteCallback(callback, servers));
+    });
+
+  if (resolved)
+  {
+    TRC_INFO("Resolved destination URI %s to %d servers",
+             PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                    PJUtils::next_hop(tdata->msg)).c_str(),
+             servers.size());
+  }
+  else
+  {
+    TRC_DEBUG("Resolving destination %s asynchronously", name.c_str());
+  }
+
+  return resolved;
+}
+
+
 /// Blacklists the specified server so it will not be preferred in subsequent
 /// resolve calls.
 void PJUtils::blacklist_server(AddrInfo& server)
@@ -968,6 +1144,14 @@ void PJUtils::blacklist_server(AddrInfo& server)
 }
 
 
+/// Records how long a server took to respond to a request.
+void PJUtils::record_server_latency(const AddrInfo& server,
+                                    unsigned long latency_us)
+{
+  stack_data.sipresolver->record_latency(server, latency_us);
+}
+
+
 /// Substitutes the branch identifier in the top Via header with a new unique
 /// identifier.  This is used when forking requests and when retrying requests
 /// to alternate servers.  This code is taken from pjsip_generate_branch_id
@@ -1300,6 +1484,7 @@ struct StatelessSendState
 {
   std::vector<AddrInfo> servers;
   int current_server;
+  bool new_branch;
 };
 
 
@@ -1331,8 +1516,12 @@ static void stateless_send_cb(pjsip_send_state *st,
       // According to RFC3263 we should generate a new branch identifier for
       // the message so there is no possibility of it being confused with
       // previous attempts.  Not clear this is really necessary in this case,
-      // but just in case ...
-      PJUtils::generate_new_branch_id(tdata);
+      // but just in case ...  (A stateless proxy keeps the branch it
+      // calculated, as a CANCEL for the request must have the same one.)
+      if (sss->new_branch)
+      {
+        PJUtils::generate_new_branch_id(tdata);
+      }
 
       // Add a reference to the tdata to stop PJSIP releasing it when we
       // return the callback.
@@ -1367,11 +1556,14 @@ static void stateless_send_cb(pjsip_send_state *st,
 
 /// Sends a request statelessly, possibly retrying the specified number of
 /// times if the
-pj_status_t PJUtils::send_request_stateless(pjsip_tx_data* tdata, int retries)
+pj_status_t PJUtils::send_request_stateless(pjsip_tx_data* tdata,
+                                            int retries,
+                                            bool new_branch)
 {
   pj_status_t status = PJ_SUCCESS;
   StatelessSendState* sss = new StatelessSendState;
   sss->current_server = 0;
+  sss->new_branch = new_branch;
 
   if (tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT)
   {
@@ -2184,19 +2376,16 @@ void PJUtils::add_parameter_to_sip_uri(pjsip_sip_uri* sip_uri,
   pj_strdup2(pool, &parameter->value, param_value);
 }
 
-static const boost::regex CHARS_TO_STRIP = boost::regex("[.)(-]");
-
 // Strip any visual separators from the number
 std::string PJUtils::remove_visual_separators(const std::string& number)
 {
-  return boost::regex_replace(number, CHARS_TO_STRIP, std::string(""));
+  return NumberUtils::normalize(number, NumberUtils::remove_visual_separators);
 };
 
 // Strip any visual separators from the number
 std::string PJUtils::remove_visual_separators(const pj_str_t& number)
 {
-  std::string s = pj_str_to_string(&number);
-  return remove_visual_separators(s);
+  return NumberUtils::normalize(number, NumberUtils::remove_visual_separators);
 };
 
 bool PJUtils::get_npdi(pjsip_uri* uri)
@@ -2262,20 +2451,14 @@ pjsip_param* PJUtils::get_userpart_param(pjsip_uri* uri, pj_str_t param)
 
 
 /// Attempt ENUM lookup if appropriate.
-static std::string query_enum(pjsip_msg* req,
+static std::string query_enum(const std::string& user,
                               EnumService* enum_service,
                               SAS::TrailId trail)
 {
-  std::string user;
   std::string new_uri;
-  pjsip_uri* uri = req->line.req.uri;
 
   if (enum_service != NULL)
   {
-    // Perform an ENUM lookup if we have a tel URI, or if we have
-    // a SIP URI which is being treated as a phone number.
-    pj_str_t pj_user = PJUtils::user_from_uri(uri);
-    user = PJUtils::pj_str_to_string(&pj_user);
     TRC_DEBUG("Performing ENUM translation for user %s", user.c_str());
     new_uri = enum_service->lookup_uri_from_user(user, trail);
   }
@@ -2294,73 +2477,12 @@ void PJUtils::translate_request_uri(pjsip_msg* req,
                                     bool should_override_npdi,
                                     SAS::TrailId trail)
 {
-  pjsip_uri* uri = req->line.req.uri;
-  URIClass uri_class = URIClassifier::classify_uri(uri, false, true);
+  std::string user;
 
-  if ((uri_class == GLOBAL_PHONE_NUMBER) ||
-      (uri_class == NP_DATA) ||
-      (uri_class == FINAL_NP_DATA))
+  if (should_query_enum(req, false, user))
   {
-
-    // Request is either to a URI in this domain, or a Tel URI, so attempt
-    // to translate it according to 5.4.3.2 section 10.
-    TRC_DEBUG("Translating URI");
-    std::string new_uri_str = query_enum(req,
-                                         enum_service,
-                                         trail);
-
-    if (!new_uri_str.empty())
-    {
-      pjsip_uri* new_uri = (pjsip_uri*)PJUtils::uri_from_string(new_uri_str,
-                                                                pool);
-
-      if (new_uri == NULL)
-      {
-        // The ENUM lookup has returned an invalid URI. Reject the
-        // request.
-        TRC_WARNING("Invalid ENUM response: %s", new_uri_str.c_str());
-        SAS::Event event(trail, SASEvent::ENUM_INVALID, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-        return;
-      }
-
-      // The URI was successfully translated, so see what it is.
-      URIClass new_uri_class = URIClassifier::classify_uri(new_uri, false, true);
-      std::string rn;
-      get_rn(new_uri, rn);
-
-      if ((new_uri_class == HOME_DOMAIN_SIP_URI) ||
-          (new_uri_class == NODE_LOCAL_SIP_URI) ||
-          (new_uri_class == OFFNET_SIP_URI))
-      {
-        // Translation to a real SIP URI - this always takes priority.
-        TRC_DEBUG("Translated URI %s is a real SIP URI - replacing Request-URI",
-                  new_uri_str.c_str());
-        req->line.req.uri = new_uri;
-        SAS::Event event(trail, SASEvent::SIP_URI_FROM_ENUM, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-      }
-      else if ((new_uri_class == NP_DATA) || (new_uri_class == FINAL_NP_DATA))
-      {
-        if (should_update_np_data(uri_class, new_uri_class, new_uri_str, rn, should_override_npdi, trail))
-        {
-          req->line.req.uri = new_uri;
-        }
-      }
-      else
-      {
-        // We got a TEL URI of some description - update the Request-URI anyway and expect a
-        // downstream MGCF to sort it out.
-        TRC_DEBUG("Translated URI %s is not a SIP URI - replacing Request-URI anyway",
-                  new_uri_str.c_str());
-        req->line.req.uri = new_uri;
-        SAS::Event event(trail, SASEvent::NON_SIP_URI_FROM_ENUM, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-      }
-    }
+    std::string new_uri_str = query_enum(user, enum_service, trail);
+    apply_enum_result(req, pool, new_uri_str, false, should_override_npdi, trail);
   }
 }
 
@@ -2369,55 +2491,110 @@ void PJUtils::update_request_uri_np_data(pjsip_msg* req,
                                     EnumService* enum_service,
                                     bool should_override_npdi,
                                     SAS::TrailId trail)
+{
+  std::string user;
+
+  if (should_query_enum(req, true, user))
+  {
+    std::string new_uri_str = query_enum(user, enum_service, trail);
+    apply_enum_result(req, pool, new_uri_str, true, should_override_npdi, trail);
+  }
+}
+
+bool PJUtils::should_query_enum(pjsip_msg* req,
+                                bool np_data_only,
+                                std::string& user)
 {
   pjsip_uri* uri = req->line.req.uri;
-  URIClass uri_class = URIClassifier::classify_uri(uri, true, true);
+  URIClass uri_class = URIClassifier::classify_uri(uri, np_data_only, true);
 
   if ((uri_class == GLOBAL_PHONE_NUMBER) ||
       (uri_class == NP_DATA) ||
       (uri_class == FINAL_NP_DATA))
   {
-
     // Request is either to a URI in this domain, or a Tel URI, so attempt
-    // to translate it according to 5.4.3.2 section 10.
+    // to translate it according to 5.4.3.2 section 10.  Perform an ENUM
+    // lookup if we have a tel URI, or if we have a SIP URI which is being
+    // treated as a phone number.
     TRC_DEBUG("Translating URI");
-    std::string new_uri_str = query_enum(req,
-                                         enum_service,
-                                         trail);
+    pj_str_t pj_user = PJUtils::user_from_uri(uri);
+    user = PJUtils::pj_str_to_string(&pj_user);
+    return true;
+  }
+  else
+  {
+    TRC_DEBUG("Not translating URI");
+    return false;
+  }
+}
 
-    if (!new_uri_str.empty())
-    {
-      pjsip_uri* new_uri = (pjsip_uri*)PJUtils::uri_from_string(new_uri_str,
-                                                                pool);
+void PJUtils::apply_enum_result(pjsip_msg* req,
+                                pj_pool_t* pool,
+                                std::string new_uri_str,
+                                bool np_data_only,
+                                bool should_override_npdi,
+                                SAS::TrailId trail)
+{
+  if (new_uri_str.empty())
+  {
+    return;
+  }
 
-      if (new_uri == NULL)
-      {
-        // The ENUM lookup has returned an invalid URI. Reject the
-        // request.
-        TRC_WARNING("Invalid ENUM response: %s", new_uri_str.c_str());
-        SAS::Event event(trail, SASEvent::ENUM_INVALID, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-        return;
-      }
+  pjsip_uri* new_uri = (pjsip_uri*)PJUtils::uri_from_string(new_uri_str,
+                                                            pool);
+
+  if (new_uri == NULL)
+  {
+    // The ENUM lookup has returned an invalid URI. Reject the
+    // request.
+    TRC_WARNING("Invalid ENUM response: %s", new_uri_str.c_str());
+    SAS::Event event(trail, SASEvent::ENUM_INVALID, 0);
+    event.add_var_param(new_uri_str);
+    SAS::report_event(event);
+    return;
+  }
 
-      // The URI was successfully translated, so see what it is.
-      URIClass new_uri_class = URIClassifier::classify_uri(new_uri, false, true);
-      std::string rn;
-      get_rn(new_uri, rn);
+  // The URI was successfully translated, so see what it is.
+  URIClass uri_class = URIClassifier::classify_uri(req->line.req.uri,
+                                                   np_data_only,
+                                                   true);
+  URIClass new_uri_class = URIClassifier::classify_uri(new_uri, false, true);
+  std::string rn;
+  get_rn(new_uri, rn);
 
-      if ((new_uri_class == NP_DATA) || (new_uri_class == FINAL_NP_DATA))
-      {
-        if (should_update_np_data(uri_class, new_uri_class, new_uri_str, rn, should_override_npdi, trail))
-        {
-          req->line.req.uri = new_uri;
-        }
-      }
+  if ((new_uri_class == NP_DATA) || (new_uri_class == FINAL_NP_DATA))
+  {
+    if (should_update_np_data(uri_class, new_uri_class, new_uri_str, rn, should_override_npdi, trail))
+    {
+      req->line.req.uri = new_uri;
     }
   }
+  else if (np_data_only)
+  {
+    // Only number portability data is of interest.
+  }
+  else if ((new_uri_class == HOME_DOMAIN_SIP_URI) ||
+           (new_uri_class == NODE_LOCAL_SIP_URI) ||
+           (new_uri_class == OFFNET_SIP_URI))
+  {
+    // Translation to a real SIP URI - this always takes priority.
+    TRC_DEBUG("Translated URI %s is a real SIP URI - replacing Request-URI",
+              new_uri_str.c_str());
+    req->line.req.uri = new_uri;
+    SAS::Event event(trail, SASEvent::SIP_URI_FROM_ENUM, 0);
+    event.add_var_param(new_uri_str);
+    SAS::report_event(event);
+  }
   else
   {
-    TRC_DEBUG("Not translating URI");
+    // We got a TEL URI of some description - update the Request-URI anyway and expect a
+    // downstream MGCF to sort it out.
+    TRC_DEBUG("Translated URI %s is not a SIP URI - replacing Request-URI anyway",
+              new_uri_str.c_str());
+    req->line.req.uri = new_uri;
+    SAS::Event event(trail, SASEvent::NON_SIP_URI_FROM_ENUM, 0);
+    event.add_var_param(new_uri_str);
+    SAS::report_event(event);
   }
 }
 
@@ -0,0 +1,387 @@
+/**
+ * @file routing_db.cpp  Compiled, memory-mapped ENUM and BGCF routing tables.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+
+#include "log.h"
+#include "routing_db.h"
+
+const char RoutingDb::MAGIC[8] = {'C', 'W', 'R', 'O', 'U', 'T', 'E', '\0'};
+const uint32_t RoutingDb::VERSION;
+const uint32_t RoutingDb::NOT_FOUND;
+
+RoutingDb::RoutingDb(void* addr, size_t len) :
+  _addr(addr),
+  _len(len)
+{
+  const char* base = (const char*)addr;
+  _header = (const Header*)base;
+  _values = (const StringRef*)(base + sizeof(Header));
+  _numbers = (const Entry*)(_values + _header->num_values);
+  _domains = _numbers + _header->num_numbers;
+  _strings = (const char*)(_domains + _header->num_domains);
+}
+
+RoutingDb::~RoutingDb()
+{
+  munmap(_addr, _len);
+}
+
+RoutingDb* RoutingDb::open(const std::string& path, Type type)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    TRC_DEBUG("Unable to open routing database %s", path.c_str());
+    return NULL;
+  }
+
+  struct stat s;
+  void* addr = MAP_FAILED;
+
+  if ((fstat(fd, &s) == 0) &&
+      ((size_t)s.st_size >= sizeof(Header)))
+  {
+    addr = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+
+  // The mapping stays valid once the file is closed.
+  close(fd);
+
+  if (addr == MAP_FAILED)
+  {
+    TRC_ERROR("Unable to map routing database %s", path.c_str());
+    return NULL;
+  }
+
+  RoutingDb* db = new RoutingDb(addr, s.st_size);
+
+  if (!db->validate(type))
+  {
+    TRC_ERROR("Invalid routing database %s", path.c_str());
+    delete db; db = NULL;
+  }
+
+  return db;
+}
+
+bool RoutingDb::validate(Type type) const
+{
+  if ((memcmp(_header->magic, MAGIC, sizeof(MAGIC)) != 0) ||
+      (_header->version != VERSION) ||
+      (_header->type != (uint32_t)type))
+  {
+    TRC_WARNING("Routing database has wrong format (version %u, type %u)",
+                _header->version, _header->type);
+    return false;
+  }
+
+  uint64_t expected_len = sizeof(Header) +
+                          (uint64_t)_header->num_values * sizeof(StringRef) +
+                          ((uint64_t)_header->num_numbers +
+                           (uint64_t)_header->num_domains) * sizeof(Entry) +
+                          (uint64_t)_header->strings_len;
+
+  if (expected_len != _len)
+  {
+    TRC_WARNING("Routing database is %lu bytes, expected %lu",
+                (unsigned long)_len, (unsigned long)expected_len);
+    return false;
+  }
+
+  // There are few values, so check them all now.  Keys are bounds checked as
+  // they're used, so that loading doesn't have to touch the whole file.
+  for (uint32_t ii = 0; ii < _header->num_values; ++ii)
+  {
+    if ((uint64_t)_values[ii].offset + _values[ii].length > _header->strings_len)
+    {
+      TRC_WARNING("Routing database value %u is out of range", ii);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::string RoutingDb::compiled_path(const std::string& json_path)
+{
+  const std::string json_ext = ".json";
+  std::string path = json_path;
+
+  if ((path.size() >= json_ext.size()) &&
+      (path.compare(path.size() - json_ext.size(), json_ext.size(), json_ext) == 0))
+  {
+    path.erase(path.size() - json_ext.size());
+  }
+
+  return path + ".db";
+}
+
+bool RoutingDb::use_compiled(const std::string& json_path,
+                             const std::string& db_path)
+{
+  struct stat db_stat;
+  struct stat json_stat;
+
+  if (stat(db_path.c_str(), &db_stat) != 0)
+  {
+    return false;
+  }
+
+  if (stat(json_path.c_str(), &json_stat) != 0)
+  {
+    return true;
+  }
+
+  if (db_stat.st_mtime < json_stat.st_mtime)
+  {
+    TRC_WARNING("Ignoring %s as it is older than %s",
+                db_path.c_str(), json_path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+std::string RoutingDb::value(uint32_t index) const
+{
+  if (index >= _header->num_values)
+  {
+    return std::string();
+  }
+
+  return std::string(_strings + _values[index].offset, _values[index].length);
+}
+
+std::string RoutingDb::key(const Entry& entry) const
+{
+  if ((uint64_t)entry.key.offset + entry.key.length > _header->strings_len)
+  {
+    return std::string();
+  }
+
+  return std::string(_strings + entry.key.offset, entry.key.length);
+}
+
+int RoutingDb::compare_key(const Entry& entry,
+                           const std::string& s,
+                           size_t len) const
+{
+  size_t key_len = 0;
+
+  if ((uint64_t)entry.key.offset + entry.key.length <= _header->strings_len)
+  {
+    key_len = std::min((size_t)entry.key.length, len);
+  }
+
+  size_t s_len = std::min(s.size(), len);
+  int rc = memcmp(_strings + entry.key.offset, s.data(), std::min(key_len, s_len));
+
+  if (rc == 0)
+  {
+    rc = (key_len < s_len) ? -1 : ((key_len > s_len) ? 1 : 0);
+  }
+
+  return rc;
+}
+
+uint32_t RoutingDb::find_exact(const Entry* entries,
+                               uint32_t num_entries,
+                               const std::string& key) const
+{
+  uint32_t lo = 0;
+  uint32_t hi = num_entries;
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int rc = compare_key(entries[mid], key, std::string::npos);
+
+    if (rc == 0)
+    {
+      return entries[mid].value_index;
+    }
+    else if (rc < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return NOT_FOUND;
+}
+
+uint32_t RoutingDb::match_number(const std::string& number,
+                                 std::string* prefix) const
+{
+  size_t len = number.size();
+
+  // Keys that start with the number are contiguous in the sorted table, and
+  // comparing just their first len characters puts them in order relative to
+  // the other keys.  Find the last of them.
+  uint32_t lo = 0;
+  uint32_t hi = _header->num_numbers;
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (compare_key(_numbers[mid], number, len) <= 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  if ((lo > 0) && (compare_key(_numbers[lo - 1], number, len) == 0))
+  {
+    if (prefix != NULL)
+    {
+      *prefix = key(_numbers[lo - 1]);
+    }
+
+    return _numbers[lo - 1].value_index;
+  }
+
+  // Otherwise look for the longest key that the number starts with.
+  for (size_t prefix_len = len; prefix_len-- > 0; )
+  {
+    uint32_t index = find_exact(_numbers,
+                                _header->num_numbers,
+                                number.substr(0, prefix_len));
+
+    if (index != NOT_FOUND)
+    {
+      if (prefix != NULL)
+      {
+        *prefix = number.substr(0, prefix_len);
+      }
+
+      return index;
+    }
+  }
+
+  return NOT_FOUND;
+}
+
+uint32_t RoutingDb::find_domain(const std::string& domain) const
+{
+  return find_exact(_domains, _header->num_domains, domain);
+}
+
+uint32_t RoutingDb::Builder::add_value(const std::string& value)
+{
+  std::map<std::string, uint32_t>::iterator it = _value_indexes.find(value);
+
+  if (it != _value_indexes.end())
+  {
+    return it->second;
+  }
+
+  uint32_t index = _values.size();
+  _values.push_back(value);
+  _value_indexes[value] = index;
+  return index;
+}
+
+void RoutingDb::Builder::add_number(const std::string& prefix,
+                                    uint32_t value_index)
+{
+  _numbers.insert(std::make_pair(prefix, value_index));
+}
+
+void RoutingDb::Builder::add_domain(const std::string& domain,
+                                    uint32_t value_index)
+{
+  _domains.insert(std::make_pair(domain, value_index));
+}
+
+bool RoutingDb::Builder::write(const std::string& path) const
+{
+  std::string strings;
+  std::vector<StringRef> values;
+  std::vector<Entry> numbers;
+  std::vector<Entry> domains;
+
+  for (const std::string& value : _values)
+  {
+    StringRef ref = {(uint32_t)strings.size(), (uint32_t)value.size()};
+    values.push_back(ref);
+    strings.append(value);
+  }
+
+  // std::map iterates in key order, which is the order lookups need.
+  for (const std::pair<const std::string, uint32_t>& number : _numbers)
+  {
+    Entry entry = {{(uint32_t)strings.size(), (uint32_t)number.first.size()},
+                   number.second};
+    numbers.push_back(entry);
+    strings.append(number.first);
+  }
+
+  for (const std::pair<const std::string, uint32_t>& domain : _domains)
+  {
+    Entry entry = {{(uint32_t)strings.size(), (uint32_t)domain.first.size()},
+                   domain.second};
+    domains.push_back(entry);
+    strings.append(domain.first);
+  }
+
+  Header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.type = _type;
+  header.num_values = values.size();
+  header.num_numbers = numbers.size();
+  header.num_domains = domains.size();
+  header.strings_len = strings.size();
+
+  std::string tmp_path = path + ".tmp";
+  std::ofstream fs(tmp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  fs.write((const char*)&header, sizeof(header));
+  fs.write((const char*)values.data(), values.size() * sizeof(StringRef));
+  fs.write((const char*)numbers.data(), numbers.size() * sizeof(Entry));
+  fs.write((const char*)domains.data(), domains.size() * sizeof(Entry));
+  fs.write(strings.data(), strings.size());
+  fs.close();
+
+  if (!fs)
+  {
+    TRC_ERROR("Failed to write routing database to %s", tmp_path.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  if (rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to rename %s to %s", tmp_path.c_str(), path.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file routing_db_compiler.cpp  Offline compiler for ENUM and BGCF routing
+ * databases.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <string>
+
+#include "routing_db.h"
+#include "enumservice.h"
+#include "bgcfservice.h"
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: sprout_routing_db_compiler (enum|bgcf) <JSON file> [<database file>]\n"
+          "\n"
+          "Compiles enum.json or bgcf.json into a routing database that Sprout\n"
+          "maps into memory instead of parsing the JSON.  The database is written\n"
+          "alongside the JSON file (e.g. enum.json is compiled to enum.db) unless\n"
+          "a database file is specified.  Sprout only uses the database while it\n"
+          "is at least as new as the JSON file.\n");
+}
+
+int main(int argc, char* argv[])
+{
+  if ((argc < 3) || (argc > 4))
+  {
+    usage();
+    return 1;
+  }
+
+  std::string type = argv[1];
+  std::string json_file = argv[2];
+  std::string db_file = (argc == 4) ? argv[3] : RoutingDb::compiled_path(json_file);
+  bool success;
+
+  if (type == "enum")
+  {
+    success = JSONEnumService::compile(json_file, db_file);
+  }
+  else if (type == "bgcf")
+  {
+    success = BgcfService::compile(json_file, db_file);
+  }
+  else
+  {
+    usage();
+    return 1;
+  }
+
+  if (!success)
+  {
+    fprintf(stderr, "Failed to compile %s\n", json_file.c_str());
+    return 1;
+  }
+
+  printf("Compiled %s to %s\n", json_file.c_str(), db_file.c_str());
+  return 0;
+}
@@ -268,7 +268,9 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                     std::bind(&RegistrarSproutlet::expiry_for_binding,
                                               _registrar_sproutlet,
                                               std::placeholders::_1,
-                                              std::placeholders::_2));
+                                              std::placeholders::_2),
+                                    opt.stateless_nonce_key,
+                                    digest_av_cache);
       ok = ok && _auth_sproutlet->init();
       sproutlets.push_front(_auth_sproutlet);
     }
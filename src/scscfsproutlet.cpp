@@ -456,6 +456,8 @@ SCSCFSproutletTsx::SCSCFSproutletTsx(SCSCFSproutlet* scscf,
   _target_aor(),
   _target_bindings(),
   _liveness_timer(0),
+  _enum_req(NULL),
+  _enum_result(),
   _record_routed(false),
   _req_type(req_type),
   _seen_1xx(false),
@@ -1450,37 +1452,12 @@ void SCSCFSproutletTsx::apply_originating_services(pjsip_msg* req)
     if (_scscf->_enum_service)
     {
       // Attempt to translate the RequestURI using ENUM or an alternative
-      // database.
-      _scscf->translate_request_uri(req, get_pool(req), trail());
-
-      URIClass uri_class = URIClassifier::classify_uri(req->line.req.uri, true, true);
-      std::string new_uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, req->line.req.uri);
-      TRC_INFO("New URI string is %s", new_uri_str.c_str());
-
-      if ((uri_class == LOCAL_PHONE_NUMBER) ||
-          (uri_class == GLOBAL_PHONE_NUMBER) ||
-          (uri_class == NP_DATA) ||
-          (uri_class == FINAL_NP_DATA))
-      {
-        TRC_DEBUG("Routing to BGCF");
-        SAS::Event event(trail(), SASEvent::PHONE_ROUTING_TO_BGCF, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-        route_to_bgcf(req);
-      }
-      else if (uri_class == OFFNET_SIP_URI)
-      {
-        // Destination is off-net, so route to the BGCF.
-        TRC_DEBUG("Routing to BGCF");
-        SAS::Event event(trail(), SASEvent::OFFNET_ROUTING_TO_BGCF, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-        route_to_bgcf(req);
-      }
-      else
+      // database.  If the lookup is done asynchronously, routing continues
+      // when it completes (in on_timer_expiry).
+      if (!translate_request_uri_async(req))
       {
-        // Destination is on-net so route to the I-CSCF.
-        route_to_icscf(req);
+        _scscf->translate_request_uri(req, get_pool(req), trail());
+        route_translated_request(req);
       }
     }
     else
@@ -1495,6 +1472,109 @@ void SCSCFSproutletTsx::apply_originating_services(pjsip_msg* req)
 }
 
 
+/// Starts translating the Request-URI using ENUM without blocking this
+/// thread, if the ENUM service supports it.  Returns false if the
+/// translation should be done synchronously instead.
+bool SCSCFSproutletTsx::translate_request_uri_async(pjsip_msg* req)
+{
+  std::string user;
+
+  if ((!_scscf->_enum_service->is_async()) ||
+      (!PJUtils::should_query_enum(req, false, user)))
+  {
+    return false;
+  }
+
+  std::function<void()> complete = start_async_timer(&_enum_result);
+  if (!complete)
+  {
+    // LCOV_EXCL_START - the sproutlet proxy always supports asynchronous
+    // timers.
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  TRC_DEBUG("Performing asynchronous ENUM translation for user %s", user.c_str());
+  _enum_req = req;
+  std::string* result = &_enum_result;
+  _scscf->_enum_service->lookup_uri_from_user_async(
+    user,
+    trail(),
+    [result, complete](const std::string& uri)
+    {
+      // The transaction (and so the result string) is kept alive until the
+      // completion function is called.
+      *result = uri;
+      complete();
+    });
+
+  return true;
+}
+
+
+/// Handles the completion of an asynchronous ENUM lookup.
+void SCSCFSproutletTsx::on_enum_complete()
+{
+  pjsip_msg* req = _enum_req;
+  _enum_req = NULL;
+
+  if (_cancelled)
+  {
+    // The request was cancelled while the lookup was in progress, so there's
+    // no point routing it.
+    TRC_DEBUG("Request cancelled during ENUM lookup");
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TERMINATED);
+    send_response(rsp);
+    free_msg(req);
+    return;
+  }
+
+  PJUtils::apply_enum_result(req,
+                             get_pool(req),
+                             _enum_result,
+                             false,
+                             _scscf->should_override_npdi(),
+                             trail());
+  route_translated_request(req);
+}
+
+
+/// Routes a request at the end of originating processing, once its
+/// Request-URI has been translated.
+void SCSCFSproutletTsx::route_translated_request(pjsip_msg* req)
+{
+  URIClass uri_class = URIClassifier::classify_uri(req->line.req.uri, true, true);
+  std::string new_uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, req->line.req.uri);
+  TRC_INFO("New URI string is %s", new_uri_str.c_str());
+
+  if ((uri_class == LOCAL_PHONE_NUMBER) ||
+      (uri_class == GLOBAL_PHONE_NUMBER) ||
+      (uri_class == NP_DATA) ||
+      (uri_class == FINAL_NP_DATA))
+  {
+    TRC_DEBUG("Routing to BGCF");
+    SAS::Event event(trail(), SASEvent::PHONE_ROUTING_TO_BGCF, 0);
+    event.add_var_param(new_uri_str);
+    SAS::report_event(event);
+    route_to_bgcf(req);
+  }
+  else if (uri_class == OFFNET_SIP_URI)
+  {
+    // Destination is off-net, so route to the BGCF.
+    TRC_DEBUG("Routing to BGCF");
+    SAS::Event event(trail(), SASEvent::OFFNET_ROUTING_TO_BGCF, 0);
+    event.add_var_param(new_uri_str);
+    SAS::report_event(event);
+    route_to_bgcf(req);
+  }
+  else
+  {
+    // Destination is on-net so route to the I-CSCF.
+    route_to_icscf(req);
+  }
+}
+
+
 /// Apply terminating services for this request.
 void SCSCFSproutletTsx::apply_terminating_services(pjsip_msg* req)
 {
@@ -2234,9 +2314,16 @@ bool SCSCFSproutletTsx::get_billing_role(ACR::NodeRole &role)
 }
 
 
-/// Handles liveness timer expiry.
+/// Handles liveness timer expiry (and the completion of asynchronous ENUM
+/// lookups).
 void SCSCFSproutletTsx::on_timer_expiry(void* context)
 {
+  if (context == &_enum_result)
+  {
+    on_enum_complete();
+    return;
+  }
+
   _liveness_timer = 0;
 
   if (_as_chain_link.is_set())
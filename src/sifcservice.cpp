@@ -26,6 +26,7 @@ SIFCService::SIFCService(Alarm* alarm,
                          std::string configuration) :
   _alarm(alarm),
   _no_shared_ifcs_set_tbl(no_shared_ifcs_set_tbl),
+  _shared_ifc_sets(std::make_shared<SharedIfcSets>()),
   _configuration(configuration),
   _updater(NULL)
 {
@@ -93,9 +94,8 @@ void SIFCService::update_sets()
   }
 
   // At this point, we're definitely going to override the IFCs we've got.
-  // Update our map, taking a lock while we do so.
-  boost::lock_guard<boost::shared_mutex> write_lock(_sets_rw_lock);
-  _shared_ifc_sets.clear();
+  // Build a new map, which we swap in once it's complete.
+  std::shared_ptr<SharedIfcSets> shared_ifc_sets(new SharedIfcSets());
   bool any_errors = false;
 
   rapidxml::xml_node<>* sets = root->first_node(SIFCService::SHARED_IFCS_SETS);
@@ -128,7 +128,7 @@ void SIFCService::update_sets()
       continue;
     }
 
-    if (_shared_ifc_sets.count(set_id) != 0)
+    if (shared_ifc_sets->count(set_id) != 0)
     {
       TRC_ERROR("Invalid shared IFC block - SetID (%d) is repeated. Skipping this entry",
                 set_id);
@@ -170,9 +170,11 @@ void SIFCService::update_sets()
     }
 
     TRC_STATUS("Adding %lu IFCs for ID %d", ifc_set.size(), set_id);
-    _shared_ifc_sets.insert(std::make_pair(set_id, ifc_set));
+    shared_ifc_sets->insert(std::make_pair(set_id, ifc_set));
   }
 
+  _shared_ifc_sets.set(shared_ifc_sets);
+
   if (any_errors)
   {
     set_alarm();
@@ -188,7 +190,6 @@ void SIFCService::update_sets()
 SIFCService::~SIFCService()
 {
   delete _updater; _updater = NULL;
-  _shared_ifc_sets.clear();
   delete _alarm; _alarm = NULL;
 }
 
@@ -197,20 +198,18 @@ void SIFCService::get_ifcs_from_id(std::multimap<int32_t, Ifc>& ifc_map,
                                    std::shared_ptr<xml_document<> > ifc_doc,
                                    SAS::TrailId trail) const
 {
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_sets_rw_lock);
+  const SharedIfcSets& shared_ifc_sets = _shared_ifc_sets.get();
 
   for (int id : ids)
   {
     TRC_DEBUG("Getting the shared IFCs for ID %d", id);
-    std::map<int, std::vector<std::pair<int32_t, std::string>>>::const_iterator i =
-                                                      _shared_ifc_sets.find(id);
+    SharedIfcSets::const_iterator i = shared_ifc_sets.find(id);
 
-    if (i != _shared_ifc_sets.end())
+    if (i != shared_ifc_sets.end())
     {
       TRC_DEBUG("Found IFC set for ID %d", id);
 
-      for (std::pair<int32_t, std::string> ifc : i->second)
+      for (const std::pair<int32_t, std::string>& ifc : i->second)
       {
         ifc_map.insert(std::make_pair(ifc.first, Ifc(ifc.second, ifc_doc.get())));
       }
@@ -9,14 +9,30 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <algorithm>
+
 #include "log.h"
 #include "sipresolver.h"
+#include "dnscachedresolver.h"
 #include "sas.h"
 #include "sproutsasevent.h"
 
+constexpr double SIPResolver::LATENCY_EWMA_ALPHA;
+constexpr double SIPResolver::LATENCY_MIN_FACTOR;
+
 SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
                          int blacklist_duration) :
-  BaseResolver(dns_client)
+  BaseResolver(dns_client),
+  _blacklist_duration(blacklist_duration),
+  _target_cache_enabled(false),
+  _stale_served_tbl(NULL),
+  _refresh_failures_tbl(NULL),
+  _stale_served(0),
+  _refresh_failures(0),
+  _latency_weighting(false),
+  _refresh_thread_running(false),
+  _terminate(false),
+  _async_terminate(false)
 {
   TRC_DEBUG("Creating SIP resolver");
 
@@ -32,16 +48,131 @@ SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
   // Create the blacklist.
   create_blacklist(blacklist_duration);
 
+  for (int ii = 0; ii < TARGET_CACHE_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_target_cache[ii].lock, NULL);
+  }
+
+  pthread_mutex_init(&_latency_lock, NULL);
+  pthread_mutex_init(&_refresh_lock, NULL);
+  pthread_cond_init(&_refresh_cond, NULL);
+  pthread_mutex_init(&_async_lock, NULL);
+  pthread_cond_init(&_async_cond, NULL);
+
   TRC_STATUS("Created SIP resolver");
 }
 
 SIPResolver::~SIPResolver()
 {
+  if (!_async_threads.empty())
+  {
+    // Stop the asynchronous resolution threads.  Any resolutions that
+    // haven't started are abandoned.
+    pthread_mutex_lock(&_async_lock);
+    _async_terminate = true;
+    pthread_cond_broadcast(&_async_cond);
+    pthread_mutex_unlock(&_async_lock);
+
+    for (pthread_t thread : _async_threads)
+    {
+      pthread_join(thread, NULL);
+    }
+  }
+
+  pthread_cond_destroy(&_async_cond);
+  pthread_mutex_destroy(&_async_lock);
+
+  if (_refresh_thread_running)
+  {
+    pthread_mutex_lock(&_refresh_lock);
+    _terminate = true;
+    pthread_cond_signal(&_refresh_cond);
+    pthread_mutex_unlock(&_refresh_lock);
+    pthread_join(_refresh_thread, NULL);
+  }
+
+  pthread_cond_destroy(&_refresh_cond);
+  pthread_mutex_destroy(&_refresh_lock);
+  pthread_mutex_destroy(&_latency_lock);
+
+  for (int ii = 0; ii < TARGET_CACHE_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_target_cache[ii].lock);
+  }
+
   destroy_blacklist();
   destroy_srv_cache();
   destroy_naptr_cache();
 }
 
+void SIPResolver::enable_target_cache(SNMP::CounterTable* stale_served_tbl,
+                                      SNMP::CounterTable* refresh_failures_tbl,
+                                      bool refresh_thread)
+{
+  _target_cache_enabled = true;
+  _stale_served_tbl = stale_served_tbl;
+  _refresh_failures_tbl = refresh_failures_tbl;
+
+  if (refresh_thread)
+  {
+    int rc = pthread_create(&_refresh_thread,
+                            NULL,
+                            &SIPResolver::refresh_thread_fn,
+                            this);
+    if (rc == 0)
+    {
+      _refresh_thread_running = true;
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to create SIP target cache refresh thread: %d", rc);
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  TRC_STATUS("Enabled SIP target cache");
+}
+
+void SIPResolver::enable_async_resolution(int num_threads)
+{
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &SIPResolver::async_thread_fn, this);
+
+    if (rc == 0)
+    {
+      _async_threads.push_back(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to create SIP resolver thread: %d", rc);
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  TRC_STATUS("Enabled asynchronous SIP resolution on %d threads",
+             _async_threads.size());
+}
+
+void SIPResolver::enable_latency_weighting()
+{
+  _latency_weighting = true;
+  TRC_STATUS("Enabled SIP latency-weighted target selection");
+}
+
+// Reduces a TTL to another TTL, if that's lower.  A TTL of -1 means there's
+// no TTL yet.
+static void update_ttl(int& ttl, int other_ttl)
+{
+  if ((other_ttl >= 0) && ((ttl < 0) || (other_ttl < ttl)))
+  {
+    ttl = other_ttl;
+  }
+}
+
 void SIPResolver::resolve(const std::string& name,
                           int af,
                           int port,
@@ -91,207 +222,951 @@ void SIPResolver::resolve(const std::string& name,
       SAS::report_event(event);
     }
   }
+  else if (_target_cache_enabled)
+  {
+    resolve_cached(name, af, port, transport, retries, targets, trail);
+  }
   else
   {
-    std::string srv_name;
-    std::string a_name = name;
+    Plan plan;
+    get_plan(name, port, transport, plan, trail);
 
-    if (port != 0)
+    if (plan.srv_name != "")
     {
-      // Port is specified, so don't do NAPTR or SRV look-ups.  Default transport
-      // if required and move straight to A record look-up.
-      TRC_DEBUG("Port is specified");
-      transport = (transport != -1) ? transport : IPPROTO_UDP;
+      srv_resolve(plan.srv_name, af, plan.transport, retries, targets, dummy_ttl, trail);
+    }
+    else
+    {
+      a_resolve(plan.a_name, af, plan.port, plan.transport, retries, targets, dummy_ttl, trail);
+    }
+  }
 
-      if (trail != 0)
+  if ((targets.size() == 0) && (trail != 0))
+  {
+    SAS::Event event(trail, SASEvent::SIPRESOLVE_NO_RECORDS, 0);
+    event.add_var_param(name);
+    SAS::report_event(event);
+  }
+}
+
+bool SIPResolver::resolve_async(const std::string& name,
+                                int af,
+                                int port,
+                                int transport,
+                                int retries,
+                                std::vector<AddrInfo>& targets,
+                                SAS::TrailId trail,
+                                ResolveCallback callback)
+{
+  IP46Address address;
+
+  if ((_async_threads.empty()) ||
+      (parse_ip_target(name, address)) ||
+      ((_target_cache_enabled) &&
+       (is_target_cached(TargetCacheKey(name, af, port, transport)))))
+  {
+    // We can resolve the name without waiting for DNS (or we have to wait
+    // anyway).
+    resolve(name, af, port, transport, retries, targets, trail);
+    return true;
+  }
+
+  TRC_DEBUG("Queue asynchronous resolution of %s", name.c_str());
+  AsyncRequest request;
+  request.name = name;
+  request.af = af;
+  request.port = port;
+  request.transport = transport;
+  request.retries = retries;
+  request.trail = trail;
+  request.callback = callback;
+
+  pthread_mutex_lock(&_async_lock);
+  _async_q.push_back(request);
+  pthread_cond_signal(&_async_cond);
+  pthread_mutex_unlock(&_async_lock);
+
+  return false;
+}
+
+bool SIPResolver::is_target_cached(const TargetCacheKey& key)
+{
+  TargetCacheShard& shard = target_cache_shard(key);
+  pthread_mutex_lock(&shard.lock);
+
+  std::map<TargetCacheKey, TargetCacheEntry>::const_iterator i = shard.entries.find(key);
+  bool cached = ((i != shard.entries.end()) &&
+                 (time(NULL) < i->second.expires + TARGET_CACHE_MAX_STALE));
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return cached;
+}
+
+SIPResolver::TargetCacheShard& SIPResolver::target_cache_shard(const TargetCacheKey& key)
+{
+  return _target_cache[std::hash<std::string>()(std::get<0>(key)) % TARGET_CACHE_SHARDS];
+}
+
+size_t SIPResolver::target_cache_size()
+{
+  size_t size = 0;
+
+  for (int ii = 0; ii < TARGET_CACHE_SHARDS; ++ii)
+  {
+    pthread_mutex_lock(&_target_cache[ii].lock);
+    size += _target_cache[ii].entries.size();
+    pthread_mutex_unlock(&_target_cache[ii].lock);
+  }
+
+  return size;
+}
+
+void* SIPResolver::async_thread_fn(void* arg)
+{
+  ((SIPResolver*)arg)->async_thread();
+  return NULL;
+}
+
+void SIPResolver::async_thread()
+{
+  pthread_mutex_lock(&_async_lock);
+
+  while (!_async_terminate)
+  {
+    if (_async_q.empty())
+    {
+      pthread_cond_wait(&_async_cond, &_async_lock);
+    }
+    else
+    {
+      AsyncRequest request = _async_q.front();
+      _async_q.pop_front();
+      pthread_mutex_unlock(&_async_lock);
+
+      std::vector<AddrInfo> targets;
+      resolve(request.name,
+              request.af,
+              request.port,
+              request.transport,
+              request.retries,
+              targets,
+              request.trail);
+      request.callback(targets);
+
+      pthread_mutex_lock(&_async_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_async_lock);
+}
+
+void SIPResolver::get_plan(const std::string& name,
+                           int port,
+                           int transport,
+                           Plan& plan,
+                           SAS::TrailId trail)
+{
+  int naptr_ttl = -1;
+  plan.ttl = -1;
+
+  std::string srv_name;
+  std::string a_name = name;
+
+  if (port != 0)
+  {
+    // Port is specified, so don't do NAPTR or SRV look-ups.  Default transport
+    // if required and move straight to A record look-up.
+    TRC_DEBUG("Port is specified");
+    transport = (transport != -1) ? transport : IPPROTO_UDP;
+
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_PORT_A_LOOKUP, 0);
+      event.add_var_param(name);
+      std::string port_str = std::to_string(port);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      event.add_var_param(port_str);
+      SAS::report_event(event);
+    }
+  }
+  else if (transport == -1)
+  {
+    // Transport protocol isn't specified, so do a NAPTR lookup for the target.
+    TRC_DEBUG("Do NAPTR look-up for %s", name.c_str());
+
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_LOOKUP, 0);
+      event.add_var_param(name);
+      SAS::report_event(event);
+    }
+
+    NAPTRReplacement* naptr = _naptr_cache->get(name, naptr_ttl, trail);
+
+    if (naptr != NULL)
+    {
+      // The targets are only valid for as long as the NAPTR record.  (If
+      // there's no NAPTR record, the targets are valid for as long as the
+      // records we use instead.)
+      update_ttl(plan.ttl, naptr_ttl);
+
+      // NAPTR resolved to a supported service
+      TRC_DEBUG("NAPTR resolved to transport %d", naptr->transport);
+      transport = naptr->transport;
+      if (strcasecmp(naptr->flags.c_str(), "S") == 0)
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_PORT_A_LOOKUP, 0);
-        event.add_var_param(name);
-        std::string port_str = std::to_string(port);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
-        event.add_var_param(port_str);
-        SAS::report_event(event);
+        // Do an SRV lookup with the replacement domain from the NAPTR lookup.
+        srv_name = naptr->replacement;
+
+        if (trail != 0)
+        {
+          SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_SRV, 0);
+          event.add_var_param(name);
+          event.add_var_param(srv_name);
+          std::string transport_str = get_transport_str(naptr->transport);
+          event.add_var_param(transport_str);
+          SAS::report_event(event);
+        }
+      }
+      else
+      {
+        // Move straight to A/AAAA lookup of the domain returned by NAPTR.
+        a_name = naptr->replacement;
+
+        if (trail != 0)
+        {
+          SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_A, 0);
+          event.add_var_param(name);
+          event.add_var_param(a_name);
+          SAS::report_event(event);
+        }
       }
     }
-    else if (transport == -1)
+    else
     {
-      // Transport protocol isn't specified, so do a NAPTR lookup for the target.
-      TRC_DEBUG("Do NAPTR look-up for %s", name.c_str());
+      // NAPTR resolution failed, so do SRV lookups for both UDP and TCP to
+      // see which transports are supported.
+      TRC_DEBUG("NAPTR lookup failed, so do SRV lookups for UDP and TCP");
 
       if (trail != 0)
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_LOOKUP, 0);
+        SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_FAILURE, 0);
         event.add_var_param(name);
         SAS::report_event(event);
       }
 
-      NAPTRReplacement* naptr = _naptr_cache->get(name, dummy_ttl, trail);
+      std::vector<std::string> domains;
+      domains.push_back("_sip._udp." + name);
+      domains.push_back("_sip._tcp." + name);
+      std::vector<DnsResult> results;
+      _dns_client->dns_query(domains, ns_t_srv, results, trail);
+      DnsResult& udp_result = results[0];
+      TRC_DEBUG("UDP SRV record %s returned %d records",
+                udp_result.domain().c_str(), udp_result.records().size());
+      DnsResult& tcp_result = results[1];
+      TRC_DEBUG("TCP SRV record %s returned %d records",
+                tcp_result.domain().c_str(), tcp_result.records().size());
 
-      if (naptr != NULL)
+      if (!udp_result.records().empty())
       {
-        // NAPTR resolved to a supported service
-        TRC_DEBUG("NAPTR resolved to transport %d", naptr->transport);
-        transport = naptr->transport;
-        if (strcasecmp(naptr->flags.c_str(), "S") == 0)
-        {
-          // Do an SRV lookup with the replacement domain from the NAPTR lookup.
-          srv_name = naptr->replacement;
+        // UDP SRV lookup returned some records, so use UDP transport.
+        TRC_DEBUG("UDP SRV lookup successful, select UDP transport");
+        transport = IPPROTO_UDP;
+        srv_name = udp_result.domain();
+      }
+      else if (!tcp_result.records().empty())
+      {
+        // TCP SRV lookup returned some records, so use TCP transport.
+        TRC_DEBUG("TCP SRV lookup successful, select TCP transport");
+        transport = IPPROTO_TCP;
+        srv_name = tcp_result.domain();
+      }
+      else
+      {
+        // Neither UDP nor TCP SRV lookup returned any results, so default to
+        // UDP transport and move straight to A/AAAA record lookups.
+        TRC_DEBUG("UDP and TCP SRV queries unsuccessful, default to UDP");
+        transport = IPPROTO_UDP;
+      }
+    }
+
+    _naptr_cache->dec_ref(name);
+  }
+  else if (transport == IPPROTO_UDP)
+  {
+    // Use specified transport and try an SRV lookup.
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
+      event.add_var_param(name);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      SAS::report_event(event);
+    }
+
+    DnsResult result = _dns_client->dns_query("_sip._udp." + name, ns_t_srv, trail);
+
+    if (!result.records().empty())
+    {
+      srv_name = result.domain();
+    }
+  }
+  else if (transport == IPPROTO_TCP)
+  {
+    // Use specified transport and try an SRV lookup.
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
+      event.add_var_param(name);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      SAS::report_event(event);
+    }
+
+    DnsResult result = _dns_client->dns_query("_sip._tcp." + name, ns_t_srv, trail);
+
+    if (!result.records().empty())
+    {
+      srv_name = result.domain();
+    }
+  }
+
+
+  if (srv_name != "")
+  {
+    TRC_DEBUG("Do SRV lookup for %s", srv_name.c_str());
+
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_SRV_LOOKUP, 0);
+      event.add_var_param(srv_name);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      SAS::report_event(event);
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Perform A/AAAA record lookup only, name = %s", a_name.c_str());
+    port = (port != 0) ? port : 5060;
+
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_A_LOOKUP, 0);
+      event.add_var_param(a_name);
+      std::string transport_str = get_transport_str(transport);
+      std::string port_str = std::to_string(port);
+      event.add_var_param(transport_str);
+      event.add_var_param(port_str);
+      SAS::report_event(event);
+    }
+  }
+
+  plan.transport = transport;
+  plan.srv_name = srv_name;
+  plan.a_name = a_name;
+  plan.port = port;
+}
+
+void SIPResolver::resolve_cached(const std::string& name,
+                                 int af,
+                                 int port,
+                                 int transport,
+                                 int retries,
+                                 std::vector<AddrInfo>& targets,
+                                 SAS::TrailId trail)
+{
+  TargetCacheKey key(name, af, port, transport);
+  TargetCacheShard& shard = target_cache_shard(key);
+  std::shared_ptr<const std::vector<CachedHost>> hosts;
+  time_t now = time(NULL);
+
+  // Take a reference to the cached hosts, so that the targets can be
+  // selected from them without holding the lock.
+  pthread_mutex_lock(&shard.lock);
+
+  std::map<TargetCacheKey, TargetCacheEntry>::iterator i = shard.entries.find(key);
+
+  if ((i != shard.entries.end()) &&
+      (now < i->second.expires + TARGET_CACHE_MAX_STALE))
+  {
+    hosts = i->second.hosts;
+    i->second.used = true;
+
+    if (now >= i->second.expires)
+    {
+      // The targets have expired, but the refresh thread hasn't refreshed
+      // them yet (or can't), so use them anyway rather than block.
+      TRC_DEBUG("Using expired targets for %s", name.c_str());
+      _stale_served++;
+
+      if (_stale_served_tbl)
+      {
+        _stale_served_tbl->increment();
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  if (hosts == NULL)
+  {
+    // The name isn't cached, so resolve it now.
+    std::shared_ptr<std::vector<CachedHost>> new_hosts(new std::vector<CachedHost>());
+    int ttl = resolve_hosts(key, *new_hosts, trail);
+
+    if (ttl < 0)
+    {
+      // No targets.  Don't cache this, so we try again next time.
+      return;
+    }
+
+    hosts = new_hosts;
 
-          if (trail != 0)
+    if (ttl > 0)
+    {
+      TargetCacheEntry entry;
+      entry.hosts = hosts;
+      entry.expires = now + ttl;
+      entry.refresh_at = entry.expires;
+      entry.used = false;
+
+      pthread_mutex_lock(&shard.lock);
+      shard.entries[key] = entry;
+      pthread_mutex_unlock(&shard.lock);
+    }
+    else
+    {
+      // The records mustn't be reused, so resolve the name again next time.
+      TRC_DEBUG("Not caching targets for %s with TTL 0", name.c_str());
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Found cached targets for %s", name.c_str());
+  }
+
+  select_targets(*hosts, retries, targets);
+}
+
+int SIPResolver::resolve_hosts(const TargetCacheKey& key,
+                               std::vector<CachedHost>& hosts,
+                               SAS::TrailId trail)
+{
+  const std::string& name = std::get<0>(key);
+  int af = std::get<1>(key);
+  int addr_type = (af == AF_INET6) ? ns_t_aaaa : ns_t_a;
+
+  Plan plan;
+  get_plan(name, std::get<2>(key), std::get<3>(key), plan, trail);
+
+  int ttl = plan.ttl;
+
+  // Get the hosts (and the ports to use), either from the SRV records or
+  // just the name we have.
+  std::vector<std::string> host_names;
+
+  if (plan.srv_name != "")
+  {
+    DnsResult srv_result = _dns_client->dns_query(plan.srv_name, ns_t_srv, trail);
+    update_ttl(ttl, srv_result.ttl());
+
+    for (DnsRRecord* record : srv_result.records())
+    {
+      DnsSrvRecord* srv = (DnsSrvRecord*)record;
+      CachedHost host;
+      host.priority = srv->priority();
+      host.weight = srv->weight();
+      hosts.push_back(host);
+      host_names.push_back(srv->target());
+
+      // Stash the port until we have the addresses.
+      hosts.back().targets.resize(1);
+      hosts.back().targets[0].port = srv->port();
+    }
+  }
+  else
+  {
+    CachedHost host;
+    host.priority = 0;
+    host.weight = 0;
+    host.targets.resize(1);
+    host.targets[0].port = plan.port;
+    hosts.push_back(host);
+    host_names.push_back(plan.a_name);
+  }
+
+  // Look up the addresses of all the hosts at once.
+  std::vector<DnsResult> results;
+  _dns_client->dns_query(host_names, addr_type, results, trail);
+
+  bool found = false;
+
+  for (size_t ii = 0; ii < hosts.size(); ++ii)
+  {
+    AddrInfo ai;
+    ai.port = hosts[ii].targets[0].port;
+    ai.transport = plan.transport;
+    ai.address.af = af;
+    hosts[ii].targets.clear();
+
+    for (DnsRRecord* record : results[ii].records())
+    {
+      if (af == AF_INET6)
+      {
+        ai.address.addr.ipv6 = ((DnsAAAARecord*)record)->address();
+      }
+      else
+      {
+        ai.address.addr.ipv4 = ((DnsARecord*)record)->address();
+      }
+
+      hosts[ii].targets.push_back(ai);
+      found = true;
+    }
+
+    if (!hosts[ii].targets.empty())
+    {
+      update_ttl(ttl, results[ii].ttl());
+    }
+  }
+
+  if (!found)
+  {
+    return -1;
+  }
+
+  std::stable_sort(hosts.begin(),
+                   hosts.end(),
+                   [](const CachedHost& host1, const CachedHost& host2)
+                   { return host1.priority < host2.priority; });
+
+  return std::max(ttl, 0);
+}
+
+// Picks an index at random in proportion to the weights (never picking one
+// with zero weight unless they're all zero, in which case the pick is
+// uniform).
+static size_t weighted_choice(const std::vector<double>& weights, double total)
+{
+  size_t index = 0;
+
+  if (total > 0)
+  {
+    double random = total * rand() / ((double)RAND_MAX + 1);
+    double accumulator = weights[0];
+
+    while ((accumulator <= random) && (index + 1 < weights.size()))
+    {
+      ++index;
+      accumulator += weights[index];
+    }
+  }
+  else
+  {
+    index = rand() % weights.size();
+  }
+
+  return index;
+}
+
+void SIPResolver::select_targets(const std::vector<CachedHost>& hosts,
+                                 int retries,
+                                 std::vector<AddrInfo>& targets)
+{
+  std::vector<AddrInfo> blacklisted;
+  std::vector<std::vector<double>> latencies_us;
+  std::vector<std::vector<double>> slow_start;
+
+  if (_latency_weighting)
+  {
+    get_latencies(hosts, latencies_us, slow_start);
+  }
+
+  for (size_t start = 0; start < hosts.size(); )
+  {
+    // Find the hosts with this priority.
+    size_t end = start;
+    int total_srv_weight = 0;
+
+    while ((end < hosts.size()) &&
+           (hosts[end].priority == hosts[start].priority))
+    {
+      total_srv_weight += hosts[end].weight;
+      ++end;
+    }
+
+    // Work out how much to favour each target, based on its latency relative
+    // to the fastest in this priority.
+    double best_latency_us = 0;
+
+    if (_latency_weighting)
+    {
+      for (size_t ii = start; ii < end; ++ii)
+      {
+        for (double latency_us : latencies_us[ii])
+        {
+          if ((latency_us > 0) &&
+              ((best_latency_us == 0) || (latency_us < best_latency_us)))
           {
-            SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_SRV, 0);
-            event.add_var_param(name);
-            event.add_var_param(srv_name);
-            std::string transport_str = get_transport_str(naptr->transport);
-            event.add_var_param(transport_str);
-            SAS::report_event(event);
+            best_latency_us = latency_us;
           }
         }
-        else
-        {
-          // Move straight to A/AAAA lookup of the domain returned by NAPTR.
-          a_name = naptr->replacement;
+      }
+    }
+
+    std::vector<const CachedHost*> group;
+    std::vector<std::vector<double>> factors;
+    std::vector<double> weights;
+    double total_weight = 0;
 
-          if (trail != 0)
+    for (size_t ii = start; ii < end; ++ii)
+    {
+      group.push_back(&hosts[ii]);
+      factors.push_back(std::vector<double>());
+      double host_factor = 0;
+
+      for (size_t jj = 0; jj < hosts[ii].targets.size(); ++jj)
+      {
+        double factor = 1;
+
+        if (_latency_weighting)
+        {
+          // Favour targets in inverse proportion to their latency.  Targets
+          // we don't know the latency of are treated like the fastest, so
+          // that we measure them.
+          if (latencies_us[ii][jj] > 0)
           {
-            SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_A, 0);
-            event.add_var_param(name);
-            event.add_var_param(a_name);
-            SAS::report_event(event);
+            factor = best_latency_us / latencies_us[ii][jj];
           }
+
+          // Ramp up the traffic to targets that have just come off the
+          // blacklist, but always send some traffic to every target, so we
+          // notice when they speed up.
+          factor = std::max(factor * slow_start[ii][jj], LATENCY_MIN_FACTOR);
         }
+
+        factors.back().push_back(factor);
+        host_factor = std::max(host_factor, factor);
       }
-      else
+
+      // If none of the hosts have a weight, they're picked with equal
+      // probability (before allowing for latency).
+      double weight = ((total_srv_weight > 0) ? hosts[ii].weight : 1) * host_factor;
+      weights.push_back(weight);
+      total_weight += weight;
+    }
+
+    // Order the hosts as described in RFC2782 - repeatedly pick a host at
+    // random in proportion to its weight.  Hosts with zero weight are only
+    // picked once all the others have been.
+    while (!group.empty())
+    {
+      size_t index = weighted_choice(weights, total_weight);
+      const CachedHost* host = group[index];
+      std::vector<double> host_factors = factors[index];
+      total_weight -= weights[index];
+      group.erase(group.begin() + index);
+      factors.erase(factors.begin() + index);
+      weights.erase(weights.begin() + index);
+
+      // Order the host's addresses in the same way.
+      std::vector<AddrInfo> host_targets = host->targets;
+      double total_factor = 0;
+
+      for (double factor : host_factors)
       {
-        // NAPTR resolution failed, so do SRV lookups for both UDP and TCP to
-        // see which transports are supported.
-        TRC_DEBUG("NAPTR lookup failed, so do SRV lookups for UDP and TCP");
+        total_factor += factor;
+      }
 
-        if (trail != 0)
-        {
-          SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_FAILURE, 0);
-          event.add_var_param(name);
-          SAS::report_event(event);
-        }
+      while (!host_targets.empty())
+      {
+        size_t target_index = weighted_choice(host_factors, total_factor);
+        const AddrInfo& ai = host_targets[target_index];
 
-        std::vector<std::string> domains;
-        domains.push_back("_sip._udp." + name);
-        domains.push_back("_sip._tcp." + name);
-        std::vector<DnsResult> results;
-        _dns_client->dns_query(domains, ns_t_srv, results, trail);
-        DnsResult& udp_result = results[0];
-        TRC_DEBUG("UDP SRV record %s returned %d records",
-                  udp_result.domain().c_str(), udp_result.records().size());
-        DnsResult& tcp_result = results[1];
-        TRC_DEBUG("TCP SRV record %s returned %d records",
-                  tcp_result.domain().c_str(), tcp_result.records().size());
-
-        if (!udp_result.records().empty())
+        if (blacklisted(ai))
         {
-          // UDP SRV lookup returned some records, so use UDP transport.
-          TRC_DEBUG("UDP SRV lookup successful, select UDP transport");
-          transport = IPPROTO_UDP;
-          srv_name = udp_result.domain();
-        }
-        else if (!tcp_result.records().empty())
-        {
-          // TCP SRV lookup returned some records, so use TCP transport.
-          TRC_DEBUG("TCP SRV lookup successful, select TCP transport");
-          transport = IPPROTO_TCP;
-          srv_name = tcp_result.domain();
+          blacklisted.push_back(ai);
         }
         else
         {
-          // Neither UDP nor TCP SRV lookup returned any results, so default to
-          // UDP transport and move straight to A/AAAA record lookups.
-          TRC_DEBUG("UDP and TCP SRV queries unsuccessful, default to UDP");
-          transport = IPPROTO_UDP;
+          targets.push_back(ai);
         }
-      }
 
-      _naptr_cache->dec_ref(name);
+        total_factor -= host_factors[target_index];
+        host_targets.erase(host_targets.begin() + target_index);
+        host_factors.erase(host_factors.begin() + target_index);
+      }
     }
-    else if (transport == IPPROTO_UDP)
+
+    start = end;
+  }
+
+  // Only use blacklisted targets if there aren't enough others.
+  targets.insert(targets.end(), blacklisted.begin(), blacklisted.end());
+
+  if (targets.size() > (size_t)retries)
+  {
+    targets.resize(retries);
+  }
+}
+
+void SIPResolver::get_latencies(const std::vector<CachedHost>& hosts,
+                                std::vector<std::vector<double>>& latencies_us,
+                                std::vector<std::vector<double>>& slow_start)
+{
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&_latency_lock);
+
+  for (const CachedHost& host : hosts)
+  {
+    latencies_us.push_back(std::vector<double>());
+    slow_start.push_back(std::vector<double>());
+
+    for (const AddrInfo& ai : host.targets)
     {
-      // Use specified transport and try an SRV lookup.
-      if (trail != 0)
-      {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
-        event.add_var_param(name);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
-        SAS::report_event(event);
-      }
+      std::map<AddrInfo, LatencyStats, TargetCompare>::const_iterator l =
+                                                            _latencies.find(ai);
+      latencies_us.back().push_back((l != _latencies.end()) ? l->second.ewma_us : 0);
 
-      DnsResult result = _dns_client->dns_query("_sip._udp." + name, ns_t_srv, trail);
+      // If the target has just come off the blacklist, its traffic is ramped
+      // up over the slow start period.
+      std::map<AddrInfo, time_t, TargetCompare>::const_iterator ss =
+                                                            _slow_start.find(ai);
+      double ramp = 1;
 
-      if (!result.records().empty())
+      if ((ss != _slow_start.end()) &&
+          (ss->second <= now) &&
+          (now < ss->second + LATENCY_SLOW_START))
       {
-        srv_name = result.domain();
+        ramp = (double)(now - ss->second) / LATENCY_SLOW_START;
       }
+
+      slow_start.back().push_back(ramp);
     }
-    else if (transport == IPPROTO_TCP)
+  }
+
+  pthread_mutex_unlock(&_latency_lock);
+}
+
+void SIPResolver::record_latency(const AddrInfo& ai, unsigned long latency_us)
+{
+  if (_latency_weighting)
+  {
+    pthread_mutex_lock(&_latency_lock);
+
+    std::map<AddrInfo, LatencyStats, TargetCompare>::iterator l =
+                                                            _latencies.find(ai);
+
+    if (l == _latencies.end())
     {
-      // Use specified transport and try an SRV lookup.
-      if (trail != 0)
-      {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
-        event.add_var_param(name);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
-        SAS::report_event(event);
-      }
+      LatencyStats stats;
+      stats.ewma_us = latency_us;
+      stats.updated = time(NULL);
+      _latencies[ai] = stats;
+    }
+    else
+    {
+      l->second.ewma_us += LATENCY_EWMA_ALPHA * (latency_us - l->second.ewma_us);
+      l->second.updated = time(NULL);
+    }
+
+    pthread_mutex_unlock(&_latency_lock);
+  }
+}
+
+void SIPResolver::blacklist(const AddrInfo& ai)
+{
+  BaseResolver::blacklist(ai);
+  start_slow_start(ai, _blacklist_duration);
+}
+
+void SIPResolver::blacklist(const AddrInfo& ai, int blacklist_ttl)
+{
+  BaseResolver::blacklist(ai, blacklist_ttl);
+  start_slow_start(ai, blacklist_ttl);
+}
+
+void SIPResolver::clear_blacklist()
+{
+  BaseResolver::clear_blacklist();
+
+  pthread_mutex_lock(&_latency_lock);
+  _slow_start.clear();
+  pthread_mutex_unlock(&_latency_lock);
+}
+
+void SIPResolver::start_slow_start(const AddrInfo& ai, int blacklist_ttl)
+{
+  if (_latency_weighting)
+  {
+    pthread_mutex_lock(&_latency_lock);
+
+    _slow_start[ai] = time(NULL) + blacklist_ttl;
+
+    // The target's latency from before it failed isn't relevant once it
+    // comes back.
+    _latencies.erase(ai);
+
+    pthread_mutex_unlock(&_latency_lock);
+  }
+}
+
+void SIPResolver::refresh_target_cache()
+{
+  time_t now = time(NULL);
+
+  for (int ii = 0; ii < TARGET_CACHE_SHARDS; ++ii)
+  {
+    TargetCacheShard& shard = _target_cache[ii];
+    std::vector<TargetCacheKey> to_refresh;
+
+    pthread_mutex_lock(&shard.lock);
+
+    std::map<TargetCacheKey, TargetCacheEntry>::iterator i = shard.entries.begin();
 
-      DnsResult result = _dns_client->dns_query("_sip._tcp." + name, ns_t_srv, trail);
+    while (i != shard.entries.end())
+    {
+      TargetCacheEntry& entry = i->second;
 
-      if (!result.records().empty())
+      if (now < entry.expires)
+      {
+        ++i;
+      }
+      else if ((!entry.used) ||
+               (now >= entry.expires + TARGET_CACHE_MAX_STALE))
       {
-        srv_name = result.domain();
+        // The targets haven't been used since they were last refreshed, or
+        // have been stale for too long, so drop them.  If the name is used
+        // again, it's resolved on the request path.
+        TRC_DEBUG("Removing cached targets for %s", std::get<0>(i->first).c_str());
+        shard.entries.erase(i++);
+      }
+      else
+      {
+        if (now >= entry.refresh_at)
+        {
+          to_refresh.push_back(i->first);
+        }
+
+        ++i;
       }
     }
 
-    if (srv_name != "")
+    pthread_mutex_unlock(&shard.lock);
+
+    // Now refresh the targets, without holding the lock.
+    for (const TargetCacheKey& key : to_refresh)
     {
-      TRC_DEBUG("Do SRV lookup for %s", srv_name.c_str());
+      TRC_DEBUG("Refreshing cached targets for %s", std::get<0>(key).c_str());
+      std::shared_ptr<std::vector<CachedHost>> hosts(new std::vector<CachedHost>());
+      int ttl = resolve_hosts(key, *hosts, 0);
+      time_t refreshed = time(NULL);
 
-      if (trail != 0)
+      pthread_mutex_lock(&shard.lock);
+
+      i = shard.entries.find(key);
+
+      if (i != shard.entries.end())
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_SRV_LOOKUP, 0);
-        event.add_var_param(srv_name);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
-        SAS::report_event(event);
+        if (ttl > 0)
+        {
+          i->second.hosts = hosts;
+          i->second.expires = refreshed + ttl;
+          i->second.refresh_at = i->second.expires;
+          i->second.used = false;
+        }
+        else if (ttl == 0)
+        {
+          // The records now have a TTL of 0, so mustn't be cached.
+          TRC_DEBUG("Removing cached targets for %s with TTL 0",
+                    std::get<0>(key).c_str());
+          shard.entries.erase(i);
+        }
+        else
+        {
+          // Keep using the old targets for now, and try again later.
+          TRC_WARNING("Failed to refresh SIP targets for %s",
+                      std::get<0>(key).c_str());
+          i->second.refresh_at = refreshed + TARGET_CACHE_RETRY_INTERVAL;
+          _refresh_failures++;
+
+          if (_refresh_failures_tbl)
+          {
+            _refresh_failures_tbl->increment();
+          }
+        }
       }
 
-      srv_resolve(srv_name, af, transport, retries, targets, dummy_ttl, trail);
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+
+  // Tidy up slow starts that are over, and latencies that are too old to be
+  // relevant.
+  pthread_mutex_lock(&_latency_lock);
+
+  std::map<AddrInfo, time_t, TargetCompare>::iterator ss = _slow_start.begin();
+
+  while (ss != _slow_start.end())
+  {
+    if (ss->second + LATENCY_SLOW_START <= now)
+    {
+      _slow_start.erase(ss++);
     }
     else
     {
-      TRC_DEBUG("Perform A/AAAA record lookup only, name = %s", a_name.c_str());
-      port = (port != 0) ? port : 5060;
+      ++ss;
+    }
+  }
 
-      if (trail != 0)
-      {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_A_LOOKUP, 0);
-        event.add_var_param(a_name);
-        std::string transport_str = get_transport_str(transport);
-        std::string port_str = std::to_string(port);
-        event.add_var_param(transport_str);
-        event.add_var_param(port_str);
-        SAS::report_event(event);
-      }
+  std::map<AddrInfo, LatencyStats, TargetCompare>::iterator l = _latencies.begin();
 
-      a_resolve(a_name, af, port, transport, retries, targets, dummy_ttl, trail);
+  while (l != _latencies.end())
+  {
+    if (l->second.updated + LATENCY_MAX_AGE <= now)
+    {
+      _latencies.erase(l++);
+    }
+    else
+    {
+      ++l;
     }
   }
 
-  if ((targets.size() == 0) && (trail != 0))
+  pthread_mutex_unlock(&_latency_lock);
+}
+
+void* SIPResolver::refresh_thread_fn(void* arg)
+{
+  ((SIPResolver*)arg)->refresh_thread();
+  return NULL;
+}
+
+void SIPResolver::refresh_thread()
+{
+  pthread_mutex_lock(&_refresh_lock);
+
+  while (!_terminate)
   {
-    SAS::Event event(trail, SASEvent::SIPRESOLVE_NO_RECORDS, 0);
-    event.add_var_param(name);
-    SAS::report_event(event);
+    // Check the cache every second.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&_refresh_cond, &_refresh_lock, &ts);
+
+    if (!_terminate)
+    {
+      pthread_mutex_unlock(&_refresh_lock);
+      refresh_target_cache();
+      pthread_mutex_lock(&_refresh_lock);
+    }
   }
+
+  pthread_mutex_unlock(&_refresh_lock);
 }
 
 std::string SIPResolver::get_transport_str(int transport)
@@ -0,0 +1,178 @@
+/**
+ * @file sproutlet_executor.cpp  Dedicated worker threads for a Sproutlet.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "sproutlet_executor.h"
+
+SproutletExecutor::SproutletExecutor(const std::string& service_name,
+                                     int num_threads,
+                                     int max_queue_depth) :
+  _service_name(service_name),
+  _num_threads(num_threads),
+  _max_queue_depth(max_queue_depth),
+  _q(),
+  _threads(),
+  _queue_depth(0),
+  _processed(0),
+  _rejected(0),
+  _total_queue_us(0),
+  _total_service_us(0)
+{
+}
+
+
+SproutletExecutor::~SproutletExecutor()
+{
+  _q.terminate();
+
+  for (std::vector<pj_thread_t*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pj_thread_join(*i);
+  }
+  _threads.clear();
+}
+
+
+pj_status_t SproutletExecutor::start(pj_pool_t* pool)
+{
+  pj_status_t status = PJ_SUCCESS;
+
+  TRC_STATUS("Starting %d worker threads for %s (maximum queue depth %zu)",
+             _num_threads, _service_name.c_str(), _max_queue_depth);
+
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pj_thread_t* thread;
+    status = pj_thread_create(pool, "sproutlet", &worker_thread,
+                              this, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error creating worker thread for %s, %s",
+                _service_name.c_str(),
+                PJUtils::pj_status_to_string(status).c_str());
+      break;
+    }
+    _threads.push_back(thread);
+  }
+
+  return status;
+}
+
+
+bool SproutletExecutor::try_queue(PJUtils::Callback* cb)
+{
+  // Reserve a place in the queue, checking there is room in the same atomic
+  // operation so that concurrent callers can't overfill it.
+  size_t depth = _queue_depth;
+  do
+  {
+    if (depth >= _max_queue_depth)
+    {
+      TRC_WARNING("%s queue is full (%zu entries) - rejecting work",
+                  _service_name.c_str(), _max_queue_depth);
+      _rejected++;
+      return false;
+    }
+  }
+  while (!_queue_depth.compare_exchange_weak(depth, depth + 1));
+
+  push(cb);
+  return true;
+}
+
+
+void SproutletExecutor::queue(PJUtils::Callback* cb)
+{
+  _queue_depth++;
+  push(cb);
+}
+
+
+void SproutletExecutor::push(PJUtils::Callback* cb)
+{
+  QueueEntry* qe = new QueueEntry();
+  qe->cb = cb;
+  qe->stop_watch.start();
+  _q.push(qe);
+}
+
+
+int SproutletExecutor::run_queued_callbacks()
+{
+  QueueEntry* qe;
+  int processed = 0;
+
+  while ((_q.size() > 0) && (_q.pop(qe)))
+  {
+    run_callback(qe);
+    ++processed;
+  }
+
+  return processed;
+}
+
+
+SproutletExecutor::Stats SproutletExecutor::stats() const
+{
+  Stats stats;
+  stats.queue_depth = _queue_depth;
+  stats.processed = _processed;
+  stats.rejected = _rejected;
+  stats.avg_queue_us = (stats.processed > 0) ?
+                                     (_total_queue_us / stats.processed) : 0;
+  stats.avg_service_us = (stats.processed > 0) ?
+                                   (_total_service_us / stats.processed) : 0;
+  return stats;
+}
+
+
+int SproutletExecutor::worker_thread(void* p)
+{
+  ((SproutletExecutor*)p)->run();
+  return 0;
+}
+
+
+void SproutletExecutor::run()
+{
+  TRC_DEBUG("%s worker thread started", _service_name.c_str());
+
+  QueueEntry* qe;
+
+  while (_q.pop(qe))
+  {
+    run_callback(qe);
+  }
+
+  TRC_DEBUG("%s worker thread ended", _service_name.c_str());
+}
+
+
+void SproutletExecutor::run_callback(QueueEntry* qe)
+{
+  _queue_depth--;
+
+  unsigned long queue_us = 0;
+  qe->stop_watch.read(queue_us);
+
+  qe->cb->run();
+  delete qe->cb;
+
+  unsigned long total_us = 0;
+  qe->stop_watch.read(total_us);
+  delete qe;
+
+  _total_queue_us += queue_us;
+  _total_service_us += (total_us - queue_us);
+  _processed++;
+}
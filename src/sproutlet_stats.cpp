@@ -0,0 +1,151 @@
+/**
+ * @file sproutlet_stats.cpp  Per-Sproutlet resource usage statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "sproutlet_stats.h"
+
+SproutletStats::SproutletStats(const std::string& name) :
+  _name(name),
+  _invocations(0),
+  _wall_us(0),
+  _cpu_us(0),
+  _msgs_cloned(0),
+  _pool_bytes(0),
+  _tables(),
+  _aliases()
+{
+}
+
+
+void SproutletStats::add_callback(unsigned long wall_us, unsigned long cpu_us)
+{
+  _invocations++;
+  _wall_us += wall_us;
+  _cpu_us += cpu_us;
+
+  if (_tables.callback_latency != NULL)
+  {
+    _tables.callback_latency->accumulate(wall_us);
+  }
+
+  if (_tables.callback_cpu != NULL)
+  {
+    _tables.callback_cpu->accumulate(cpu_us);
+  }
+
+  if (_tables.invocations != NULL)
+  {
+    _tables.invocations->increment();
+  }
+}
+
+
+void SproutletStats::add_msg_cloned()
+{
+  _msgs_cloned++;
+
+  if (_tables.msgs_cloned != NULL)
+  {
+    _tables.msgs_cloned->increment();
+  }
+}
+
+
+void SproutletStats::add_pool_bytes(size_t bytes)
+{
+  _pool_bytes += bytes;
+
+  if (_tables.pool_bytes != NULL)
+  {
+    _tables.pool_bytes->accumulate(bytes);
+  }
+}
+
+
+void SproutletStats::to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) const
+{
+  writer.StartObject();
+  {
+    writer.String("invocations");
+    writer.Uint64(_invocations);
+    writer.String("wall_time_us");
+    writer.Uint64(_wall_us);
+    writer.String("cpu_time_us");
+    writer.Uint64(_cpu_us);
+    writer.String("messages_cloned");
+    writer.Uint64(_msgs_cloned);
+    writer.String("pool_bytes");
+    writer.Uint64(_pool_bytes);
+
+    if (!_aliases.empty())
+    {
+      writer.String("aliases");
+      writer.StartObject();
+      {
+        for (std::vector<SproutletStats*>::const_iterator it = _aliases.begin();
+             it != _aliases.end();
+             ++it)
+        {
+          writer.String((*it)->name().c_str());
+          (*it)->to_json(writer);
+        }
+      }
+      writer.EndObject();
+    }
+  }
+  writer.EndObject();
+}
+
+
+static unsigned long elapsed_us(const struct timespec& start,
+                                const struct timespec& end)
+{
+  long us = ((end.tv_sec - start.tv_sec) * 1000000L) +
+            ((end.tv_nsec - start.tv_nsec) / 1000L);
+  return (us > 0) ? us : 0;
+}
+
+
+SproutletStats::CallbackTimer::CallbackTimer(SproutletStats* stats,
+                                             SproutletStats* alias_stats) :
+  _stats(stats),
+  _alias_stats(alias_stats)
+{
+  if ((_stats != NULL) || (_alias_stats != NULL))
+  {
+    clock_gettime(CLOCK_MONOTONIC, &_wall_start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &_cpu_start);
+  }
+}
+
+
+SproutletStats::CallbackTimer::~CallbackTimer()
+{
+  if ((_stats != NULL) || (_alias_stats != NULL))
+  {
+    struct timespec wall_end;
+    struct timespec cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+
+    unsigned long wall_us = elapsed_us(_wall_start, wall_end);
+    unsigned long cpu_us = elapsed_us(_cpu_start, cpu_end);
+
+    if (_stats != NULL)
+    {
+      _stats->add_callback(wall_us, cpu_us);
+    }
+
+    if (_alias_stats != NULL)
+    {
+      _alias_stats->add_callback(wall_us, cpu_us);
+    }
+  }
+}
@@ -18,11 +18,14 @@ extern "C" {
 }
 
 #include <sstream>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
 
 #include "log.h"
 #include "pjutils.h"
 #include "sproutsasevent.h"
 #include "sproutletproxy.h"
+#include "thread_dispatcher.h"
 #include "snmp_sip_request_types.h"
 
 const pj_str_t SproutletProxy::STR_SERVICE = {"service", 7};
@@ -49,7 +52,14 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
              false,
              stateless_proxies),
   _root_uri(NULL),
-  _host_aliases(host_aliases),
+  _local_hosts(),
+  _services(),
+  _ports(),
+  _index_strs(),
+  _executors(),
+  _stateless_sproutlets(),
+  _stats(),
+  _service_stats(),
   _sproutlets(sproutlets)
 {
   /// Store the URI of this SproutletProxy - this is used for Record-Routing.
@@ -58,6 +68,15 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                                        stack_data.pool,
                                                        false);
 
+  // The root URI's host and the host aliases are local host names.
+  _local_hosts.insert(_root_uri->host);
+  for (std::unordered_set<std::string>::const_iterator it = host_aliases.begin();
+       it != host_aliases.end();
+       ++it)
+  {
+    _local_hosts.insert(index_str(*it));
+  }
+
   for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
        it != _sproutlets.end();
        ++it)
@@ -79,6 +98,306 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
 /// Destructor.
 SproutletProxy::~SproutletProxy()
 {
+  for (std::unordered_map<const Sproutlet*, SproutletExecutor*>::iterator it =
+                                                           _executors.begin();
+       it != _executors.end();
+       ++it)
+  {
+    delete it->second;
+  }
+
+  for (std::map<std::string, SproutletStats*>::iterator it = _stats.begin();
+       it != _stats.end();
+       ++it)
+  {
+    delete it->second;
+  }
+}
+
+
+bool SproutletProxy::add_executor(const std::string& service_name,
+                                  int num_threads,
+                                  int max_queue_depth)
+{
+  pj_str_t name = {(char*)service_name.data(), (pj_ssize_t)service_name.size()};
+  Sproutlet* sproutlet = find_service(&name);
+
+  if (sproutlet == NULL)
+  {
+    TRC_ERROR("Can't create worker threads for unknown sproutlet \"%s\"",
+              service_name.c_str());
+    return false;
+  }
+
+  if ((num_threads <= 0) || (max_queue_depth <= 0))
+  {
+    TRC_ERROR("Invalid worker threads (%d) or queue depth (%d) for sproutlet \"%s\"",
+              num_threads, max_queue_depth, service_name.c_str());
+    return false;
+  }
+
+  if (_executors.find(sproutlet) != _executors.end())
+  {
+    TRC_ERROR("Sproutlet \"%s\" already has worker threads",
+              service_name.c_str());
+    return false;
+  }
+
+  SproutletExecutor* executor = new SproutletExecutor(sproutlet->service_name(),
+                                                      num_threads,
+                                                      max_queue_depth);
+  _executors[sproutlet] = executor;
+
+  return (executor->start(stack_data.pool) == PJ_SUCCESS);
+}
+
+
+SproutletExecutor* SproutletProxy::executor(const Sproutlet* sproutlet) const
+{
+  std::unordered_map<const Sproutlet*, SproutletExecutor*>::const_iterator it =
+                                                     _executors.find(sproutlet);
+  return (it != _executors.end()) ? it->second : NULL;
+}
+
+
+SproutletStats* SproutletProxy::stats(const std::string& name) const
+{
+  std::map<std::string, SproutletStats*>::const_iterator it = _stats.find(name);
+  return (it != _stats.end()) ? it->second : NULL;
+}
+
+
+/// Writes the statistics of an object pool as a JSON object.
+template <class S>
+static void pool_stats_to_json(const S& stats,
+                               rapidjson::Writer<rapidjson::StringBuffer>& writer)
+{
+  writer.StartObject();
+  {
+    writer.String("heap_allocs");
+    writer.Uint64(stats.heap_allocs);
+    writer.String("pool_allocs");
+    writer.Uint64(stats.pool_allocs);
+    writer.String("heap_frees");
+    writer.Uint64(stats.heap_frees);
+    writer.String("in_use");
+    writer.Uint64(stats.in_use);
+  }
+  writer.EndObject();
+}
+
+
+std::string SproutletProxy::stats_json() const
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("sproutlets");
+    writer.StartObject();
+    {
+      for (std::vector<SproutletStats*>::const_iterator it =
+                                                        _service_stats.begin();
+           it != _service_stats.end();
+           ++it)
+      {
+        writer.String((*it)->name().c_str());
+        (*it)->to_json(writer);
+      }
+    }
+    writer.EndObject();
+
+    writer.String("executors");
+    writer.StartObject();
+    {
+      for (std::unordered_map<const Sproutlet*, SproutletExecutor*>::const_iterator it =
+                                                            _executors.begin();
+           it != _executors.end();
+           ++it)
+      {
+        SproutletExecutor::Stats stats = it->second->stats();
+        writer.String(it->second->service_name().c_str());
+        writer.StartObject();
+        {
+          writer.String("queue_depth");
+          writer.Uint64(stats.queue_depth);
+          writer.String("processed");
+          writer.Uint64(stats.processed);
+          writer.String("rejected");
+          writer.Uint64(stats.rejected);
+          writer.String("avg_queue_us");
+          writer.Uint64(stats.avg_queue_us);
+          writer.String("avg_service_us");
+          writer.Uint64(stats.avg_service_us);
+        }
+        writer.EndObject();
+      }
+    }
+    writer.EndObject();
+
+    writer.String("object_pools");
+    writer.StartObject();
+    {
+      writer.String("uas_tsx");
+      pool_stats_to_json(ObjectPool<UASTsx>::stats(), writer);
+      writer.String("sproutlet_wrapper");
+      pool_stats_to_json(ObjectPool<SproutletWrapper>::stats(), writer);
+    }
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+
+bool SproutletProxy::enable_stateless(const std::string& service_name)
+{
+  pj_str_t name = {(char*)service_name.data(), (pj_ssize_t)service_name.size()};
+  Sproutlet* sproutlet = find_service(&name);
+
+  if (sproutlet == NULL)
+  {
+    TRC_ERROR("Can't enable stateless forwarding for unknown sproutlet \"%s\"",
+              service_name.c_str());
+    return false;
+  }
+
+  TRC_STATUS("Sproutlet \"%s\" forwards statelessly", service_name.c_str());
+  _stateless_sproutlets.insert(sproutlet);
+
+  return true;
+}
+
+
+pj_bool_t SproutletProxy::on_rx_request(pjsip_rx_data* rdata)
+{
+  if (_stateless_sproutlets.empty())
+  {
+    // No Sproutlets forward statelessly, so there's nothing to check.
+    return BasicProxy::on_rx_request(rdata);
+  }
+
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  if (msg->line.req.method.id == PJSIP_CANCEL_METHOD)
+  {
+    // A CANCEL for an INVITE that we're handling statefully must go to its
+    // transaction.  Any other CANCEL is for an INVITE that was forwarded
+    // statelessly (or that we don't know about), so is routed like any other
+    // request.
+    pj_str_t key;
+    pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
+                         pjsip_get_invite_method(), rdata);
+    if (pjsip_tsx_layer_find_tsx(&key, PJ_FALSE) != NULL)
+    {
+      return BasicProxy::on_rx_request(rdata);
+    }
+  }
+
+  // Find the target Sproutlet, and process the request statelessly if it
+  // supports it.
+  RxTarget target;
+  target.sproutlet = target_sproutlet(msg,
+                                      rdata->tp_info.transport->local_name.port,
+                                      target.alias,
+                                      get_trail(rdata));
+
+  // Requests received over unreliable transports are always handled
+  // statefully, so that their retransmissions are absorbed by the transaction
+  // rather than being routed again.
+  if ((target.sproutlet != NULL) &&
+      (PJSIP_TRANSPORT_IS_RELIABLE(rdata->tp_info.transport)) &&
+      (_stateless_sproutlets.find(target.sproutlet) != _stateless_sproutlets.end()) &&
+      (target.sproutlet->supports_stateless(msg)))
+  {
+    int status_code = verify_request(rdata);
+    if (status_code != PJSIP_SC_OK)
+    {
+      reject_request(rdata, status_code);
+      return PJ_TRUE;
+    }
+
+    if (process_stateless_request(rdata, target.sproutlet, target.alias))
+    {
+      return PJ_TRUE;
+    }
+  }
+
+  // Handle the request statefully, passing on the target we've found so the
+  // UASTsx doesn't have to look it up again.
+  rdata->endpt_info.mod_data[_mod_proxy.id()] = &target;
+  BasicProxy::on_rx_request(rdata);
+  rdata->endpt_info.mod_data[_mod_proxy.id()] = NULL;
+
+  return PJ_TRUE;
+}
+
+
+pj_bool_t SproutletProxy::on_rx_response(pjsip_rx_data* rdata)
+{
+  // Responses to requests that were forwarded statelessly don't match a
+  // transaction, so are recognised by the branch of the top Via header and
+  // forwarded upstream.  Any other unmatched response is handled as usual.
+  const pj_str_t& prefix = StatelessSproutletWrapper::BRANCH_PREFIX;
+  const pj_str_t& branch = rdata->msg_info.via->branch_param;
+
+  if ((!_stateless_sproutlets.empty()) &&
+      (branch.slen > prefix.slen) &&
+      (pj_strncmp(&branch, &prefix, prefix.slen) == 0))
+  {
+    forward_response_stateless(rdata);
+    return PJ_TRUE;
+  }
+
+  return BasicProxy::on_rx_response(rdata);
+}
+
+
+bool SproutletProxy::process_stateless_request(pjsip_rx_data* rdata,
+                                               Sproutlet* sproutlet,
+                                               const std::string& alias)
+{
+  SAS::TrailId trail = get_trail(rdata);
+
+  pjsip_tx_data* req = PJUtils::clone_msg(stack_data.endpt, rdata);
+  if (req == NULL)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to clone request for stateless forwarding");
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  pjsip_sip_uri* next_hop = NULL;
+  SproutletTsx* sproutlet_tsx = sproutlet->get_tsx(this,
+                                                   alias,
+                                                   req->msg,
+                                                   next_hop,
+                                                   req->pool,
+                                                   trail);
+  if (sproutlet_tsx == NULL)
+  {
+    // The Sproutlet doesn't want the request, so leave it to the stateful
+    // path to find the next Sproutlet.
+    TRC_DEBUG("%s declined request for stateless forwarding",
+              sproutlet->service_name().c_str());
+    pjsip_tx_data_dec_ref(req);
+    return false;
+  }
+
+  TRC_DEBUG("Process %s statelessly in %s",
+            pjsip_rx_data_get_info(rdata), sproutlet->service_name().c_str());
+
+  StatelessSproutletWrapper wrapper(this,
+                                    sproutlet,
+                                    sproutlet_tsx,
+                                    alias,
+                                    req,
+                                    rdata,
+                                    trail);
+  return wrapper.process_request();
 }
 
 
@@ -88,59 +407,89 @@ BasicProxy::UASTsx* SproutletProxy::create_uas_tsx()
   return (BasicProxy::UASTsx*)new SproutletProxy::UASTsx(this);
 }
 
+pj_str_t SproutletProxy::index_str(const std::string& str)
+{
+  _index_strs.push_back(str);
+  const std::string& stored = _index_strs.back();
+  pj_str_t pj = {(char*)stored.data(), (pj_ssize_t)stored.size()};
+  return pj;
+}
+
+
+size_t SproutletProxy::PjStrHash::operator()(const pj_str_t& str) const
+{
+  return pj_hash_calc(0, str.ptr, str.slen);
+}
+
+
+size_t SproutletProxy::PjStrCaseHash::operator()(const pj_str_t& str) const
+{
+  // This is the same hash function as pj_hash_calc, but on the lower case
+  // characters.
+  size_t hash = 0;
+  for (pj_ssize_t ii = 0; ii < str.slen; ++ii)
+  {
+    hash = (hash * 33) + pj_tolower(str.ptr[ii]);
+  }
+  return hash;
+}
+
+
 // Registers sproutlet and returns whether this was successful or not.
 bool SproutletProxy::register_sproutlet(Sproutlet* sproutlet)
 {
   bool ok = true;
   std::string service_name = sproutlet->service_name();
 
-  // Add the service name and any aliases into a map of
-  // service names to sproutlets.
-  std::map<std::string, Sproutlet*>::const_iterator i;
-  i = _services.find(service_name);
-  if (i != _services.end())
-  {
-    std::string sproutlet_name = i->second->service_name();
-    TRC_ERROR("Can't assign service name \"%s\" to sproutlet \"%s\" because it is taken by sproutlet \"%s\"",
-              service_name.c_str(),
-              service_name.c_str(),
-              sproutlet_name.c_str());
-    ok = false;
-  }
-  else
-  {
-    _services.insert(std::make_pair(sproutlet->service_name(), sproutlet));
-  }
-
-  std::list<std::string> aliases = sproutlet->aliases();
-  for (std::list<std::string>::const_iterator j = aliases.begin();
-       j != aliases.end();
+  // Add the service name and any aliases into the index of service names to
+  // sproutlets.
+  std::list<std::string> names = sproutlet->aliases();
+  names.push_front(service_name);
+  SproutletStats* service_stats = NULL;
+  for (std::list<std::string>::const_iterator j = names.begin();
+       j != names.end();
        ++j)
   {
-    std::map<std::string, Sproutlet*>::const_iterator k;
-    k = _services.find(*j);
+    pj_str_t name = index_str(*j);
+    std::unordered_map<pj_str_t, Sproutlet*, PjStrHash, PjStrEqual>::const_iterator k;
+    k = _services.find(name);
     if (k != _services.end())
     {
-      std::string alias = *j;
       std::string sproutlet_name = k->second->service_name();
-      TRC_ERROR("Can't assign alias \"%s\" to sproutlet \"%s\" because it is taken by sproutlet \"%s\"",
-                alias.c_str(),
+      TRC_ERROR("Can't assign %s \"%s\" to sproutlet \"%s\" because it is taken by sproutlet \"%s\"",
+                (j == names.begin()) ? "service name" : "alias",
+                j->c_str(),
                 service_name.c_str(),
                 sproutlet_name.c_str());
       ok = false;
     }
     else
     {
-      _services.insert(std::make_pair(*j, sproutlet));
+      _services.insert(std::make_pair(name, sproutlet));
+
+      // Create the statistics that the Sproutlet's resource usage is
+      // recorded against for this name.
+      SproutletStats* stats = new SproutletStats(*j);
+      _stats[*j] = stats;
+
+      if (j == names.begin())
+      {
+        service_stats = stats;
+        _service_stats.push_back(stats);
+      }
+      else if (service_stats != NULL)
+      {
+        service_stats->add_alias(stats);
+      }
     }
   }
 
-  // If the sproutlet owns a port, add that to the map of ports to
+  // If the sproutlet owns a port, add that to the index of ports to
   // sproutlets.
   int port = sproutlet->port();
   if (port != 0)
   {
-    std::map<int, Sproutlet*>::const_iterator i;
+    std::unordered_map<int, Sproutlet*>::const_iterator i;
     i = _ports.find(port);
     if (i != _ports.end())
     {
@@ -237,7 +586,7 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
       event.add_static_param(port);
       SAS::report_event(event);
 
-      std::map<int, Sproutlet*>::const_iterator it = _ports.find(port);
+      std::unordered_map<int, Sproutlet*>::const_iterator it = _ports.find(port);
       if (it != _ports.end())
       {
         sproutlet = it->second;
@@ -279,8 +628,13 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
   // Now we know we have a SIP URI, cast to one.
   pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)uri;
 
-  std::string service_name;
-  std::map<std::string, Sproutlet*>::const_iterator it;
+  // The service name that matched (which refers into the URI), and how.
+  pj_str_t service_name;
+  int selection_type = SERVICE_NAME;
+
+  // Whether the host is local is needed for the services parameter and the
+  // user part, so only work it out once.
+  bool host_local = is_host_local(&sip_uri->host);
 
   // First check if there is a services parameter, and if it matches a
   // sproutlet.
@@ -292,22 +646,12 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
               services_param->value.slen,
               services_param->value.ptr);
 
-    if (is_host_local(&sip_uri->host))
+    if (host_local)
     {
       // Check if this service matches a sproutlet.
-      service_name = PJUtils::pj_str_to_string(&services_param->value);
-      it = _services.find(service_name);
-      if (it != _services.end())
-      {
-        sproutlet = it->second;
-        alias = service_name;
-        std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
-        report_sproutlet_selection_event(SERVICE_NAME,
-                                         sproutlet->service_name(),
-                                         alias,
-                                         uri_str,
-                                         trail);
-      }
+      service_name = services_param->value;
+      sproutlet = find_service(&service_name);
+      selection_type = SERVICE_NAME;
     }
   }
 
@@ -325,14 +669,16 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
     if (sep != NULL)
     {
       // Extract the possible service name
-      service_name = std::string(hostname.ptr, sep - hostname.ptr);
+      service_name.ptr = hostname.ptr;
+      service_name.slen = sep - hostname.ptr;
 
       // Remove the service name part and the period from the hostname.
       hostname.slen -= (sep - hostname.ptr + 1);
       hostname.ptr = sep + 1;
 
-      TRC_DEBUG("Possible service name %s will be used if %.*s is a local hostname",
-                service_name.c_str(),
+      TRC_DEBUG("Possible service name %.*s will be used if %.*s is a local hostname",
+                service_name.slen,
+                service_name.ptr,
                 hostname.slen,
                 hostname.ptr);
 
@@ -340,19 +686,8 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
       {
         // Check if the part of the hostname before the first '.' matches
         // a sproutlet.
-        it = _services.find(service_name);
-        if (it != _services.end())
-        {
-          sproutlet = it->second;
-          alias = service_name;
-          std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
-
-          report_sproutlet_selection_event(DOMAIN_PART,
-                                           sproutlet->service_name(),
-                                           alias,
-                                           uri_str,
-                                           trail);
-        }
+        sproutlet = find_service(&service_name);
+        selection_type = DOMAIN_PART;
       }
     }
   }
@@ -364,30 +699,38 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
   {
     TRC_DEBUG("Found user part - %.*s", sip_uri->user.slen, sip_uri->user.ptr);
 
-    if (is_host_local(&sip_uri->host))
+    if (host_local)
     {
       // Check if the user part matches a sproutlet.
-      service_name = PJUtils::pj_str_to_string(&sip_uri->user);
-      it = _services.find(service_name);
-      if (it != _services.end())
-      {
-        sproutlet = it->second;
-        alias = service_name;
-        std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
-
-        report_sproutlet_selection_event(USER_PART,
-                                         sproutlet->service_name(),
-                                         alias,
-                                         uri_str,
-                                         trail);
-      }
+      service_name = sip_uri->user;
+      sproutlet = find_service(&service_name);
+      selection_type = USER_PART;
     }
   }
 
+  if (sproutlet != NULL)
+  {
+    alias = PJUtils::pj_str_to_string(&service_name);
+    std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
+    report_sproutlet_selection_event(selection_type,
+                                     sproutlet->service_name(),
+                                     alias,
+                                     uri_str,
+                                     trail);
+  }
+
   return sproutlet;
 }
 
 
+Sproutlet* SproutletProxy::find_service(const pj_str_t* name) const
+{
+  std::unordered_map<pj_str_t, Sproutlet*, PjStrHash, PjStrEqual>::const_iterator it =
+                                                         _services.find(*name);
+  return (it != _services.end()) ? it->second : NULL;
+}
+
+
 pjsip_sip_uri* SproutletProxy::next_hop_uri(const std::string& service,
                                             const pjsip_route_hdr* route,
                                             pj_pool_t* pool) const
@@ -499,24 +842,7 @@ bool SproutletProxy::is_uri_local(const pjsip_uri* uri)
 
 bool SproutletProxy::is_host_local(const pj_str_t* host)
 {
-  bool rc = false;
-
-  if (!pj_stricmp(host, &_root_uri->host))
-  {
-    rc = true;
-  }
-
-  for (std::unordered_set<std::string>::iterator it = _host_aliases.begin();
-       (rc != true) && (it != _host_aliases.end());
-       ++it)
-  {
-    if (!pj_stricmp2(host, it->c_str()))
-    {
-      rc = true;
-    }
-  }
-
-  return rc;
+  return (_local_hosts.find(*host) != _local_hosts.end());
 }
 
 bool SproutletProxy::is_uri_reflexive(const pjsip_uri* uri,
@@ -577,7 +903,10 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   _pending_req_q(),
   _sproutlet_proxy(proxy),
   _timers(),
-  _pending_timers()
+  _pending_timers(),
+  _shared_body_rsps(),
+  _shared_hdr_reqs(),
+  _dispatching()
 {
   TRC_VERBOSE("Sproutlet Proxy transaction (%p) created", this);
 }
@@ -585,7 +914,7 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
 
 SproutletProxy::UASTsx::~UASTsx()
 {
-  for (std::set<pj_timer_entry*>::const_iterator timer = _timers.begin();
+  for (SmallSet<pj_timer_entry*, 4>::const_iterator timer = _timers.begin();
        timer != _timers.end();
        ++timer)
   {
@@ -628,9 +957,12 @@ pj_status_t SproutletProxy::UASTsx::init(pjsip_rx_data* rdata)
     Sproutlet* sproutlet = NULL;
     pjsip_route_hdr* route = (pjsip_route_hdr*)
                 pjsip_msg_find_hdr(rdata->msg_info.msg, PJSIP_H_ROUTE, NULL);
+    const RxTarget* rx_target = (const RxTarget*)
+          rdata->endpt_info.mod_data[_sproutlet_proxy->_mod_proxy.id()];
     SproutletTsx* sproutlet_tsx = get_sproutlet_tsx(_req,
                                                     rdata->tp_info.transport->local_name.port,
-                                                    alias);
+                                                    alias,
+                                                    rx_target);
 
     if (sproutlet_tsx == NULL)
     {
@@ -673,7 +1005,7 @@ void SproutletProxy::UASTsx::process_tsx_request(pjsip_rx_data* rdata)
 {
   // Pass the request to the Sproutlet at the root of the tree.
   pjsip_tx_data_add_ref(_req);
-  _root->rx_request(_req);
+  dispatch_request(_root, _req);
 
   // Schedule any requests generated by the Sproutlet.
   schedule_requests();
@@ -692,7 +1024,7 @@ void SproutletProxy::UASTsx::process_cancel_request(pjsip_rx_data* rdata)
     pjsip_tx_data* cancel = PJUtils::create_cancel(stack_data.endpt,
                                                    _req,
                                                    0);
-    _root->rx_cancel(cancel);
+    cancel_sproutlet(_root, cancel, PJSIP_SC_REQUEST_TERMINATED);
 
     // Schedule any requests generated by the Sproutlet.
     schedule_requests();
@@ -728,7 +1060,11 @@ void SproutletProxy::UASTsx::on_new_client_response(UACTsx* uac_tsx,
       _umap.erase(i);
     }
 
-    upstream_sproutlet->rx_response(rsp, upstream_fork);
+    run_on_sproutlet(upstream_sproutlet,
+                     [upstream_sproutlet, rsp, upstream_fork]()
+                     {
+                       upstream_sproutlet->rx_response(rsp, upstream_fork);
+                     });
 
     // Schedule any requests generated by the Sproutlet.
     schedule_requests();
@@ -770,7 +1106,11 @@ void SproutletProxy::UASTsx::on_client_not_responding(UACTsx* uac_tsx,
     TRC_VERBOSE("Notifying upstream sproutlet %s of client failure: %s",
            upstream_sproutlet->service_name().c_str(), pjsip_event_str(event));
 
-    upstream_sproutlet->rx_fork_error(event, upstream_fork);
+    run_on_sproutlet(upstream_sproutlet,
+                     [upstream_sproutlet, event, upstream_fork]()
+                     {
+                       upstream_sproutlet->rx_fork_error(event, upstream_fork);
+                     });
 
     // Schedule any requests generated by the Sproutlet.
     schedule_requests();
@@ -803,7 +1143,7 @@ void SproutletProxy::UASTsx::on_tsx_state(pjsip_event* event)
   {
     // Notify the root Sproutlet of the error.
     TRC_DEBUG("Pass error to Sproutlet %p", _root);
-    _root->rx_error(PJSIP_SC_REQUEST_TIMEOUT);
+    error_sproutlet(_root, PJSIP_SC_REQUEST_TIMEOUT);
 
     // Schedule any requests generated by the Sproutlet.
     schedule_requests();
@@ -833,7 +1173,7 @@ void SproutletProxy::UASTsx::tx_request(SproutletWrapper* upstream,
   PendingRequest pr;
   pr.req = req;
   pr.upstream = std::make_pair(upstream, fork_id);
-  _pending_req_q.push(pr);
+  _pending_req_q.push_back(pr);
 }
 
 
@@ -841,8 +1181,8 @@ void SproutletProxy::UASTsx::schedule_requests()
 {
   while (!_pending_req_q.empty())
   {
-    PendingRequest req = _pending_req_q.front();
-    _pending_req_q.pop();
+    PendingRequest req = _pending_req_q[0];
+    _pending_req_q.erase(_pending_req_q.begin());
 
     // Reject the request if the Max-Forwards value has dropped to zero.
     pjsip_max_fwd_hdr* mf_hdr = (pjsip_max_fwd_hdr*)
@@ -864,7 +1204,13 @@ void SproutletProxy::UASTsx::schedule_requests()
         if (status == PJ_SUCCESS)
         {
           // Pass the response back to the Sproutlet.
-          req.upstream.first->rx_response(rsp, req.upstream.second);
+          SproutletWrapper* upstream = req.upstream.first;
+          int fork_id = req.upstream.second;
+          run_on_sproutlet(upstream,
+                           [upstream, rsp, fork_id]()
+                           {
+                             upstream->rx_response(rsp, fork_id);
+                           });
         }
       }
       else
@@ -879,8 +1225,12 @@ void SproutletProxy::UASTsx::schedule_requests()
 
       if (sproutlet_tsx != NULL)
       {
-        // Found a local Sproutlet and SproutletTsx to handle the request, so
-        // create a SproutletWrapper. Since the Tsx is non-NULL, there is
+        // Found a local Sproutlet and SproutletTsx to handle the request.  If
+        // the request is a fork, the Sproutlet needs its own copy of the
+        // headers.
+        req.req = unshare_hdrs(req.req);
+
+        // Create a SproutletWrapper. Since the Tsx is non-NULL, there is
         // guaranteed to be a sproutlet to handle the request.
         SproutletWrapper* downstream = new SproutletWrapper(_sproutlet_proxy,
                                                             this,
@@ -910,12 +1260,18 @@ void SproutletProxy::UASTsx::schedule_requests()
                                                         &trying);
           if (status == PJ_SUCCESS)
           {
-            req.upstream.first->rx_response(trying, req.upstream.second);
+            SproutletWrapper* upstream = req.upstream.first;
+            int fork_id = req.upstream.second;
+            run_on_sproutlet(upstream,
+                             [upstream, trying, fork_id]()
+                             {
+                               upstream->rx_response(trying, fork_id);
+                             });
           }
         }
 
         // Pass the request to the downstream sproutlet.
-        downstream->rx_request(req.req);
+        dispatch_request(downstream, req.req);
       }
       else
       {
@@ -994,6 +1350,51 @@ bool SproutletProxy::UASTsx::timer_running(TimerID id)
 }
 
 
+/// Callback run on a worker thread when the operation an asynchronous timer
+/// is waiting for completes.
+class SproutletProxy::UASTsx::AsyncTimerCallback : public PJUtils::Callback
+{
+public:
+  AsyncTimerCallback(pj_timer_entry* tentry) : _tentry(tentry) {}
+
+  void run()
+  {
+    TRC_DEBUG("Asynchronous Sproutlet timer popped, id = %ld", (TimerID)_tentry);
+    ((SproutletTimerCallbackData*)_tentry->user_data)->uas_tsx->process_timer_pop(_tentry);
+  }
+
+private:
+  pj_timer_entry* _tentry;
+};
+
+
+std::function<void()> SproutletProxy::UASTsx::start_async_timer(SproutletWrapper* tsx,
+                                                                void* context,
+                                                                TimerID& id)
+{
+  SproutletTimerCallbackData* tdata = new SproutletTimerCallbackData;
+  tdata->uas_tsx = this;
+  tdata->sproutlet_wrapper = tsx;
+  tdata->context = context;
+
+  pj_timer_entry* tentry = new pj_timer_entry();
+  pj_timer_entry_init(tentry, 0, tdata, &SproutletProxy::UASTsx::on_timer_pop);
+
+  _timers.insert(tentry);
+
+  id = (TimerID)tentry;
+
+  // The timer is pending (so this transaction isn't destroyed) until the
+  // operation completes, but is never put on the timer heap.  This means it
+  // can only pop once, and only from the worker thread the completion is
+  // passed to.
+  _pending_timers.insert(tentry);
+
+  TRC_DEBUG("Started asynchronous Sproutlet timer, id = %ld", id);
+  return [tentry]() { add_callback_to_queue(new AsyncTimerCallback(tentry)); };
+}
+
+
 void SproutletProxy::UASTsx::on_timer_pop(pj_timer_heap_t* th,
                                           pj_timer_entry* tentry)
 {
@@ -1008,7 +1409,13 @@ void SproutletProxy::UASTsx::process_timer_pop(pj_timer_entry* tentry)
 
   _pending_timers.erase(tentry);
   SproutletTimerCallbackData* tdata = (SproutletTimerCallbackData*)tentry->user_data;
-  tdata->sproutlet_wrapper->on_timer_pop((TimerID)tentry, tdata->context);
+  SproutletWrapper* sproutlet = tdata->sproutlet_wrapper;
+  void* context = tdata->context;
+  run_on_sproutlet(sproutlet,
+                   [sproutlet, tentry, context]()
+                   {
+                     sproutlet->on_timer_pop((TimerID)tentry, context);
+                   });
   schedule_requests();
 
   exit_context();
@@ -1026,6 +1433,7 @@ void SproutletProxy::UASTsx::tx_response(SproutletWrapper* downstream,
     {
       int st_code = rsp->msg->line.status.code;
       set_trail(rsp, trail());
+      unshare_body(rsp);
       on_tx_response(rsp);
       pjsip_tsx_send_msg(_tsx, rsp);
 
@@ -1063,7 +1471,11 @@ void SproutletProxy::UASTsx::tx_response(SproutletWrapper* downstream,
         _dmap_sproutlet.erase(i->second);
         _umap.erase(i);
       }
-      upstream->rx_response(rsp, fork_id);
+      run_on_sproutlet(upstream,
+                       [upstream, rsp, fork_id]()
+                       {
+                         upstream->rx_response(rsp, fork_id);
+                       });
     }
     else
     {
@@ -1094,7 +1506,7 @@ void SproutletProxy::UASTsx::tx_cancel(SproutletWrapper* upstream,
     // Pass the CANCEL request to the downstream Sproutlet.
     SproutletWrapper* downstream = i->second;
     TRC_DEBUG("Route CANCEL to %s", downstream->service_name().c_str());
-    downstream->rx_cancel(cancel);
+    cancel_sproutlet(downstream, cancel, PJSIP_SC_REQUEST_TERMINATED);
   }
   else
   {
@@ -1114,86 +1526,661 @@ void SproutletProxy::UASTsx::tx_cancel(SproutletWrapper* upstream,
 }
 
 
-/// Checks to see if the UASTsx can be destroyed.  It is only safe to destroy
-/// the UASTsx when all the Sproutlet's have completed their processing, which
-/// only occurs when all the linkages are broken.
-void SproutletProxy::UASTsx::check_destroy()
+/// Callback run on a Sproutlet's executor to run the next of the callbacks
+/// queued for the Sproutlet.
+class SproutletProxy::UASTsx::DispatchCallback :
+  public PJUtils::Callback,
+  public PooledObject<DispatchCallback>
 {
-  if ((_dmap_uac.empty()) &&
-      (_dmap_sproutlet.empty()) &&
-      (_umap.empty()) &&
-      (_pending_req_q.empty()) &&
-      (_pending_timers.empty()) &&
-      (_tsx == NULL))
+public:
+  DispatchCallback(SproutletProxy::UASTsx* uas_tsx,
+                   SproutletWrapper* sproutlet) :
+    _uas_tsx(uas_tsx),
+    _sproutlet(sproutlet)
   {
-    // UAS transaction has been destroyed and all Sproutlets are complete.
-    TRC_DEBUG("Safe for UASTsx to suicide");
-    _pending_destroy = true;
   }
-}
 
-SproutletTsx* SproutletProxy::UASTsx::get_sproutlet_tsx(pjsip_tx_data* req,
-                                                        int port,
-                                                        std::string& alias)
-{
-  SproutletTsx* sproutlet_tsx = NULL;
+  void run()
+  {
+    _uas_tsx->process_dispatched_callback(_sproutlet);
+  }
 
-  // Do an initial lookup for the target sproutlet.
-  Sproutlet* sproutlet = _sproutlet_proxy->target_sproutlet(req->msg,
-                                                            port,
-                                                            alias,
-                                                            trail());
+private:
+  SproutletProxy::UASTsx* _uas_tsx;
+  SproutletWrapper* _sproutlet;
+};
 
-  // Keep cycling though sproutlets until we either find a sproutlet that
-  // wants to handle the request or run out of sproutlets.
-  while (sproutlet != NULL)
+
+void SproutletProxy::UASTsx::dispatch_request(SproutletWrapper* sproutlet,
+                                              pjsip_tx_data* req)
+{
+  SproutletExecutor* executor = _sproutlet_proxy->executor(sproutlet->_sproutlet);
+
+  if (executor == NULL)
   {
-    // Found a local Sproutlet, so offer the sproutlet a chance to handle
-    // the request.
-    pjsip_sip_uri* next_hop = NULL;
-    sproutlet_tsx = sproutlet->get_tsx(_sproutlet_proxy,
-                                       alias,
-                                       req->msg,
-                                       next_hop,
-                                       req->pool,
-                                       trail());
+    sproutlet->rx_request(req);
+    return;
+  }
 
-    if (sproutlet_tsx != NULL)
-    {
-      // We've found a sproutlet that wants to handle the request so break
-      // out of the loop.
-      break;
-    }
+  // Queue the request for the Sproutlet's threads.  This transaction stays
+  // alive until the request has been passed to the Sproutlet.
+  DispatchCallback* cb = new DispatchCallback(this, sproutlet);
+
+  if (!executor->try_queue(cb))
+  {
+    // The Sproutlet's queue is full, so reject the request.
+    delete cb;
+    sproutlet->reject_request(req, PJSIP_SC_SERVICE_UNAVAILABLE);
+  }
+  else
+  {
+    TRC_DEBUG("Queue request %s for %s",
+              pjsip_tx_data_get_info(req), sproutlet->service_name().c_str());
+    Dispatch* dispatch = new Dispatch();
+    dispatch->queued_req = req;
+    dispatch->callbacks.push_back([sproutlet, req]()
+                                  {
+                                    sproutlet->rx_request(req);
+                                  });
+    _dispatching[sproutlet] = dispatch;
+  }
+}
+
+
+void SproutletProxy::UASTsx::run_on_sproutlet(SproutletWrapper* sproutlet,
+                                              const std::function<void()>& callback)
+{
+  SmallMap<SproutletWrapper*, Dispatch*, 2>::iterator i = _dispatching.find(sproutlet);
+
+  if (i != _dispatching.end())
+  {
+    // The Sproutlet already has callbacks queued, so this one must run after
+    // them.
+    i->second->callbacks.push_back(callback);
+    return;
+  }
+
+  SproutletExecutor* executor = _sproutlet_proxy->executor(sproutlet->_sproutlet);
+
+  if (executor == NULL)
+  {
+    callback();
+  }
+  else
+  {
+    TRC_DEBUG("Queue callback for %s", sproutlet->service_name().c_str());
+    Dispatch* dispatch = new Dispatch();
+    dispatch->callbacks.push_back(callback);
+    _dispatching[sproutlet] = dispatch;
+    executor->queue(new DispatchCallback(this, sproutlet));
+  }
+}
+
+
+void SproutletProxy::UASTsx::process_dispatched_callback(SproutletWrapper* sproutlet)
+{
+  enter_context();
+
+  SmallMap<SproutletWrapper*, Dispatch*, 2>::iterator i = _dispatching.find(sproutlet);
+  Dispatch* dispatch = i->second;
+  std::function<void()> callback;
+  callback.swap(dispatch->callbacks[0]);
+  dispatch->callbacks.erase(dispatch->callbacks.begin());
+  dispatch->queued_req = NULL;
+
+  if (dispatch->callbacks.empty())
+  {
+    // This is the last queued callback, so the Sproutlet can be destroyed
+    // once it has run.  Anything the Sproutlet is passed in the meantime is
+    // queued afresh.
+    _dispatching.erase(i);
+    delete dispatch;
+  }
+  else
+  {
+    // Queue the next callback behind this one.
+    _sproutlet_proxy->executor(sproutlet->_sproutlet)->queue(
+                                       new DispatchCallback(this, sproutlet));
+  }
+
+  callback();
+
+  // Schedule any requests generated by the Sproutlet (this also checks
+  // whether the UASTsx can now be destroyed).
+  schedule_requests();
+
+  exit_context();
+}
+
+
+void SproutletProxy::UASTsx::cancel_sproutlet(SproutletWrapper* sproutlet,
+                                              pjsip_tx_data* cancel,
+                                              int status_code)
+{
+  if (reject_queued_request(sproutlet, status_code))
+  {
+    pjsip_tx_data_dec_ref(cancel);
+  }
+  else
+  {
+    run_on_sproutlet(sproutlet, [sproutlet, cancel]()
+                                {
+                                  sproutlet->rx_cancel(cancel);
+                                });
+  }
+}
+
+
+void SproutletProxy::UASTsx::error_sproutlet(SproutletWrapper* sproutlet,
+                                             int status_code)
+{
+  if (!reject_queued_request(sproutlet, status_code))
+  {
+    run_on_sproutlet(sproutlet, [sproutlet, status_code]()
+                                {
+                                  sproutlet->rx_error(status_code);
+                                });
+  }
+}
+
+
+bool SproutletProxy::UASTsx::reject_queued_request(SproutletWrapper* sproutlet,
+                                                   int status_code)
+{
+  SmallMap<SproutletWrapper*, Dispatch*, 2>::iterator i = _dispatching.find(sproutlet);
+
+  if ((i == _dispatching.end()) ||
+      (i->second->queued_req == NULL))
+  {
+    return false;
+  }
+
+  // The request hasn't reached the Sproutlet yet (so is the first callback
+  // queued for it), so just reject it when it does.
+  TRC_DEBUG("Request for %s cancelled while queued",
+            sproutlet->service_name().c_str());
+  pjsip_tx_data* req = i->second->queued_req;
+  i->second->callbacks[0] = [sproutlet, req, status_code]()
+                                 {
+                                   sproutlet->reject_request(req, status_code);
+                                 };
+  i->second->queued_req = NULL;
+
+  return true;
+}
+
+
+bool SproutletProxy::UASTsx::callbacks_queued(SproutletWrapper* sproutlet) const
+{
+  return (_dispatching.find(sproutlet) != _dispatching.end());
+}
+
+
+pjsip_tx_data* SproutletProxy::UASTsx::clone_msg(pjsip_tx_data* tdata,
+                                                 bool fork)
+{
+  pjsip_tx_data* clone = fork ?
+           PJUtils::clone_msg_sharing_hdrs(stack_data.endpt, tdata) :
+           PJUtils::clone_msg_sharing_body(stack_data.endpt, tdata);
+
+  if ((clone != NULL) &&
+      ((fork) || (clone->msg->body != NULL)))
+  {
+    // Keep the original (which holds what the clone shares, or is itself
+    // keeping the message that does) for as long as the clone might use it.
+    keep_shared_msg(tdata);
+
+    if ((clone->msg->type == PJSIP_RESPONSE_MSG) &&
+        (clone->msg->body != NULL))
+    {
+      _shared_body_rsps.insert(clone);
+    }
+    else if (fork)
+    {
+      // The original shares its headers with the fork just as much as the
+      // fork does with it, so neither may be modified in place.
+      _shared_hdr_reqs.insert(clone);
+      _shared_hdr_reqs.insert(tdata);
+    }
+  }
+
+  return clone;
+}
+
+
+void SproutletProxy::UASTsx::unshare_body(pjsip_tx_data* rsp)
+{
+  if (_shared_body_rsps.erase(rsp) > 0)
+  {
+    TRC_DEBUG("Copy shared body into %s", rsp->obj_name);
+    PJUtils::unshare_body(rsp);
+  }
+}
+
+
+pjsip_tx_data* SproutletProxy::UASTsx::unshare_hdrs(pjsip_tx_data* req)
+{
+  if (_shared_hdr_reqs.erase(req) > 0)
+  {
+    // Copy the headers, but carry on sharing the body (which Sproutlets
+    // don't modify in place).
+    TRC_DEBUG("Copy shared headers of %s", req->obj_name);
+    pjsip_tx_data* clone = clone_msg(req);
+
+    if (clone != NULL)
+    {
+      set_trail(clone, trail());
+      pjsip_tx_data_dec_ref(req);
+      req = clone;
+    }
+  }
+
+  return req;
+}
+
+
+/// Checks to see if the UASTsx can be destroyed.  It is only safe to destroy
+/// the UASTsx when all the Sproutlet's have completed their processing, which
+/// only occurs when all the linkages are broken.
+void SproutletProxy::UASTsx::check_destroy()
+{
+  if ((_dmap_uac.empty()) &&
+      (_dmap_sproutlet.empty()) &&
+      (_umap.empty()) &&
+      (_pending_req_q.empty()) &&
+      (_pending_timers.empty()) &&
+      (_dispatching.empty()) &&
+      (_tsx == NULL))
+  {
+    // UAS transaction has been destroyed and all Sproutlets are complete.
+    TRC_DEBUG("Safe for UASTsx to suicide");
+    _pending_destroy = true;
+  }
+}
+
+SproutletTsx* SproutletProxy::UASTsx::get_sproutlet_tsx(pjsip_tx_data* req,
+                                                        int port,
+                                                        std::string& alias,
+                                                        const RxTarget* rx_target)
+{
+  SproutletTsx* sproutlet_tsx = NULL;
+  Sproutlet* sproutlet = NULL;
+
+  if (rx_target != NULL)
+  {
+    // The proxy has already found the target Sproutlet.
+    sproutlet = rx_target->sproutlet;
+    alias = rx_target->alias;
+  }
+  else
+  {
+    // Do an initial lookup for the target sproutlet.
+    sproutlet = _sproutlet_proxy->target_sproutlet(req->msg,
+                                                   port,
+                                                   alias,
+                                                   trail());
+  }
+
+  // Keep cycling though sproutlets until we either find a sproutlet that
+  // wants to handle the request or run out of sproutlets.
+  while (sproutlet != NULL)
+  {
+    // Found a local Sproutlet, so offer the sproutlet a chance to handle
+    // the request.
+    pjsip_sip_uri* next_hop = NULL;
+    sproutlet_tsx = sproutlet->get_tsx(_sproutlet_proxy,
+                                       alias,
+                                       req->msg,
+                                       next_hop,
+                                       req->pool,
+                                       trail());
+
+    if (sproutlet_tsx != NULL)
+    {
+      // We've found a sproutlet that wants to handle the request so break
+      // out of the loop.
+      break;
+    }
 
     // Remove the top route header if there is one and it refers to us.
 
-    pjsip_route_hdr* route = (pjsip_route_hdr*)pjsip_msg_find_hdr(req->msg,
-                                                                  PJSIP_H_ROUTE,
-                                                                  NULL);
-    if ((route != NULL) &&
-        (_sproutlet_proxy->is_uri_local(route->name_addr.uri)))
+    pjsip_route_hdr* route = (pjsip_route_hdr*)pjsip_msg_find_hdr(req->msg,
+                                                                  PJSIP_H_ROUTE,
+                                                                  NULL);
+    if ((route != NULL) &&
+        (_sproutlet_proxy->is_uri_local(route->name_addr.uri)))
+    {
+      TRC_DEBUG("Remove top Route header %s", PJUtils::hdr_to_string(route).c_str());
+      pj_list_erase(route);
+    }
+
+    // Add on the next hop URI if there is one.
+    if (next_hop != NULL)
+    {
+      PJUtils::add_top_route_header(req->msg, next_hop, req->pool);
+    }
+
+    // Attempt to find the next Sproutlet.
+    sproutlet = _sproutlet_proxy->target_sproutlet(req->msg,
+                                                   0,
+                                                   alias,
+                                                   trail());
+  }
+
+  return sproutlet_tsx;
+}
+
+
+//
+// SproutletWrapperBase methods.
+//
+
+SproutletWrapperBase::SproutletWrapperBase(SproutletProxy* proxy,
+                                           Sproutlet* sproutlet,
+                                           SproutletTsx* sproutlet_tsx,
+                                           const std::string& sproutlet_alias,
+                                           pjsip_tx_data* req,
+                                           SAS::TrailId trail_id) :
+  _proxy(proxy),
+  _sproutlet(sproutlet),
+  _sproutlet_tsx(sproutlet_tsx),
+  _service_name(""),
+  _req(req),
+  _packets(),
+  _trail_id(trail_id),
+  _stats(NULL),
+  _alias_stats(NULL)
+{
+  if (_sproutlet != NULL)
+  {
+    // Set the service name from the sproutlet, and find the statistics to
+    // record the Sproutlet's resource usage against, including those of the
+    // alias used to route to it (if not the service name).
+    _service_name = _sproutlet->service_name();
+    _stats = _proxy->stats(_service_name);
+    if (sproutlet_alias != _service_name)
+    {
+      _alias_stats = _proxy->stats(sproutlet_alias);
+    }
+  }
+  else
+  {
+    // No Sproutlet specified, so we'll use a default "no-op" Sproutlet.
+    _service_name = "noop";
+  }
+
+  if (_sproutlet_tsx == NULL)
+  {
+    // We haven't been supplied a tsx, so create a default SproutletTsx to
+    // handle the request.
+    _sproutlet_tsx = new SproutletTsx(NULL);
+  }
+
+  // Initialize the Tsx
+  _sproutlet_tsx->set_helper(this);
+}
+
+SproutletWrapperBase::~SproutletWrapperBase()
+{
+  if (_req != NULL)
+  {
+    TRC_DEBUG("Free original request %s (%s)",
+              pjsip_tx_data_get_info(_req), _req->obj_name);
+    pjsip_tx_data_dec_ref(_req);
+  }
+
+  if (!_packets.empty())
+  {
+    TRC_WARNING("Sproutlet %s leaked %d messages - reclaiming",
+                _service_name.c_str(), _packets.size());
+    for (Packets::iterator it = _packets.begin(); it != _packets.end(); ++it)
+    {
+      TRC_WARNING("  Leaked message - %s", pjsip_tx_data_get_info(it->second));
+      pjsip_tx_data_dec_ref(it->second);
+    }
+  }
+}
+
+const std::string& SproutletWrapperBase::service_name() const
+{
+  return _service_name;
+}
+
+/// Returns a mutable clone of the original request suitable for forwarding
+/// or as the basis for constructing a response.
+pjsip_msg* SproutletWrapperBase::original_request()
+{
+  pjsip_tx_data* clone = clone_tdata(_req, false);
+
+  if (clone == NULL)
+  {
+    //LCOV_EXCL_START
+    TRC_ERROR("Failed to clone original request for Sproutlet %s", _service_name.c_str());
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
+
+  // Remove the top Route header from the request if it refers to this node or
+  // this Sproutlet.  The Sproutlet can inspect the route_hdr API if required
+  // using the route_hdr() API, but cannot manipulate it.
+  pjsip_route_hdr* hr = (pjsip_route_hdr*)
+                           pjsip_msg_find_hdr(clone->msg, PJSIP_H_ROUTE, NULL);
+  if ((hr != NULL) &&
+      (is_uri_local(hr->name_addr.uri)))
+  {
+    TRC_DEBUG("Remove top Route header %s", PJUtils::hdr_to_string(hr).c_str());
+    pj_list_erase(hr);
+  }
+
+  register_tdata(clone);
+
+  count_msg_allocated(clone, true);
+
+  return clone->msg;
+}
+
+/// Returns a brief message summary.
+const char* SproutletWrapperBase::msg_info(pjsip_msg* msg)
+{
+  Packets::const_iterator it = _packets.find(msg);
+  if (it != _packets.end())
+  {
+    return pjsip_tx_data_get_info(it->second);
+  }
+  return "";
+}
+
+/// Returns the top Route header from the original request.
+const pjsip_route_hdr* SproutletWrapperBase::route_hdr() const
+{
+  if (_req != NULL)
+  {
+    pjsip_route_hdr* hr = (pjsip_route_hdr*)
+                            pjsip_msg_find_hdr(_req->msg, PJSIP_H_ROUTE, NULL);
+    if ((hr != NULL) &&
+        (is_uri_local(hr->name_addr.uri)))
+    {
+      return hr;
+    }
+  }
+
+  return NULL;
+}
+
+pjsip_msg* SproutletWrapperBase::clone_msg(pjsip_msg* msg)
+{
+  return clone_registered_msg(msg, false);
+}
+
+pjsip_msg* SproutletWrapperBase::clone_registered_msg(pjsip_msg* msg, bool fork)
+{
+  // Get the old tdata from the map of clones
+  Packets::iterator it = _packets.find(msg);
+  if (it == _packets.end())
+  {
+    TRC_WARNING("Sproutlet attempted to clone an unrecognised message");
+    return NULL;
+  }
+
+  // Clone the tdata and put it back into the map
+  pjsip_tx_data* new_tdata = clone_tdata(it->second, fork);
+
+  if (new_tdata == NULL)
+  {
+    //LCOV_EXCL_START
+    TRC_ERROR("Failed to clone message for Sproutlet %s", _service_name.c_str());
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
+
+  register_tdata(new_tdata);
+
+  count_msg_allocated(new_tdata, true);
+
+  return new_tdata->msg;
+}
+
+pjsip_msg* SproutletWrapperBase::create_response(pjsip_msg* req,
+                                                 pjsip_status_code status_code,
+                                                 const std::string& status_text)
+{
+  // Get the request's tdata from the map of clones
+  Packets::iterator it = _packets.find(req);
+  if (it == _packets.end())
+  {
+    TRC_WARNING("Sproutlet attempted to create a response from an unrecognised request");
+    return NULL;
+  }
+
+  // Create a response from the tdata and add it to the map.
+  pjsip_tx_data* new_tdata;
+
+  pj_str_t status_text_str;
+  pj_cstr(&status_text_str, status_text.c_str());
+  pj_status_t status = PJUtils::create_response(stack_data.endpt,
+                                                it->second,
+                                                status_code,
+                                                (status_text_str.slen > 0) ? &status_text_str : NULL,
+                                                &new_tdata);
+
+  if (status == PJ_SUCCESS)
+  {
+    register_tdata(new_tdata);
+    count_msg_allocated(new_tdata, false);
+    return new_tdata->msg;
+  }
+
+  //LCOV_EXCL_START
+  return NULL;
+  //LCOV_EXCL_STOP
+}
+
+void SproutletWrapperBase::free_msg(pjsip_msg*& msg)
+{
+  // Get the tdata from the map of clones
+  Packets::iterator it = _packets.find(msg);
+  if (it == _packets.end())
+  {
+    TRC_ERROR("Sproutlet attempted to free an unrecognised message");
+    return;
+  }
+
+  pjsip_tx_data* tdata = it->second;
+
+  deregister_tdata(tdata);
+
+  TRC_DEBUG("Free message %s", tdata->obj_name);
+  pjsip_tx_data_dec_ref(tdata);
+
+  // Finish up
+  msg = NULL;
+}
+
+pj_pool_t* SproutletWrapperBase::get_pool(const pjsip_msg* msg)
+{
+  // Get the tdata from the map of clones
+  Packets::iterator it = _packets.find(msg);
+  if (it == _packets.end())
+  {
+    TRC_ERROR("Sproutlet attempted to get the pool for an unrecognised message");
+    return NULL;
+  }
+
+  return it->second->pool;
+}
+
+SAS::TrailId SproutletWrapperBase::trail() const
+{
+  return _trail_id;
+}
+
+bool SproutletWrapperBase::is_uri_reflexive(const pjsip_uri* uri) const
+{
+  return _proxy->is_uri_reflexive(uri, _sproutlet, trail());
+}
+
+bool SproutletWrapperBase::is_uri_local(const pjsip_uri* uri) const
+{
+  return _proxy->is_uri_local(uri);
+}
+
+pjsip_sip_uri* SproutletWrapperBase::get_reflexive_uri(pj_pool_t* pool) const
+{
+  return _proxy->create_sproutlet_uri(pool, _sproutlet);
+}
+
+pjsip_sip_uri* SproutletWrapperBase::next_hop_uri(const std::string& service,
+                                                  const pjsip_route_hdr* route,
+                                                  pj_pool_t* pool) const
+{
+  return _proxy->next_hop_uri(service, route, pool);
+}
+
+void SproutletWrapperBase::register_tdata(pjsip_tx_data* tdata)
+{
+  TRC_DEBUG("Adding message %p => txdata %p mapping",
+            tdata->msg, tdata);
+  _packets[tdata->msg] = tdata;
+}
+
+void SproutletWrapperBase::deregister_tdata(pjsip_tx_data* tdata)
+{
+  TRC_DEBUG("Removing message %p => txdata %p mapping",
+            tdata->msg, tdata);
+  _packets.erase(tdata->msg);
+}
+
+void SproutletWrapperBase::count_msg_allocated(pjsip_tx_data* tdata, bool cloned)
+{
+  if ((_stats == NULL) && (_alias_stats == NULL))
+  {
+    return;
+  }
+
+  // Measure the pool now, before the message is used, as this is the memory
+  // allocated for it (cloned messages share their body with the original,
+  // so this doesn't include the body).
+  size_t pool_bytes = pj_pool_get_used_size(tdata->pool);
+
+  if (_stats != NULL)
+  {
+    if (cloned)
     {
-      TRC_DEBUG("Remove top Route header %s", PJUtils::hdr_to_string(route).c_str());
-      pj_list_erase(route);
+      _stats->add_msg_cloned();
     }
+    _stats->add_pool_bytes(pool_bytes);
+  }
 
-    // Add on the next hop URI if there is one.
-    if (next_hop != NULL)
+  if (_alias_stats != NULL)
+  {
+    if (cloned)
     {
-      PJUtils::add_top_route_header(req->msg, next_hop, req->pool);
+      _alias_stats->add_msg_cloned();
     }
-
-    // Attempt to find the next Sproutlet.
-    sproutlet = _sproutlet_proxy->target_sproutlet(req->msg,
-                                                   0,
-                                                   alias,
-                                                   trail());
+    _alias_stats->add_pool_bytes(pool_bytes);
   }
-
-  return sproutlet_tsx;
 }
 
-
 //
 // UASTsx::SproutletWrapper methods.
 //
@@ -1206,16 +2193,16 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
                                    pjsip_tx_data* req,
                                    pjsip_transport* original_transport,
                                    SAS::TrailId trail_id) :
-  _proxy(proxy),
+  SproutletWrapperBase(proxy,
+                       sproutlet,
+                       sproutlet_tsx,
+                       sproutlet_alias,
+                       req,
+                       trail_id),
   _proxy_tsx(proxy_tsx),
-  _sproutlet(sproutlet),
-  _sproutlet_tsx(sproutlet_tsx),
-  _service_name(""),
   _id(""),
-  _req(req),
   _req_type(),
   _original_transport(original_transport),
-  _packets(),
   _send_requests(),
   _send_responses(),
   _pending_sends(0),
@@ -1224,8 +2211,7 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _complete(false),
   _process_actions_entered(0),
   _forks(),
-  _pending_timers(),
-  _trail_id(trail_id)
+  _pending_timers()
 {
   if (_original_transport != NULL)
   {
@@ -1234,26 +2220,6 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
 
   _req_type = SNMP::string_to_request_type(_req->msg->line.req.method.name.ptr,
                                            _req->msg->line.req.method.name.slen);
-  if (sproutlet != NULL)
-  {
-    // Set the service name from the sproutlet
-    _service_name = sproutlet->service_name();
-  }
-  else
-  {
-    // No Sproutlet specified, so we'll use a default "no-op" Sproutlet.
-    _service_name = "noop";
-  }
-
-  if (_sproutlet_tsx == NULL)
-  {
-    // We haven't been supplied a tsx, so create a default SproutletTsx to
-    // handle the request.
-    _sproutlet_tsx = new SproutletTsx(NULL);
-  }
-
-  // Initialize the Tsx
-  _sproutlet_tsx->set_helper(this);
 
   if ((_sproutlet != NULL) &&
       (_sproutlet->_incoming_sip_transactions_tbl != NULL))
@@ -1276,29 +2242,11 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
 
 SproutletWrapper::~SproutletWrapper()
 {
-  // Destroy the SproutletTsx.
+  // Destroy the SproutletTsx.  The base class frees the original request and
+  // reclaims any messages the Sproutlet leaked.
   TRC_DEBUG("Destroying SproutletWrapper %p", this);
-  if (_sproutlet_tsx != NULL)
-  {
-    delete _sproutlet_tsx;
-  }
-
-  if (_req != NULL)
-  {
-    TRC_DEBUG("Free original request %s (%s)",
-              pjsip_tx_data_get_info(_req), _req->obj_name);
-    pjsip_tx_data_dec_ref(_req);
-  }
-
-  if (!_packets.empty())
-  {
-    TRC_WARNING("Sproutlet %s leaked %d messages - reclaiming", _id.c_str(), _packets.size());
-    for (Packets::iterator it = _packets.begin(); it != _packets.end(); ++it)
-    {
-      TRC_WARNING("  Leaked message - %s", pjsip_tx_data_get_info(it->second));
-      pjsip_tx_data_dec_ref(it->second);
-    }
-  }
+  delete _sproutlet_tsx;
+  _sproutlet_tsx = NULL;
 
   if (_original_transport != NULL)
   {
@@ -1306,46 +2254,10 @@ SproutletWrapper::~SproutletWrapper()
   }
 }
 
-const std::string& SproutletWrapper::service_name() const
-{
-  return _service_name;
-}
-
 //
 // UASTsx::SproutletWrapper overloads.
 //
 
-/// Returns a mutable clone of the original request suitable for forwarding
-/// or as the basis for constructing a response.
-pjsip_msg* SproutletWrapper::original_request()
-{
-  pjsip_tx_data* clone = PJUtils::clone_msg(stack_data.endpt, _req);
-
-  if (clone == NULL)
-  {
-    //LCOV_EXCL_START
-    TRC_ERROR("Failed to clone original request for Sproutlet %s", _service_name.c_str());
-    return NULL;
-    //LCOV_EXCL_STOP
-  }
-
-  // Remove the top Route header from the request if it refers to this node or
-  // this Sproutlet.  The Sproutlet can inspect the route_hdr API if required
-  // using the route_hdr() API, but cannot manipulate it.
-  pjsip_route_hdr* hr = (pjsip_route_hdr*)
-                           pjsip_msg_find_hdr(clone->msg, PJSIP_H_ROUTE, NULL);
-  if ((hr != NULL) &&
-      (is_uri_local(hr->name_addr.uri)))
-  {
-    TRC_DEBUG("Remove top Route header %s", PJUtils::hdr_to_string(hr).c_str());
-    pj_list_erase(hr);
-  }
-
-  register_tdata(clone);
-
-  return clone->msg;
-}
-
 // Sets the transport on this request to be the same as on the original.
 void SproutletWrapper::copy_original_transport(pjsip_msg* req)
 {
@@ -1377,34 +2289,6 @@ void SproutletWrapper::copy_original_transport(pjsip_msg* req)
   pjsip_tx_data_set_transport(tdata, &tpsel);
 }
 
-/// Returns a brief message summary.
-const char* SproutletWrapper::msg_info(pjsip_msg* msg)
-{
-  Packets::const_iterator it = _packets.find(msg);
-  if (it != _packets.end())
-  {
-    return pjsip_tx_data_get_info(it->second);
-  }
-  return "";
-}
-
-/// Returns the top Route header from the original request.
-const pjsip_route_hdr* SproutletWrapper::route_hdr() const
-{
-  if (_req != NULL)
-  {
-    pjsip_route_hdr* hr = (pjsip_route_hdr*)
-                            pjsip_msg_find_hdr(_req->msg, PJSIP_H_ROUTE, NULL);
-    if ((hr != NULL) &&
-        (is_uri_local(hr->name_addr.uri)))
-    {
-      return hr;
-    }
-  }
-
-  return NULL;
-}
-
 pjsip_msg* SproutletWrapper::create_request()
 {
   // Create a new tdata
@@ -1438,72 +2322,20 @@ pjsip_msg* SproutletWrapper::create_request()
   set_trail(new_tdata, trail());
   register_tdata(new_tdata);
 
+  count_msg_allocated(new_tdata, true);
+
   return new_tdata->msg;
 }
 
 pjsip_msg* SproutletWrapper::clone_request(pjsip_msg* req)
 {
-  return clone_msg(req);
-}
-
-pjsip_msg* SproutletWrapper::clone_msg(pjsip_msg* msg)
-{
-  // Get the old tdata from the map of clones
-  Packets::iterator it = _packets.find(msg);
-  if (it == _packets.end())
-  {
-    TRC_WARNING("Sproutlet attempted to clone an unrecognised message");
-    return NULL;
-  }
-
-  // Clone the tdata and put it back into the map
-  pjsip_tx_data* new_tdata = PJUtils::clone_msg(stack_data.endpt, it->second);
-
-  if (new_tdata == NULL)
-  {
-    //LCOV_EXCL_START
-    TRC_ERROR("Failed to clone message for Sproutlet %s", _service_name.c_str());
-    return NULL;
-    //LCOV_EXCL_STOP
-  }
-
-  register_tdata(new_tdata);
-
-  return new_tdata->msg;
+  // Clone the request for a fork, sharing the body and headers.
+  return clone_registered_msg(req, true);
 }
 
-pjsip_msg* SproutletWrapper::create_response(pjsip_msg* req,
-                                             pjsip_status_code status_code,
-                                             const std::string& status_text)
+pjsip_tx_data* SproutletWrapper::clone_tdata(pjsip_tx_data* tdata, bool fork)
 {
-  // Get the request's tdata from the map of clones
-  Packets::iterator it = _packets.find(req);
-  if (it == _packets.end())
-  {
-    TRC_WARNING("Sproutlet attempted to create a response from an unrecognised request");
-    return NULL;
-  }
-
-  // Create a response from the tdata and add it to the map.
-  pjsip_tx_data* new_tdata;
-
-  pj_str_t status_text_str;
-  pj_cstr(&status_text_str, status_text.c_str());
-  pj_status_t status = PJUtils::create_response(stack_data.endpt,
-                                                it->second,
-                                                status_code,
-                                                (status_text_str.slen > 0) ? &status_text_str : NULL,
-                                                &new_tdata);
-
-  if (status == PJ_SUCCESS)
-  {
-    register_tdata(new_tdata);
-    return new_tdata->msg;
-  }
-
-  //LCOV_EXCL_START
-  return NULL;
-  //LCOV_EXCL_STOP
+  return _proxy_tsx->clone_msg(tdata, fork);
 }
 
 int SproutletWrapper::send_request(pjsip_msg*& req)
@@ -1634,88 +2466,35 @@ const ForkState& SproutletWrapper::fork_state(int fork_id)
   }
 }
 
-void SproutletWrapper::free_msg(pjsip_msg*& msg)
-{
-  // Get the tdata from the map of clones
-  Packets::iterator it = _packets.find(msg);
-  if (it == _packets.end())
-  {
-    TRC_ERROR("Sproutlet attempted to free an unrecognised message");
-    return;
-  }
-
-  pjsip_tx_data* tdata = it->second;
-
-  deregister_tdata(tdata);
-
-  TRC_DEBUG("Free message %s", tdata->obj_name);
-  pjsip_tx_data_dec_ref(tdata);
-
-  // Finish up
-  msg = NULL;
-}
-
-pj_pool_t* SproutletWrapper::get_pool(const pjsip_msg* msg)
-{
-  // Get the tdata from the map of clones
-  Packets::iterator it = _packets.find(msg);
-  if (it == _packets.end())
-  {
-    TRC_ERROR("Sproutlet attempted to get the pool for an unrecognised message");
-    return NULL;
-  }
-
-  return it->second->pool;
-}
-
 bool SproutletWrapper::schedule_timer(void* context, TimerID& id, int duration)
 {
   bool scheduled = _proxy_tsx->schedule_timer(this, context, id, duration);
   if (scheduled)
   {
-    _pending_timers.insert(id);
-  }
-  return scheduled;
-}
-
-void SproutletWrapper::cancel_timer(TimerID id)
-{
-  if (_proxy_tsx->cancel_timer(id))
-  {
-    _pending_timers.erase(id);
-  }
-}
-
-bool SproutletWrapper::timer_running(TimerID id)
-{
-  return _proxy_tsx->timer_running(id);
-}
-
-SAS::TrailId SproutletWrapper::trail() const
-{
-  return _trail_id;
-}
-
-bool SproutletWrapper::is_uri_reflexive(const pjsip_uri* uri) const
-{
-  return _proxy->is_uri_reflexive(uri, _sproutlet, trail());
+    _pending_timers.insert(id);
+  }
+  return scheduled;
 }
 
-bool SproutletWrapper::is_uri_local(const pjsip_uri* uri) const
+void SproutletWrapper::cancel_timer(TimerID id)
 {
-  return _proxy->is_uri_local(uri);
+  if (_proxy_tsx->cancel_timer(id))
+  {
+    _pending_timers.erase(id);
+  }
 }
 
-pjsip_sip_uri* SproutletWrapper::get_reflexive_uri(pj_pool_t* pool) const
+bool SproutletWrapper::timer_running(TimerID id)
 {
-  return _proxy->create_sproutlet_uri(pool, _sproutlet);
+  return _proxy_tsx->timer_running(id);
 }
 
-pjsip_sip_uri* SproutletWrapper::next_hop_uri(const std::string& service,
-                                              const pjsip_route_hdr* route,
-                                              pj_pool_t* pool) const
+std::function<void()> SproutletWrapper::start_async_timer(void* context)
 {
-  return _proxy->next_hop_uri(service, route, pool);
+  TimerID id;
+  std::function<void()> complete = _proxy_tsx->start_async_timer(this, context, id);
+  _pending_timers.insert(id);
+  return complete;
 }
 
 void SproutletWrapper::rx_request(pjsip_tx_data* req)
@@ -1754,12 +2533,14 @@ void SproutletWrapper::rx_request(pjsip_tx_data* req)
   {
     TRC_VERBOSE("%s pass initial request %s to Sproutlet",
                 _id.c_str(), msg_info(clone));
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
     _sproutlet_tsx->on_rx_initial_request(clone);
   }
   else
   {
     TRC_VERBOSE("%s pass in dialog request %s to Sproutlet",
                 _id.c_str(), msg_info(clone));
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
     _sproutlet_tsx->on_rx_in_dialog_request(clone);
   }
 
@@ -1771,6 +2552,32 @@ void SproutletWrapper::rx_request(pjsip_tx_data* req)
   process_actions(complete_after_actions);
 }
 
+void SproutletWrapper::reject_request(pjsip_tx_data* req, int status_code)
+{
+  TRC_INFO("%s rejecting request %s with status code %d",
+           _id.c_str(), pjsip_tx_data_get_info(req), status_code);
+
+  _req = req;
+
+  // Respond to the request on behalf of the Sproutlet (unless it is an ACK,
+  // which doesn't get a response).
+  bool ack = (req->msg->line.req.method.id == PJSIP_ACK_METHOD);
+
+  if (!ack)
+  {
+    pjsip_msg* clone = original_request();
+    pjsip_msg* rsp = create_response(clone, (pjsip_status_code)status_code);
+    free_msg(clone);
+
+    if (rsp != NULL)
+    {
+      send_response(rsp);
+    }
+  }
+
+  process_actions(ack);
+}
+
 void SproutletWrapper::rx_response(pjsip_tx_data* rsp, int fork_id)
 {
   // SAS log the start of processing by this sproutlet
@@ -1823,7 +2630,11 @@ void SproutletWrapper::rx_response(pjsip_tx_data* rsp, int fork_id)
       }
     }
   }
-  _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+  }
 
   process_actions(false);
 }
@@ -1831,8 +2642,21 @@ void SproutletWrapper::rx_response(pjsip_tx_data* rsp, int fork_id)
 void SproutletWrapper::rx_cancel(pjsip_tx_data* cancel)
 {
   TRC_VERBOSE("%s received CANCEL request", _id.c_str());
-  _sproutlet_tsx->on_rx_cancel(PJSIP_SC_REQUEST_TERMINATED,
-                           cancel->msg);
+
+  if (_complete)
+  {
+    // The Sproutlet sent its final response while the CANCEL was queued for
+    // its executor, so there is nothing to cancel.
+    pjsip_tx_data_dec_ref(cancel);
+    process_actions(false);
+    return;
+  }
+
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_rx_cancel(PJSIP_SC_REQUEST_TERMINATED,
+                                 cancel->msg);
+  }
   pjsip_tx_data_dec_ref(cancel);
   cancel_pending_forks();
   process_actions(false);
@@ -1841,7 +2665,19 @@ void SproutletWrapper::rx_cancel(pjsip_tx_data* cancel)
 void SproutletWrapper::rx_error(int status_code)
 {
   TRC_VERBOSE("%s received error %d", _id.c_str(), status_code);
-  _sproutlet_tsx->on_rx_cancel(status_code, NULL);
+
+  if (_complete)
+  {
+    // The Sproutlet sent its final response while the error was queued for
+    // its executor.
+    process_actions(false);
+    return;
+  }
+
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_rx_cancel(status_code, NULL);
+  }
   cancel_pending_forks();
 
   // Consider the transaction to be complete as no final response should be
@@ -1898,7 +2734,10 @@ void SproutletWrapper::rx_fork_error(pjsip_event_id_e event, int fork_id)
 
       // Pass the response to the application.
       register_tdata(rsp);
-      _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+      {
+        SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+        _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+      }
       process_actions(false);
     }
   }
@@ -1908,24 +2747,13 @@ void SproutletWrapper::on_timer_pop(TimerID id, void* context)
 {
   TRC_DEBUG("Timer has popped");
   _pending_timers.erase(id);
-  _sproutlet_tsx->on_timer_expiry(context);
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_timer_expiry(context);
+  }
   process_actions(false);
 }
 
-void SproutletWrapper::register_tdata(pjsip_tx_data* tdata)
-{
-  TRC_DEBUG("Adding message %p => txdata %p mapping",
-            tdata->msg, tdata);
-  _packets[tdata->msg] = tdata;
-}
-
-void SproutletWrapper::deregister_tdata(pjsip_tx_data* tdata)
-{
-  TRC_DEBUG("Removing message %p => txdata %p mapping",
-            tdata->msg, tdata);
-  _packets.erase(tdata->msg);
-}
-
 /// Process actions required by a Sproutlet
 void SproutletWrapper::process_actions(bool complete_after_actions)
 {
@@ -1945,8 +2773,8 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   // Now handle any responses generated or forwarded by the Sproutlet.
   while (!_send_responses.empty())
   {
-    pjsip_tx_data* tdata = _send_responses.front();
-    _send_responses.pop_front();
+    pjsip_tx_data* tdata = _send_responses[0];
+    _send_responses.erase(_send_responses.begin());
     aggregate_response(tdata);
   }
 
@@ -1965,7 +2793,7 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   // forwarded/generated by the Sproutlet.
   while (!_send_requests.empty())
   {
-    std::map<int, pjsip_tx_data*>::iterator i = _send_requests.begin();
+    Requests::iterator i = _send_requests.begin();
     int fork_id = i->first;
     pjsip_tx_data* tdata = i->second;
     _send_requests.erase(i);
@@ -2004,10 +2832,12 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   if ((_complete) &&
       (_pending_responses == 0) &&
       (_pending_timers.empty()) &&
-      (_process_actions_entered == 0))
+      (_process_actions_entered == 0) &&
+      (!_proxy_tsx->callbacks_queued(this)))
   {
     // Sproutlet has sent a final response, has no downstream forks waiting
-    // a response, and has no pending timers, so should destroy itself.
+    // a response, and has no pending timers or callbacks waiting to run on
+    // its executor, so should destroy itself.
     TRC_VERBOSE("%s suiciding", _id.c_str());
     delete this;
   }
@@ -2119,7 +2949,10 @@ void SproutletWrapper::tx_request(pjsip_tx_data* req, int fork_id)
   }
 
   // Notify the sproutlet that the request is being sent downstream.
-  _sproutlet_tsx->on_tx_request(req->msg, fork_id);
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_tx_request(req->msg, fork_id);
+  }
 
   // Forward the request downstream.
   deregister_tdata(req);
@@ -2129,7 +2962,10 @@ void SproutletWrapper::tx_request(pjsip_tx_data* req, int fork_id)
 void SproutletWrapper::tx_response(pjsip_tx_data* rsp)
 {
   // Notify the sproutlet that the response is being sent upstream.
-  _sproutlet_tsx->on_tx_response(rsp->msg);
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_tx_response(rsp->msg);
+  }
 
   if (rsp->msg->line.status.code >= PJSIP_SC_OK)
   {
@@ -2244,3 +3080,343 @@ void SproutletWrapper::log_inter_sproutlet(pjsip_tx_data* tdata,
               (int)size,
               buf);
 }
+
+//
+// StatelessSproutletWrapper methods.
+//
+
+const pj_str_t StatelessSproutletWrapper::BRANCH_PREFIX = {"z9hG4bKSL", 9};
+
+StatelessSproutletWrapper::StatelessSproutletWrapper(SproutletProxy* proxy,
+                                                     Sproutlet* sproutlet,
+                                                     SproutletTsx* sproutlet_tsx,
+                                                     const std::string& sproutlet_alias,
+                                                     pjsip_tx_data* req,
+                                                     pjsip_rx_data* rdata,
+                                                     SAS::TrailId trail_id) :
+  SproutletWrapperBase(proxy,
+                       sproutlet,
+                       sproutlet_tsx,
+                       sproutlet_alias,
+                       req,
+                       trail_id),
+  _rdata(rdata),
+  _send_request(NULL),
+  _send_response(NULL)
+{
+}
+
+StatelessSproutletWrapper::~StatelessSproutletWrapper()
+{
+  // Destroy the SproutletTsx.  The base class frees the original request and
+  // reclaims any messages the Sproutlet leaked.
+  delete _sproutlet_tsx;
+  _sproutlet_tsx = NULL;
+
+  if (_send_request != NULL)
+  {
+    pjsip_tx_data_dec_ref(_send_request);
+  }
+
+  if (_send_response != NULL)
+  {
+    pjsip_tx_data_dec_ref(_send_response);
+  }
+}
+
+bool StatelessSproutletWrapper::process_request()
+{
+  // SAS log the start of processing by this sproutlet
+  SAS::Event event(trail(), SASEvent::BEGIN_SPROUTLET_REQ, 0);
+  event.add_var_param(_service_name);
+  SAS::report_event(event);
+
+  // Decrement Max-Forwards if present.
+  pjsip_max_fwd_hdr* mf_hdr = (pjsip_max_fwd_hdr*)
+                     pjsip_msg_find_hdr(_req->msg, PJSIP_H_MAX_FORWARDS, NULL);
+  if (mf_hdr != NULL)
+  {
+    --mf_hdr->ivalue;
+  }
+
+  pjsip_msg* clone = original_request();
+  if (clone == NULL)
+  {
+    // LCOV_EXCL_START
+    return true;
+    // LCOV_EXCL_STOP
+  }
+
+  if (PJSIP_MSG_TO_HDR(clone)->tag.slen == 0)
+  {
+    TRC_VERBOSE("%s pass initial request %s to Sproutlet statelessly",
+                _service_name.c_str(), msg_info(clone));
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_rx_initial_request(clone);
+  }
+  else
+  {
+    TRC_VERBOSE("%s pass in dialog request %s to Sproutlet statelessly",
+                _service_name.c_str(), msg_info(clone));
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_rx_in_dialog_request(clone);
+  }
+
+  bool ack = (_req->msg->line.req.method.id == PJSIP_ACK_METHOD);
+
+  if ((_send_response != NULL) && (!ack))
+  {
+    pjsip_tx_data* rsp = _send_response;
+    _send_response = NULL;
+    tx_response(rsp);
+  }
+  else if (_send_request != NULL)
+  {
+    if ((!ack) && (!forwards_reliably(_send_request)))
+    {
+      // Nothing would retransmit the request if it were lost, so leave it to
+      // the stateful path.  This runs the Sproutlet again, but only for
+      // requests routed over an unreliable transport.
+      TRC_DEBUG("%s forwards %s over an unreliable transport, so handle it statefully",
+                _service_name.c_str(), pjsip_tx_data_get_info(_send_request));
+      return false;
+    }
+
+    pjsip_tx_data* req = _send_request;
+    _send_request = NULL;
+    tx_request(req);
+  }
+  else if (!ack)
+  {
+    // The Sproutlet didn't forward or respond to the request, so reject it.
+    TRC_WARNING("%s didn't forward or respond to %s",
+                _service_name.c_str(), pjsip_tx_data_get_info(_req));
+    _proxy->reject_request(_rdata, PJSIP_SC_INTERNAL_SERVER_ERROR);
+  }
+
+  return true;
+}
+
+bool StatelessSproutletWrapper::forwards_reliably(pjsip_tx_data* req)
+{
+  if (req->tp_sel.type == PJSIP_TPSELECTOR_TRANSPORT)
+  {
+    return PJSIP_TRANSPORT_IS_RELIABLE(req->tp_sel.u.transport);
+  }
+
+  // Check every server the request could be sent to, as the stateless send
+  // may fail over to any of them.  If there are none the send fails anyway.
+  std::vector<AddrInfo> servers;
+  PJUtils::resolve_next_hop(req, 0, servers, trail());
+
+  for (std::vector<AddrInfo>::const_iterator i = servers.begin();
+       i != servers.end();
+       ++i)
+  {
+    if (i->transport != IPPROTO_TCP)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void StatelessSproutletWrapper::copy_original_transport(pjsip_msg* req)
+{
+  Packets::iterator it = _packets.find(req);
+  if (it == _packets.end())
+  {
+    // LCOV_EXCL_START - defensive code not hit in UT
+    TRC_WARNING("Sproutlet tried to copy transport on an unknown request");
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  pjsip_tpselector tpsel;
+  pj_bzero(&tpsel, sizeof(tpsel));
+  tpsel.type = PJSIP_TPSELECTOR_TRANSPORT;
+  tpsel.u.transport = _rdata->tp_info.transport;
+  pjsip_tx_data_set_transport(it->second, &tpsel);
+}
+
+// LCOV_EXCL_START - Sproutlets that forward statelessly don't create requests
+pjsip_msg* StatelessSproutletWrapper::create_request()
+{
+  TRC_ERROR("%s can't create requests when forwarding statelessly",
+            _service_name.c_str());
+  return NULL;
+}
+// LCOV_EXCL_STOP
+
+pjsip_msg* StatelessSproutletWrapper::clone_request(pjsip_msg* req)
+{
+  // Only one request can be forwarded, but a Sproutlet may still take a copy
+  // of the request before modifying it.
+  return clone_msg(req);
+}
+
+pjsip_tx_data* StatelessSproutletWrapper::clone_tdata(pjsip_tx_data* tdata,
+                                                      bool fork)
+{
+  return PJUtils::clone_msg(stack_data.endpt, tdata);
+}
+
+int StatelessSproutletWrapper::send_request(pjsip_msg*& req)
+{
+  Packets::iterator it = _packets.find(req);
+  if (it == _packets.end())
+  {
+    TRC_ERROR("Sproutlet attempted to forward an unrecognised request");
+    return -1;
+  }
+
+  if (req->type != PJSIP_REQUEST_MSG)
+  {
+    TRC_ERROR("Sproutlet attempted to forward a response as a request");
+    return -1;
+  }
+
+  if (_send_request != NULL)
+  {
+    TRC_ERROR("%s attempted to fork a request when forwarding statelessly",
+              _service_name.c_str());
+    return -1;
+  }
+
+  TRC_VERBOSE("%s sending %s statelessly",
+              _service_name.c_str(), pjsip_tx_data_get_info(it->second));
+
+  _send_request = it->second;
+  deregister_tdata(_send_request);
+
+  req = NULL;
+  return 0;
+}
+
+void StatelessSproutletWrapper::send_response(pjsip_msg*& rsp)
+{
+  Packets::iterator it = _packets.find(rsp);
+  if (it == _packets.end())
+  {
+    TRC_ERROR("Sproutlet attempted to send an unrecognised response");
+    return;
+  }
+
+  if (rsp->type != PJSIP_RESPONSE_MSG)
+  {
+    TRC_ERROR("Sproutlet attempted to forward a request as a response");
+    return;
+  }
+
+  pjsip_tx_data* tdata = it->second;
+  deregister_tdata(tdata);
+  rsp = NULL;
+
+  if ((tdata->msg->line.status.code < PJSIP_SC_OK) ||
+      (_send_response != NULL))
+  {
+    // Provisional responses aren't sent when forwarding statelessly, and
+    // only the first final response is.
+    TRC_DEBUG("Discard %s", pjsip_tx_data_get_info(tdata));
+    pjsip_tx_data_dec_ref(tdata);
+    return;
+  }
+
+  TRC_VERBOSE("%s sending %s statelessly",
+              _service_name.c_str(), pjsip_tx_data_get_info(tdata));
+  _send_response = tdata;
+}
+
+// LCOV_EXCL_START - requests forwarded statelessly can't be cancelled
+void StatelessSproutletWrapper::cancel_fork(int fork_id, int reason)
+{
+}
+
+void StatelessSproutletWrapper::cancel_pending_forks(int reason)
+{
+}
+// LCOV_EXCL_STOP
+
+const ForkState& StatelessSproutletWrapper::fork_state(int fork_id)
+{
+  return NULL_FORK_STATE;
+}
+
+// LCOV_EXCL_START - Sproutlets that forward statelessly don't use timers
+bool StatelessSproutletWrapper::schedule_timer(void* context, TimerID& id, int duration)
+{
+  TRC_ERROR("%s can't schedule timers when forwarding statelessly",
+            _service_name.c_str());
+  return false;
+}
+
+void StatelessSproutletWrapper::cancel_timer(TimerID id)
+{
+}
+
+bool StatelessSproutletWrapper::timer_running(TimerID id)
+{
+  return false;
+}
+// LCOV_EXCL_STOP
+
+void StatelessSproutletWrapper::tx_request(pjsip_tx_data* req)
+{
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_tx_request(req->msg, 0);
+  }
+
+  // Add our Via header.  The branch is calculated from the received request,
+  // so that a CANCEL or an ACK for a non-2xx response is forwarded with the
+  // same branch as the request it applies to, and starts with BRANCH_PREFIX
+  // so that responses to it are recognised in on_rx_response.
+  pj_str_t calculated = pjsip_calculate_branch_id(_rdata);
+  pj_str_t suffix = {calculated.ptr + PJSIP_RFC3261_BRANCH_LEN,
+                     calculated.slen - PJSIP_RFC3261_BRANCH_LEN};
+  pjsip_via_hdr* hvia = pjsip_via_hdr_create(req->pool);
+  hvia->branch_param.ptr = (char*)pj_pool_alloc(req->pool,
+                                                BRANCH_PREFIX.slen + suffix.slen);
+  hvia->branch_param.slen = 0;
+  pj_strcat(&hvia->branch_param, &BRANCH_PREFIX);
+  pj_strcat(&hvia->branch_param, &suffix);
+  pjsip_msg_insert_first_hdr(req->msg, (pjsip_hdr*)hvia);
+
+  TRC_DEBUG("Statelessly forwarding %s", pjsip_tx_data_get_info(req));
+
+  // If the first target fails, the request is retried to the next one with
+  // the same branch, as a CANCEL for it would be.
+  bool ack = (req->msg->line.req.method.id == PJSIP_ACK_METHOD);
+  pj_status_t status = PJUtils::send_request_stateless(req, 0, false);
+
+  if ((status != PJ_SUCCESS) && (!ack))
+  {
+    // There's nowhere to forward the request to.
+    _proxy->reject_request(_rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
+  }
+}
+
+void StatelessSproutletWrapper::tx_response(pjsip_tx_data* rsp)
+{
+  {
+    SproutletStats::CallbackTimer timer(_stats, _alias_stats);
+    _sproutlet_tsx->on_tx_response(rsp->msg);
+  }
+
+  TRC_DEBUG("Statelessly sending %s", pjsip_tx_data_get_info(rsp));
+
+  pj_status_t status = pjsip_endpt_send_response2(stack_data.endpt,
+                                                  _rdata,
+                                                  rsp,
+                                                  NULL,
+                                                  NULL);
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to send response, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    pjsip_tx_data_dec_ref(rsp);
+    // LCOV_EXCL_STOP
+  }
+}
@@ -0,0 +1,264 @@
+/**
+ * @file stateless_nonce.cpp  Self-contained digest authentication nonces.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "log.h"
+#include "base64.h"
+#include "stateless_nonce.h"
+
+const std::string StatelessNonce::PREFIX = "s1.";
+
+StatelessNonce::StatelessNonce(const std::string& key)
+{
+  // Derive a fixed length AES key from the configured secret.
+  SHA256((const unsigned char*)key.data(), key.size(), _key);
+}
+
+StatelessNonce::~StatelessNonce()
+{
+  memset(_key, 0, sizeof(_key));
+}
+
+bool StatelessNonce::is_stateless(const std::string& nonce)
+{
+  return (nonce.compare(0, PREFIX.size(), PREFIX) == 0);
+}
+
+std::string StatelessNonce::encode(const std::string& impi,
+                                   const ImpiStore::DigestAuthChallenge* challenge)
+{
+  // The plaintext is the expiry time (4 bytes, network order) followed by
+  // length-prefixed fields.
+  std::string plaintext;
+  uint32_t expires = (uint32_t)challenge->expires;
+  plaintext.push_back((char)((expires >> 24) & 0xFF));
+  plaintext.push_back((char)((expires >> 16) & 0xFF));
+  plaintext.push_back((char)((expires >> 8) & 0xFF));
+  plaintext.push_back((char)(expires & 0xFF));
+  append_field(plaintext, impi);
+  append_field(plaintext, challenge->realm);
+  append_field(plaintext, challenge->qop);
+  append_field(plaintext, challenge->ha1);
+  append_field(plaintext, challenge->correlator);
+
+  std::string ciphertext;
+  if (!encrypt(plaintext, ciphertext))
+  {
+    // LCOV_EXCL_START - OpenSSL failures aren't tested in UT
+    TRC_ERROR("Failed to encrypt stateless nonce for %s", impi.c_str());
+    return "";
+    // LCOV_EXCL_STOP
+  }
+
+  // Use the URL-safe base64 alphabet without padding, so that the nonce can
+  // be carried unescaped in URI parameters as well as in quoted strings.
+  std::string encoded = base64_encode(ciphertext);
+  encoded.erase(std::remove(encoded.begin(), encoded.end(), '='), encoded.end());
+  std::replace(encoded.begin(), encoded.end(), '+', '-');
+  std::replace(encoded.begin(), encoded.end(), '/', '_');
+
+  return PREFIX + encoded;
+}
+
+StatelessNonce::Result StatelessNonce::decode(const std::string& impi,
+                                              const std::string& nonce,
+                                              ImpiStore::DigestAuthChallenge*& challenge)
+{
+  challenge = NULL;
+
+  if (!is_stateless(nonce))
+  {
+    return NOT_STATELESS;
+  }
+
+  std::string encoded = nonce.substr(PREFIX.size());
+  std::replace(encoded.begin(), encoded.end(), '-', '+');
+  std::replace(encoded.begin(), encoded.end(), '_', '/');
+  encoded.append((4 - (encoded.size() % 4)) % 4, '=');
+
+  std::string plaintext;
+  if (!decrypt(base64_decode(encoded), plaintext))
+  {
+    TRC_DEBUG("Stateless nonce %s failed authentication", nonce.c_str());
+    return INVALID;
+  }
+
+  std::string nonce_impi;
+  std::string realm;
+  std::string qop;
+  std::string ha1;
+  std::string correlator;
+  size_t offset = 4;
+
+  if ((plaintext.size() < offset) ||
+      (!read_field(plaintext, offset, nonce_impi)) ||
+      (!read_field(plaintext, offset, realm)) ||
+      (!read_field(plaintext, offset, qop)) ||
+      (!read_field(plaintext, offset, ha1)) ||
+      (!read_field(plaintext, offset, correlator)))
+  {
+    // LCOV_EXCL_START - Can only happen if the key has leaked
+    TRC_WARNING("Malformed stateless nonce %s", nonce.c_str());
+    return INVALID;
+    // LCOV_EXCL_STOP
+  }
+
+  if (nonce_impi != impi)
+  {
+    TRC_DEBUG("Stateless nonce was issued to %s, not %s",
+              nonce_impi.c_str(), impi.c_str());
+    return INVALID;
+  }
+
+  uint32_t expires = (((uint32_t)(uint8_t)plaintext[0]) << 24) |
+                     (((uint32_t)(uint8_t)plaintext[1]) << 16) |
+                     (((uint32_t)(uint8_t)plaintext[2]) << 8) |
+                     ((uint32_t)(uint8_t)plaintext[3]);
+
+  if ((time_t)expires < time(NULL))
+  {
+    TRC_DEBUG("Stateless nonce expired at %u", expires);
+    return EXPIRED;
+  }
+
+  challenge = new ImpiStore::DigestAuthChallenge(nonce,
+                                                 realm,
+                                                 qop,
+                                                 ha1,
+                                                 (int)expires);
+  challenge->correlator = correlator;
+
+  return OK;
+}
+
+void StatelessNonce::append_field(std::string& buf, const std::string& field)
+{
+  size_t len = std::min(field.size(), (size_t)0xFFFF);
+  buf.push_back((char)((len >> 8) & 0xFF));
+  buf.push_back((char)(len & 0xFF));
+  buf.append(field, 0, len);
+}
+
+bool StatelessNonce::read_field(const std::string& buf,
+                                size_t& offset,
+                                std::string& field)
+{
+  if (offset + 2 > buf.size())
+  {
+    return false;
+  }
+
+  size_t len = (((size_t)(uint8_t)buf[offset]) << 8) |
+               ((size_t)(uint8_t)buf[offset + 1]);
+  offset += 2;
+
+  if (offset + len > buf.size())
+  {
+    return false;
+  }
+
+  field.assign(buf, offset, len);
+  offset += len;
+  return true;
+}
+
+bool StatelessNonce::encrypt(const std::string& plaintext,
+                             std::string& ciphertext)
+{
+  uint8_t iv[IV_LEN];
+  uint8_t tag[TAG_LEN];
+  std::string out(plaintext.size(), '\0');
+  int len = 0;
+  bool success = false;
+
+  if (RAND_bytes(iv, sizeof(iv)) != 1)
+  {
+    return false; // LCOV_EXCL_LINE
+  }
+
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+  // The nonce format prefix is authenticated as additional data so that a
+  // future format can't be confused with this one.
+  if ((ctx != NULL) &&
+      (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) == 1) &&
+      (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, IV_LEN, NULL) == 1) &&
+      (EVP_EncryptInit_ex(ctx, NULL, NULL, _key, iv) == 1) &&
+      (EVP_EncryptUpdate(ctx,
+                         NULL,
+                         &len,
+                         (const unsigned char*)PREFIX.data(),
+                         PREFIX.size()) == 1) &&
+      (EVP_EncryptUpdate(ctx,
+                         (unsigned char*)&out[0],
+                         &len,
+                         (const unsigned char*)plaintext.data(),
+                         plaintext.size()) == 1) &&
+      (EVP_EncryptFinal_ex(ctx, (unsigned char*)&out[0] + len, &len) == 1) &&
+      (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, tag) == 1))
+  {
+    ciphertext.assign((char*)iv, IV_LEN);
+    ciphertext.append(out);
+    ciphertext.append((char*)tag, TAG_LEN);
+    success = true;
+  }
+
+  EVP_CIPHER_CTX_free(ctx);
+  return success;
+}
+
+bool StatelessNonce::decrypt(const std::string& ciphertext,
+                             std::string& plaintext)
+{
+  if (ciphertext.size() < IV_LEN + TAG_LEN)
+  {
+    return false;
+  }
+
+  const uint8_t* iv = (const uint8_t*)ciphertext.data();
+  size_t data_len = ciphertext.size() - IV_LEN - TAG_LEN;
+  std::string tag = ciphertext.substr(IV_LEN + data_len);
+  std::string out(data_len, '\0');
+  int len = 0;
+  bool success = false;
+
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+  if ((ctx != NULL) &&
+      (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) == 1) &&
+      (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, IV_LEN, NULL) == 1) &&
+      (EVP_DecryptInit_ex(ctx, NULL, NULL, _key, iv) == 1) &&
+      (EVP_DecryptUpdate(ctx,
+                         NULL,
+                         &len,
+                         (const unsigned char*)PREFIX.data(),
+                         PREFIX.size()) == 1) &&
+      (EVP_DecryptUpdate(ctx,
+                         (unsigned char*)&out[0],
+                         &len,
+                         (const unsigned char*)ciphertext.data() + IV_LEN,
+                         data_len) == 1) &&
+      (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, (void*)tag.data()) == 1) &&
+      (EVP_DecryptFinal_ex(ctx, (unsigned char*)&out[0] + len, &len) == 1))
+  {
+    plaintext = out;
+    success = true;
+  }
+
+  EVP_CIPHER_CTX_free(ctx);
+  return success;
+}
@@ -41,6 +41,7 @@ extern "C" {
 #include "constants.h"
 #include "json_parse_utils.h"
 #include "rapidjson/error/en.h"
+#include "parallel_store_ops.h"
 
 /// JSON serialization constants.
 static const char* const JSON_BINDINGS = "bindings";
@@ -81,10 +82,11 @@ SubscriberDataManager::SubscriberDataManager(Store* data_store,
                                              std::vector<SerializerDeserializer*>& deserializers,
                                              ChronosConnection* chronos_connection,
                                              AnalyticsLogger* analytics_logger,
-                                             bool is_primary) :
+                                             bool is_primary,
+                                             ParallelStoreOps* parallel_ops) :
   _primary_sdm(is_primary)
 {
-  _connector = new Connector(data_store, serializer, deserializers);
+  _connector = new Connector(data_store, serializer, deserializers, parallel_ops);
   _chronos_timer_request_sender = new ChronosTimerRequestSender(chronos_connection);
   _notify_sender = new NotifySender();
   _analytics = analytics_logger;
@@ -181,6 +183,125 @@ Store::Status SubscriberDataManager::set_aor_data(
   // state. Therefore, we log removed or shortened bindings before any such calls,
   // and we log new or extended bindings afterwards.
 
+  int now = time(NULL);
+  ClassifiedBindings classified_bindings;
+
+  // Steps 1-3.
+  int expiry = prepare_aor_write(aor_id,
+                                 aor_pair,
+                                 now,
+                                 trail,
+                                 all_bindings_expired,
+                                 classified_bindings);
+
+  // 4. Write the data to memcached. If this fails, bail out here
+  Store::Status rc = _connector->set_aor_data(aor_id,
+                                              aor_pair->get_current(),
+                                              expiry,
+                                              trail);
+
+  if (rc != Store::Status::OK)
+  {
+    // We were unable to write to the store - return to the caller and
+    // send no further messages
+    delete_bindings(classified_bindings);
+    return rc;
+  }
+
+  // Steps 5-7.
+  complete_aor_write(aor_id,
+                     associated_uris,
+                     aor_pair,
+                     now,
+                     trail,
+                     classified_bindings);
+
+  delete_bindings(classified_bindings);
+
+  return Store::Status::OK;
+}
+
+/// Retrieve the registration data for several SIP Addresses of Record.  The
+/// store reads are issued together rather than one after another.
+///
+/// @param aor_ids      The SIP Addresses of Record for the registrations
+std::vector<SubscriberDataManager::AoRPair*> SubscriberDataManager::get_aor_data_multi(
+                                          const std::vector<std::string>& aor_ids,
+                                          SAS::TrailId trail)
+{
+  std::vector<AoR*> aors = _connector->get_aor_data_multi(aor_ids, trail);
+  std::vector<AoRPair*> aor_pairs(aor_ids.size(), NULL);
+  int now = time(NULL);
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    if (aors[ii] != NULL)
+    {
+      AoR* aor_copy = new AoR(*aors[ii]);
+      aor_pairs[ii] = new AoRPair(aors[ii], aor_copy);
+      expire_aor_members(aor_pairs[ii], now, trail);
+    }
+  }
+
+  return aor_pairs;
+}
+
+/// Update the data for several addresses of record.  Each AoR is written
+/// atomically, with the same semantics as set_aor_data, but the store writes
+/// are issued together.  Timers and NOTIFYs are always sent from the calling
+/// thread.
+void SubscriberDataManager::set_aor_data_multi(std::vector<AoRUpdate>& updates,
+                                               SAS::TrailId trail)
+{
+  int now = time(NULL);
+  std::vector<std::string> aor_ids;
+  std::vector<AoR*> aors;
+  std::vector<int> expiries;
+  std::vector<ClassifiedBindings> classified_bindings(updates.size());
+
+  for (size_t ii = 0; ii < updates.size(); ++ii)
+  {
+    AoRUpdate& update = updates[ii];
+    int expiry = prepare_aor_write(update.aor_id,
+                                   update.aor_pair,
+                                   now,
+                                   trail,
+                                   update.all_bindings_expired,
+                                   classified_bindings[ii]);
+    aor_ids.push_back(update.aor_id);
+    aors.push_back(update.aor_pair->get_current());
+    expiries.push_back(expiry);
+  }
+
+  std::vector<Store::Status> rcs =
+                  _connector->set_aor_data_multi(aor_ids, aors, expiries, trail);
+
+  for (size_t ii = 0; ii < updates.size(); ++ii)
+  {
+    AoRUpdate& update = updates[ii];
+    update.status = rcs[ii];
+
+    if (update.status == Store::Status::OK)
+    {
+      complete_aor_write(update.aor_id,
+                         update.associated_uris,
+                         update.aor_pair,
+                         now,
+                         trail,
+                         classified_bindings[ii]);
+    }
+
+    delete_bindings(classified_bindings[ii]);
+  }
+}
+
+int SubscriberDataManager::prepare_aor_write(const std::string& aor_id,
+                                             AoRPair* aor_pair,
+                                             int now,
+                                             SAS::TrailId trail,
+                                             bool& all_bindings_expired,
+                                             ClassifiedBindings& classified_bindings)
+{
   // 1. Expire any old bindings/subscriptions.
   all_bindings_expired = false;
 
@@ -189,8 +310,7 @@ Store::Status SubscriberDataManager::set_aor_data(
   // cause concurrency problems because memcached does not support
   // cas on delete operations.  In this case we do a memcached_cas with
   // an effectively immediate expiry time.
-  int now = time(NULL);
-
+  //
   // Set the max expires to be greater than the longest binding expiry time.
   // This prevents a window condition where Chronos can return a binding to
   // expire, but memcached has already deleted the aor data (meaning that
@@ -210,8 +330,6 @@ Store::Status SubscriberDataManager::set_aor_data(
   TRC_DEBUG("Set AoR data for %s, CAS=%ld, expiry = %d",
             aor_id.c_str(), aor_pair->get_current()->_cas, max_expires);
 
-  ClassifiedBindings classified_bindings;
-
   if (_primary_sdm)
   {
     // 2. Log removed or shortened bindings
@@ -226,26 +344,22 @@ Store::Status SubscriberDataManager::set_aor_data(
     _chronos_timer_request_sender->send_timers(aor_id, aor_pair, now, trail);
   }
 
-  // 4. Write the data to memcached. If this fails, bail out here
-
-  // Update the Notify CSeq, and write to store. We always update the cseq
-  // as it's safe to increment it unnecessarily, and if we wait to find out
-  // how many NOTIFYs we're going to send then we'll have to write back to
+  // Update the Notify CSeq ready for the write to store. We always update the
+  // cseq as it's safe to increment it unnecessarily, and if we wait to find
+  // out how many NOTIFYs we're going to send then we'll have to write back to
   // memcached again
   aor_pair->get_current()->_notify_cseq++;
-  Store::Status rc = _connector->set_aor_data(aor_id,
-                                              aor_pair->get_current(),
-                                              max_expires - now,
-                                              trail);
 
-  if (rc != Store::Status::OK)
-  {
-    // We were unable to write to the store - return to the caller and
-    // send no further messages
-    delete_bindings(classified_bindings);
-    return rc;
-  }
+  return max_expires - now;
+}
 
+void SubscriberDataManager::complete_aor_write(const std::string& aor_id,
+                                               AssociatedURIs* associated_uris,
+                                               AoRPair* aor_pair,
+                                               int now,
+                                               SAS::TrailId trail,
+                                               ClassifiedBindings& classified_bindings)
+{
   if (_primary_sdm)
   {
     // 5. Log new / extended bindings
@@ -257,10 +371,6 @@ Store::Status SubscriberDataManager::set_aor_data(
     // 6. Send any NOTIFYs
     _notify_sender->send_notifys(aor_id, associated_uris, aor_pair, now, trail);
   }
-
-  delete_bindings(classified_bindings);
-
-  return Store::Status::OK;
 }
 
 void SubscriberDataManager::classify_bindings(const std::string& aor_id,
@@ -486,10 +596,12 @@ int SubscriberDataManager::expire_bindings(AoR* aor_data,
 
 SubscriberDataManager::Connector::Connector(Store* data_store,
                                SerializerDeserializer*& serializer,
-                               std::vector<SerializerDeserializer*>& deserializers) :
+                               std::vector<SerializerDeserializer*>& deserializers,
+                               ParallelStoreOps* parallel_ops) :
   _data_store(data_store),
   _serializer(serializer),
-  _deserializers(deserializers)
+  _deserializers(deserializers),
+  _parallel_ops(parallel_ops)
 {
   // We have taken ownership of the serializer and deserializers.
   serializer = NULL;
@@ -604,6 +716,65 @@ Store::Status SubscriberDataManager::Connector::set_aor_data(
   return status;
 }
 
+void SubscriberDataManager::Connector::run_store_ops(
+                                       std::vector<std::function<void()>>& ops)
+{
+  if (_parallel_ops != NULL)
+  {
+    _parallel_ops->run(ops);
+  }
+  else
+  {
+    for (std::function<void()>& op : ops)
+    {
+      op();
+    }
+  }
+}
+
+std::vector<SubscriberDataManager::AoR*>
+  SubscriberDataManager::Connector::get_aor_data_multi(
+                                       const std::vector<std::string>& aor_ids,
+                                       SAS::TrailId trail)
+{
+  std::vector<AoR*> aors(aor_ids.size(), NULL);
+  std::vector<std::function<void()>> ops;
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    ops.push_back([this, &aor_ids, &aors, ii, trail]()
+    {
+      aors[ii] = get_aor_data(aor_ids[ii], trail);
+    });
+  }
+
+  run_store_ops(ops);
+
+  return aors;
+}
+
+std::vector<Store::Status> SubscriberDataManager::Connector::set_aor_data_multi(
+                                       const std::vector<std::string>& aor_ids,
+                                       const std::vector<AoR*>& aor_data,
+                                       const std::vector<int>& expiries,
+                                       SAS::TrailId trail)
+{
+  std::vector<Store::Status> statuses(aor_ids.size(), Store::Status::ERROR);
+  std::vector<std::function<void()>> ops;
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    ops.push_back([this, &aor_ids, &aor_data, &expiries, &statuses, ii, trail]()
+    {
+      statuses[ii] = set_aor_data(aor_ids[ii], aor_data[ii], expiries[ii], trail);
+    });
+  }
+
+  run_store_ops(ops);
+
+  return statuses;
+}
+
 /// Serialize the contents of an AoR.
 std::string SubscriberDataManager::Connector::serialize_aor(AoR* aor_data)
 {
@@ -353,9 +353,33 @@ void add_callback_to_queue(PJUtils::Callback* cb)
   queue_event.callback = cb;
   worker_thread_qe qe = { CALLBACK, queue_event };
 
-  // Track the current queue size
-  queue_size_table->accumulate(worker_thread_q.size());
+  // Track the current queue size (the UTs don't set up the table).
+  if (queue_size_table != NULL)
+  {
+    queue_size_table->accumulate(worker_thread_q.size());
+  }
 
   // Add the Event
   worker_thread_q.push(qe);
 }
+
+int process_queued_callbacks()
+{
+  struct worker_thread_qe qe = { MESSAGE };
+  int processed = 0;
+
+  // The UTs don't register the dispatcher module, so only callbacks are
+  // queued.
+  while ((worker_thread_q.size() > 0) && (worker_thread_q.pop(qe)))
+  {
+    if (qe.type == CALLBACK)
+    {
+      PJUtils::Callback* cb = qe.event.callback;
+      cb->run();
+      delete cb; cb = NULL;
+      ++processed;
+    }
+  }
+
+  return processed;
+}
@@ -8,47 +8,18 @@
  */
 
 #include <vector>
-#include <boost/regex.hpp>
 #include "uri_classifier.h"
+#include "number_utils.h"
 #include "stack.h"
 #include "constants.h"
 
-// Regexes that match global and local numbers:
-// - A global number starts with "+" followed by a combination of digits "0-9"
-//   and visual separators ",-()".
-// - A local number can contain a combination of hexdigits "0-9A-F", "*#" and
-//   visual separators ",-()".
-static const boost::regex CHARS_ALLOWED_IN_GLOBAL_NUM = boost::regex("\\+[0-9,\\-\\(\\)]*");
-static const boost::regex CHARS_ALLOWED_IN_LOCAL_NUM = boost::regex("[0-9A-F\\*#,\\-\\(\\)]*");
-
 std::vector<pj_str_t*> URIClassifier::home_domains;
 bool URIClassifier::enforce_global;
 bool URIClassifier::enforce_user_phone;
 
 bool URIClassifier::is_user_numeric(pj_str_t user)
 {
-  const char* uri = user.ptr;
-
-  for (int i = 0; i < user.slen; i++)
-  {
-    if ((uri[i] == '+') ||
-        (uri[i] == '-') ||
-        (uri[i] == '.') ||
-        (uri[i] == '(') ||
-        (uri[i] == ')') ||
-        (uri[i] == '[') ||
-        (uri[i] == ']') ||
-        ((uri[i] >= '0') &&
-         (uri[i] <= '9')))
-    {
-      continue;
-    }
-    else
-    {
-      return false;
-    }
-  }
-  return true;
+  return NumberUtils::is_user_numeric(user);
 }
 
 static bool is_home_domain(pj_str_t host)
@@ -131,9 +102,7 @@ URIClass URIClassifier::classify_uri(const pjsip_uri* uri, bool prefer_sip, bool
   {
     // TEL URIs can only represent phone numbers - decide if it's a global (E.164) number or not
     pjsip_tel_uri* tel_uri = (pjsip_tel_uri*)uri;
-    std::string user = PJUtils::pj_str_to_string(&tel_uri->number);
-    boost::match_results<std::string::const_iterator> results;
-    if (boost::regex_match(user, results, CHARS_ALLOWED_IN_GLOBAL_NUM))
+    if (NumberUtils::is_global_number(tel_uri->number))
     {
       ret = GLOBAL_PHONE_NUMBER;
     }
@@ -164,17 +133,14 @@ URIClass URIClassifier::classify_uri(const pjsip_uri* uri, bool prefer_sip, bool
          (home_domain && treat_number_as_phone && !is_gruu)))
     {
       // Get the user part minus any parameters.
-      std::string user = PJUtils::pj_str_to_string(&sip_uri->user);
-      if (!user.empty())
+      pj_str_t user;
+      if (NumberUtils::user_minus_params(sip_uri->user, user))
       {
-        std::vector<std::string> user_tokens;
-        Utils::split_string(user, ';', user_tokens, 0, true);
-        boost::match_results<std::string::const_iterator> results;
-        if (boost::regex_match(user_tokens[0], results, CHARS_ALLOWED_IN_GLOBAL_NUM))
+        if (NumberUtils::is_global_number(user))
         {
           ret = GLOBAL_PHONE_NUMBER;
         }
-        else if (boost::regex_match(user_tokens[0], results, CHARS_ALLOWED_IN_LOCAL_NUM))
+        else if (NumberUtils::is_local_number(user))
         {
           ret = enforce_global ? LOCAL_PHONE_NUMBER : GLOBAL_PHONE_NUMBER;
         }
@@ -27,6 +27,7 @@ extern "C" {
 #include "sproutletproxy.h"
 #include "hssconnection.h"
 #include "authenticationsproutlet.h"
+#include "stateless_nonce.h"
 #include "fakehssconnection.hpp"
 #include "fakechronosconnection.hpp"
 #include "test_interposer.hpp"
@@ -138,6 +139,7 @@ public:
     pjsip_tsx_layer_instance()->start();
 
     delete _auth_sproutlet; _auth_sproutlet = NULL;
+    delete _digest_av_cache; _digest_av_cache = NULL;
     delete _sproutlet_proxy; _sproutlet_proxy = NULL;
     delete _tp; _tp = NULL;
 
@@ -247,6 +249,7 @@ protected:
   static std::vector<ImpiStore*> _remote_impi_stores;
 
   AuthenticationSproutlet* _auth_sproutlet;
+  DigestAvCache* _digest_av_cache = NULL;
   SproutletProxy* _sproutlet_proxy;
   TransportFlow* _tp;
 };
@@ -280,6 +283,11 @@ class AuthenticationTestTemplate : public BaseAuthenticationTest
 
   AuthenticationSproutlet* create_auth_sproutlet()
   {
+    if (C::digest_av_cache_ttl() > 0)
+    {
+      _digest_av_cache = new DigestAvCache(C::digest_av_cache_ttl(), NULL, NULL);
+    }
+
     AuthenticationSproutlet* auth_sproutlet =
       new AuthenticationSproutlet("authentication",
                                   stack_data.scscf_port,
@@ -296,18 +304,22 @@ class AuthenticationTestTemplate : public BaseAuthenticationTest
                                   _analytics,
                                   &SNMP::FAKE_AUTHENTICATION_STATS_TABLES,
                                   C::nonce_count_supported(),
-                                  get_binding_expiry);
+                                  get_binding_expiry,
+                                  C::stateless_nonce_key(),
+                                  _digest_av_cache);
     EXPECT_TRUE(auth_sproutlet->init());
     return auth_sproutlet;
   }
 };
 
 /// Templated configuration class for use with the above fixture.
-template<uint32_t A, bool N>
+template<uint32_t A, bool N, bool S = false, int T = 0>
 class AuthenticationTestConfig
 {
   static uint32_t non_reg_auth() { return A; }
   static uint32_t nonce_count_supported() { return N; }
+  static std::string stateless_nonce_key() { return S ? "cluster-secret" : ""; }
+  static int digest_av_cache_ttl() { return T; }
 };
 
 class AuthenticationMessage
@@ -2714,6 +2726,393 @@ TEST_F(AuthenticationTest, DigestAuthFailureWithSetError)
 }
 
 
+//
+// Tests for stateless digest nonces.
+//
+
+typedef AuthenticationTestTemplate<
+  AuthenticationTestConfig<NonRegisterAuthentication::NEVER, false, true>
+> AuthenticationStatelessNonceTest;
+
+TEST_F(AuthenticationStatelessNonceTest, DigestAuthSuccess)
+{
+  // Test a successful SIP Digest authentication flow where the challenge is
+  // carried in the nonce rather than the IMPI store.
+  pjsip_tx_data* tdata;
+
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_TRUE(StatelessNonce::is_stateless(auth_params["nonce"]));
+  EXPECT_EQ("auth", auth_params["qop"]);
+  EXPECT_EQ("MD5", auth_params["algorithm"]);
+  free_txdata();
+
+  // Nothing has been written to the IMPI store.
+  ImpiStore::Impi* impi = _impi_store->get_impi("6505550001@homedomain", 0);
+  ASSERT_TRUE(impi != NULL);
+  EXPECT_TRUE(impi->auth_challenges.empty());
+  delete impi; impi = NULL;
+
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  inject_msg(msg2.get());
+
+  auth_sproutlet_allows_request();
+
+  // The challenge has now been written, to record that the nonce has been
+  // used.
+  impi = _impi_store->get_impi("6505550001@homedomain", 0);
+  ASSERT_TRUE(impi != NULL);
+  ImpiStore::AuthChallenge* auth_challenge = impi->get_auth_challenge(auth_params["nonce"]);
+  ASSERT_TRUE(auth_challenge != NULL);
+  EXPECT_EQ(2u, auth_challenge->nonce_count);
+  delete impi; impi = NULL;
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+TEST_F(AuthenticationStatelessNonceTest, DigestAuthFailReplay)
+{
+  // Test that a response to a stateless challenge can't be replayed.
+  pjsip_tx_data* tdata;
+
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  free_txdata();
+
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  inject_msg(msg2.get());
+
+  auth_sproutlet_allows_request();
+
+  // Send exactly the same response again. It is rejected with a new
+  // challenge, flagged as stale.
+  inject_msg(msg2.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params2;
+  parse_www_authenticate(auth, auth_params2);
+  EXPECT_EQ("true", auth_params2["stale"]);
+  EXPECT_NE(auth_params["nonce"], auth_params2["nonce"]);
+  free_txdata();
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+TEST_F(AuthenticationStatelessNonceTest, DigestAuthFailTamperedNonce)
+{
+  // Test that a stateless nonce that has been modified is treated as stale.
+  pjsip_tx_data* tdata;
+
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  free_txdata();
+
+  std::string nonce = auth_params["nonce"];
+  nonce[nonce.size() - 2] = (nonce[nonce.size() - 2] == 'A') ? 'B' : 'A';
+
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._nonce = nonce;
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  inject_msg(msg2.get());
+
+  // Expect a new challenge, flagged as stale.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params2;
+  parse_www_authenticate(auth, auth_params2);
+  EXPECT_EQ("true", auth_params2["stale"]);
+  free_txdata();
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+TEST_F(AuthenticationStatelessNonceTest, NonceEncoding)
+{
+  StatelessNonce codec("cluster-secret");
+  StatelessNonce other_codec("another-secret");
+  ImpiStore::DigestAuthChallenge challenge("",
+                                           "homedomain",
+                                           "auth",
+                                           "12345678123456781234567812345678",
+                                           time(NULL) + 40);
+  challenge.correlator = "z9hG4bK1234";
+
+  std::string nonce = codec.encode("6505550001@homedomain", &challenge);
+  EXPECT_TRUE(StatelessNonce::is_stateless(nonce));
+  EXPECT_EQ(std::string::npos, nonce.find_first_of("+/=\""));
+
+  // The nonce decodes to the original challenge.
+  ImpiStore::DigestAuthChallenge* decoded = NULL;
+  EXPECT_EQ(StatelessNonce::OK,
+            codec.decode("6505550001@homedomain", nonce, decoded));
+  ASSERT_TRUE(decoded != NULL);
+  EXPECT_EQ(nonce, decoded->nonce);
+  EXPECT_EQ("homedomain", decoded->realm);
+  EXPECT_EQ("auth", decoded->qop);
+  EXPECT_EQ("12345678123456781234567812345678", decoded->ha1);
+  EXPECT_EQ("z9hG4bK1234", decoded->correlator);
+  EXPECT_EQ(challenge.expires, decoded->expires);
+  delete decoded; decoded = NULL;
+
+  // The nonce can't be used by a different IMPI, or checked with a different
+  // key.
+  EXPECT_EQ(StatelessNonce::INVALID,
+            codec.decode("6505550002@homedomain", nonce, decoded));
+  EXPECT_EQ(StatelessNonce::INVALID,
+            other_codec.decode("6505550001@homedomain", nonce, decoded));
+  EXPECT_TRUE(decoded == NULL);
+
+  // Nonces that weren't created by the codec are passed over.
+  EXPECT_EQ(StatelessNonce::NOT_STATELESS,
+            codec.decode("6505550001@homedomain", "abcdef0123456789", decoded));
+
+  // The nonce expires.
+  cwtest_advance_time_ms(41000);
+  EXPECT_EQ(StatelessNonce::EXPIRED,
+            codec.decode("6505550001@homedomain", nonce, decoded));
+  EXPECT_TRUE(decoded == NULL);
+}
+
+
+//
+// Tests for the digest AV cache.
+//
+
+typedef AuthenticationTestTemplate<
+  AuthenticationTestConfig<NonRegisterAuthentication::NEVER, false, false, 300>
+> AuthenticationDigestAvCacheTest;
+
+TEST_F(AuthenticationDigestAvCacheTest, ReRegisterUsesCachedAv)
+{
+  // Test that a re-registration is challenged using the digest AV cached from
+  // the previous registration, without querying the HSS.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(401).matches(current_txdata()->msg);
+  free_txdata();
+  EXPECT_EQ(0u, _digest_av_cache->hits());
+  EXPECT_EQ(1u, _digest_av_cache->misses());
+
+  // Remove the HSS result.  The re-registration is still challenged.
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+
+  AuthenticationMessage msg2("REGISTER");
+  msg2._auth_hdr = false;
+  inject_msg(msg2.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_EQ("homedomain", auth_params["realm"]);
+  EXPECT_EQ("auth", auth_params["qop"]);
+  free_txdata();
+  EXPECT_EQ(1u, _digest_av_cache->hits());
+
+  // The client can authenticate against the challenge built from the cached
+  // AV.
+  AuthenticationMessage msg3("REGISTER");
+  msg3._algorithm = "MD5";
+  msg3._key = "12345678123456781234567812345678";
+  msg3._nonce = auth_params["nonce"];
+  msg3._opaque = auth_params["opaque"];
+  msg3._nc = "00000001";
+  msg3._cnonce = "8765432187654321";
+  msg3._qop = "auth";
+  msg3._integ_prot = "ip-assoc-pending";
+  inject_msg(msg3.get());
+  auth_sproutlet_allows_request();
+
+  // Once the cached AV expires the HSS is queried again.
+  cwtest_advance_time_ms(301000);
+
+  AuthenticationMessage msg4("REGISTER");
+  msg4._auth_hdr = false;
+  inject_msg(msg4.get());
+  ASSERT_EQ(1, txdata_count());
+  free_txdata();
+  EXPECT_EQ(1u, _digest_av_cache->hits());
+  EXPECT_EQ(2u, _digest_av_cache->misses());
+}
+
+TEST_F(AuthenticationDigestAvCacheTest, AuthFailureInvalidatesCachedAv)
+{
+  // Test that a failed authentication discards the cached AV.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  free_txdata();
+
+  // Respond with the wrong password.
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "wrong";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  msg2._integ_prot = "ip-assoc-pending";
+  inject_msg(msg2.get());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(403).matches(current_txdata()->msg);
+  free_txdata();
+
+  // The next registration goes back to the HSS.
+  AuthenticationMessage msg3("REGISTER");
+  msg3._auth_hdr = false;
+  inject_msg(msg3.get());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(401).matches(current_txdata()->msg);
+  free_txdata();
+  EXPECT_EQ(0u, _digest_av_cache->hits());
+  EXPECT_EQ(2u, _digest_av_cache->misses());
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+TEST_F(AuthenticationDigestAvCacheTest, AkaAvNotCached)
+{
+  // Test that AKA AVs are never cached.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"aka\":{\"challenge\":\"87654321876543218765432187654321\","
+                              "\"response\":\"12345678123456781234567812345678\","
+                              "\"cryptkey\":\"0123456789abcdef\","
+                              "\"integritykey\":\"fedcba9876543210\"}}");
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    AuthenticationMessage msg("REGISTER");
+    msg._auth_hdr = false;
+    inject_msg(msg.get());
+    ASSERT_EQ(1, txdata_count());
+    RespMatcher(401).matches(current_txdata()->msg);
+    free_txdata();
+  }
+
+  EXPECT_EQ(0u, _digest_av_cache->hits());
+  EXPECT_EQ(2u, _digest_av_cache->misses());
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+}
+
+TEST(DigestAvCacheTest, InvalidateAndExpire)
+{
+  DigestAvCache cache(60, NULL, NULL);
+  DigestAvCache::Av av;
+  av.ha1 = "ha1";
+  av.qop = "auth";
+  av.realm = "homedomain";
+
+  cache.add("impi1", "sip:impu1", "", av);
+  cache.add("impi1", "sip:impu2", "", av);
+  cache.add("impi2", "sip:impu3", "homedomain", av);
+
+  DigestAvCache::Av out;
+  EXPECT_TRUE(cache.get("impi1", "sip:impu1", "", out));
+  EXPECT_EQ("ha1", out.ha1);
+  EXPECT_EQ("auth", out.qop);
+  EXPECT_EQ("homedomain", out.realm);
+
+  // The realm forms part of the key.
+  EXPECT_FALSE(cache.get("impi2", "sip:impu3", "", out));
+  EXPECT_TRUE(cache.get("impi2", "sip:impu3", "homedomain", out));
+
+  // Invalidating an IMPI removes all of its entries.
+  cache.invalidate("impi1");
+  EXPECT_FALSE(cache.get("impi1", "sip:impu1", "", out));
+  EXPECT_FALSE(cache.get("impi1", "sip:impu2", "", out));
+  EXPECT_TRUE(cache.get("impi2", "sip:impu3", "homedomain", out));
+
+  // Entries expire after the TTL.
+  cwtest_advance_time_ms(61000);
+  EXPECT_FALSE(cache.get("impi2", "sip:impu3", "homedomain", out));
+
+  EXPECT_EQ(3u, cache.hits());
+  EXPECT_EQ(4u, cache.misses());
+}
+
+
 //
 // Tests for authenticating non-REGISTER messages from a UE that authenticates
 // using SIP Digest.
@@ -3322,7 +3721,8 @@ TYPED_TEST(AuthenticationDigestUEsTest, GrTestReadRepair)
 typedef ::testing::Types<
   AuthenticationTestConfig<NonRegisterAuthentication::INITIAL_REQ_FROM_REG_DIGEST_ENDPOINT, true>,
   AuthenticationTestConfig<NonRegisterAuthentication::INITIAL_REQ_FROM_REG_DIGEST_ENDPOINT |
-                             NonRegisterAuthentication::IF_PROXY_AUTHORIZATION_PRESENT, true>
+                             NonRegisterAuthentication::IF_PROXY_AUTHORIZATION_PRESENT, true>,
+  AuthenticationTestConfig<NonRegisterAuthentication::INITIAL_REQ_FROM_REG_DIGEST_ENDPOINT, true, true>
 > DigestUEsNonceCountSupportedTypes;
 
 template <class T>
@@ -10,6 +10,7 @@
  */
 
 #include <string>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <boost/lexical_cast.hpp>
@@ -23,6 +24,7 @@
 #include "fakehssconnection.hpp"
 #include "faketransport_tcp.hpp"
 #include "test_interposer.hpp"
+#include "thread_dispatcher.h"
 
 using namespace std;
 using testing::StrEq;
@@ -3942,3 +3944,215 @@ TEST_F(BasicProxyTest, TransportFailureWithCancelPending)
 
   delete tp;
 }
+
+
+/// Fixture for tests that resolve the next hop on a resolver thread, as
+/// sprout does when --sip-resolver-threads is set.
+class BasicProxyAsyncResolveTest : public BasicProxyTest
+{
+public:
+  BasicProxyAsyncResolveTest()
+  {
+    _sync_resolver = stack_data.sipresolver;
+    stack_data.sipresolver = new SIPResolver(&_dnsresolver);
+    stack_data.sipresolver->enable_async_resolution(1);
+  }
+
+  ~BasicProxyAsyncResolveTest()
+  {
+    delete stack_data.sipresolver;
+    stack_data.sipresolver = _sync_resolver;
+  }
+
+  /// Waits for a resolution to complete on the resolver thread, and resumes
+  /// the transaction waiting for it.
+  void complete_resolution()
+  {
+    int processed = 0;
+
+    for (int ii = 0; (ii < 5000) && (processed == 0); ++ii)
+    {
+      processed = process_queued_callbacks();
+
+      if (processed == 0)
+      {
+        usleep(1000);
+      }
+    }
+
+    ASSERT_EQ(1, processed);
+  }
+
+private:
+  SIPResolver* _sync_resolver;
+};
+
+
+TEST_F(BasicProxyAsyncResolveTest, RequestSentWhenResolved)
+{
+  // Tests that a request is forwarded once its next hop has been resolved.
+
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with a Route header not referencing this node or the
+  // home domain.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "alice";
+  msg1._to = "bob";
+  msg1._todomain = "awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Only the 100 Trying is sent while the next hop is resolved.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  // Once it's resolved, the request is forwarded to the node in the top
+  // Route header.
+  complete_resolution();
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_EQ("sip:bob@awaydomain", str_uri(tdata->msg->line.req.uri));
+
+  // Send a 200 OK response.
+  inject_msg(respond_to_current_txdata(200));
+
+  // Check the response is forwarded back to the source.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  delete tp;
+}
+
+TEST_F(BasicProxyAsyncResolveTest, CancelWhileResolving)
+{
+  // Tests CANCELing a request while its next hop is being resolved.
+
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "alice";
+  msg1._to = "bob";
+  msg1._todomain = "awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Send a CANCEL from the originator.  This gets a 200 OK, but there's
+  // nothing to CANCEL downstream yet.
+  msg1._method = "CANCEL";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // When the resolution completes, the INVITE isn't sent, and the
+  // originator gets a 487 instead.
+  complete_resolution();
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(487).matches(tdata->msg);
+  free_txdata();
+
+  // Send an ACK to complete the UAS transaction.  It's absorbed.
+  msg1._method = "ACK";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(BasicProxyAsyncResolveTest, UASCompletesWhileResolving)
+{
+  // Tests a forked request where one fork is answered, and the UAS
+  // transaction completes, while the other is still being resolved.
+
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Add two targets for bob@homedomain - the first has to be resolved, but
+  // the second is routed via an IP address so is sent straight away.
+  _basic_proxy->add_test_target("sip:bob@homedomain",
+                                "sip:bob@node1.homedomain;transport=TCP",
+                                std::list<std::string>(1, "sip:proxy1.homedomain;transport=TCP;lr"));
+  _basic_proxy->add_test_target("sip:bob@homedomain",
+                                "sip:bob@node2.homedomain;transport=TCP",
+                                std::list<std::string>(1, "sip:10.10.10.2;transport=TCP;lr"));
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@homedomain;transport=TCP";
+  msg1._from = "alice";
+  msg1._to = "bob";
+  msg1._todomain = "awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:127.0.0.1;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and the INVITE forked to node2.homedomain.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.10.2", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_EQ("sip:bob@node2.homedomain;transport=TCP",
+            str_uri(tdata->msg->line.req.uri));
+
+  // Answer the INVITE.  The 200 OK is forwarded to the originator, which
+  // completes the UAS transaction.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // When the other fork's resolution completes, its INVITE isn't sent.
+  complete_resolution();
+  ASSERT_EQ(0, txdata_count());
+
+  _basic_proxy->remove_test_targets("sip:bob@homedomain");
+
+  delete tp;
+}
@@ -24,6 +24,8 @@
 #include "sproutletappserver.h"
 #include "sproutletproxy.h"
 #include "fakesnmp.hpp"
+#include "fakeenumservice.hpp"
+#include "thread_dispatcher.h"
 
 using namespace std;
 using testing::StrEq;
@@ -488,3 +490,126 @@ TEST_F(BGCFTest, OverrideRoutes)
   hdrs.push_back(HeaderMatcher("Route", "Route: <sip:10.0.0.1:5060;transport=TCP;lr>"));
   doSuccessfulFlow(msg, testing::MatchesRegex("sip:12345@domainvalid"), hdrs);
 }
+
+/// Fixture for tests where the BGCF's ENUM service is asynchronous.
+class BGCFAsyncEnumTest : public BGCFTest
+{
+public:
+  BGCFAsyncEnumTest()
+  {
+    _bgcf_sproutlet->_enum_service = &_async_enum_service;
+  }
+
+  ~BGCFAsyncEnumTest()
+  {
+    _bgcf_sproutlet->_enum_service = _enum_service;
+  }
+
+protected:
+  FakeAsyncEnumService _async_enum_service;
+};
+
+// Test that the request is routed using the result of an asynchronous ENUM
+// lookup once it completes.
+TEST_F(BGCFAsyncEnumTest, RoutesWhenLookupCompletes)
+{
+  SCOPED_TRACE("");
+  _async_enum_service.set_result("+4412345", "tel:+4412345;npdi;rn=+16505551234");
+
+  BGCFMessage msg;
+  msg._toscheme = "tel";
+  msg._to = "+4412345";
+  msg._todomain = "";
+
+  // Only the 100 Trying is sent while the lookup is in progress.
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+  ASSERT_EQ(1u, _async_enum_service.num_pending());
+
+  // When the lookup completes, the request is routed on the routing number
+  // it returned (rather than to the wildcard domain route).
+  _async_enum_service.complete_lookup();
+  process_queued_callbacks();
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  ReqMatcher req("INVITE");
+  ASSERT_NO_FATAL_FAILURE(req.matches(out));
+  EXPECT_THAT(req.uri(), MatchesRegex("tel:\\+4412345;npdi;rn=\\+16505551234"));
+  HeaderMatcher("Route", ".*10.0.0.1:5060.*").match(out);
+
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+}
+
+// Test that a request cancelled while its ENUM lookup is in progress is
+// rejected with a 487 once the lookup completes, rather than routed.
+TEST_F(BGCFAsyncEnumTest, CancelledDuringLookup)
+{
+  SCOPED_TRACE("");
+  _async_enum_service.set_result("+4412345", "tel:+4412345;npdi;rn=+16505551234");
+
+  BGCFMessage msg;
+  msg._toscheme = "tel";
+  msg._to = "+4412345";
+  msg._todomain = "";
+
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+
+  // CANCEL gets OK'd, but nothing else happens until the lookup completes.
+  msg._method = "CANCEL";
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+  ASSERT_EQ(1u, _async_enum_service.num_pending());
+
+  _async_enum_service.complete_lookup();
+  process_queued_callbacks();
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(487).matches(current_txdata()->msg);
+  free_txdata();
+
+  // The ACK for the 487 is absorbed.
+  msg._method = "ACK";
+  inject_msg(msg.get_request());
+  poll();
+  ASSERT_EQ(0, txdata_count());
+}
+
+// Test that the BGCF only forwards statelessly when it can route the request
+// without waiting for an asynchronous ENUM lookup, and isn't sending ACRs.
+TEST_F(BGCFAsyncEnumTest, SupportsStateless)
+{
+  BGCFMessage msg;
+  msg._toscheme = "tel";
+  msg._to = "+4412345";
+  msg._todomain = "";
+  pjsip_msg* tel_req = parse_msg(msg.get_request());
+
+  BGCFMessage msg2;
+  msg2._to = "bob";
+  msg2._todomain = "awaydomain";
+  pjsip_msg* sip_req = parse_msg(msg2.get_request());
+
+  // The Tel URI needs an asynchronous ENUM lookup, but the SIP URI doesn't.
+  EXPECT_FALSE(_bgcf_sproutlet->supports_stateless(tel_req));
+  EXPECT_TRUE(_bgcf_sproutlet->supports_stateless(sip_req));
+
+  // ENUM lookups from a file don't block.
+  _bgcf_sproutlet->_enum_service = _enum_service;
+  EXPECT_TRUE(_bgcf_sproutlet->supports_stateless(tel_req));
+
+  // Nothing is forwarded statelessly if ACRs are being sent.
+  RalfACRFactory ralf_acr_factory(NULL, ACR::BGCF);
+  _bgcf_sproutlet->_acr_factory = &ralf_acr_factory;
+  EXPECT_FALSE(_bgcf_sproutlet->supports_stateless(tel_req));
+  EXPECT_FALSE(_bgcf_sproutlet->supports_stateless(sip_req));
+  _bgcf_sproutlet->_acr_factory = _acr_factory;
+}
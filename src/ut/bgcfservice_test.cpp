@@ -11,6 +11,8 @@
 
 #include <string>
 #include <vector>
+#include <thread>
+#include <atomic>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -106,6 +108,20 @@ TEST_F(BgcfServiceTest, DefaultRoute)
   ET("198.147.226.",               "sip.example.com"   ).test(bgcf_, RoutingType::DOMAIN_ROUTE);
 }
 
+TEST_F(BgcfServiceTest, WildcardDomainRoute)
+{
+  BgcfService bgcf_(string(UT_DIR).append("/test_bgcf_wildcard_domain.json"));
+
+  // Exact matches take priority, then the most specific wildcard, then the
+  // default route.
+  ET("pbx.foreign.example.com",    "sip3.example.com"   ).test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("other.foreign.example.com",  "sip2.example.com"   ).test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("a.b.foreign.example.com",    "sip2.example.com"   ).test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("foreign.example.com",        "sip.example.com"    ).test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("example.com",                "default.example.com").test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("example.org",                "default.example.com").test(bgcf_, RoutingType::DOMAIN_ROUTE);
+}
+
 TEST_F(BgcfServiceTest, ParseError)
 {
   BgcfService bgcf_(string(UT_DIR).append("/test_bgcf_parse_error.json"));
@@ -161,3 +177,35 @@ TEST_F(BgcfServiceTest, NumberRouteTests)
   ET("+654-(3.21)", "sip3.example.com").test(bgcf_, RoutingType::NUMBER_ROUTE);
   ET("+654!-(321)", "").test(bgcf_, RoutingType::NUMBER_ROUTE);
 }
+
+TEST_F(BgcfServiceTest, ReloadDuringLookups)
+{
+  string file1 = string(UT_DIR).append("/test_bgcf.json");
+  string file2 = string(UT_DIR).append("/test_bgcf_default_route.json");
+  BgcfService bgcf_(file1);
+
+  // Keep swapping between two configurations while looking up routes.  Every
+  // lookup sees one complete configuration or the other.
+  std::atomic<bool> done(false);
+  std::thread reloader([&]()
+  {
+    for (int ii = 0; !done; ++ii)
+    {
+      bgcf_._configuration = (ii % 2 == 0) ? file2 : file1;
+      bgcf_.update_routes();
+    }
+  });
+
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    EXPECT_EQ(vector<string>({"ec2-54-243-253-10.compute-1.amazonaws.com"}),
+              bgcf_.get_route_from_domain("198.147.226.2", 0));
+
+    vector<string> route = bgcf_.get_route_from_domain("billy2", 0);
+    EXPECT_TRUE((route.empty()) ||
+                (route == vector<string>({"sip.example.com"})));
+  }
+
+  done = true;
+  reloader.join();
+}
@@ -10,6 +10,9 @@
  */
 
 #include <string>
+#include <future>
+#include <thread>
+#include <atomic>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -17,7 +20,9 @@
 #include "utils.h"
 #include "sas.h"
 #include "enumservice.h"
+#include "prefix_trie.h"
 #include "fakednsresolver.hpp"
+#include "fakenaptrserver.hpp"
 #include "fakelogger.h"
 #include "test_utils.hpp"
 #include "mockcommunicationmonitor.h"
@@ -89,6 +94,19 @@ TEST_F(DummyEnumServiceTest, SimpleTests)
   ET("+15108580277", "sip:+15108580277@ut.cw-ngv.com").test(enum_);
 }
 
+TEST_F(DummyEnumServiceTest, AsyncTest)
+{
+  // Services that don't support asynchronous lookups call back immediately.
+  DummyEnumService enum_("ut.cw-ngv.com");
+  EXPECT_FALSE(enum_.is_async());
+
+  std::string result;
+  enum_.lookup_uri_from_user_async("+15108580277",
+                                   0,
+                                   [&result](const std::string& uri) { result = uri; });
+  EXPECT_EQ("sip:+15108580277@ut.cw-ngv.com", result);
+}
+
 
 TEST_F(JSONEnumServiceTest, SimpleTests)
 {
@@ -188,6 +206,71 @@ TEST_F(JSONEnumServiceTest, PrefixMatching)
   // Matches to the most specific four-digits-prefix, rather than any rule
   // before or after it
   ET("+22228899", "tel:+22228899;four-digits-prefix-match;npdi").test(enum_);
+  // A number that is shorter than the configured prefixes matches the
+  // greatest prefix that extends it.
+  ET("+222", "tel:+222;four-digits-prefix-match;npdi").test(enum_);
+  ET("+23", "").test(enum_);
+}
+
+TEST_F(JSONEnumServiceTest, ReloadDuringLookups)
+{
+  // Work out what the two configurations translate a number to.
+  string file1 = string(UT_DIR).append("/test_enum.json");
+  string file2 = string(UT_DIR).append("/test_enum_prefix_matching.json");
+  JSONEnumService enum_(file2);
+  string uri2 = enum_.lookup_uri_from_user("+22238899", 0);
+  enum_._configuration = file1;
+  enum_.update_enum();
+  string uri1 = enum_.lookup_uri_from_user("+22238899", 0);
+  ASSERT_NE(uri1, uri2);
+
+  // Keep swapping between the configurations while looking the number up.
+  // Every lookup sees one complete configuration or the other.
+  std::atomic<bool> done(false);
+  std::thread reloader([&]()
+  {
+    for (int ii = 0; !done; ++ii)
+    {
+      enum_._configuration = (ii % 2 == 0) ? file2 : file1;
+      enum_.update_enum();
+    }
+  });
+
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    string uri = enum_.lookup_uri_from_user("+22238899", 0);
+    EXPECT_TRUE((uri == uri1) || (uri == uri2)) << uri;
+  }
+
+  done = true;
+  reloader.join();
+}
+
+// Test the prefix trie used for matching numbers to number ranges.
+TEST(PrefixTrieTest, Matching)
+{
+  PrefixTrie<int> trie;
+  EXPECT_TRUE(trie.insert("+22", 2));
+  EXPECT_TRUE(trie.insert("+2222", 4));
+  EXPECT_TRUE(trie.insert("+222", 3));
+  EXPECT_FALSE(trie.insert("+22", 5));
+  EXPECT_EQ(3u, trie.size());
+
+  EXPECT_EQ(3, *trie.longest_prefix_match("+22238899"));
+  EXPECT_EQ(2, *trie.longest_prefix_match("+22338899"));
+  EXPECT_EQ(4, *trie.longest_prefix_match("+22228899"));
+  EXPECT_TRUE(trie.longest_prefix_match("+2") == NULL);
+  EXPECT_TRUE(trie.longest_prefix_match("+33") == NULL);
+
+  EXPECT_EQ(4, *trie.last_with_prefix("+2"));
+  EXPECT_EQ(4, *trie.last_with_prefix("+222"));
+  EXPECT_TRUE(trie.last_with_prefix("+2223") == NULL);
+  EXPECT_TRUE(trie.insert("+2225", 5));
+  EXPECT_EQ(5, *trie.last_with_prefix("+22"));
+
+  // An empty prefix matches everything.
+  EXPECT_TRUE(trie.insert("", 1));
+  EXPECT_EQ(1, *trie.longest_prefix_match("+33"));
 }
 
 // Test if prefix matching correctly ignores all visual separators
@@ -440,3 +523,216 @@ TEST_F(DNSEnumServiceTest, PosixRegexTest)
   ET("1234", "").test(enum_);
 }
 
+
+TEST_F(DNSEnumServiceTest, CachedResultTest)
+{
+  // Results are cached for the TTL of the NAPTR records, so the second lookup
+  // doesn't query the ENUM server.
+  FakeDNSResolver::_ttl = 300;
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory());
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("+1234", "sip:+1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 1);
+  EXPECT_EQ(1u, enum_.cache_hits());
+  EXPECT_EQ(1u, enum_.cache_misses());
+}
+
+TEST_F(DNSEnumServiceTest, CachedNonTerminalRuleTest)
+{
+  FakeDNSResolver::_ttl = 300;
+  struct ares_naptr_reply naptr_reply[] = {{NULL, (unsigned char*)"", (unsigned char*)"e2u+sip", (unsigned char*)"!1234!5678!", ".", 1, 1}};
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)naptr_reply));
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("8.7.6.5.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory());
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+  EXPECT_EQ(2u, enum_.cache_hits());
+}
+
+TEST_F(DNSEnumServiceTest, ZeroTTLNotCachedTest)
+{
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory());
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+  EXPECT_EQ(0u, enum_.cache_hits());
+}
+
+TEST_F(DNSEnumServiceTest, NegativeCacheTest)
+{
+  // Domains that don't exist are only cached if there's a negative TTL.
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory());
+  ET("1234", "").test(enum_);
+  ET("1234", "").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+
+  FakeDNSResolver::_num_calls = 0;
+  DNSEnumService enum2_(_servers, ".e164.arpa", new FakeDNSResolverFactory(), NULL, 60);
+  ET("1234", "").test(enum2_);
+  ET("1234", "").test(enum2_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 1);
+  EXPECT_EQ(1u, enum2_.cache_hits());
+}
+
+TEST_F(DNSEnumServiceTest, ServerFailureNotCachedTest)
+{
+  DNSEnumService enum_(_servers, ".e164.arpa", new BrokenDNSResolverFactory(), NULL, 60);
+  ET("1234", "").test(enum_);
+  ET("1234", "").test(enum_);
+  EXPECT_EQ(0u, enum_.cache_hits());
+  EXPECT_EQ(2u, enum_.cache_misses());
+}
+
+TEST_F(DNSEnumServiceTest, CachedResultCommMonMockTest)
+{
+  // A lookup that is answered entirely from the cache doesn't talk to the
+  // ENUM server, so doesn't report anything to the communication monitor.
+  AlarmManager am;
+  MockCommunicationMonitor cm_(&am);
+  EXPECT_CALL(cm_, inform_success(_)).Times(1);
+  FakeDNSResolver::_ttl = 300;
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory(), &cm_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+}
+
+
+/// Fixture for tests of asynchronous lookups, which query a real (local) DNS
+/// server.
+class AsyncDNSEnumServiceTest : public EnumServiceTest
+{
+  AsyncDNSEnumServiceTest() : EnumServiceTest()
+  {
+    _servers.push_back("127.0.0.1");
+    _server.add_record("4.3.2.1.e164.arpa",
+                       {1, 1, "u", "e2u+sip", "!(^.*$)!sip:\\1@ut.cw-ngv.com!"});
+  }
+
+  /// Does an asynchronous lookup and waits for the result.
+  std::string lookup(const DNSEnumService& enum_, const std::string& user)
+  {
+    std::promise<std::string> result;
+    enum_.lookup_uri_from_user_async(user,
+                                     0,
+                                     [&result](const std::string& uri)
+                                     {
+                                       result.set_value(uri);
+                                     });
+    return result.get_future().get();
+  }
+
+  std::vector<std::string> _servers;
+  FakeNaptrServer _server;
+};
+
+TEST_F(AsyncDNSEnumServiceTest, BasicTest)
+{
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeNaptrServerResolverFactory(_server.port()));
+  EXPECT_TRUE(enum_.is_async());
+  EXPECT_EQ("sip:1234@ut.cw-ngv.com", lookup(enum_, "1234"));
+  EXPECT_EQ(1, _server._num_queries);
+}
+
+TEST_F(AsyncDNSEnumServiceTest, NonTerminalRuleTest)
+{
+  _server.add_record("8.7.6.5.e164.arpa", {1, 1, "", "e2u+sip", "!5678!1234!"});
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeNaptrServerResolverFactory(_server.port()));
+  EXPECT_EQ("sip:5678@ut.cw-ngv.com", lookup(enum_, "5678"));
+  EXPECT_EQ(2, _server._num_queries);
+}
+
+TEST_F(AsyncDNSEnumServiceTest, NotFoundTest)
+{
+  AlarmManager am;
+  MockCommunicationMonitor cm_(&am);
+  EXPECT_CALL(cm_, inform_success(_));
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeNaptrServerResolverFactory(_server.port()), &cm_);
+  EXPECT_EQ("", lookup(enum_, "5678"));
+}
+
+TEST_F(AsyncDNSEnumServiceTest, CachedResultTest)
+{
+  // Results from asynchronous lookups are cached (using the TTL from the
+  // response), and lookups that hit the cache call back immediately.
+  _server._ttl = 300;
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeNaptrServerResolverFactory(_server.port()));
+  EXPECT_EQ("sip:1234@ut.cw-ngv.com", lookup(enum_, "1234"));
+
+  std::string result;
+  enum_.lookup_uri_from_user_async("+1234",
+                                   0,
+                                   [&result](const std::string& uri) { result = uri; });
+  EXPECT_EQ("sip:+1234@ut.cw-ngv.com", result);
+  EXPECT_EQ(1, _server._num_queries);
+  EXPECT_EQ(1u, enum_.cache_hits());
+
+  // Synchronous lookups share the cache.
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(2u, enum_.cache_hits());
+}
+
+TEST_F(AsyncDNSEnumServiceTest, ConcurrentLookupsTest)
+{
+  // Lookups don't wait for each other.  The server holds on to its responses
+  // until it has received every query, which only happens if all the lookups
+  // are outstanding at once.
+  const int NUM_LOOKUPS = 10;
+  _server._hold = true;
+
+  for (int ii = 0; ii < NUM_LOOKUPS; ii++)
+  {
+    _server.add_record(std::to_string(ii) + ".5.5.5.e164.arpa",
+                       {1, 1, "u", "e2u+sip", "!(^.*$)!sip:\\1@ut.cw-ngv.com!"});
+  }
+
+  std::vector<std::promise<std::string>> results(NUM_LOOKUPS);
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeNaptrServerResolverFactory(_server.port()));
+
+  for (int ii = 0; ii < NUM_LOOKUPS; ii++)
+  {
+    std::promise<std::string>* result = &results[ii];
+    enum_.lookup_uri_from_user_async("555" + std::to_string(ii),
+                                     0,
+                                     [result](const std::string& uri)
+                                     {
+                                       result->set_value(uri);
+                                     });
+  }
+
+  // The timeout is only there so that a broken implementation fails rather
+  // than hanging - it's far longer than the lookups should ever take.
+  ASSERT_TRUE(_server.wait_for_queries(NUM_LOOKUPS, 10000));
+  _server._hold = false;
+
+  for (int ii = 0; ii < NUM_LOOKUPS; ii++)
+  {
+    EXPECT_EQ("sip:555" + std::to_string(ii) + "@ut.cw-ngv.com",
+              results[ii].get_future().get());
+  }
+
+  EXPECT_EQ(NUM_LOOKUPS, _server._num_queries);
+}
+
+TEST_F(AsyncDNSEnumServiceTest, DestroyWithLookupsOutstanding)
+{
+  // Lookups still waiting for the ENUM server when the service is destroyed
+  // complete (unsuccessfully).
+  _server._delay_ms = 5000;
+  std::promise<std::string> result;
+
+  {
+    DNSEnumService enum_(_servers, ".e164.arpa", new FakeNaptrServerResolverFactory(_server.port()));
+    enum_.lookup_uri_from_user_async("1234",
+                                     0,
+                                     [&result](const std::string& uri)
+                                     {
+                                       result.set_value(uri);
+                                     });
+  }
+
+  EXPECT_EQ("", result.get_future().get());
+}
@@ -0,0 +1,69 @@
+/**
+ * @file fakeenumservice.hpp Fake asynchronous ENUM service (for testing).
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FAKEENUMSERVICE_H__
+#define FAKEENUMSERVICE_H__
+
+#include <deque>
+#include <map>
+#include <string>
+#include "enumservice.h"
+
+/// An asynchronous ENUM service whose lookups don't complete until the test
+/// completes them, so that tests can control exactly what happens while a
+/// lookup is in progress.
+class FakeAsyncEnumService : public EnumService
+{
+public:
+  FakeAsyncEnumService() {}
+  virtual ~FakeAsyncEnumService() {}
+
+  /// Sets the URI that lookups for a user return.  Lookups for any other user
+  /// fail.
+  void set_result(const std::string& user, const std::string& uri)
+  {
+    _results[user] = uri;
+  }
+
+  std::string lookup_uri_from_user(const std::string& user,
+                                   SAS::TrailId trail) const
+  {
+    std::map<std::string, std::string>::const_iterator it =
+                                                        _results.find(user);
+    return (it != _results.end()) ? it->second : std::string();
+  }
+
+  void lookup_uri_from_user_async(const std::string& user,
+                                  SAS::TrailId trail,
+                                  LookupCallback callback) const
+  {
+    _pending.push_back(std::make_pair(user, callback));
+  }
+
+  bool is_async() const { return true; }
+
+  /// The number of lookups waiting to be completed.
+  size_t num_pending() const { return _pending.size(); }
+
+  /// Completes the oldest outstanding lookup (on the calling thread).
+  void complete_lookup()
+  {
+    std::pair<std::string, LookupCallback> lookup = _pending.front();
+    _pending.pop_front();
+    lookup.second(lookup_uri_from_user(lookup.first, 0));
+  }
+
+private:
+  std::map<std::string, std::string> _results;
+  mutable std::deque<std::pair<std::string, LookupCallback>> _pending;
+};
+
+#endif
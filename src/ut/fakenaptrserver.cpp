@@ -0,0 +1,266 @@
+/**
+ * @file fakenaptrserver.cpp Fake NAPTR server (for testing).
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <list>
+#include <algorithm>
+
+#include "fakenaptrserver.hpp"
+
+/// Appends a 16-bit value in network byte order.
+static void append_16(std::string& buf, int value)
+{
+  buf.push_back((char)((value >> 8) & 0xff));
+  buf.push_back((char)(value & 0xff));
+}
+
+/// Appends a 32-bit value in network byte order.
+static void append_32(std::string& buf, int value)
+{
+  append_16(buf, (value >> 16) & 0xffff);
+  append_16(buf, value & 0xffff);
+}
+
+/// Appends a DNS character-string.
+static void append_string(std::string& buf, const std::string& value)
+{
+  buf.push_back((char)value.length());
+  buf.append(value);
+}
+
+static long now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+FakeNaptrServer::FakeNaptrServer() :
+  _ttl(0),
+  _delay_ms(0),
+  _num_queries(0),
+  _hold(false),
+  _terminate(false)
+{
+  pthread_mutex_init(&_database_lock, NULL);
+  pthread_mutex_init(&_queries_lock, NULL);
+  pthread_cond_init(&_queries_cond, NULL);
+
+  _sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  bind(_sock, (struct sockaddr*)&addr, sizeof(addr));
+
+  socklen_t addr_len = sizeof(addr);
+  getsockname(_sock, (struct sockaddr*)&addr, &addr_len);
+  _port = ntohs(addr.sin_port);
+
+  pthread_create(&_thread, NULL, &FakeNaptrServer::thread_fn, this);
+}
+
+FakeNaptrServer::~FakeNaptrServer()
+{
+  _terminate = true;
+  pthread_join(_thread, NULL);
+  close(_sock);
+  pthread_cond_destroy(&_queries_cond);
+  pthread_mutex_destroy(&_queries_lock);
+  pthread_mutex_destroy(&_database_lock);
+}
+
+bool FakeNaptrServer::wait_for_queries(int num_queries, int timeout_ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&_queries_lock);
+  int rc = 0;
+  while ((_num_queries < num_queries) && (rc == 0))
+  {
+    rc = pthread_cond_timedwait(&_queries_cond, &_queries_lock, &deadline);
+  }
+  bool received = (_num_queries >= num_queries);
+  pthread_mutex_unlock(&_queries_lock);
+
+  return received;
+}
+
+void* FakeNaptrServer::thread_fn(void* arg)
+{
+  ((FakeNaptrServer*)arg)->run();
+  return NULL;
+}
+
+void FakeNaptrServer::run()
+{
+  // Responses waiting for their delay to pass, in the order they are due.
+  struct PendingResponse
+  {
+    long due_ms;
+    std::string response;
+    struct sockaddr_in addr;
+  };
+  std::list<PendingResponse> pending;
+
+  while (!_terminate)
+  {
+    // Send any responses that are due.
+    long now = now_ms();
+    while ((!_hold) && (!pending.empty()) && (pending.front().due_ms <= now))
+    {
+      PendingResponse& rsp = pending.front();
+      sendto(_sock,
+             rsp.response.data(),
+             rsp.response.length(),
+             0,
+             (struct sockaddr*)&rsp.addr,
+             sizeof(rsp.addr));
+      pending.pop_front();
+    }
+
+    // Wait for a query, but wake up regularly to check for termination.
+    int timeout_ms = 10;
+    if ((!_hold) && (!pending.empty()))
+    {
+      timeout_ms = std::max(0, std::min(timeout_ms,
+                                        (int)(pending.front().due_ms - now)));
+    }
+
+    struct pollfd fd = {_sock, POLLIN, 0};
+    if (poll(&fd, 1, timeout_ms) > 0)
+    {
+      unsigned char query[512];
+      PendingResponse rsp;
+      socklen_t addr_len = sizeof(rsp.addr);
+      int len = recvfrom(_sock,
+                         query,
+                         sizeof(query),
+                         0,
+                         (struct sockaddr*)&rsp.addr,
+                         &addr_len);
+      if (len > 0)
+      {
+        rsp.response = build_response(query, len);
+        rsp.due_ms = now_ms() + _delay_ms;
+        if (!rsp.response.empty())
+        {
+          // Every response has the same delay, so the list stays in order.
+          pending.push_back(rsp);
+        }
+
+        pthread_mutex_lock(&_queries_lock);
+        _num_queries++;
+        pthread_cond_broadcast(&_queries_cond);
+        pthread_mutex_unlock(&_queries_lock);
+      }
+    }
+  }
+}
+
+std::string FakeNaptrServer::build_response(const unsigned char* query, int len)
+{
+  if (len < NS_HFIXEDSZ)
+  {
+    return std::string();
+  }
+
+  // Parse the domain out of the question.
+  std::string domain;
+  int offset = NS_HFIXEDSZ;
+  while ((offset < len) && (query[offset] != 0))
+  {
+    int label_len = query[offset++];
+    if (offset + label_len > len)
+    {
+      return std::string();
+    }
+    if (!domain.empty())
+    {
+      domain.push_back('.');
+    }
+    domain.append((const char*)&query[offset], label_len);
+    offset += label_len;
+  }
+
+  // Skip the terminating label, type and class.
+  int question_end = offset + 1 + NS_QFIXEDSZ;
+  if (question_end > len)
+  {
+    return std::string();
+  }
+
+  std::vector<Record> records;
+  pthread_mutex_lock(&_database_lock);
+  std::map<std::string, std::vector<Record>>::const_iterator it =
+                                                         _database.find(domain);
+  bool found = (it != _database.end());
+  if (found)
+  {
+    records = it->second;
+  }
+  pthread_mutex_unlock(&_database_lock);
+
+  // Header - copy the ID, and set QR, RD and RA.
+  std::string rsp;
+  rsp.append((const char*)query, 2);
+  append_16(rsp, found ? 0x8180 : (0x8180 | ns_r_nxdomain));
+  append_16(rsp, 1);
+  append_16(rsp, records.size());
+  append_16(rsp, 0);
+  append_16(rsp, 0);
+
+  // Question, copied from the query.
+  rsp.append((const char*)&query[NS_HFIXEDSZ], question_end - NS_HFIXEDSZ);
+
+  for (const Record& record : records)
+  {
+    // Name (a pointer to the question), type, class and TTL.
+    append_16(rsp, 0xc000 | NS_HFIXEDSZ);
+    append_16(rsp, ns_t_naptr);
+    append_16(rsp, ns_c_in);
+    append_32(rsp, _ttl);
+
+    std::string rdata;
+    append_16(rdata, record.order);
+    append_16(rdata, record.preference);
+    append_string(rdata, record.flags);
+    append_string(rdata, record.service);
+    append_string(rdata, record.regexp);
+    // Replacement (always the root domain).
+    rdata.push_back('\0');
+
+    append_16(rsp, rdata.length());
+    rsp.append(rdata);
+  }
+
+  return rsp;
+}
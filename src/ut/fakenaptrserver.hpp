@@ -0,0 +1,98 @@
+/**
+ * @file fakenaptrserver.hpp Header file for a fake NAPTR server (for testing).
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include "dnsresolver.h"
+
+/// A DNS server listening on UDP on an ephemeral port on 127.0.0.1, which
+/// answers NAPTR queries from its database (and returns NXDOMAIN for any
+/// other domain).  Responses can be delayed, to simulate a slow ENUM server,
+/// without holding up other queries, or held until the test releases them.
+class FakeNaptrServer
+{
+public:
+  struct Record
+  {
+    int order;
+    int preference;
+    std::string flags;
+    std::string service;
+    std::string regexp;
+  };
+
+  FakeNaptrServer();
+  ~FakeNaptrServer();
+
+  /// The port the server is listening on.
+  int port() const { return _port; }
+
+  /// Adds a record to the database.
+  void add_record(const std::string& domain, const Record& record)
+  {
+    pthread_mutex_lock(&_database_lock);
+    _database[domain].push_back(record);
+    pthread_mutex_unlock(&_database_lock);
+  }
+
+  // TTL to return with each record.
+  std::atomic<int> _ttl;
+  // How long to wait (in milliseconds) before responding to each query.
+  std::atomic<int> _delay_ms;
+  // Number of queries received so far.
+  std::atomic<int> _num_queries;
+  // Whether to hold on to responses (rather than sending them when due).
+  std::atomic<bool> _hold;
+
+  /// Waits until the server has received at least num_queries queries.
+  ///
+  /// @return - Whether it did so within timeout_ms.
+  bool wait_for_queries(int num_queries, int timeout_ms);
+
+private:
+  static void* thread_fn(void* arg);
+  void run();
+
+  // Builds the response to a query.  Returns an empty string if the query
+  // can't be parsed.
+  std::string build_response(const unsigned char* query, int len);
+
+  pthread_mutex_t _database_lock;
+  pthread_mutex_t _queries_lock;
+  pthread_cond_t _queries_cond;
+  std::map<std::string, std::vector<Record>> _database;
+  int _sock;
+  int _port;
+  pthread_t _thread;
+  std::atomic<bool> _terminate;
+};
+
+/// DNSResolverFactory that creates asynchronous resolvers which query a
+/// FakeNaptrServer.
+class FakeNaptrServerResolverFactory : public DNSResolverFactory
+{
+public:
+  FakeNaptrServerResolverFactory(int port) : _port(port) {}
+
+  virtual AsyncDNSResolver* new_async_resolver(const std::vector<struct IP46Address>& servers) const
+  {
+    return new AsyncDNSResolver(servers, _port);
+  }
+
+private:
+  int _port;
+};
@@ -17,14 +17,18 @@
 
 #include "stack.h"
 #include "utils.h"
+#include "pjutils.h"
 #include "siptest.hpp"
 #include "dialog_tracker.hpp"
 #include "snmp_scalar.h"
+#include "test_interposer.hpp"
 
 using namespace std;
 
 //This can only be statically initialised in UT, because we're stubbing out netsnmp - in production code, net-snmp needs to be initialized before creating any tables
 static SNMP::U32Scalar fake_connection_count("", "");
+static SNMP::U32Scalar fake_lock_acquisitions("", "");
+static SNMP::U32Scalar fake_lock_contentions("", "");
 
 /// Fixture for IfcHandlerTest
 class FlowTest : public SipTest
@@ -39,7 +43,10 @@ public:
   {
     SipTest::SetUpTestCase();
     qm = NULL;
-    ft = new FlowTable(qm, &fake_connection_count);
+    ft = new FlowTable(qm,
+                       &fake_connection_count,
+                       &fake_lock_acquisitions,
+                       &fake_lock_contentions);
     addr.addr.sa_family = PJ_AF_INET;
   }
 
@@ -131,3 +138,98 @@ TEST_F(FlowTest, FlowUnQuiesceMidDialog)
   EXPECT_FALSE(flow->should_quiesce());
 }
 
+
+TEST_F(FlowTest, FindFlows)
+{
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+  FlowTable::Stats before = ft->stats();
+  EXPECT_EQ(1u, before.flows);
+
+  // The flow can be found by its address and by its token.
+  Flow* flow_by_addr = ft->find_flow(tp, &addr);
+  EXPECT_EQ(flow, flow_by_addr);
+  flow_by_addr->dec_ref();
+
+  Flow* flow_by_token = ft->find_flow(flow->token());
+  EXPECT_EQ(flow, flow_by_token);
+  flow_by_token->dec_ref();
+
+  EXPECT_TRUE(ft->find_flow(std::string("unknown")) == NULL);
+
+  // A different remote port is a different flow.
+  pj_sockaddr addr2 = addr;
+  pj_sockaddr_set_port(&addr2, 5061);
+  EXPECT_TRUE(ft->find_flow(tp, &addr2) == NULL);
+  Flow* flow2 = ft->find_create_flow(tp, &addr2);
+  EXPECT_NE(flow, flow2);
+  EXPECT_EQ(flow2, ft->find_flow(flow2->token()));
+  flow2->dec_ref();
+  EXPECT_EQ(2u, ft->stats().flows);
+
+  ft->remove_flow(flow2);
+  EXPECT_TRUE(ft->find_flow(tp, &addr2) == NULL);
+
+  // Every lookup took a shard lock, none of which were contended.
+  FlowTable::Stats after = ft->stats();
+  EXPECT_EQ(1u, after.flows);
+  EXPECT_GT(after.lock_acquisitions, before.lock_acquisitions);
+  EXPECT_EQ(before.lock_contentions, after.lock_contentions);
+}
+
+TEST_F(FlowTest, LockStatsReported)
+{
+  // The shard lock statistics are reported to SNMP when the flows are swept.
+  Flow* flow_by_token = ft->find_flow(flow->token());
+  flow_by_token->dec_ref();
+
+  ft->sweep();
+  FlowTable::Stats stats = ft->stats();
+  EXPECT_GT(stats.lock_acquisitions, 0u);
+  EXPECT_EQ((uint32_t)stats.lock_acquisitions, fake_lock_acquisitions.value);
+  EXPECT_EQ((uint32_t)stats.lock_contentions, fake_lock_contentions.value);
+}
+
+TEST_F(FlowTest, IdentityExpiry)
+{
+  pjsip_uri* uri = PJUtils::uri_from_string("sip:alice@homedomain", stack_data.pool);
+  flow->set_identity(uri, "", true, 60);
+  EXPECT_EQ("sip:alice@homedomain", flow->default_identity());
+
+  // Touching the flow doesn't affect the identity's expiry, which includes
+  // a grace period.
+  cwtest_advance_time_ms(60000L);
+  flow->touch();
+  poll();
+  EXPECT_EQ("sip:alice@homedomain", flow->default_identity());
+
+  cwtest_advance_time_ms(31000L);
+  poll();
+  EXPECT_EQ("", flow->default_identity());
+}
+
+TEST_F(FlowTest, TouchedFlowSurvivesSweep)
+{
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+
+  // Create a second flow, which won't be touched.
+  pj_sockaddr addr2 = addr;
+  pj_sockaddr_set_port(&addr2, 5062);
+  Flow* idle_flow = ft->find_create_flow(tp, &addr2);
+  idle_flow->dec_ref();
+
+  // Touch the first flow shortly before it would become idle, then sweep
+  // once both flows' original idle timeouts have passed.
+  cwtest_advance_time_ms((Flow::IDLE_TIMEOUT - 10) * 1000L);
+  flow->touch();
+  cwtest_advance_time_ms(20 * 1000L);
+  ft->sweep();
+
+  // The touched flow is still in the table, but the idle one has gone.
+  Flow* flow_by_addr = ft->find_flow(tp, &addr);
+  EXPECT_EQ(flow, flow_by_addr);
+  if (flow_by_addr != NULL)
+  {
+    flow_by_addr->dec_ref();
+  }
+  EXPECT_TRUE(ft->find_flow(tp, &addr2) == NULL);
+}
@@ -695,6 +695,37 @@ TEST_F(DeregistrationTaskTest, SubscriberDataManagerFailureTest)
   _task->run();
 }
 
+// Test that, as when the AoRs were deregistered one at a time, the AoRs
+// after one that can't be read are left alone.
+TEST_F(DeregistrationTaskTest, SubscriberDataManagerFailureStopsDeregistration)
+{
+  // Build the request
+  std::string body = "{\"registrations\": [{\"primary-impu\": \"sip:6505552001@homedomain\"}, {\"primary-impu\": \"sip:6505552002@homedomain\"}, {\"primary-impu\": \"sip:6505552003@homedomain\"}]}";
+  build_dereg_request(body, "false");
+
+  // The first AoR is deregistered, the second can't be read and the third is
+  // read (as the reads are batched) but not written.
+  std::string aor_id_1 = "sip:6505552001@homedomain";
+  std::string aor_id_2 = "sip:6505552002@homedomain";
+  std::string aor_id_3 = "sip:6505552003@homedomain";
+  SubscriberDataManager::AoR* aor_1 = new SubscriberDataManager::AoR(aor_id_1);
+  SubscriberDataManager::AoR* aor_11 = new SubscriberDataManager::AoR(*aor_1);
+  SubscriberDataManager::AoRPair* aor_pair_1 = new SubscriberDataManager::AoRPair(aor_1, aor_11);
+  SubscriberDataManager::AoR* aor_3 = new SubscriberDataManager::AoR(aor_id_3);
+  SubscriberDataManager::AoR* aor_33 = new SubscriberDataManager::AoR(*aor_3);
+  SubscriberDataManager::AoRPair* aor_pair_3 = new SubscriberDataManager::AoRPair(aor_3, aor_33);
+
+  EXPECT_CALL(*_subscriber_data_manager, get_aor_data(aor_id_1, _)).WillOnce(Return(aor_pair_1));
+  EXPECT_CALL(*_subscriber_data_manager, get_aor_data(aor_id_2, _)).WillOnce(Return((SubscriberDataManager::AoRPair*)NULL));
+  EXPECT_CALL(*_subscriber_data_manager, get_aor_data(aor_id_3, _)).WillOnce(Return(aor_pair_3));
+  EXPECT_CALL(*_subscriber_data_manager, set_aor_data(aor_id_1, _, _, _, _)).WillOnce(Return(Store::OK));
+  EXPECT_CALL(*_subscriber_data_manager, set_aor_data(aor_id_3, _, _, _, _)).Times(0);
+
+  // Run the task
+  EXPECT_CALL(*_httpstack, send_reply(_, 500, _));
+  _task->run();
+}
+
 // Test that an invalid SIP URI doesn't get sent on third party registers.
 TEST_F(DeregistrationTaskTest, InvalidIMPUTest)
 {
@@ -1117,6 +1148,38 @@ TEST_F(AuthTimeoutTest, NonceTimedOutWithEmptyCorrelator)
   delete impi; impi = NULL;
 }
 
+// This tests the case where a stateless challenge was never responded to, so
+// was never written to the store.
+TEST_F(AuthTimeoutTest, StatelessNonceTimedOut)
+{
+  fake_hss->set_impu_result("sip:6505550231@homedomain", "dereg-auth-timeout", RegDataXMLUtils::STATE_REGISTERED, "", "?private_id=6505550231%40homedomain");
+
+  std::string body = "{\"impu\": \"sip:6505550231@homedomain\", \"impi\": \"6505550231@homedomain\", \"nonce\": \"abcdef\", \"stateless\": true}";
+  int status = handler->handle_response(body);
+
+  ASSERT_EQ(status, 200);
+  ASSERT_TRUE(fake_hss->url_was_requested("/impu/sip%3A6505550231%40homedomain/reg-data?private_id=6505550231%40homedomain", "{\"reqtype\": \"dereg-auth-timeout\", \"server_name\": \"sip:scscf.sprout.homedomain:5058;transport=TCP\"}"));
+}
+
+// This tests the case where a stateless challenge was responded to, so was
+// written to the store when it was used.
+TEST_F(AuthTimeoutTest, StatelessNonceUsed)
+{
+  ImpiStore::Impi* impi = new ImpiStore::Impi("test@example.com");
+  ImpiStore::DigestAuthChallenge* auth_challenge = new ImpiStore::DigestAuthChallenge("abcdef", "example.com", "auth", "ha1", time(NULL) + 30);
+  auth_challenge->nonce_count++;
+  impi->auth_challenges.push_back(auth_challenge);
+  store->set_impi(impi, 0);
+
+  std::string body = "{\"impu\": \"sip:test@example.com\", \"impi\": \"test@example.com\", \"nonce\": \"abcdef\", \"stateless\": true}";
+  int status = handler->handle_response(body);
+
+  ASSERT_EQ(status, 200);
+  ASSERT_FALSE(fake_hss->url_was_requested("/impu/sip%3Atest%40example.com/reg-data?private_id=test%40example.com", "{\"reqtype\": \"dereg-auth-timeout\"}"));
+
+  delete impi; impi = NULL;
+}
+
 TEST_F(AuthTimeoutTest, MainlineTest)
 {
   ImpiStore::Impi* impi = new ImpiStore::Impi("test@example.com");
@@ -1374,6 +1374,76 @@ TEST_F(IfcHandlerTest, SIPHeaderBadRegex)
   EXPECT_TRUE(log2.contains("Invalid regular expression in Content element for SIPHeader service point trigger"));
 }
 
+// Test that the per-message SPT cache evaluates each distinct SIPHeader
+// trigger once, and gives the same answers as evaluating them individually.
+TEST_F(IfcHandlerTest, SPTMatchCache)
+{
+  SPTMatchCache cache(TEST_MSG);
+  std::string content_match = ".*5755550018.*";
+  std::string content_mismatch = ".*111111.*";
+  std::string empty_content = "";
+  std::string bad_content = "?";
+
+  EXPECT_EQ(SPTMatchCache::MATCH, cache.header_matches("Contact", NULL));
+  EXPECT_EQ(SPTMatchCache::MATCH, cache.header_matches("contact", NULL));
+  EXPECT_EQ(SPTMatchCache::NO_MATCH, cache.header_matches("Contaaaaaact", NULL));
+  EXPECT_EQ(SPTMatchCache::MATCH, cache.header_matches("Contact", &content_match));
+  EXPECT_EQ(SPTMatchCache::NO_MATCH, cache.header_matches("Contact", &content_mismatch));
+  EXPECT_EQ(SPTMatchCache::MATCH, cache.header_matches("Contact", &empty_content));
+  EXPECT_EQ(SPTMatchCache::NO_MATCH, cache.header_matches("Accept", &content_mismatch));
+  EXPECT_EQ(SPTMatchCache::INVALID_HEADER_REGEX, cache.header_matches("*", NULL));
+  EXPECT_EQ(SPTMatchCache::INVALID_CONTENT_REGEX, cache.header_matches(".*", &bad_content));
+
+  // An invalid content regex is not reported if no header names match.
+  EXPECT_EQ(SPTMatchCache::NO_MATCH, cache.header_matches("Contaaaaaact", &bad_content));
+
+  // Repeating triggers doesn't cause them to be evaluated again.
+  size_t evaluated = cache.triggers_evaluated();
+  EXPECT_EQ(SPTMatchCache::MATCH, cache.header_matches("Contact", NULL));
+  EXPECT_EQ(SPTMatchCache::MATCH, cache.header_matches("Contact", &content_match));
+  EXPECT_EQ(evaluated, cache.triggers_evaluated());
+}
+
+// Test that identical SIPHeader triggers in multiple iFCs in the same
+// service profile all fire.
+TEST_F(IfcHandlerTest, RepeatedHeaderTriggers)
+{
+  std::string ifc("    <InitialFilterCriteria>\n"
+                  "    <Priority>$1</Priority>\n"
+                  "    <TriggerPoint>\n"
+                  "    <ConditionTypeCNF>1</ConditionTypeCNF>\n"
+                  "    <SPT>\n"
+                  "      <ConditionNegated>0</ConditionNegated>\n"
+                  "      <Group>0</Group>\n"
+                  "      <SIPHeader><Header>Contact</Header><Content>.*5755550018.*</Content></SIPHeader>\n"
+                  "    </SPT>\n"
+                  "  </TriggerPoint>\n"
+                  "  <ApplicationServer>\n"
+                  "    <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                  "    <DefaultHandling>0</DefaultHandling>\n"
+                  "  </ApplicationServer>\n"
+                  "  </InitialFilterCriteria>\n");
+  std::string sp = "<ServiceProfile>\n" +
+                   boost::replace_all_copy(ifc, "$1", "1") +
+                   boost::replace_all_copy(ifc, "$1", "2") +
+                   boost::replace_all_copy(ifc, "$1", "3") +
+                   "</ServiceProfile>";
+
+  std::shared_ptr<rapidxml::xml_document<> > root (new rapidxml::xml_document<>);
+  char* cstr_ifc = strdup(sp.c_str());
+  root->parse<0>(cstr_ifc);
+  Ifcs ifcs(root, root->first_node("ServiceProfile"), NULL, 0);
+  std::vector<AsInvocation> application_servers;
+  ifcs.interpret(SessionCase::Originating,
+                 true,
+                 false,
+                 TEST_MSG,
+                 application_servers,
+                 0);
+  free(cstr_ifc);
+  EXPECT_EQ(3u, application_servers.size());
+}
+
 TEST_F(IfcHandlerTest, ReqURIMatch)
 {
   doTest("",
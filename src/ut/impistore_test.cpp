@@ -38,8 +38,9 @@ public:
 class LiveImpiStoreImpl : public ImpiStoreImpl
 {
 public:
-  LiveImpiStoreImpl(ImpiStore* store) : _store(store) {};
-  virtual ~LiveImpiStoreImpl() {delete _store;};
+  LiveImpiStoreImpl(ImpiStore* store, ParallelStoreOps* parallel_ops = NULL) :
+    _store(store), _parallel_ops(parallel_ops) {};
+  virtual ~LiveImpiStoreImpl() {delete _store; delete _parallel_ops;};
   virtual Store::Status set_impi(ImpiStore::Impi* impi)
   {
     return _store->set_impi(impi, 0L);
@@ -58,6 +59,7 @@ public:
   };
 private:
   ImpiStore* _store;
+  ParallelStoreOps* _parallel_ops;
 };
 
 class LiveImpiStoreImplImpi : public LiveImpiStoreImpl
@@ -72,6 +74,14 @@ public:
   LiveImpiStoreImplAvImpi(Store* store) : LiveImpiStoreImpl(new ImpiStore(store, ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI)) {};
 };
 
+class LiveImpiStoreImplAvImpiParallel : public LiveImpiStoreImpl
+{
+public:
+  LiveImpiStoreImplAvImpiParallel(Store* store) : LiveImpiStoreImplAvImpiParallel(store, new ParallelStoreOps(2, NULL)) {};
+private:
+  LiveImpiStoreImplAvImpiParallel(Store* store, ParallelStoreOps* parallel_ops) : LiveImpiStoreImpl(new ImpiStore(store, ImpiStore::Mode::READ_AV_IMPI_WRITE_AV_IMPI, parallel_ops), parallel_ops) {};
+};
+
 class LiveImpiStoreImplAvLostImpi : public LiveImpiStoreImplAvImpi
 {
 public:
@@ -208,6 +218,7 @@ public:
 
 typedef ::testing::Types<
   LiveImpiStoreImplAvImpi,
+  LiveImpiStoreImplAvImpiParallel,
   LiveImpiStoreImplImpi
 > OneStoreScenarios;
 
@@ -235,6 +246,34 @@ TYPED_TEST(ImpiOneStoreTest, SetGetWithNonce)
   delete impi1;
 }
 
+TYPED_TEST(ImpiOneStoreTest, SetGetDeleteMultipleChallenges)
+{
+  ImpiStore::Impi* impi1 = example_impi_digest_aka();
+  Store::Status status = this->impi_store->set_impi(impi1);
+  ASSERT_EQ(Store::Status::OK, status);
+  ImpiStore::Impi* impi2 = this->impi_store->get_impi_with_nonce(IMPI, NONCE2);
+  expect_impis_equal(impi1, impi2);
+
+  // Remove one of the challenges and write the IMPI back.
+  delete impi2->auth_challenges[0];
+  impi2->auth_challenges.erase(impi2->auth_challenges.begin());
+  status = this->impi_store->set_impi(impi2);
+  ASSERT_EQ(Store::Status::OK, status);
+  ImpiStore::Impi* impi3 = this->impi_store->get_impi(IMPI);
+  expect_impis_equal(impi2, impi3);
+
+  // Now delete the whole IMPI.
+  status = this->impi_store->delete_impi(impi3);
+  ASSERT_EQ(Store::Status::OK, status);
+  ImpiStore::Impi* impi4 = this->impi_store->get_impi_with_nonce(IMPI, NONCE2);
+  ASSERT_TRUE(impi4 != NULL);
+  EXPECT_EQ(0u, impi4->auth_challenges.size());
+  delete impi4;
+  delete impi3;
+  delete impi2;
+  delete impi1;
+}
+
 TYPED_TEST(ImpiOneStoreTest, SetGetFailure)
 {
   ImpiStore::Impi* impi1 = example_impi_digest();
@@ -292,7 +331,9 @@ typedef ::testing::Types<
   TwoStoreScenarioTemplate<LiveImpiStoreImplAvImpi, LiveImpiStoreImplAvImpi>,
   TwoStoreScenarioTemplate<LiveImpiStoreImplAvImpi, LiveImpiStoreImplImpi>,
   TwoStoreScenarioTemplate<LiveImpiStoreImplImpi, LiveImpiStoreImplAvImpi>,
-  TwoStoreScenarioTemplate<LiveImpiStoreImplImpi, LiveImpiStoreImplImpi>
+  TwoStoreScenarioTemplate<LiveImpiStoreImplImpi, LiveImpiStoreImplImpi>,
+  TwoStoreScenarioTemplate<LiveImpiStoreImplAvImpiParallel, LiveImpiStoreImplAvImpi>,
+  TwoStoreScenarioTemplate<LiveImpiStoreImplAvImpi, LiveImpiStoreImplAvImpiParallel>
 > TwoStoreScenarios;
 
 TYPED_TEST_CASE(ImpiTwoStoreTest, TwoStoreScenarios);
@@ -396,7 +437,8 @@ typedef ::testing::Types<
   TwoStoreScenarioTemplate<LiveImpiStoreImplAvImpi, LiveImpiStoreImplImpi>,
   TwoStoreScenarioTemplate<LiveImpiStoreImplImpi, LiveImpiStoreImplAvImpi>,
   TwoStoreScenarioTemplate<LiveImpiStoreImplImpi, LiveImpiStoreImplImpi>,
-  TwoStoreScenarioTemplate<LiveImpiStoreImplAvLostImpi, LiveImpiStoreImplAvImpi>
+  TwoStoreScenarioTemplate<LiveImpiStoreImplAvLostImpi, LiveImpiStoreImplAvImpi>,
+  TwoStoreScenarioTemplate<LiveImpiStoreImplAvLostImpi, LiveImpiStoreImplAvImpiParallel>
 > TwoStoreLostImpiScenarios;
 
 TYPED_TEST_CASE(ImpiTwoStoreLostImpiTest, TwoStoreLostImpiScenarios);
@@ -0,0 +1,99 @@
+/**
+ * @file ip_prefix_trie_test.cpp UT for the IP subnet trie.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "ip_prefix_trie.h"
+
+using namespace std;
+
+/// Fixture for IPPrefixTrieTest.
+class IPPrefixTrieTest : public ::testing::Test
+{
+public:
+  static bool contains(const IPPrefixTrie& trie, const string& address)
+  {
+    pj_str_t host;
+    pj_cstr(&host, address.c_str());
+    pj_sockaddr addr;
+    EXPECT_EQ(PJ_SUCCESS, pj_sockaddr_parse(pj_AF_UNSPEC(), 0, &host, &addr));
+    return trie.contains(addr);
+  }
+};
+
+TEST_F(IPPrefixTrieTest, Hosts)
+{
+  IPPrefixTrie trie;
+  EXPECT_TRUE(trie.empty());
+  EXPECT_FALSE(contains(trie, "10.7.7.10"));
+
+  EXPECT_TRUE(trie.insert("10.7.7.10"));
+  EXPECT_TRUE(trie.insert("10.7.7.11"));
+  EXPECT_TRUE(trie.insert("2001:db8::1"));
+  EXPECT_EQ(3u, trie.size());
+
+  EXPECT_TRUE(contains(trie, "10.7.7.10"));
+  EXPECT_TRUE(contains(trie, "10.7.7.11"));
+  EXPECT_FALSE(contains(trie, "10.7.7.12"));
+  EXPECT_TRUE(contains(trie, "2001:db8::1"));
+  EXPECT_FALSE(contains(trie, "2001:db8::2"));
+
+  // The port is ignored.
+  EXPECT_TRUE(contains(trie, "10.7.7.10:5060"));
+  EXPECT_TRUE(contains(trie, "[2001:db8::1]:5060"));
+}
+
+TEST_F(IPPrefixTrieTest, Subnets)
+{
+  IPPrefixTrie trie;
+  EXPECT_TRUE(trie.insert("10.1.0.0/16"));
+  EXPECT_TRUE(trie.insert("192.168.1.128/25"));
+  EXPECT_TRUE(trie.insert("2001:db8::/32"));
+
+  // Bits beyond the prefix length are ignored.
+  EXPECT_TRUE(trie.insert("172.16.5.5/12"));
+
+  EXPECT_TRUE(contains(trie, "10.1.0.0"));
+  EXPECT_TRUE(contains(trie, "10.1.255.255"));
+  EXPECT_FALSE(contains(trie, "10.2.0.1"));
+  EXPECT_TRUE(contains(trie, "192.168.1.200"));
+  EXPECT_FALSE(contains(trie, "192.168.1.127"));
+  EXPECT_TRUE(contains(trie, "172.31.0.1"));
+  EXPECT_FALSE(contains(trie, "172.32.0.1"));
+  EXPECT_TRUE(contains(trie, "2001:db8:ffff::1"));
+  EXPECT_FALSE(contains(trie, "2001:db9::1"));
+
+  // IPv4 and IPv6 addresses don't match each other's subnets.
+  EXPECT_FALSE(contains(trie, "::a01:1"));
+
+  // A zero-length prefix matches every address of its family.
+  EXPECT_TRUE(trie.insert("0.0.0.0/0"));
+  EXPECT_TRUE(contains(trie, "8.8.8.8"));
+  EXPECT_FALSE(contains(trie, "::1"));
+
+  // Adding a subnet twice doesn't count it twice.
+  EXPECT_EQ(5u, trie.size());
+  EXPECT_TRUE(trie.insert("10.1.0.0/16"));
+  EXPECT_EQ(5u, trie.size());
+}
+
+TEST_F(IPPrefixTrieTest, Invalid)
+{
+  IPPrefixTrie trie;
+  EXPECT_FALSE(trie.insert("[2001:db8::1"));
+  EXPECT_FALSE(trie.insert("10.1.0.0/"));
+  EXPECT_FALSE(trie.insert("10.1.0.0/abc"));
+  EXPECT_FALSE(trie.insert("10.1.0.0/33"));
+  EXPECT_FALSE(trie.insert("10.1.0.0/-1"));
+  EXPECT_FALSE(trie.insert("2001:db8::/129"));
+  EXPECT_TRUE(trie.empty());
+}
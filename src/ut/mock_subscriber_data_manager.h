@@ -29,6 +29,34 @@ public:
                                            SAS::TrailId trail,
                                            bool& all_bindings_expired));
   MOCK_METHOD0(has_servers, bool());
+
+  // The multi-AoR operations are implemented in terms of the mocked single
+  // AoR operations, so that tests can set expectations per AoR.
+  std::vector<AoRPair*> get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                           SAS::TrailId trail) override
+  {
+    std::vector<AoRPair*> aor_pairs;
+
+    for (const std::string& aor_id : aor_ids)
+    {
+      aor_pairs.push_back(get_aor_data(aor_id, trail));
+    }
+
+    return aor_pairs;
+  }
+
+  void set_aor_data_multi(std::vector<AoRUpdate>& updates,
+                          SAS::TrailId trail) override
+  {
+    for (AoRUpdate& update : updates)
+    {
+      update.status = set_aor_data(update.aor_id,
+                                   update.associated_uris,
+                                   update.aor_pair,
+                                   trail,
+                                   update.all_bindings_expired);
+    }
+  }
 };
 
 #endif
@@ -0,0 +1,162 @@
+/**
+ * @file number_utils_test.cpp UT for the telephone number filters.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+#include "gtest/gtest.h"
+
+#include "number_utils.h"
+#include "utils.h"
+
+using namespace std;
+
+/// Fixture for NumberUtilsTest.  The filters replaced regular expressions, so
+/// most of these tests check that they behave exactly as those did, for every
+/// string of up to a few characters from an alphabet of interesting ones.
+class NumberUtilsTest : public ::testing::Test
+{
+  NumberUtilsTest()
+  {
+    const string alphabet = "09+-.()[],AFa*#; x";
+    vector<string> previous(1, "");
+    _strings.push_back("");
+
+    for (int len = 1; len <= 4; ++len)
+    {
+      vector<string> current;
+
+      for (const string& s : previous)
+      {
+        for (char c : alphabet)
+        {
+          current.push_back(s + c);
+        }
+      }
+
+      _strings.insert(_strings.end(), current.begin(), current.end());
+      previous.swap(current);
+    }
+  }
+
+  virtual ~NumberUtilsTest()
+  {
+  }
+
+  static pj_str_t to_pj(const string& s)
+  {
+    pj_str_t pj = {(char*)s.data(), (pj_ssize_t)s.size()};
+    return pj;
+  }
+
+  vector<string> _strings;
+};
+
+TEST_F(NumberUtilsTest, GlobalNumber)
+{
+  boost::regex regex("\\+[0-9,\\-\\(\\)]*");
+
+  for (const string& s : _strings)
+  {
+    EXPECT_EQ(boost::regex_match(s, regex),
+              NumberUtils::is_global_number(to_pj(s))) << s;
+  }
+}
+
+TEST_F(NumberUtilsTest, LocalNumber)
+{
+  boost::regex regex("[0-9A-F\\*#,\\-\\(\\)]*");
+
+  for (const string& s : _strings)
+  {
+    EXPECT_EQ(boost::regex_match(s, regex),
+              NumberUtils::is_local_number(to_pj(s))) << s;
+  }
+}
+
+TEST_F(NumberUtilsTest, UserNumeric)
+{
+  boost::regex regex("[0-9+\\-.()\\[\\]]*");
+
+  for (const string& s : _strings)
+  {
+    EXPECT_EQ(boost::regex_match(s, regex),
+              NumberUtils::is_user_numeric(to_pj(s))) << s;
+  }
+}
+
+TEST_F(NumberUtilsTest, RemoveVisualSeparators)
+{
+  boost::regex regex("[.)(-]");
+
+  for (const string& s : _strings)
+  {
+    EXPECT_EQ(boost::regex_replace(s, regex, string("")),
+              NumberUtils::normalize(s, NumberUtils::remove_visual_separators)) << s;
+  }
+}
+
+TEST_F(NumberUtilsTest, UserToAus)
+{
+  boost::regex regex("([^0-9+]|(?<=.)[^0-9])");
+
+  for (const string& s : _strings)
+  {
+    EXPECT_EQ(boost::regex_replace(s, regex, string("")),
+              NumberUtils::normalize(s, NumberUtils::user_to_aus)) << s;
+  }
+}
+
+TEST_F(NumberUtilsTest, UserMinusParams)
+{
+  // As well as the generated strings, check some with whitespace around the
+  // parameters, which is trimmed from each token.
+  vector<string> strings = _strings;
+  strings.push_back("+1234 ;npdi");
+  strings.push_back("; ;+1234");
+  strings.push_back(" ;  +1234  ; rn=567");
+
+  for (const string& s : strings)
+  {
+    vector<string> tokens;
+    Utils::split_string(s, ';', tokens, 0, true);
+
+    pj_str_t token;
+    bool found = NumberUtils::user_minus_params(to_pj(s), token);
+    ASSERT_EQ(!tokens.empty(), found) << s;
+
+    if (found)
+    {
+      EXPECT_EQ(tokens[0], string(token.ptr, token.slen)) << s;
+    }
+  }
+}
+
+TEST_F(NumberUtilsTest, InPlace)
+{
+  // The normalizers work on the caller's buffer, only changing its length.
+  char buf[] = "+1 (650) 555-1234";
+  pj_str_t number = pj_str(buf);
+  NumberUtils::remove_visual_separators(number);
+  EXPECT_EQ(buf, number.ptr);
+  EXPECT_EQ("+1 650 5551234", string(number.ptr, number.slen));
+
+  NumberUtils::keep_only(number, NumberUtils::DIGITS);
+  EXPECT_EQ("16505551234", string(number.ptr, number.slen));
+
+  NumberUtils::strip(number, NumberUtils::CharSet("15"));
+  EXPECT_EQ("60234", string(number.ptr, number.slen));
+
+  // Characters outside ASCII aren't in any of the sets.
+  string high = "+12\xe9";
+  EXPECT_FALSE(NumberUtils::is_global_number(to_pj(high)));
+  EXPECT_EQ("+12", NumberUtils::normalize(to_pj(high), NumberUtils::user_to_aus));
+}
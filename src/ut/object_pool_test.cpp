@@ -0,0 +1,229 @@
+/**
+ * @file object_pool_test.cpp UT for the object pool and small containers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "object_pool.h"
+#include "small_vector.h"
+
+using namespace std;
+
+/// Fixture for ObjectPoolTest.
+class ObjectPoolTest : public ::testing::Test
+{
+};
+
+class PooledThing : public PooledObject<PooledThing>
+{
+public:
+  PooledThing(int value) : _value(value) {}
+  virtual ~PooledThing() {}
+  int _value;
+};
+
+class BiggerPooledThing : public PooledThing
+{
+public:
+  BiggerPooledThing() : PooledThing(2) {}
+  char _more[64];
+};
+
+TEST_F(ObjectPoolTest, ReusesMemory)
+{
+  ObjectPool<PooledThing>::Stats before = ObjectPool<PooledThing>::stats();
+
+  // Freed objects go to the pool, and are reused by the next allocation.
+  PooledThing* thing = new PooledThing(1);
+  delete thing;
+  PooledThing* thing2 = new PooledThing(2);
+  EXPECT_EQ(thing, thing2);
+  EXPECT_EQ(2, thing2->_value);
+
+  ObjectPool<PooledThing>::Stats after = ObjectPool<PooledThing>::stats();
+  EXPECT_EQ(before.in_use + 1, after.in_use);
+  EXPECT_EQ(before.pool_allocs + 1, after.pool_allocs);
+  EXPECT_LE(before.heap_allocs, after.heap_allocs);
+
+  delete thing2;
+  EXPECT_EQ(before.in_use, ObjectPool<PooledThing>::stats().in_use);
+}
+
+TEST_F(ObjectPoolTest, SubclassesUseHeap)
+{
+  ObjectPool<PooledThing>::Stats before = ObjectPool<PooledThing>::stats();
+
+  // Subclasses are a different size, so aren't pooled (and are deleted
+  // correctly through a pointer to the base class).
+  PooledThing* thing = new BiggerPooledThing();
+  EXPECT_EQ(2, thing->_value);
+  delete thing;
+
+  ObjectPool<PooledThing>::Stats after = ObjectPool<PooledThing>::stats();
+  EXPECT_EQ(before.in_use, after.in_use);
+  EXPECT_EQ(before.pool_allocs, after.pool_allocs);
+  EXPECT_EQ(before.heap_allocs, after.heap_allocs);
+}
+
+TEST_F(ObjectPoolTest, FreeOnOtherThread)
+{
+  ObjectPool<PooledThing>::Stats before = ObjectPool<PooledThing>::stats();
+
+  // An object can be freed on a different thread to the one that created
+  // it.
+  PooledThing* thing = new PooledThing(1);
+  std::thread thread([thing]() { delete thing; });
+  thread.join();
+
+  EXPECT_EQ(before.in_use, ObjectPool<PooledThing>::stats().in_use);
+}
+
+TEST_F(ObjectPoolTest, FreedBlocksReturnToAllocatingThread)
+{
+  // Allocate more objects than a thread keeps free, and free them all on
+  // another thread.  The excess is passed back through the depot, so
+  // allocating them again on this thread reuses it.
+  const size_t num = ObjectPool<PooledThing>::MAX_FREE +
+                     2 * ObjectPool<PooledThing>::BATCH;
+  std::vector<PooledThing*> things;
+
+  for (size_t ii = 0; ii < num; ++ii)
+  {
+    things.push_back(new PooledThing(1));
+  }
+
+  std::thread thread([&things]()
+                     {
+                       for (PooledThing* thing : things)
+                       {
+                         delete thing;
+                       }
+                     });
+  thread.join();
+  things.clear();
+
+  ObjectPool<PooledThing>::Stats before = ObjectPool<PooledThing>::stats();
+
+  for (size_t ii = 0; ii < 2 * ObjectPool<PooledThing>::BATCH; ++ii)
+  {
+    things.push_back(new PooledThing(1));
+  }
+
+  ObjectPool<PooledThing>::Stats after = ObjectPool<PooledThing>::stats();
+  EXPECT_EQ(before.heap_allocs, after.heap_allocs);
+  EXPECT_EQ(before.pool_allocs + 2 * ObjectPool<PooledThing>::BATCH,
+            after.pool_allocs);
+
+  for (PooledThing* thing : things)
+  {
+    delete thing;
+  }
+}
+
+TEST_F(ObjectPoolTest, StatsIncludeExitedThreads)
+{
+  ObjectPool<PooledThing>::Stats before = ObjectPool<PooledThing>::stats();
+
+  // Statistics are kept per thread, but a thread's are still counted after
+  // it exits.
+  PooledThing* thing = NULL;
+  std::thread thread([&thing]() { thing = new PooledThing(1); });
+  thread.join();
+
+  ObjectPool<PooledThing>::Stats after = ObjectPool<PooledThing>::stats();
+  EXPECT_EQ(before.in_use + 1, after.in_use);
+  EXPECT_EQ(before.heap_allocs + before.pool_allocs + 1,
+            after.heap_allocs + after.pool_allocs);
+
+  delete thing;
+  EXPECT_EQ(before.in_use, ObjectPool<PooledThing>::stats().in_use);
+}
+
+TEST_F(ObjectPoolTest, SmallVector)
+{
+  SmallVector<int, 2> vec;
+  EXPECT_TRUE(vec.empty());
+
+  // Entries are held inline until the vector outgrows its inline storage.
+  vec.push_back(1);
+  vec.push_back(2);
+  EXPECT_FALSE(vec.on_heap());
+  vec.resize(4);
+  EXPECT_TRUE(vec.on_heap());
+  EXPECT_EQ(4u, vec.size());
+  EXPECT_EQ(1, vec[0]);
+  EXPECT_EQ(2, vec[1]);
+  EXPECT_EQ(0, vec[3]);
+
+  vec.erase(vec.begin());
+  EXPECT_EQ(3u, vec.size());
+  EXPECT_EQ(2, vec[0]);
+
+  vec.insert(vec.begin(), 5);
+  EXPECT_EQ(5, vec[0]);
+  EXPECT_EQ(2, vec[1]);
+
+  vec.clear();
+  EXPECT_TRUE(vec.empty());
+}
+
+TEST_F(ObjectPoolTest, SmallMap)
+{
+  SmallMap<int, string, 2> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find(1) == map.end());
+
+  // Entries are kept in key order, like std::map.
+  map[3] = "three";
+  map[1] = "one";
+  map[2] = "two";
+  EXPECT_EQ(3u, map.size());
+  EXPECT_EQ(1, map.begin()->first);
+  EXPECT_EQ("two", map.find(2)->second);
+  EXPECT_TRUE(map.find(4) == map.end());
+
+  map[2] = "deux";
+  EXPECT_EQ(3u, map.size());
+  EXPECT_EQ("deux", map[2]);
+
+  EXPECT_EQ(1u, map.erase(2));
+  EXPECT_EQ(0u, map.erase(2));
+  map.erase(map.begin());
+  EXPECT_EQ(1u, map.size());
+  EXPECT_EQ(3, map.begin()->first);
+}
+
+TEST_F(ObjectPoolTest, SmallSet)
+{
+  SmallSet<int, 2> set;
+  EXPECT_TRUE(set.empty());
+  EXPECT_TRUE(set.find(1) == set.end());
+
+  // Keys are kept in order, and only once, like std::set.
+  set.insert(3);
+  set.insert(1);
+  set.insert(2);
+  set.insert(1);
+  EXPECT_EQ(3u, set.size());
+  EXPECT_EQ(1, *set.begin());
+  EXPECT_EQ(2, *set.find(2));
+  EXPECT_TRUE(set.find(4) == set.end());
+
+  EXPECT_EQ(1u, set.erase(2));
+  EXPECT_EQ(0u, set.erase(2));
+  EXPECT_EQ(2u, set.size());
+  EXPECT_TRUE(set.find(2) == set.end());
+
+  set.clear();
+  EXPECT_TRUE(set.empty());
+}
@@ -0,0 +1,94 @@
+/**
+ * @file parallel_store_ops_test.cpp UT for the parallel store operations pool.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "parallel_store_ops.h"
+
+using namespace std;
+
+/// Fixture for ParallelStoreOpsTest.
+class ParallelStoreOpsTest : public ::testing::Test
+{
+};
+
+TEST_F(ParallelStoreOpsTest, RunsEveryOpOnce)
+{
+  ParallelStoreOps parallel_ops(4, NULL);
+
+  // Many more operations than there are threads.
+  vector<atomic<int>> runs(100);
+  vector<function<void()>> ops;
+  for (size_t ii = 0; ii < runs.size(); ii++)
+  {
+    runs[ii] = 0;
+    ops.push_back([&runs, ii]() { runs[ii]++; });
+  }
+
+  parallel_ops.run(ops);
+
+  for (size_t ii = 0; ii < runs.size(); ii++)
+  {
+    EXPECT_EQ(1, runs[ii]) << "Operation " << ii;
+  }
+}
+
+TEST_F(ParallelStoreOpsTest, CompletesWhenPoolBusy)
+{
+  ParallelStoreOps parallel_ops(1, NULL);
+
+  // Start a batch on another thread whose operations block until released.
+  // Between them, they tie up that thread and the only pool thread.
+  mutex lock;
+  condition_variable cond;
+  bool released = false;
+  int started = 0;
+
+  vector<function<void()>> blocking_ops;
+  for (int ii = 0; ii < 2; ii++)
+  {
+    blocking_ops.push_back([&]()
+    {
+      unique_lock<mutex> guard(lock);
+      started++;
+      cond.notify_all();
+      cond.wait(guard, [&]() { return released; });
+    });
+  }
+
+  thread blocked_thread([&]() { parallel_ops.run(blocking_ops); });
+
+  {
+    unique_lock<mutex> guard(lock);
+    cond.wait(guard, [&]() { return started == 2; });
+  }
+
+  // A second batch still completes, on this thread.
+  int runs = 0;
+  vector<function<void()>> ops;
+  for (int ii = 0; ii < 3; ii++)
+  {
+    ops.push_back([&runs]() { runs++; });
+  }
+  parallel_ops.run(ops);
+  EXPECT_EQ(3, runs);
+
+  {
+    lock_guard<mutex> guard(lock);
+    released = true;
+    cond.notify_all();
+  }
+  blocked_thread.join();
+}
@@ -0,0 +1,240 @@
+/**
+ * @file routing_db_test.cpp UT for compiled ENUM and BGCF routing databases.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unistd.h>
+#include <utime.h>
+#include "gtest/gtest.h"
+
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "routing_db.h"
+#include "prefix_trie.h"
+#include "enumservice.h"
+#include "bgcfservice.h"
+
+using namespace std;
+
+/// Fixture for RoutingDbTest.  Databases are written to a temporary
+/// directory.
+class RoutingDbTest : public ::testing::Test
+{
+protected:
+  RoutingDbTest()
+  {
+    char dir[] = "/tmp/routing_db_test.XXXXXX";
+    _dir = mkdtemp(dir);
+  }
+
+  virtual ~RoutingDbTest()
+  {
+    for (const string& file : _files)
+    {
+      unlink(file.c_str());
+    }
+
+    rmdir(_dir.c_str());
+  }
+
+  string path(const string& name)
+  {
+    string file = _dir + "/" + name;
+    _files.push_back(file);
+    return file;
+  }
+
+  string _dir;
+  vector<string> _files;
+};
+
+TEST_F(RoutingDbTest, NumberMatching)
+{
+  // Build the same prefixes into a database and an in-memory trie, and check
+  // that they match numbers in the same way.
+  vector<string> prefixes = {"+22", "+2222", "+222", "+2225", "123", "", "9"};
+  vector<string> numbers = {"+22238899", "+22338899", "+22228899", "+2",
+                            "+222", "+2223", "1", "12345", "9", "99", "555"};
+
+  RoutingDb::Builder builder(RoutingDb::ENUM);
+  PrefixTrie<uint32_t> trie;
+
+  for (const string& prefix : prefixes)
+  {
+    uint32_t index = builder.add_value("value " + prefix);
+    builder.add_number(prefix, index);
+    trie.insert(prefix, index);
+  }
+
+  string file = path("numbers.db");
+  ASSERT_TRUE(builder.write(file));
+
+  RoutingDb* db = RoutingDb::open(file, RoutingDb::ENUM);
+  ASSERT_TRUE(db != NULL);
+  EXPECT_EQ(prefixes.size(), db->num_numbers());
+  EXPECT_EQ(0u, db->num_domains());
+
+  for (const string& number : numbers)
+  {
+    SCOPED_TRACE(number);
+    const uint32_t* expected = trie.last_with_prefix(number);
+
+    if (expected == NULL)
+    {
+      expected = trie.longest_prefix_match(number);
+    }
+
+    ASSERT_TRUE(expected != NULL);
+    EXPECT_EQ(*expected, db->match_number(number));
+
+    // The matching prefix is reported too.
+    string prefix = "unset";
+    EXPECT_EQ(*expected, db->match_number(number, &prefix));
+    EXPECT_EQ(db->value(*expected), "value " + prefix);
+  }
+
+  string prefix;
+  EXPECT_EQ("value +222", db->value(db->match_number("+22238899", &prefix)));
+  EXPECT_EQ("+222", prefix);
+  EXPECT_EQ("value +2225", db->value(db->match_number("+222", &prefix)));
+  EXPECT_EQ("+2225", prefix);
+  EXPECT_EQ("value ", db->value(db->match_number("555", &prefix)));
+  EXPECT_EQ("", prefix);
+  EXPECT_EQ("", db->value(RoutingDb::NOT_FOUND));
+
+  delete db;
+}
+
+TEST_F(RoutingDbTest, DomainsAndSharedValues)
+{
+  RoutingDb::Builder builder(RoutingDb::BGCF);
+  uint32_t index1 = builder.add_value("sip.example.com");
+  uint32_t index2 = builder.add_value("sip2.example.com\nsip3.example.com");
+  EXPECT_EQ(index1, builder.add_value("sip.example.com"));
+  builder.add_domain("example.com", index1);
+  builder.add_domain("*.example.com", index2);
+  builder.add_domain("example.com", index2);
+  builder.add_number("+1", index1);
+
+  string file = path("domains.db");
+  ASSERT_TRUE(builder.write(file));
+
+  // The database can't be opened as the wrong type.
+  EXPECT_TRUE(RoutingDb::open(file, RoutingDb::ENUM) == NULL);
+
+  RoutingDb* db = RoutingDb::open(file, RoutingDb::BGCF);
+  ASSERT_TRUE(db != NULL);
+  EXPECT_EQ(2u, db->num_values());
+  EXPECT_EQ(index1, db->find_domain("example.com"));
+  EXPECT_EQ(index2, db->find_domain("*.example.com"));
+  EXPECT_EQ(RoutingDb::NOT_FOUND, db->find_domain("foo.example.com"));
+  EXPECT_EQ(RoutingDb::NOT_FOUND, db->find_domain("example"));
+  EXPECT_EQ(index1, db->match_number("+1234"));
+  EXPECT_EQ(RoutingDb::NOT_FOUND, db->match_number("+4"));
+  delete db;
+}
+
+TEST_F(RoutingDbTest, InvalidFiles)
+{
+  CapturingTestLogger log;
+
+  EXPECT_TRUE(RoutingDb::open(path("missing.db"), RoutingDb::ENUM) == NULL);
+
+  // A JSON file isn't a routing database.
+  EXPECT_TRUE(RoutingDb::open(string(UT_DIR).append("/test_enum.json"),
+                              RoutingDb::ENUM) == NULL);
+
+  // Nor is a truncated database.
+  RoutingDb::Builder builder(RoutingDb::ENUM);
+  builder.add_number("123", builder.add_value("!(^.*$)!sip:\\1@example.com!"));
+  string file = path("truncated.db");
+  ASSERT_TRUE(builder.write(file));
+  ASSERT_EQ(0, truncate(file.c_str(), 40));
+  EXPECT_TRUE(RoutingDb::open(file, RoutingDb::ENUM) == NULL);
+  EXPECT_TRUE(log.contains("Invalid routing database"));
+}
+
+TEST_F(RoutingDbTest, CompiledPath)
+{
+  EXPECT_EQ("/etc/clearwater/enum.db", RoutingDb::compiled_path("/etc/clearwater/enum.json"));
+  EXPECT_EQ("./bgcf.db", RoutingDb::compiled_path("./bgcf.json"));
+  EXPECT_EQ("routes.db", RoutingDb::compiled_path("routes"));
+}
+
+TEST_F(RoutingDbTest, UseCompiled)
+{
+  string json_file = path("enum.json");
+  string db_file = path("enum.db");
+
+  // No database.
+  EXPECT_FALSE(RoutingDb::use_compiled(json_file, db_file));
+
+  // Database but no JSON.
+  std::ofstream(db_file.c_str()) << "db";
+  EXPECT_TRUE(RoutingDb::use_compiled(json_file, db_file));
+
+  // Database older than the JSON.
+  std::ofstream(json_file.c_str()) << "{}";
+  struct utimbuf times = {1000, 1000};
+  utime(db_file.c_str(), &times);
+  EXPECT_FALSE(RoutingDb::use_compiled(json_file, db_file));
+
+  // Database newer than the JSON.
+  times.actime = times.modtime = 500;
+  utime(json_file.c_str(), &times);
+  EXPECT_TRUE(RoutingDb::use_compiled(json_file, db_file));
+}
+
+TEST_F(RoutingDbTest, CompiledEnum)
+{
+  // Compile the ENUM configuration, and load it from a path where there's no
+  // JSON file.
+  string json_file = path("enum.json");
+  string db_file = RoutingDb::compiled_path(json_file);
+  _files.push_back(db_file);
+  ASSERT_TRUE(JSONEnumService::compile(string(UT_DIR).append("/test_enum_prefix_matching.json"),
+                                       db_file));
+
+  JSONEnumService enum_(json_file);
+  EXPECT_EQ("tel:+22238899;three-digits-prefix-match;npdi",
+            enum_.lookup_uri_from_user("+22238899", 0));
+  EXPECT_EQ("tel:+22338899;two-digits-prefix-match;npdi",
+            enum_.lookup_uri_from_user("+22338899", 0));
+  EXPECT_EQ("tel:+22228899;four-digits-prefix-match;npdi",
+            enum_.lookup_uri_from_user("+22228899", 0));
+  EXPECT_EQ("", enum_.lookup_uri_from_user("+23", 0));
+
+  // A configuration that doesn't parse can't be compiled.
+  EXPECT_FALSE(JSONEnumService::compile(string(UT_DIR).append("/test_enum_parse_error.json"),
+                                        path("error.db")));
+}
+
+TEST_F(RoutingDbTest, CompiledBgcf)
+{
+  string json_file = path("bgcf.json");
+  string db_file = RoutingDb::compiled_path(json_file);
+  _files.push_back(db_file);
+  ASSERT_TRUE(BgcfService::compile(string(UT_DIR).append("/test_bgcf.json"),
+                                   db_file));
+
+  BgcfService bgcf_(json_file);
+  EXPECT_EQ(vector<string>({"ec2-54-243-253-10.compute-1.amazonaws.com"}),
+            bgcf_.get_route_from_domain("198.147.226.2", 0));
+  EXPECT_EQ(vector<string>({"sip2.example.com", "sip3.example.com"}),
+            bgcf_.get_route_from_domain("multiple-nodes.example.com", 0));
+  EXPECT_TRUE(bgcf_.get_route_from_domain("billy2", 0).empty());
+  EXPECT_EQ(vector<string>({"sip.example.com"}),
+            bgcf_.get_route_from_number("+123-123", 0));
+  EXPECT_EQ(vector<string>({"sip2.example.com"}),
+            bgcf_.get_route_from_number("+123", 0));
+  EXPECT_TRUE(bgcf_.get_route_from_number("123123", 0).empty());
+}
@@ -32,6 +32,8 @@
 #include "mmtel.h"
 #include "sproutletproxy.h"
 #include "fakesnmp.hpp"
+#include "fakeenumservice.hpp"
+#include "thread_dispatcher.h"
 #include "mock_as_communication_tracker.h"
 
 using namespace std;
@@ -2406,6 +2408,81 @@ TEST_F(SCSCFTest, TestWithoutEnum)
   doSuccessfulFlow(msg, testing::MatchesRegex(".*+15108580271@homedomain;user=phone.*"), hdrs, false);
 }
 
+// Test that the S-CSCF routes a request once an asynchronous ENUM lookup at
+// the end of originating processing completes.
+TEST_F(SCSCFTest, TestAsyncEnumExternalSuccess)
+{
+  SCOPED_TRACE("");
+  _hss_connection->set_impu_result("sip:+16505551000@homedomain", "call", RegDataXMLUtils::STATE_REGISTERED, "");
+
+  FakeAsyncEnumService async_enum_service;
+  async_enum_service.set_result("+15108580271", "sip:+15108580271@ut.cw-ngv.com");
+  _scscf_sproutlet->_enum_service = &async_enum_service;
+
+  Message msg;
+  msg._to = "+15108580271";
+  msg._route = "Route: <sip:homedomain;orig>";
+  msg._extra = "Record-Route: <sip:homedomain>\nP-Asserted-Identity: <sip:+16505551000@homedomain>";
+  add_host_mapping("ut.cw-ngv.com", "10.9.8.7");
+
+  // Only the 100 Trying is sent while the lookup is in progress.
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+  ASSERT_EQ(1u, async_enum_service.num_pending());
+
+  // The request is routed to the translated URI when the lookup completes.
+  async_enum_service.complete_lookup();
+  process_queued_callbacks();
+  ASSERT_EQ(1, txdata_count());
+  ReqMatcher req("INVITE");
+  ASSERT_NO_FATAL_FAILURE(req.matches(current_txdata()->msg));
+  EXPECT_THAT(req.uri(), testing::MatchesRegex(".*+15108580271@ut.cw-ngv.com.*"));
+
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+}
+
+// Test that a request cancelled while the S-CSCF is waiting for an
+// asynchronous ENUM lookup is rejected with a 487 when the lookup completes.
+TEST_F(SCSCFTest, TestAsyncEnumCancelledDuringLookup)
+{
+  SCOPED_TRACE("");
+  _hss_connection->set_impu_result("sip:+16505551000@homedomain", "call", RegDataXMLUtils::STATE_REGISTERED, "");
+
+  FakeAsyncEnumService async_enum_service;
+  async_enum_service.set_result("+15108580271", "sip:+15108580271@ut.cw-ngv.com");
+  _scscf_sproutlet->_enum_service = &async_enum_service;
+
+  Message msg;
+  msg._to = "+15108580271";
+  msg._route = "Route: <sip:homedomain;orig>";
+  msg._extra = "Record-Route: <sip:homedomain>\nP-Asserted-Identity: <sip:+16505551000@homedomain>";
+  add_host_mapping("ut.cw-ngv.com", "10.9.8.7");
+
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+
+  // CANCEL gets OK'd, but nothing else happens until the lookup completes.
+  msg._method = "CANCEL";
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+  ASSERT_EQ(1u, async_enum_service.num_pending());
+
+  async_enum_service.complete_lookup();
+  process_queued_callbacks();
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(487).matches(current_txdata()->msg);
+  free_txdata();
+}
+
 
 /// Test a forked flow - setup phase.
 void SCSCFTest::setupForkedFlow(SP::Message& msg)
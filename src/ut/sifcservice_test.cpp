@@ -174,7 +174,7 @@ TEST_F(SIFCServiceTest, MissingFile)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/non_existent_file.xml"));
   EXPECT_TRUE(log.contains("No shared IFCs configuration"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get().empty());
 }
 
 // Test that we log appropriately if the shared IFC file is empty.
@@ -184,7 +184,7 @@ TEST_F(SIFCServiceTest, EmptyFile)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_empty_file.xml"));
   EXPECT_TRUE(log.contains("Failed to read shared IFCs configuration"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get().empty());
 }
 
 // Test that we log appropriately if the shared IFC file is unparseable.
@@ -194,7 +194,7 @@ TEST_F(SIFCServiceTest, ParseError)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_parse_error.xml"));
   EXPECT_TRUE(log.contains("Failed to parse the shared IFCs configuration data"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get().empty());
 }
 
 // Test that we log appropriately if the shared IFC file has the wrong syntax.
@@ -204,7 +204,7 @@ TEST_F(SIFCServiceTest, MissingSetBlock)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_missing_set.xml"));
   EXPECT_TRUE(log.contains("Invalid shared IFCs configuration file - missing SharedIFCsSets block"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get().empty());
 }
 
 // Test that we cope with the case that the shared IFC file is valid but empty
@@ -214,7 +214,7 @@ TEST_F(SIFCServiceTest, NoEntries)
   EXPECT_CALL(*_mock_alarm, clear()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_no_entries.xml"));
   EXPECT_FALSE(log.contains("Failed"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get().empty());
 }
 
 // In the following tests we have various SIFC xml files that have invalid
@@ -650,3 +650,366 @@ TEST_F(SIPResolverTest, NoMatchingNAPTR)
   EXPECT_EQ("4.0.0.1:5060;transport=UDP",
             RT(_sipresolver, "sprout.cw-ngv.com").resolve());
 }
+
+/// Fixture for tests of the SIPResolver target cache.  The refresh thread
+/// isn't started, so the tests refresh the cache explicitly.
+class SIPResolverTargetCacheTest : public SIPResolverTest
+{
+  SIPResolverTargetCacheTest() : SIPResolverTest()
+  {
+    cwtest_completely_control_time();
+    _sipresolver.enable_target_cache(NULL, NULL, false);
+  }
+
+  virtual ~SIPResolverTargetCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  // Resolves a name to all its targets, rendered as a comma-separated list
+  // of addresses.
+  std::string resolve_all(const std::string& name)
+  {
+    std::vector<AddrInfo> targets;
+    _sipresolver.resolve(name, AF_INET, 0, -1, 10, targets, 0);
+    std::string output;
+
+    for (const AddrInfo& ai : targets)
+    {
+      char buf[100];
+      output += (output.empty() ? "" : ",");
+      output += inet_ntop(AF_INET, &ai.address.addr.ipv4, buf, sizeof(buf));
+    }
+
+    return output;
+  }
+};
+
+TEST_F(SIPResolverTargetCacheTest, CachedTargets)
+{
+  // Resolve a name, then change its records.  The cached targets are used
+  // until they expire.
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 30, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // The targets are cached separately for each port and transport.
+  EXPECT_EQ("3.0.0.2:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  // Refreshing the cache before the targets expire does nothing.
+  cwtest_advance_time_ms(29000);
+  _sipresolver.refresh_target_cache();
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(0u, _sipresolver.stale_served());
+}
+
+TEST_F(SIPResolverTargetCacheTest, RefreshTargets)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 30, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // Once the targets expire, they're still used until they're refreshed.
+  cwtest_advance_time_ms(31000);
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(1u, _sipresolver.stale_served());
+
+  _sipresolver.refresh_target_cache();
+  EXPECT_EQ("3.0.0.2:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(1u, _sipresolver.stale_served());
+  EXPECT_EQ(0u, _sipresolver.refresh_failures());
+}
+
+TEST_F(SIPResolverTargetCacheTest, RefreshFailure)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 30, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // Remove the records, so the refresh fails.  The expired targets are still
+  // used.
+  cwtest_advance_time_ms(31000);
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  _sipresolver.refresh_target_cache();
+  EXPECT_EQ(1u, _sipresolver.refresh_failures());
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(2u, _sipresolver.stale_served());
+
+  // The refresh isn't retried straight away.
+  _sipresolver.refresh_target_cache();
+  EXPECT_EQ(1u, _sipresolver.refresh_failures());
+
+  cwtest_advance_time_ms(SIPResolver::TARGET_CACHE_RETRY_INTERVAL * 1000);
+  _sipresolver.refresh_target_cache();
+  EXPECT_EQ(2u, _sipresolver.refresh_failures());
+
+  // Expired targets are only used for so long.
+  cwtest_advance_time_ms(SIPResolver::TARGET_CACHE_MAX_STALE * 1000);
+  EXPECT_EQ("", RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+}
+
+TEST_F(SIPResolverTargetCacheTest, UnusedTargetsRemoved)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 30, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(1u, _sipresolver.target_cache_size());
+
+  // The targets aren't used again before they expire, so they're removed
+  // rather than refreshed.
+  cwtest_advance_time_ms(31000);
+  _sipresolver.refresh_target_cache();
+  EXPECT_EQ(0u, _sipresolver.target_cache_size());
+  EXPECT_EQ(0u, _sipresolver.refresh_failures());
+}
+
+TEST_F(SIPResolverTargetCacheTest, ZeroTTLNotCached)
+{
+  // Targets with a TTL of 0 aren't cached, so changes to the records are
+  // picked up straight away.
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 0, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(0u, _sipresolver.target_cache_size());
+
+  records.push_back(a("sprout.cw-ngv.com", 0, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.2:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  EXPECT_EQ(0u, _sipresolver.stale_served());
+}
+
+TEST_F(SIPResolverTargetCacheTest, SRVPriorityAndBlacklist)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(naptr("sprout.cw-ngv.com", 3600, 0, 0, "S", "SIP+D2T", "", "_sip._tcp.sprout.cw-ngv.com"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_naptr, records);
+
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 1, 0, 5054, "sprout-1.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 0, 5054, "sprout-2.cw-ngv.com"));
+  _dnsresolver.add_to_cache("_sip._tcp.sprout.cw-ngv.com", ns_t_srv, records);
+
+  records.push_back(a("sprout-1.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout-1.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-2.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout-2.cw-ngv.com", ns_t_a, records);
+
+  // The targets are ordered by priority.
+  EXPECT_EQ("3.0.0.2,3.0.0.1", resolve_all("sprout.cw-ngv.com"));
+
+  // Blacklisted targets go last.
+  AddrInfo ai;
+  ai.address.af = AF_INET;
+  inet_pton(AF_INET, "3.0.0.2", &ai.address.addr.ipv4);
+  ai.port = 5054;
+  ai.transport = IPPROTO_TCP;
+  _sipresolver.blacklist(ai, 300);
+  EXPECT_EQ("3.0.0.1,3.0.0.2", resolve_all("sprout.cw-ngv.com"));
+
+  // Until the blacklist expires.
+  cwtest_advance_time_ms(301000);
+  EXPECT_EQ("3.0.0.2,3.0.0.1", resolve_all("sprout.cw-ngv.com"));
+}
+
+TEST_F(SIPResolverTargetCacheTest, SRVWeight)
+{
+  // Check that cached SRV targets are selected in proportion to their
+  // weights.  The error bounds are chosen to be 5 standard deviations.
+  std::vector<DnsRRecord*> records;
+  records.push_back(naptr("sprout.cw-ngv.com", 3600, 0, 0, "S", "SIP+D2T", "", "_sip._tcp.sprout.cw-ngv.com"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_naptr, records);
+
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 100, 5054, "sprout-1.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 300, 5054, "sprout-2.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 200, 5054, "sprout-3.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 400, 5054, "sprout-4.cw-ngv.com"));
+  _dnsresolver.add_to_cache("_sip._tcp.sprout.cw-ngv.com", ns_t_srv, records);
+
+  records.push_back(a("sprout-1.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout-1.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-2.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout-2.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-3.cw-ngv.com", 3600, "3.0.0.3"));
+  _dnsresolver.add_to_cache("sprout-3.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-4.cw-ngv.com", 3600, "3.0.0.4"));
+  _dnsresolver.add_to_cache("sprout-4.cw-ngv.com", ns_t_a, records);
+
+  std::map<std::string, int> counts;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    counts[RT(_sipresolver, "sprout.cw-ngv.com").resolve()]++;
+  }
+
+  EXPECT_LT(100-5*10, counts["3.0.0.1:5054;transport=TCP"]);
+  EXPECT_GT(100+5*10, counts["3.0.0.1:5054;transport=TCP"]);
+  EXPECT_LT(300-5*15, counts["3.0.0.2:5054;transport=TCP"]);
+  EXPECT_GT(300+5*15, counts["3.0.0.2:5054;transport=TCP"]);
+  EXPECT_LT(200-5*13, counts["3.0.0.3:5054;transport=TCP"]);
+  EXPECT_GT(200+5*13, counts["3.0.0.3:5054;transport=TCP"]);
+  EXPECT_LT(400-5*16, counts["3.0.0.4:5054;transport=TCP"]);
+  EXPECT_GT(400+5*16, counts["3.0.0.4:5054;transport=TCP"]);
+}
+
+TEST_F(SIPResolverTargetCacheTest, LatencyWeighting)
+{
+  _sipresolver.enable_latency_weighting();
+
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.1"));
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  // 3.0.0.2 is ten times slower than 3.0.0.1, so should be selected about
+  // one time in eleven.  The error bounds are chosen to be 5 standard
+  // deviations.
+  AddrInfo ai;
+  ai.address.af = AF_INET;
+  ai.port = 5060;
+  ai.transport = IPPROTO_UDP;
+  inet_pton(AF_INET, "3.0.0.1", &ai.address.addr.ipv4);
+  _sipresolver.record_latency(ai, 10000);
+  inet_pton(AF_INET, "3.0.0.2", &ai.address.addr.ipv4);
+  _sipresolver.record_latency(ai, 100000);
+
+  std::map<std::string, int> counts;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    counts[RT(_sipresolver, "sprout.cw-ngv.com").resolve()]++;
+  }
+
+  EXPECT_LT(909-5*9, counts["3.0.0.1:5060;transport=UDP"]);
+  EXPECT_GT(909+5*9, counts["3.0.0.1:5060;transport=UDP"]);
+
+  // The latencies are moving averages, so one fast response from 3.0.0.2
+  // makes little difference.
+  _sipresolver.record_latency(ai, 10000);
+  EXPECT_EQ(91000, _sipresolver._latencies[ai].ewma_us);
+}
+
+TEST_F(SIPResolverTargetCacheTest, LatencySlowStart)
+{
+  _sipresolver.enable_latency_weighting();
+
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.1"));
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  AddrInfo ai;
+  ai.address.af = AF_INET;
+  ai.port = 5060;
+  ai.transport = IPPROTO_UDP;
+  inet_pton(AF_INET, "3.0.0.2", &ai.address.addr.ipv4);
+  _sipresolver.blacklist(ai, 10);
+
+  // Once the blacklist expires, traffic to 3.0.0.2 is ramped up, until it's
+  // treated the same as 3.0.0.1.
+  std::map<std::string, int> counts;
+  cwtest_advance_time_ms(10000 + SIPResolver::LATENCY_SLOW_START * 500);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    counts[RT(_sipresolver, "sprout.cw-ngv.com").resolve()]++;
+  }
+
+  EXPECT_LT(333-5*15, counts["3.0.0.2:5060;transport=UDP"]);
+  EXPECT_GT(333+5*15, counts["3.0.0.2:5060;transport=UDP"]);
+
+  counts.clear();
+  cwtest_advance_time_ms(SIPResolver::LATENCY_SLOW_START * 500);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    counts[RT(_sipresolver, "sprout.cw-ngv.com").resolve()]++;
+  }
+
+  EXPECT_LT(500-5*16, counts["3.0.0.2:5060;transport=UDP"]);
+  EXPECT_GT(500+5*16, counts["3.0.0.2:5060;transport=UDP"]);
+}
+
+TEST_F(SIPResolverTargetCacheTest, AsyncResolution)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  std::vector<AddrInfo> targets;
+  std::vector<AddrInfo> async_targets;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  bool called = false;
+  SIPResolver::ResolveCallback callback =
+    [&](const std::vector<AddrInfo>& result)
+    {
+      pthread_mutex_lock(&lock);
+      async_targets = result;
+      called = true;
+      pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&lock);
+    };
+
+  // Without any resolver threads, names are resolved straight away.
+  EXPECT_TRUE(_sipresolver.resolve_async("sprout.cw-ngv.com", AF_INET, 5054, IPPROTO_TCP, 5, targets, 0, callback));
+  EXPECT_EQ(1u, targets.size());
+  targets.clear();
+
+  _sipresolver.enable_async_resolution(1);
+
+  // IP addresses and cached names are still resolved straight away.
+  EXPECT_TRUE(_sipresolver.resolve_async("3.0.0.2", AF_INET, 0, -1, 5, targets, 0, callback));
+  EXPECT_EQ(1u, targets.size());
+  targets.clear();
+
+  EXPECT_TRUE(_sipresolver.resolve_async("sprout.cw-ngv.com", AF_INET, 5054, IPPROTO_TCP, 5, targets, 0, callback));
+  EXPECT_EQ(1u, targets.size());
+  targets.clear();
+
+  // Other names are resolved on the resolver's thread.
+  EXPECT_FALSE(_sipresolver.resolve_async("sprout.cw-ngv.com", AF_INET, 0, -1, 5, targets, 0, callback));
+  EXPECT_TRUE(targets.empty());
+
+  pthread_mutex_lock(&lock);
+  while (!called)
+  {
+    pthread_cond_wait(&cond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  ASSERT_EQ(1u, async_targets.size());
+  EXPECT_EQ(5060, async_targets[0].port);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file snapshot_test.cpp UT for configuration snapshots.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "snapshot.h"
+
+using namespace std;
+
+/// Fixture for SnapshotTest.
+class SnapshotTest : public ::testing::Test
+{
+};
+
+TEST_F(SnapshotTest, ReadsCurrentVersion)
+{
+  Snapshot<string> snapshot(make_shared<string>("one"));
+  EXPECT_EQ("one", snapshot.get());
+
+  snapshot.set(make_shared<string>("two"));
+  EXPECT_EQ("two", snapshot.get());
+}
+
+TEST_F(SnapshotTest, SnapshotsAreIndependent)
+{
+  Snapshot<string> snapshot1(make_shared<string>("one"));
+  Snapshot<string> snapshot2(make_shared<string>("two"));
+
+  EXPECT_EQ("one", snapshot1.get());
+  EXPECT_EQ("two", snapshot2.get());
+
+  snapshot2.set(make_shared<string>("three"));
+  EXPECT_EQ("one", snapshot1.get());
+  EXPECT_EQ("three", snapshot2.get());
+}
+
+TEST_F(SnapshotTest, OldVersionFreedWhenAllThreadsRefresh)
+{
+  shared_ptr<const string> first = make_shared<string>("one");
+  weak_ptr<const string> weak_first = first;
+
+  Snapshot<string> snapshot(first);
+  first.reset();
+
+  // Read the first version on this thread and on another thread.
+  EXPECT_EQ("one", snapshot.get());
+  thread reader([&snapshot]() { EXPECT_EQ("one", snapshot.get()); });
+  reader.join();
+
+  // Replace it.  This thread still refers to the first version until it
+  // reads the snapshot again, and the other thread's reference was released
+  // when it exited.
+  snapshot.set(make_shared<string>("two"));
+  EXPECT_FALSE(weak_first.expired());
+
+  EXPECT_EQ("two", snapshot.get());
+  EXPECT_TRUE(weak_first.expired());
+}
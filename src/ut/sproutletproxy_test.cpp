@@ -14,6 +14,7 @@
 #include "test_interposer.hpp"
 #include "sproutletproxy.h"
 #include "pjutils.h"
+#include "fakesnmp.hpp"
 #include "pjsip.h"
 #include "pjsip_simple.h"
 
@@ -66,6 +67,24 @@ private:
   std::list<std::string> _aliases;
 };
 
+template <class T>
+class FakeStatelessSproutlet : public FakeSproutlet<T>
+{
+public:
+  FakeStatelessSproutlet(const std::string& service_name,
+                         int port,
+                         const std::string& uri,
+                         const std::string& service_host) :
+    FakeSproutlet<T>(service_name, port, uri, service_host)
+  {
+  }
+
+  bool supports_stateless(const pjsip_msg* req) const
+  {
+    return true;
+  }
+};
+
 template <int S>
 class FakeSproutletTsxReject : public SproutletTsx
 {
@@ -202,6 +221,70 @@ public:
   }
 };
 
+template <int N>
+class FakeSproutletTsxForkerSendsOriginal : public SproutletTsx
+{
+public:
+  FakeSproutletTsxForkerSendsOriginal(Sproutlet* sproutlet) :
+    SproutletTsx(sproutlet)
+  {
+  }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    // Send clones of the request directly to the Request-URI, skipping any
+    // further routing, then send the original request as the last fork.
+    for (int ii = N - 2; ii >= 0; --ii)
+    {
+      pjsip_msg* clone = clone_request(req);
+      pj_pool_t* pool = get_pool(clone);
+      pjsip_sip_uri* uri = (pjsip_sip_uri*)pjsip_uri_get_uri(clone->line.req.uri);
+      std::string user = std::string(uri->user.ptr, uri->user.slen) + "-" + std::to_string(ii);
+      pj_strdup2(pool, &uri->user, user.c_str());
+      uri->port = 5060;
+      pj_strdup2(pool, &uri->transport_param, "TCP");
+
+      pjsip_hdr* route;
+      while ((route = (pjsip_hdr*)pjsip_msg_find_hdr(clone, PJSIP_H_ROUTE, NULL)) != NULL)
+      {
+        pj_list_erase(route);
+      }
+
+      send_request(clone);
+    }
+    send_request(req);
+  }
+
+  void on_rx_response(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(rsp);
+  }
+};
+
+class FakeSproutletTsxMangler : public SproutletTsx
+{
+public:
+  FakeSproutletTsxMangler(Sproutlet* sproutlet) :
+    SproutletTsx(sproutlet)
+  {
+  }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    // Modify the user part of the To header URI in place.
+    pjsip_to_hdr* to_hdr = PJSIP_MSG_TO_HDR(req);
+    pjsip_sip_uri* uri = (pjsip_sip_uri*)pjsip_uri_get_uri(to_hdr->uri);
+    std::string user = std::string(uri->user.ptr, uri->user.slen) + "-mangled";
+    pj_strdup2(get_pool(req), &uri->user, user.c_str());
+    send_request(req);
+  }
+
+  void on_rx_response(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(rsp);
+  }
+};
+
 template <int T>
 class FakeSproutletTsxDelayRedirect : public SproutletTsx
 {
@@ -616,6 +699,8 @@ public:
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForwarder<true> >("fwdrr", 0, "sip:fwdrr.proxy1.homedomain;transport=tcp", "", "alias"));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDownstreamRequest>("dsreq", 0, "sip:dsreq.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForker<NUM_FORKS> >("forker", 0, "sip:forker.homedomain;transport=tcp", ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForkerSendsOriginal<NUM_FORKS> >("forkorig", 0, "sip:forkorig.homedomain;transport=tcp", ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxMangler>("mangler", 0, "sip:mangler.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDelayRedirect<1> >("delayredirect", 0, "sip:delayredirect.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxBad >("bad", 0, "sip:bad.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxB2BUA >("b2bua", 0, "sip:b2bua.homedomain;transport=tcp", ""));
@@ -624,6 +709,7 @@ public:
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDummySCSCF>("scscf", 44444, "sip:scscf.homedomain:44444;transport=tcp", "scscf"));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletReusesTransport>("transport", 0, "sip:transport.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForwarder<false> >("fwdwithstats", 0, "sip:fwdwithstats.homedomain;transport=tcp", "", "", &SNMP::FAKE_INCOMING_SIP_TRANSACTIONS_TABLE, &SNMP::FAKE_OUTGOING_SIP_TRANSACTIONS_TABLE));
+    _sproutlets.push_back(new FakeStatelessSproutlet<FakeSproutletTsxForwarder<false> >("stateless", 0, "sip:stateless.homedomain;transport=tcp", ""));
 
     // Create a host alias.
     std::unordered_set<std::string> host_aliases;
@@ -658,6 +744,7 @@ public:
     {
       delete (*i);
     }
+    _sproutlets.clear();
 
     SipTest::TearDownTestCase();
   }
@@ -2108,6 +2195,266 @@ TEST_F(SproutletProxyTest, SproutletChain)
   delete tp;
 }
 
+TEST_F(SproutletProxyTest, SproutletChainSharedBody)
+{
+  // Tests that a request with a body passes through a chain of sproutlets
+  // (which share the body between themselves) intact.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a MESSAGE request that passes through the forwarder Sproutlet
+  // twice before going to an external node.
+  Message msg1;
+  msg1._method = "MESSAGE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._content_type = "text/plain";
+  msg1._body = "Hello Bob";
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Request is forwarded to the node in the last Route header, with the
+  // body unchanged.
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* req = pop_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, req);
+  ReqMatcher("MESSAGE").matches(req->msg);
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(req->msg, "Route"));
+  ASSERT_TRUE(req->msg->body != NULL);
+  EXPECT_EQ("Hello Bob",
+            std::string((char*)req->msg->body->data, req->msg->body->len));
+
+  // Send a 200 OK response and check it is forwarded back to the source.
+  inject_msg(respond_to_txdata(req, 200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  pjsip_tx_data_dec_ref(req);
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, SproutletForkerSharedBody)
+{
+  // Tests that the forks of a request share its body, but each has its own
+  // Request-URI.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a MESSAGE request with a body and a Route header referencing the
+  // forking Sproutlet.
+  Message msg1;
+  msg1._method = "MESSAGE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._content_type = "text/plain";
+  msg1._body = "Hello Bob";
+  msg1._route = "Route: <sip:forker.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Request is forked to NUM_FORKS different users, and every fork carries
+  // the same body.
+  ASSERT_EQ(NUM_FORKS, txdata_count());
+  std::vector<pjsip_tx_data*> req;
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    int idx = NUM_FORKS - ii - 1;
+    req.push_back(pop_txdata());
+    ReqMatcher("MESSAGE").matches(req[ii]->msg);
+    EXPECT_EQ("sip:bob-" + std::to_string(idx) + "@proxy1.awaydomain:5060;transport=TCP",
+              str_uri(req[ii]->msg->line.req.uri));
+    EXPECT_EQ("From: <sip:alice@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf",
+              get_headers(req[ii]->msg, "From"));
+    ASSERT_TRUE(req[ii]->msg->body != NULL);
+    EXPECT_EQ("Hello Bob",
+              std::string((char*)req[ii]->msg->body->data, req[ii]->msg->body->len));
+    EXPECT_EQ(req[0]->msg->body->data, req[ii]->msg->body->data);
+  }
+
+  // Reject all but the last fork, then accept the last one.
+  for (int ii = 0; ii < NUM_FORKS - 1; ++ii)
+  {
+    inject_msg(respond_to_txdata(req[ii], 404));
+  }
+  inject_msg(respond_to_txdata(req[NUM_FORKS - 1], 200));
+
+  // Check the 200 OK is forwarded.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    pjsip_tx_data_dec_ref(req[ii]);
+  }
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, SproutletForkerLocalCopiesHeaders)
+{
+  // Tests that forks passed to a local Sproutlet get their own copy of the
+  // headers, so that Sproutlet modifying a header in place doesn't affect
+  // the other forks.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a MESSAGE request with a body and Route headers referencing the
+  // forking Sproutlet and then a Sproutlet that modifies the To header.
+  Message msg1;
+  msg1._method = "MESSAGE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._content_type = "text/plain";
+  msg1._body = "Hello Bob";
+  msg1._route = "Route: <sip:forker.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:mangler.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Every fork has been modified exactly once, and still carries the body.
+  ASSERT_EQ(NUM_FORKS, txdata_count());
+  std::vector<pjsip_tx_data*> req;
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    req.push_back(pop_txdata());
+    ReqMatcher("MESSAGE").matches(req[ii]->msg);
+    EXPECT_EQ("To: <sip:bob-mangled@awaydomain>", get_headers(req[ii]->msg, "To"));
+    EXPECT_EQ("", get_headers(req[ii]->msg, "Route"));
+    ASSERT_TRUE(req[ii]->msg->body != NULL);
+    EXPECT_EQ("Hello Bob",
+              std::string((char*)req[ii]->msg->body->data, req[ii]->msg->body->len));
+  }
+
+  // Reject all but the last fork, then accept the last one.
+  for (int ii = 0; ii < NUM_FORKS - 1; ++ii)
+  {
+    inject_msg(respond_to_txdata(req[ii], 404));
+  }
+  inject_msg(respond_to_txdata(req[NUM_FORKS - 1], 200));
+
+  // Check the 200 OK is forwarded.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    pjsip_tx_data_dec_ref(req[ii]);
+  }
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, SproutletForkerLocalCopiesOriginalHeaders)
+{
+  // Tests that when a Sproutlet forks clones of a request and then sends the
+  // original request to a local Sproutlet, that Sproutlet gets its own copy
+  // of the headers, so modifying a header in place doesn't affect the clones.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a MESSAGE request with Route headers referencing the forking
+  // Sproutlet and then a Sproutlet that modifies the To header.  Only the
+  // original request is routed on to the second Sproutlet.
+  Message msg1;
+  msg1._method = "MESSAGE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:forkorig.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:mangler.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Only the original request has been modified.
+  ASSERT_EQ(NUM_FORKS, txdata_count());
+  std::vector<pjsip_tx_data*> req;
+  int mangled = -1;
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    req.push_back(pop_txdata());
+    ReqMatcher("MESSAGE").matches(req[ii]->msg);
+    EXPECT_EQ("", get_headers(req[ii]->msg, "Route"));
+
+    pjsip_sip_uri* uri = (pjsip_sip_uri*)pjsip_uri_get_uri(req[ii]->msg->line.req.uri);
+    if (pj_strcmp2(&uri->user, "bob") == 0)
+    {
+      mangled = ii;
+      EXPECT_EQ("To: <sip:bob-mangled@awaydomain>", get_headers(req[ii]->msg, "To"));
+    }
+    else
+    {
+      EXPECT_EQ("To: <sip:bob@awaydomain>", get_headers(req[ii]->msg, "To"));
+    }
+  }
+  ASSERT_NE(-1, mangled);
+
+  // Reject the clones, then accept the original.
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    if (ii != mangled)
+    {
+      inject_msg(respond_to_txdata(req[ii], 404));
+    }
+  }
+  inject_msg(respond_to_txdata(req[mangled], 200));
+
+  // Check the 200 OK is forwarded.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    pjsip_tx_data_dec_ref(req[ii]);
+  }
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, LoopDetection)
 {
   // Test loop detection of requests passing through a chain of sproutlets.
@@ -2360,6 +2707,33 @@ TEST_F(SproutletProxyTest, SproutletSelection)
   ASSERT_EQ("b2bua", service_name);
 }
 
+// Tests that host names are matched case insensitively when selecting a
+// sproutlet, but service names aren't.
+TEST_F(SproutletProxyTest, SproutletSelectionCase)
+{
+  std::string service_name;
+  std::string uri_str = "sip:b2bua@PROXY1.HomeDomain-Alias";
+  pjsip_sip_uri* uri = (pjsip_sip_uri*)PJUtils::uri_from_string(uri_str, stack_data.pool, PJ_FALSE);
+
+  // Should match b2bua.
+  service_name = match_sproutlet_from_uri((pjsip_uri*)uri);
+  ASSERT_EQ("b2bua", service_name);
+
+  uri_str = "sip:fwd.PROXY1.homedomain";
+  uri = (pjsip_sip_uri*)PJUtils::uri_from_string(uri_str, stack_data.pool, PJ_FALSE);
+
+  // Should match fwd.
+  service_name = match_sproutlet_from_uri((pjsip_uri*)uri);
+  ASSERT_EQ("fwd", service_name);
+
+  uri_str = "sip:B2BUA@proxy1.homedomain";
+  uri = (pjsip_sip_uri*)PJUtils::uri_from_string(uri_str, stack_data.pool, PJ_FALSE);
+
+  // Shouldn't match anything.
+  service_name = match_sproutlet_from_uri((pjsip_uri*)uri);
+  ASSERT_EQ("", service_name);
+}
+
 // Tests that it's not possible to register more than one Sproutlet for the
 // same service name or port.
 TEST_F(SproutletProxyTest, ConflictingSproutlets)
@@ -2372,16 +2746,449 @@ TEST_F(SproutletProxyTest, ConflictingSproutlets)
   delete sproutlet;
 }
 
-TEST_F(SproutletProxyTest, SproutletCopiesOriginalTransport)
+// Tests that worker threads can't be added for unknown sproutlets, or with
+// invalid configuration.
+TEST_F(SproutletProxyTest, InvalidExecutors)
 {
-  // Tests standard routing of a request through a Sproutlet that simply
-  // forwards requests and responses and doesn't Record-Route itself - and
-  // that reuses the original transport for onwards messages.
-  pjsip_tx_data* tdata;
+  EXPECT_FALSE(_proxy->add_executor("unknown", 1, 10));
+  EXPECT_FALSE(_proxy->add_executor("fwd", 0, 10));
+  EXPECT_FALSE(_proxy->add_executor("fwd", 1, 0));
+}
 
-  // Create two TCP connections to the listening port.
-  TransportFlow* tp1 = new TransportFlow(TransportFlow::Protocol::TCP,
-                                         stack_data.scscf_port,
+/// Callback that counts how many times it runs.
+class CountingCallback : public PJUtils::Callback
+{
+public:
+  CountingCallback(std::atomic<int>& count) : _count(count) {}
+  void run() { _count++; }
+private:
+  std::atomic<int>& _count;
+};
+
+// Tests that a sproutlet executor runs callbacks on its threads, and rejects
+// new work once its queue is full.
+TEST_F(SproutletProxyTest, Executor)
+{
+  std::atomic<int> count(0);
+  SproutletExecutor* executor = new SproutletExecutor("test", 2, 1000);
+
+  // The queue isn't serviced until the executor is started, so it fills up.
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    ASSERT_TRUE(executor->try_queue(new CountingCallback(count)));
+  }
+  CountingCallback* rejected = new CountingCallback(count);
+  EXPECT_FALSE(executor->try_queue(rejected));
+  delete rejected;
+  EXPECT_EQ(1000u, executor->stats().queue_depth);
+  EXPECT_EQ(1u, executor->stats().rejected);
+
+  // Further work on something already admitted is queued regardless.
+  executor->queue(new CountingCallback(count));
+  EXPECT_EQ(1001u, executor->stats().queue_depth);
+
+  ASSERT_EQ(PJ_SUCCESS, executor->start(stack_data.pool));
+
+  for (int ii = 0; (ii < 1000) && (executor->stats().processed < 1001); ++ii)
+  {
+    usleep(1000);
+  }
+
+  EXPECT_EQ(1001, count);
+  EXPECT_EQ(1001u, executor->stats().processed);
+  EXPECT_EQ(0u, executor->stats().queue_depth);
+
+  delete executor;
+}
+
+// Tests that the queued callbacks can be run on the calling thread.
+TEST_F(SproutletProxyTest, ExecutorRunQueuedCallbacks)
+{
+  std::atomic<int> count(0);
+  SproutletExecutor* executor = new SproutletExecutor("test", 1, 2);
+
+  ASSERT_TRUE(executor->try_queue(new CountingCallback(count)));
+  ASSERT_TRUE(executor->try_queue(new CountingCallback(count)));
+  EXPECT_EQ(2, executor->run_queued_callbacks());
+  EXPECT_EQ(2, count);
+  EXPECT_EQ(0, executor->run_queued_callbacks());
+
+  // The queue has room again.
+  ASSERT_TRUE(executor->try_queue(new CountingCallback(count)));
+  EXPECT_EQ(1, executor->run_queued_callbacks());
+  EXPECT_EQ(3, count);
+
+  delete executor;
+}
+
+/// Fixture for tests where the forwarder sproutlet has an executor.  The
+/// executor's threads aren't started - the tests run its queue by hand.
+class SproutletProxyExecutorTest : public SproutletProxyTest
+{
+public:
+  SproutletProxyExecutorTest()
+  {
+    pj_str_t name = pj_str((char*)"fwd");
+    _fwd = _proxy->find_service(&name);
+    _executor = new SproutletExecutor("fwd", 1, 1);
+    _proxy->_executors[_fwd] = _executor;
+  }
+
+  ~SproutletProxyExecutorTest()
+  {
+    _proxy->_executors.erase(_fwd);
+    delete _executor;
+  }
+
+  Sproutlet* _fwd;
+  SproutletExecutor* _executor;
+};
+
+// Tests that a request, and the response to it, are passed to a sproutlet on
+// its executor.
+TEST_F(SproutletProxyExecutorTest, RequestAndResponse)
+{
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Only the 100 Trying is sent until the sproutlet's executor runs.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+  EXPECT_EQ(1u, _executor->stats().queue_depth);
+
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  // The response is also passed to the sproutlet on its executor.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(0, txdata_count());
+  EXPECT_EQ(1u, _executor->stats().queue_depth);
+
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+  EXPECT_EQ(2u, _executor->stats().processed);
+
+  delete tp;
+}
+
+// Tests that a request is rejected if the sproutlet's queue is full.
+TEST_F(SproutletProxyExecutorTest, QueueFull)
+{
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // The queue only has room for one request, so a second is rejected.
+  Message msg2;
+  msg2._method = "INVITE";
+  msg2._requri = "sip:bob@awaydomain";
+  msg2._from = "sip:alice@homedomain";
+  msg2._to = "sip:bob@awaydomain";
+  msg2._via = tp->to_string(false);
+  msg2._route = msg1._route;
+  inject_msg(msg2.get_request(), tp);
+
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(503).matches(tdata->msg);
+  free_txdata();
+  EXPECT_EQ(1u, _executor->stats().rejected);
+
+  msg2._method = "ACK";
+  inject_msg(msg2.get_request(), tp);
+  ASSERT_EQ(0, txdata_count());
+
+  // The first request is still processed.
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  inject_msg(respond_to_current_txdata(200));
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+// Tests that a request that is CANCELed while queued for the sproutlet is
+// rejected without being passed to it.
+TEST_F(SproutletProxyExecutorTest, CancelWhileQueued)
+{
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Send a CANCEL from the originator.  This gets a 200 OK.
+  msg1._method = "CANCEL";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // When the request comes off the queue, it isn't forwarded, and the
+  // originator gets a 487 instead.
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(487).matches(tdata->msg);
+  free_txdata();
+
+  // Send an ACK to complete the UAS transaction.  It's absorbed.
+  msg1._method = "ACK";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(0, txdata_count());
+  EXPECT_EQ(0, _executor->run_queued_callbacks());
+
+  delete tp;
+}
+
+// Tests that a CANCEL for a request the sproutlet has already been passed is
+// passed to the sproutlet on its executor, after anything queued before it.
+TEST_F(SproutletProxyExecutorTest, CancelAfterRequest)
+{
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  pjsip_tx_data* invite = pop_txdata();
+
+  // The downstream node sends a 180, which is queued for the sproutlet.
+  inject_msg(respond_to_txdata(invite, 180));
+  ASSERT_EQ(0, txdata_count());
+
+  // The originator CANCELs the request.  The CANCEL is queued behind the
+  // 180.
+  msg1._method = "CANCEL";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // The 180 is forwarded, then the CANCEL is sent downstream.
+  EXPECT_EQ(2, _executor->run_queued_callbacks());
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(180).matches(tdata->msg);
+  free_txdata();
+  tdata = current_txdata();
+  ReqMatcher("CANCEL").matches(tdata->msg);
+
+  // The downstream node responds to the CANCEL and the INVITE.
+  inject_msg(respond_to_current_txdata(200));
+  inject_msg(respond_to_txdata(invite, 487));
+
+  // The 487 is ACKed, and passed to the sproutlet, which forwards it.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+
+  EXPECT_EQ(1, _executor->run_queued_callbacks());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(487).matches(tdata->msg);
+  free_txdata();
+
+  msg1._method = "ACK";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(0, txdata_count());
+
+  pjsip_tx_data_dec_ref(invite);
+  delete tp;
+}
+
+// Tests that the resources used by a sproutlet are recorded against the
+// sproutlet and the alias used to route to it.
+TEST_F(SproutletProxyTest, SproutletStats)
+{
+  pjsip_tx_data* tdata;
+
+  EXPECT_TRUE(_proxy->stats("unknown") == NULL);
+  SproutletStats* stats = _proxy->stats("fwdrr");
+  SproutletStats* alias_stats = _proxy->stats("alias");
+  ASSERT_TRUE(stats != NULL);
+  ASSERT_TRUE(alias_stats != NULL);
+
+  uint64_t invocations = stats->invocations();
+  uint64_t alias_invocations = alias_stats->invocations();
+  uint64_t msgs_cloned = stats->msgs_cloned();
+  uint64_t pool_bytes = stats->pool_bytes();
+
+  // Report the sproutlet's statistics to SNMP tables.
+  SNMP::FakeEventAccumulatorTable latency_tbl;
+  SNMP::FakeEventAccumulatorTable cpu_tbl;
+  SNMP::FakeCounterTable invocations_tbl;
+  SNMP::FakeCounterTable msgs_cloned_tbl;
+  SNMP::FakeEventAccumulatorTable pool_bytes_tbl;
+  SproutletStats::Tables tables;
+  tables.callback_latency = &latency_tbl;
+  tables.callback_cpu = &cpu_tbl;
+  tables.invocations = &invocations_tbl;
+  tables.msgs_cloned = &msgs_cloned_tbl;
+  tables.pool_bytes = &pool_bytes_tbl;
+  stats->set_tables(tables);
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Route a request to the forwarder using its alias.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:proxy1.homedomain;transport=TCP;lr;service=alias>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE.
+  ASSERT_EQ(2, txdata_count());
+  free_txdata();
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  // Send a 200 OK response, which is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+  ASSERT_EQ(0, txdata_count());
+
+  // The sproutlet saw the request and the response, in both directions.
+  EXPECT_EQ(invocations + 4, stats->invocations());
+  EXPECT_EQ(alias_invocations + 4, alias_stats->invocations());
+  EXPECT_LT(msgs_cloned, stats->msgs_cloned());
+  EXPECT_LT(pool_bytes, stats->pool_bytes());
+
+  // The same is reported to the SNMP tables.
+  EXPECT_EQ(4, latency_tbl._count);
+  EXPECT_EQ(4, cpu_tbl._count);
+  EXPECT_EQ(4, invocations_tbl._count);
+  EXPECT_EQ((int)(stats->msgs_cloned() - msgs_cloned), msgs_cloned_tbl._count);
+  EXPECT_LE(msgs_cloned_tbl._count, pool_bytes_tbl._count);
+  stats->set_tables(SproutletStats::Tables());
+
+  // The alias is reported with the sproutlet.
+  std::string json = _proxy->stats_json();
+  EXPECT_NE(std::string::npos, json.find("\"fwdrr\":{\"invocations\""));
+  EXPECT_NE(std::string::npos, json.find("\"aliases\":{\"alias\":{"));
+  EXPECT_NE(std::string::npos, json.find("\"executors\":{"));
+  EXPECT_NE(std::string::npos,
+            json.find("\"object_pools\":{\"uas_tsx\":{\"heap_allocs\""));
+  EXPECT_NE(std::string::npos, json.find("\"sproutlet_wrapper\":{"));
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, SproutletCopiesOriginalTransport)
+{
+  // Tests standard routing of a request through a Sproutlet that simply
+  // forwards requests and responses and doesn't Record-Route itself - and
+  // that reuses the original transport for onwards messages.
+  pjsip_tx_data* tdata;
+
+  // Create two TCP connections to the listening port.
+  TransportFlow* tp1 = new TransportFlow(TransportFlow::Protocol::TCP,
+                                         stack_data.scscf_port,
                                          "10.10.28.1",   // node1.awaydomain
                                          49152);
   TransportFlow* tp2 = new TransportFlow(TransportFlow::Protocol::TCP,
@@ -2441,3 +3248,239 @@ TEST_F(SproutletProxyTest, SproutletCopiesOriginalTransport)
   delete tp1;
   delete tp2;
 }
+
+class SproutletProxyStatelessTest : public SproutletProxyTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SproutletProxyTest::SetUpTestCase();
+
+    // Make the "stateless" Sproutlet forward statelessly.
+    EXPECT_TRUE(_proxy->enable_stateless("stateless"));
+  }
+};
+
+TEST_F(SproutletProxyStatelessTest, StatelessForwarder)
+{
+  // Tests routing of requests through a Sproutlet that forwards statelessly.
+  pjsip_tx_data* tdata;
+
+  // Stateless forwarding can't be enabled for unknown Sproutlets.
+  EXPECT_FALSE(_proxy->enable_stateless("unknown"));
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with two Route headers - the first referencing the
+  // stateless Sproutlet and the second referencing an external node.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:stateless.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting just the forwarded INVITE, as there's no transaction to send a
+  // 100 Trying.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  // Check the first Route header has been removed.
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+
+  // Check the Via branch marks the request as forwarded statelessly.
+  pjsip_via_hdr* via = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg,
+                                                          PJSIP_H_VIA,
+                                                          NULL);
+  EXPECT_EQ(0u, PJUtils::pj_str_to_string(&via->branch_param).find("z9hG4bKSL"));
+
+  // Send a 200 OK response.
+  inject_msg(respond_to_current_txdata(200));
+
+  // Check the response is forwarded back to the source.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // Requests to other Sproutlets are still handled statefully.
+  Message msg2;
+  msg2._method = "INVITE";
+  msg2._requri = "sip:bob@awaydomain";
+  msg2._from = "sip:alice@homedomain";
+  msg2._to = "sip:bob@awaydomain";
+  msg2._via = tp->to_string(false);
+  msg2._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg2.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  inject_msg(respond_to_current_txdata(200));
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyStatelessTest, StatelessForwardNonInvite)
+{
+  // Tests that responses to non-INVITE requests are forwarded if the request
+  // was forwarded statelessly, but not otherwise.
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "MESSAGE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:stateless.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("MESSAGE").matches(tdata->msg);
+
+  // The response is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // A response to a non-INVITE request that wasn't forwarded statelessly
+  // doesn't match a transaction, so is discarded.
+  Message msg2;
+  msg2._method = "MESSAGE";
+  msg2._via = tp->to_string(false);
+  inject_msg(msg2.get_response(), tp);
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyStatelessTest, UnreliableTransportIsStateful)
+{
+  // Tests that requests received over UDP are handled statefully even if the
+  // Sproutlet forwards statelessly, so that retransmissions are absorbed.
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::UDP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:stateless.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  pjsip_tx_data* invite = pop_txdata();
+
+  // A retransmission of the INVITE is absorbed by the transaction, which
+  // just resends the 100 Trying rather than forwarding it again.
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+
+  inject_msg(respond_to_txdata(invite, 200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyStatelessTest, UnreliableNextHopIsStateful)
+{
+  // Tests that a request received over TCP is handled statefully if the
+  // Sproutlet forwards it over UDP, as nothing would retransmit it otherwise.
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:stateless.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=UDP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE, sent over UDP from a
+  // transaction rather than with a stateless branch.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  tdata = current_txdata();
+  expect_target("UDP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  pjsip_via_hdr* via = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg,
+                                                           PJSIP_H_VIA,
+                                                           NULL);
+  const pj_str_t& prefix = StatelessSproutletWrapper::BRANCH_PREFIX;
+  EXPECT_NE(0, pj_strncmp(&via->branch_param, &prefix, prefix.slen));
+  pjsip_tx_data* invite = pop_txdata();
+
+  inject_msg(respond_to_txdata(invite, 200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  delete tp;
+}
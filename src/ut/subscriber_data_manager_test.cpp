@@ -67,6 +67,7 @@ class BasicSubscriberDataManagerTest : public SipTest
     _chronos_connection = new FakeChronosConnection();
     _datastore = new LocalStore();
     _analytics_logger = new MockAnalyticsLogger();
+    _parallel_ops = new ParallelStoreOps(2, NULL);
 
     SubscriberDataManager::SerializerDeserializer* serializer = new T();
     std::vector<SubscriberDataManager::SerializerDeserializer*> deserializers = {
@@ -78,7 +79,8 @@ class BasicSubscriberDataManagerTest : public SipTest
                                        deserializers,
                                        _chronos_connection,
                                        _analytics_logger,
-                                       true);
+                                       true,
+                                       _parallel_ops);
   }
 
   virtual ~BasicSubscriberDataManagerTest()
@@ -97,6 +99,7 @@ class BasicSubscriberDataManagerTest : public SipTest
     //pjsip_tsx_layer_instance()->start();
 
     delete _store; _store = NULL;
+    delete _parallel_ops; _parallel_ops = NULL;
     delete _datastore; _datastore = NULL;
     delete _chronos_connection; _chronos_connection = NULL;
     delete _analytics_logger; _analytics_logger = NULL;
@@ -109,6 +112,7 @@ class BasicSubscriberDataManagerTest : public SipTest
   LocalStore* _datastore;
   SubscriberDataManager* _store;
   MockAnalyticsLogger* _analytics_logger;
+  ParallelStoreOps* _parallel_ops;
 };
 
 
@@ -597,6 +601,99 @@ TEST_F(BasicSubscriberDataManagerTestJSON, BindingTests)
 }
 
 
+// Test reading and writing several AoRs at once.
+TEST_F(BasicSubscriberDataManagerTestJSON, MultiAoRTests)
+{
+  std::vector<std::string> aor_ids = {"5102175698@cw-ngv.com",
+                                      "5102175699@cw-ngv.com"};
+  int now = time(NULL);
+
+  // Get initial empty AoR records and add a binding to each.
+  std::vector<SubscriberDataManager::AoRPair*> aor_pairs =
+    this->_store->get_aor_data_multi(aor_ids, 0);
+  ASSERT_EQ(2u, aor_pairs.size());
+
+  std::vector<AssociatedURIs> associated_uris(aor_ids.size());
+  std::vector<SubscriberDataManager::AoRUpdate> updates;
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    ASSERT_TRUE(aor_pairs[ii] != NULL);
+    EXPECT_EQ(0u, aor_pairs[ii]->get_current()->bindings().size());
+    SubscriberDataManager::AoR::Binding* b =
+      aor_pairs[ii]->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+    b->_uri = "<sip:" + aor_ids[ii] + ">";
+    b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+    b->_cseq = 17038;
+    b->_expires = now + 300;
+    b->_priority = 0;
+    b->_private_id = aor_ids[ii];
+    b->_emergency_registration = false;
+
+    associated_uris[ii].add_uri(aor_ids[ii], false);
+    updates.push_back(SubscriberDataManager::AoRUpdate(aor_ids[ii],
+                                                       &associated_uris[ii],
+                                                       aor_pairs[ii]));
+    EXPECT_CALL(*(this->_analytics_logger),
+                registration(aor_ids[ii],
+                             "urn:uuid:00000000-0000-0000-0000-b4dd32817622:1",
+                             "<sip:" + aor_ids[ii] + ">",
+                             300)).Times(1);
+  }
+
+  this->_store->set_aor_data_multi(updates, 0);
+  EXPECT_EQ(Store::Status::OK, updates[0].status);
+  EXPECT_EQ(Store::Status::OK, updates[1].status);
+  EXPECT_FALSE(updates[0].all_bindings_expired);
+  EXPECT_FALSE(updates[1].all_bindings_expired);
+
+  // Read the AoRs back.  The original pairs are now out of date for both
+  // AoRs.
+  std::vector<SubscriberDataManager::AoRPair*> new_aor_pairs =
+    this->_store->get_aor_data_multi(aor_ids, 0);
+  ASSERT_EQ(2u, new_aor_pairs.size());
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    ASSERT_TRUE(new_aor_pairs[ii] != NULL);
+    ASSERT_EQ(1u, new_aor_pairs[ii]->get_current()->bindings().size());
+    EXPECT_EQ("<sip:" + aor_ids[ii] + ">",
+              new_aor_pairs[ii]->get_current()->bindings().begin()->second->_uri);
+  }
+
+  // Write one stale AoR and one fresh one.  Only the stale one hits
+  // contention.
+  updates.clear();
+  updates.push_back(SubscriberDataManager::AoRUpdate(aor_ids[0],
+                                                     &associated_uris[0],
+                                                     aor_pairs[0]));
+  updates.push_back(SubscriberDataManager::AoRUpdate(aor_ids[1],
+                                                     &associated_uris[1],
+                                                     new_aor_pairs[1]));
+  this->_store->set_aor_data_multi(updates, 0);
+  EXPECT_EQ(Store::Status::DATA_CONTENTION, updates[0].status);
+  EXPECT_EQ(Store::Status::OK, updates[1].status);
+
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    delete aor_pairs[ii];
+    delete new_aor_pairs[ii];
+  }
+}
+
+// Test that a store read failure is reported as a NULL AoR pair.
+TEST_F(BasicSubscriberDataManagerTestJSON, MultiAoRGetError)
+{
+  std::vector<std::string> aor_ids = {"5102175698@cw-ngv.com"};
+
+  this->_datastore->force_get_error();
+  std::vector<SubscriberDataManager::AoRPair*> aor_pairs =
+    this->_store->get_aor_data_multi(aor_ids, 0);
+  ASSERT_EQ(1u, aor_pairs.size());
+  EXPECT_TRUE(aor_pairs[0] == NULL);
+}
+
+
 /// Fixture for testing converting between data formats. Thsi creates two
 /// SubscriberDataManagers:
 /// 1).  One that only uses one (de)serializer.
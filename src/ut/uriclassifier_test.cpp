@@ -72,6 +72,8 @@ TEST_F(URIClassiferTest, GlobalNumberClassification)
             classify_uri_helper("sip:+1234@example.com;user=phone"));
   EXPECT_EQ(URIClass::GLOBAL_PHONE_NUMBER,
             classify_uri_helper("tel:+1234"));
+  EXPECT_EQ(URIClass::GLOBAL_PHONE_NUMBER,
+            classify_uri_helper("sip:+1-234;npdi@example.com;user=phone"));
 }
 
 TEST_F(URIClassiferTest, LocalNumberClassification)